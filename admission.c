@@ -0,0 +1,144 @@
+#include "admission.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A probe that gets too few responses in this long is given up on
+#define PROBE_TIMEOUT_US 1000000
+
+typedef struct {
+    pthread_mutex_t lock;
+    double limit;
+    int max;
+    uint64_t probe_due_us;      // when to measure the baseline next
+    uint64_t probe_start_us;    // measuring since then, 0 if not
+    uint64_t probe_min_us;
+    int probe_samples;
+    double saved_limit;         // the limit to go back to after the probe
+    uint64_t last_cut_us;
+    atomic_int current;         // limit rounded down, read without the lock
+    atomic_uint_fast64_t base_us;  // latency without queueing, 0 until measured
+} __attribute__((aligned(64))) limiter_t;
+
+static limiter_t limiters[MAX_SERVERS];
+static int limiter_count;
+static int global_max;
+static atomic_int limit_sum;    // of the backends' current limits
+static atomic_int in_flight;
+
+static void limiter_init(limiter_t *l, int max) {
+    pthread_mutex_init(&l->lock, NULL);
+    l->max = max < ADMISSION_MIN_LIMIT ? ADMISSION_MIN_LIMIT : max;
+    l->limit = ADMISSION_INITIAL_LIMIT < l->max ? ADMISSION_INITIAL_LIMIT : l->max;
+    l->probe_due_us = 0;
+    l->probe_start_us = 0;
+    l->last_cut_us = 0;
+    atomic_store_explicit(&l->current, (int)l->limit, memory_order_relaxed);
+    atomic_store_explicit(&l->base_us, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&limit_sum, (int)l->limit, memory_order_relaxed);
+}
+
+// Hold the backend at the minimum limit until enough responses to requests
+// sent since then came back; the fastest of them is the new baseline.
+static void probe(limiter_t *l, uint64_t latency_us, int overload, uint64_t now_us) {
+    if (l->probe_start_us == 0) {
+        l->saved_limit = l->limit;
+        l->limit = ADMISSION_MIN_LIMIT;
+        l->probe_start_us = now_us;
+        l->probe_min_us = UINT64_MAX;
+        l->probe_samples = 0;
+        return;
+    }
+    if (!overload && now_us - latency_us >= l->probe_start_us) {
+        if (latency_us < l->probe_min_us)
+            l->probe_min_us = latency_us;
+        l->probe_samples++;
+    }
+    int done = l->probe_samples >= ADMISSION_PROBE_SAMPLES;
+    if (done || now_us - l->probe_start_us >= PROBE_TIMEOUT_US) {
+        if (done)
+            atomic_store_explicit(&l->base_us, l->probe_min_us, memory_order_relaxed);
+        l->limit = l->saved_limit;
+        l->probe_start_us = 0;
+        // Up to a quarter later, so backends do not all probe at once.
+        uint64_t interval = (uint64_t)ADMISSION_PROBE_INTERVAL_MS * 1000;
+        l->probe_due_us = now_us + interval + interval * (now_us % 256) / 1024;
+    }
+}
+
+// Grow the limit by 1/limit per response near the baseline while at least
+// half of it is used, or cut it on overload. A cut waits for the requests
+// sent after the previous one to come back.
+static void adapt(limiter_t *l, uint64_t latency_us, int overload, int used, uint64_t now_us) {
+    uint64_t base = atomic_load_explicit(&l->base_us, memory_order_relaxed);
+    if (!overload && base) {
+        if (latency_us < base)
+            atomic_store_explicit(&l->base_us, base = latency_us, memory_order_relaxed);
+        overload = latency_us > base * ADMISSION_TOLERANCE + ADMISSION_SLACK_MS * 1000;
+    }
+    if (overload) {
+        if (now_us - l->last_cut_us >= latency_us) {
+            l->limit *= (100 - ADMISSION_BACKOFF) / 100.0;
+            if (l->limit < ADMISSION_MIN_LIMIT)
+                l->limit = ADMISSION_MIN_LIMIT;
+            l->last_cut_us = now_us;
+        }
+    } else if (used * 2 >= (int)l->limit) {
+        l->limit += 1.0 / l->limit;
+        if (l->limit > l->max)
+            l->limit = l->max;
+    }
+}
+
+void admission_init(int count, int max, int backend_max) {
+    limiter_count = count < MAX_SERVERS ? count : MAX_SERVERS;
+    global_max = max;
+    atomic_store_explicit(&limit_sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&in_flight, 0, memory_order_relaxed);
+    for (int i = 0; i < limiter_count; i++)
+        limiter_init(&limiters[i], backend_max);
+}
+
+static int global_limit(void) {
+    int sum = atomic_load_explicit(&limit_sum, memory_order_relaxed);
+    return sum < global_max ? sum : global_max;
+}
+
+int admission_acquire(void) {
+    int limit = global_limit();
+    int n = atomic_load_explicit(&in_flight, memory_order_relaxed);
+    do {
+        if (n >= limit)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&in_flight, &n, n + 1, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return 1;
+}
+
+void admission_release(void) {
+    atomic_fetch_sub_explicit(&in_flight, 1, memory_order_relaxed);
+}
+
+int admission_observe(int backend, uint64_t latency_us, int overload, int backend_in_flight, uint64_t now_us) {
+    limiter_t *l = &limiters[backend];
+    if (pthread_mutex_trylock(&l->lock) != 0)
+        return atomic_load_explicit(&l->current, memory_order_relaxed);
+    if (l->probe_start_us || now_us >= l->probe_due_us)
+        probe(l, latency_us, overload, now_us);
+    else
+        adapt(l, latency_us, overload, backend_in_flight, now_us);
+    int limit = (int)l->limit;
+    int old = atomic_exchange_explicit(&l->current, limit, memory_order_relaxed);
+    atomic_fetch_add_explicit(&limit_sum, limit - old, memory_order_relaxed);
+    pthread_mutex_unlock(&l->lock);
+    return limit;
+}
+
+void admission_get_stats(admission_stats_t *out) {
+    out->limit = global_limit();
+    out->in_flight = atomic_load_explicit(&in_flight, memory_order_relaxed);
+    for (int i = 0; i < limiter_count; i++) {
+        out->backend_limit[i] = atomic_load_explicit(&limiters[i].current, memory_order_relaxed);
+        out->base_us[i] = atomic_load_explicit(&limiters[i].base_us, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include "backend_servers.h"
+
+// Upstream admission control: how many requests may be in flight to each
+// backend, and to all of them together. Each backend's limit adapts to
+// latency by AIMD. Now and then the backend is held at a low limit for a few
+// responses, and the fastest of them is its latency without queueing. While
+// responses come within a tolerance of that and the limit is in use, the
+// limit grows by about one per round trip; a slower response, a timeout or
+// a 503 cuts it by a factor, at most once per round trip. All backends
+// together may hold the sum of their limits, capped. A sample is taken by
+// whichever worker gets the backend's lock; one finding it taken skips it.
+typedef struct {
+    int limit;                  // requests allowed in flight to all backends
+    int in_flight;
+    int backend_limit[MAX_SERVERS];
+    uint64_t base_us[MAX_SERVERS];  // latency baseline, 0 if not known yet
+} admission_stats_t;
+
+/* Limits for backends [0, count): at most max in flight overall and
+   backend_max to one backend */
+void admission_init(int count, int max, int backend_max);
+
+/* Take a slot under the global limit (1), or 0 if there is none */
+int admission_acquire(void);
+
+/* Give back a slot taken by admission_acquire */
+void admission_release(void);
+
+/* Feed how a request to backend went: its latency from being sent to the
+   first response byte (or until it failed), whether that is a sign of
+   overload (timeout, 503), and how many requests the backend held. Returns
+   the backend's limit. */
+int admission_observe(int backend, uint64_t latency_us, int overload, int backend_in_flight, uint64_t now_us);
+
+void admission_get_stats(admission_stats_t *out);
+
+#endif // ADMISSION_H
@@ -6,6 +6,7 @@
 typedef struct {
     char ip[16];
     int port;
+    int weight;     // relative share of requests (1 to BALANCE_MAX_WEIGHT)
 } Backend;
 
 extern Backend backend_pool[MAX_SERVERS];
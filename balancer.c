@@ -0,0 +1,296 @@
+#include "balancer.h"
+#include "health.h"
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+static const char *strategy_names[] = {
+    [BALANCE_LEAST_CONN] = "least-conn",
+    [BALANCE_ROUND_ROBIN] = "round-robin",
+    [BALANCE_P2C] = "p2c",
+    [BALANCE_PEAK_EWMA] = "peak-ewma",
+    [BALANCE_MAGLEV] = "maglev",
+};
+
+int balancer_strategy(const char *name) {
+    for (int s = 0; s < (int)(sizeof(strategy_names) / sizeof(strategy_names[0])); s++)
+        if (strcmp(name, strategy_names[s]) == 0)
+            return s;
+    return -1;
+}
+
+const char *balancer_strategy_name(balance_strategy_t s) {
+    return strategy_names[s];
+}
+
+uint64_t balancer_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Smooth weighted round robin (as in nginx) unrolled into a fixed schedule,
+// so that picking is a single atomic increment: with weights 5,1,1 the
+// order is a a b a c a a rather than a a a a a b c.
+static void build_schedule(balancer_t *b) {
+    int current[MAX_SERVERS] = {0};
+    int total = 0;
+    for (int i = 0; i < b->count; i++)
+        total += b->state[i].weight;
+    for (int n = 0; n < total; n++) {
+        int best = 0;
+        for (int i = 0; i < b->count; i++) {
+            current[i] += b->state[i].weight;
+            if (current[i] > current[best])
+                best = i;
+        }
+        current[best] -= total;
+        b->schedule[n] = (unsigned char)best;
+    }
+    b->schedule_len = total;
+}
+
+static uint64_t hash_name(const Backend *be, uint64_t seed) {
+    char name[32];
+    int len = snprintf(name, sizeof(name), "%s:%d", be->ip, be->port);
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Maglev (Eisenbud et al., NSDI 2016): every backend walks its own
+// permutation of the table, derived from its address rather than its
+// index, and takes turns claiming the next free entry. Tables built for
+// two backend sets differ in about 1/N of their entries. A backend takes a
+// turn in a round only once it has saved up the largest weight, so entries
+// split by weight.
+static void build_maglev(balancer_t *b, const Backend *backends) {
+    uint32_t offset[MAX_SERVERS], skip[MAX_SERVERS], next[MAX_SERVERS] = {0};
+    int credit[MAX_SERVERS] = {0};
+    int max_weight = 1;
+    for (int i = 0; i < b->count; i++) {
+        offset[i] = hash_name(&backends[i], 0) % MAGLEV_SIZE;
+        skip[i] = hash_name(&backends[i], 0x9e3779b97f4a7c15ULL) % (MAGLEV_SIZE - 1) + 1;
+        if (b->state[i].weight > max_weight)
+            max_weight = b->state[i].weight;
+    }
+    memset(b->maglev, 0xff, sizeof(b->maglev));
+    if (b->count == 0)
+        return;
+    int filled = 0;
+    while (1) {
+        for (int i = 0; i < b->count; i++) {
+            credit[i] += b->state[i].weight;
+            if (credit[i] < max_weight)
+                continue;
+            credit[i] -= max_weight;
+            uint32_t c = (offset[i] + (uint64_t)next[i] * skip[i]) % MAGLEV_SIZE;
+            while (b->maglev[c] != 0xff) {
+                next[i]++;
+                c = (offset[i] + (uint64_t)next[i] * skip[i]) % MAGLEV_SIZE;
+            }
+            b->maglev[c] = (unsigned char)i;
+            next[i]++;
+            if (++filled == MAGLEV_SIZE)
+                return;
+        }
+    }
+}
+
+void balancer_init(balancer_t *b, balance_strategy_t s, const Backend *backends, int count, int decay_ms) {
+    memset(b, 0, sizeof(*b));
+    b->strategy = s;
+    b->count = count < MAX_SERVERS ? count : MAX_SERVERS;
+    b->decay_us = (uint64_t)(decay_ms > 0 ? decay_ms : 1) * 1000;
+    for (int i = 0; i < b->count; i++) {
+        int w = backends[i].weight;
+        b->state[i].weight = w < 1 ? 1 : w > BALANCE_MAX_WEIGHT ? BALANCE_MAX_WEIGHT : w;
+    }
+    b->load_factor = DEFAULT_HASH_LOAD_FACTOR;
+    build_schedule(b);
+    build_maglev(b, backends);
+}
+
+void balancer_set_load_factor(balancer_t *b, int load_percent) {
+    b->load_factor = load_percent < 100 ? 100 : load_percent;
+}
+
+static double load_double(atomic_uint_fast64_t *a) {
+    uint64_t bits = atomic_load_explicit(a, memory_order_relaxed);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+// Peak-EWMA: a sample above the estimate replaces it at once, so a backend
+// that slows down is avoided immediately; lower samples pull it down with
+// a time constant of decay_us. A cost read decays towards zero in the same
+// way, so a backend that was slow gets tried again after a while.
+void balancer_observe(balancer_t *b, int backend, uint64_t latency_us, uint64_t now_us) {
+    atomic_uint_fast64_t *slot = &b->state[backend].ewma;
+    uint64_t stamp = atomic_exchange_explicit(&b->state[backend].ewma_stamp, now_us, memory_order_relaxed);
+    double sample = (double)latency_us;
+    double w = now_us > stamp ? exp(-(double)(now_us - stamp) / b->decay_us) : 1.0;
+    uint64_t old_bits = atomic_load_explicit(slot, memory_order_relaxed);
+    while (1) {
+        double old;
+        memcpy(&old, &old_bits, sizeof(old));
+        double next = sample > old ? sample : old * w + sample * (1.0 - w);
+        uint64_t next_bits;
+        memcpy(&next_bits, &next, sizeof(next_bits));
+        if (atomic_compare_exchange_weak_explicit(slot, &old_bits, next_bits,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return;
+    }
+}
+
+// Expected time to serve one more request: latency estimate (decayed to
+// now) times the requests ahead of it, per unit of weight. Backends without
+// a sample yet count as 1 us, so each gets tried.
+static double ewma_cost(balancer_t *b, int i, uint64_t now_us) {
+    balancer_backend_t *st = &b->state[i];
+    double ewma = load_double(&st->ewma);
+    uint64_t stamp = atomic_load_explicit(&st->ewma_stamp, memory_order_relaxed);
+    if (now_us > stamp)
+        ewma *= exp(-(double)(now_us - stamp) / b->decay_us);
+    int active = atomic_load_explicit(&st->active, memory_order_relaxed);
+    return (ewma + 1.0) * (active + 1) / st->weight;
+}
+
+// Whether a has less load per unit of weight than c.
+static int less_loaded(balancer_t *b, int a, int c) {
+    int la = atomic_load_explicit(&b->state[a].active, memory_order_relaxed);
+    int lc = atomic_load_explicit(&b->state[c].active, memory_order_relaxed);
+    return (long)la * b->state[c].weight < (long)lc * b->state[a].weight;
+}
+
+static int at_limit(balancer_t *b, int i) {
+    int limit = atomic_load_explicit(&b->state[i].limit, memory_order_relaxed);
+    return limit > 0 && atomic_load_explicit(&b->state[i].active, memory_order_relaxed) >= limit;
+}
+
+static inline uint64_t next_random(void) {
+    static __thread uint64_t state;
+    if (state == 0)
+        state = (balancer_now_us() ^ (uintptr_t)&state) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// The key's own backend unless that holds more than its bounded share
+// (Mirrokni et al., "Consistent Hashing with Bounded Loads"): then the
+// next table entries are tried in turn, so a hot key overflows onto the
+// same few backends every time. Bounds count the request being placed,
+// so some candidate is always below its bound.
+static int pick_maglev(balancer_t *b, const int *cand, int n, uint64_t key_hash) {
+    int is_cand[MAX_SERVERS] = {0};
+    long total = 1, weights = 0;
+    for (int k = 0; k < n; k++) {
+        is_cand[cand[k]] = 1;
+        total += atomic_load_explicit(&b->state[cand[k]].active, memory_order_relaxed);
+        weights += b->state[cand[k]].weight;
+    }
+    uint32_t e = key_hash % MAGLEV_SIZE;
+    for (int step = 0; step < MAGLEV_SIZE; step++) {
+        int i = b->maglev[e];
+        if (is_cand[i]) {
+            // active < ceil(load_factor% of total * weight / weights)
+            long bound = (total * b->load_factor * b->state[i].weight + 100 * weights - 1) / (100 * weights);
+            if (atomic_load_explicit(&b->state[i].active, memory_order_relaxed) < bound)
+                return i;
+        }
+        if (++e == MAGLEV_SIZE)
+            e = 0;
+    }
+    return cand[0];
+}
+
+int balancer_pick(balancer_t *b, uint32_t tried, uint64_t key_hash, uint64_t now_us) {
+    // Candidates: untried backends with room, of the best health rank there is.
+    int cand[MAX_SERVERS];
+    int n = 0, best_rank = -1, full_rank = -1;
+    uint64_t now_ms = now_us / 1000;
+    for (int i = 0; i < b->count; i++) {
+        if (tried & (1u << i))
+            continue;
+        int rank = health_rank(i, now_ms);
+        if (at_limit(b, i)) {
+            if (rank > full_rank)
+                full_rank = rank;
+            continue;
+        }
+        if (rank > best_rank) {
+            best_rank = rank;
+            n = 0;
+        }
+        if (rank == best_rank)
+            cand[n++] = i;
+    }
+    if (n == 0 || (best_rank == 0 && full_rank > 0))
+        return full_rank >= 0 ? BALANCE_FULL : -1;
+
+    int pick = cand[0];
+    balance_strategy_t strategy = b->strategy;
+    if (strategy == BALANCE_MAGLEV && key_hash == 0)
+        strategy = BALANCE_LEAST_CONN;
+    if (n > 1) {
+        switch (strategy) {
+        case BALANCE_MAGLEV:
+            pick = pick_maglev(b, cand, n, key_hash);
+            break;
+        case BALANCE_LEAST_CONN:
+            for (int k = 1; k < n; k++)
+                if (less_loaded(b, cand[k], pick))
+                    pick = cand[k];
+            break;
+        case BALANCE_ROUND_ROBIN: {
+            // Take the next schedule slot; skip slots of backends that are
+            // not candidates. The counter only needs to be roughly fair.
+            unsigned start = atomic_fetch_add_explicit(&b->rr_next, 1, memory_order_relaxed);
+            for (int k = 0; k < b->schedule_len; k++) {
+                int i = b->schedule[(start + k) % b->schedule_len];
+                if (!(tried & (1u << i)) && health_rank(i, now_ms) == best_rank && !at_limit(b, i)) {
+                    pick = i;
+                    break;
+                }
+            }
+            break;
+        }
+        case BALANCE_P2C:
+        case BALANCE_PEAK_EWMA: {
+            // Two distinct candidates at random.
+            uint64_t r = next_random();
+            int a = (int)(r % n);
+            int c = (int)((r / n) % (n - 1));
+            if (c >= a)
+                c++;
+            int x = cand[a], y = cand[c];
+            if (strategy == BALANCE_P2C)
+                pick = less_loaded(b, y, x) ? y : x;
+            else
+                pick = ewma_cost(b, y, now_us) < ewma_cost(b, x, now_us) ? y : x;
+            break;
+        }
+        }
+    }
+    atomic_fetch_add_explicit(&b->state[pick].active, 1, memory_order_relaxed);
+    return pick;
+}
+
+void balancer_release(balancer_t *b, int backend) {
+    atomic_fetch_sub_explicit(&b->state[backend].active, 1, memory_order_relaxed);
+}
+
+void balancer_set_limit(balancer_t *b, int backend, int limit) {
+    atomic_store_explicit(&b->state[backend].limit, limit, memory_order_relaxed);
+}
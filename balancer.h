@@ -0,0 +1,82 @@
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "backend_servers.h"
+
+// Backend selection for one pool of backends. Every strategy honours the
+// backends' weights and health (see health.h): it picks among the backends
+// not tried yet for the request that rank best, so only the choice among
+// equally healthy backends differs. Picking is lock-free; all counters are
+// relaxed atomics shared by the workers.
+typedef enum {
+    BALANCE_LEAST_CONN,     // fewest active connections per unit of weight
+    BALANCE_ROUND_ROBIN,    // smooth weighted round robin
+    BALANCE_P2C,            // power of two choices on active connections
+    BALANCE_PEAK_EWMA,      // power of two choices on peak-EWMA latency x load
+    BALANCE_MAGLEV,         // by request key on a Maglev table, with bounded load
+} balance_strategy_t;
+
+// Weights above this are clamped (the round robin schedule holds the sum).
+#define BALANCE_MAX_WEIGHT 100
+
+// Maglev lookup table size: a prime well above 100 entries per backend, so
+// shares stay within about 1% of the weights.
+#define MAGLEV_SIZE 65537
+
+// Per backend; a cache line each, since every worker updates them.
+typedef struct {
+    atomic_int active;                  // requests holding the backend
+    atomic_int limit;                   // most it may hold (admission.h), 0 = no limit
+    int weight;                         // clamped copy of Backend.weight
+    atomic_uint_fast64_t ewma;          // latency estimate in us (double bits)
+    atomic_uint_fast64_t ewma_stamp;    // us of its last update
+} __attribute__((aligned(64))) balancer_backend_t;
+
+typedef struct {
+    balance_strategy_t strategy;
+    int count;
+    uint64_t decay_us;                  // EWMA time constant
+    balancer_backend_t state[MAX_SERVERS];
+    atomic_uint rr_next;
+    int schedule_len;
+    unsigned char schedule[MAX_SERVERS * BALANCE_MAX_WEIGHT];
+    int load_factor;                    // maglev: percent of the mean load a backend may take
+    unsigned char maglev[MAGLEV_SIZE];  // table entry -> backend
+} balancer_t;
+
+/* Set up b to balance over backends[0, count) with strategy s */
+void balancer_init(balancer_t *b, balance_strategy_t s, const Backend *backends, int count, int decay_ms);
+
+/* Strategy by name ("least-conn", "round-robin", "p2c", "peak-ewma", "maglev"), -1 if unknown */
+int balancer_strategy(const char *name);
+const char *balancer_strategy_name(balance_strategy_t s);
+
+/* Monotonic clock in microseconds, for latency samples */
+uint64_t balancer_now_us(void);
+
+/* Maglev: a backend may hold at most load_percent/100 of the mean load per
+   unit of weight (at least 100; the default is DEFAULT_HASH_LOAD_FACTOR) */
+void balancer_set_load_factor(balancer_t *b, int load_percent);
+
+// balancer_pick: the backends left to try are all at their limit
+#define BALANCE_FULL (-2)
+
+/* Choose a backend not in tried (bit per index) and below its limit, and
+   count a request on it. key_hash routes requests for maglev (0 = no key:
+   least connections). Returns -1 once every backend has been tried, or
+   BALANCE_FULL if those left are at their limit; a backend out of rotation
+   is not picked while one in rotation is only full. */
+int balancer_pick(balancer_t *b, uint32_t tried, uint64_t key_hash, uint64_t now_us);
+
+/* Cap the requests backend may hold at once (0 = no cap) */
+void balancer_set_limit(balancer_t *b, int backend, int limit);
+
+/* The request picked for backend is done with it */
+void balancer_release(balancer_t *b, int backend);
+
+/* Feed a response latency (request dispatched to response head) */
+void balancer_observe(balancer_t *b, int backend, uint64_t latency_us, uint64_t now_us);
+
+#endif // BALANCER_H
@@ -0,0 +1,212 @@
+// Balancing strategies against a mix of fast and slow backends. Backends
+// are simulated like dummy_server instances: each serves a few requests at
+// a time and queues the rest. Requests arrive at random (Poisson) at a
+// share of the pool's total capacity; every strategy sees the same arrivals
+// and service times, and picks through the proxy's own balancer.c in
+// simulated time. Then the cost of a pick is measured with several threads
+// picking at once.
+#include "../balancer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SLOTS 4                 // requests a backend serves at once
+#define FAST_MS 1.0             // mean service times
+#define SLOW_MS 10.0
+#define SLOW_BACKENDS 2
+
+typedef struct {
+    double at;                  // completion time (us)
+    int backend;
+    double arrived;
+} event_t;
+
+// Completions, as a binary min-heap on time.
+static event_t *heap;
+static size_t heap_len;
+
+static void heap_push(event_t e) {
+    size_t i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].at > e.at) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = e;
+}
+
+static event_t heap_pop(void) {
+    event_t top = heap[0];
+    event_t last = heap[--heap_len];
+    size_t i = 0;
+    while (1) {
+        size_t c = 2 * i + 1;
+        if (c >= heap_len)
+            break;
+        if (c + 1 < heap_len && heap[c + 1].at < heap[c].at)
+            c++;
+        if (heap[c].at >= last.at)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static double exp_random(uint64_t *s, double mean) {
+    double u = (xorshift(s) >> 11) * (1.0 / 9007199254740992.0);
+    return -mean * log(1.0 - u);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    int busy;
+    double *queue;              // arrival times waiting for a slot
+    size_t head, tail;
+    double mean_us;
+} sim_backend_t;
+
+static void run(const char *label, balance_strategy_t strategy, Backend *pool, int count,
+                size_t requests, double load) {
+    sim_backend_t be[MAX_SERVERS];
+    double capacity = 0;        // requests per us
+    for (int i = 0; i < count; i++) {
+        be[i].busy = 0;
+        be[i].queue = malloc(requests * sizeof(double));
+        be[i].head = be[i].tail = 0;
+        be[i].mean_us = (i < SLOW_BACKENDS ? SLOW_MS : FAST_MS) * 1000;
+        capacity += SLOTS / be[i].mean_us;
+    }
+    double *latency = malloc(requests * sizeof(double));
+    heap = malloc(requests * sizeof(event_t));
+    heap_len = 0;
+    static balancer_t b;
+    balancer_init(&b, strategy, pool, count, 10000);
+
+    uint64_t arrivals = 88172645463325252ULL, service = 0x9E3779B97F4A7C15ULL;
+    double now = 1e6, next_arrival = now;
+    size_t arrived = 0, done = 0, to_slow = 0;
+    while (done < requests) {
+        if (arrived < requests && (heap_len == 0 || next_arrival <= heap[0].at)) {
+            now = next_arrival;
+            next_arrival += exp_random(&arrivals, 1.0 / (capacity * load));
+            arrived++;
+            int i = balancer_pick(&b, 0, 0, (uint64_t)now);
+            to_slow += i < SLOW_BACKENDS;
+            if (be[i].busy < SLOTS) {
+                be[i].busy++;
+                heap_push((event_t){ now + exp_random(&service, be[i].mean_us), i, now });
+            } else {
+                be[i].queue[be[i].tail++] = now;
+            }
+            continue;
+        }
+        event_t e = heap_pop();
+        now = e.at;
+        latency[done++] = now - e.arrived;
+        balancer_observe(&b, e.backend, (uint64_t)(now - e.arrived), (uint64_t)now);
+        balancer_release(&b, e.backend);
+        sim_backend_t *s = &be[e.backend];
+        if (s->head < s->tail)
+            heap_push((event_t){ now + exp_random(&service, s->mean_us), e.backend, s->queue[s->head++] });
+        else
+            s->busy--;
+    }
+    qsort(latency, requests, sizeof(double), cmp_double);
+    printf("%-22s %9.2f %9.2f %9.2f %9.2f %8.1f%%\n", label,
+           latency[requests / 2] / 1000, latency[requests * 90 / 100] / 1000,
+           latency[requests * 99 / 100] / 1000, latency[requests * 999 / 1000] / 1000,
+           100.0 * to_slow / requests);
+    for (int i = 0; i < count; i++)
+        free(be[i].queue);
+    free(latency);
+    free(heap);
+}
+
+typedef struct {
+    balancer_t *b;
+    size_t picks;
+} pick_arg_t;
+
+static void *pick_thread(void *arg) {
+    pick_arg_t *a = arg;
+    uint64_t now = 1000000;
+    for (size_t n = 0; n < a->picks; n++) {
+        int i = balancer_pick(a->b, 0, 0, now);
+        balancer_observe(a->b, i, 1000, now);
+        balancer_release(a->b, i);
+        now += 3;
+    }
+    return NULL;
+}
+
+// CPU time of all threads, so contention shows however many cores there are.
+static double cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    size_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : 500000;
+    double load = argc > 2 ? atof(argv[2]) : 0.7;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    if (requests < 1000 || load <= 0 || load >= 1 || threads < 1) {
+        fprintf(stderr, "Usage: %s [requests] [load 0..1] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    Backend pool[MAX_SERVERS], weighted[MAX_SERVERS];
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        snprintf(pool[i].ip, sizeof(pool[i].ip), "127.0.0.1");
+        pool[i].port = 9090 + i;
+        pool[i].weight = 1;
+        weighted[i] = pool[i];
+        // Weighted by capacity: a slow backend serves a tenth as much.
+        weighted[i].weight = i < SLOW_BACKENDS ? 1 : (int)(SLOW_MS / FAST_MS);
+    }
+    printf("%d backends (%d slow: %.0f ms, %d fast: %.0f ms, %d requests at a time each), "
+           "%zu requests at %.0f%% load\n", MAX_SERVERS, SLOW_BACKENDS, SLOW_MS,
+           MAX_SERVERS - SLOW_BACKENDS, FAST_MS, SLOTS, requests, load * 100);
+    printf("%-22s %9s %9s %9s %9s %9s\n", "strategy", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "to slow");
+    run("least-conn", BALANCE_LEAST_CONN, pool, MAX_SERVERS, requests, load);
+    run("round-robin", BALANCE_ROUND_ROBIN, pool, MAX_SERVERS, requests, load);
+    run("round-robin weighted", BALANCE_ROUND_ROBIN, weighted, MAX_SERVERS, requests, load);
+    run("p2c", BALANCE_P2C, pool, MAX_SERVERS, requests, load);
+    run("peak-ewma", BALANCE_PEAK_EWMA, pool, MAX_SERVERS, requests, load);
+
+    printf("\npick + observe + release, %d threads\n", threads);
+    const balance_strategy_t strategies[] = { BALANCE_LEAST_CONN, BALANCE_ROUND_ROBIN, BALANCE_P2C, BALANCE_PEAK_EWMA };
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+        static balancer_t b;
+        balancer_init(&b, strategies[s], weighted, MAX_SERVERS, 10000);
+        pthread_t tids[64];
+        pick_arg_t arg = { &b, 2000000 };
+        if (threads > 64)
+            threads = 64;
+        double t0 = cpu_ns();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&tids[t], NULL, pick_thread, &arg);
+        for (int t = 0; t < threads; t++)
+            pthread_join(tids[t], NULL);
+        double t1 = cpu_ns();
+        printf("%-22s %8.1f ns/op (CPU)\n", balancer_strategy_name(strategies[s]),
+               (t1 - t0) / ((double)arg.picks * threads));
+    }
+    return 0;
+}
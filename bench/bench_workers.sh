@@ -0,0 +1,32 @@
+#!/bin/bash
+# Throughput scaling of the proxy with the number of reactor threads.
+# Starts the backends, primes the cache with one request and then drives
+# the cache-hit path with bench/hitload for 1, 2, 4 ... nproc workers.
+# Usage: bench/bench_workers.sh [client_threads] [seconds]
+cd "$(dirname "$0")/.." || exit 1
+
+CLIENTS=${1:-64}
+SECONDS_PER_RUN=${2:-5}
+MAX_WORKERS=$(nproc)
+
+make -s -f Makefile.proxy && make -s -f Makefile.backend && make -s -f Makefile.bench || exit 1
+
+./start_backends.sh > /dev/null
+trap 'kill $PROXY_PID 2>/dev/null; killall dummy_server 2>/dev/null' EXIT
+
+workers=1
+while [ "$workers" -le "$MAX_WORKERS" ]; do
+  ./proxy_server --workers "$workers" > /dev/null 2>&1 &
+  PROXY_PID=$!
+  sleep 0.5
+  # the first GET is a miss and waits on the backend; same bytes as hitload sends
+  exec 3<>/dev/tcp/127.0.0.1/8080
+  printf 'GET /bench HTTP/1.0\r\nHost: localhost\r\n\r\n' >&3
+  timeout 5 cat <&3 > /dev/null
+  exec 3<&-
+  printf "workers=%-3d " "$workers"
+  ./bench/hitload "$CLIENTS" "$SECONDS_PER_RUN"
+  kill $PROXY_PID
+  wait $PROXY_PID 2>/dev/null
+  workers=$((workers * 2))
+done
@@ -0,0 +1,76 @@
+// Cache microbenchmark: cost of cache_lookup()/cache_insert() as the number
+// of resident entries grows. With a hash index the per-lookup cost should
+// stay flat across sizes instead of growing with the entry count.
+#include "../cache.h"
+#include "../slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOKUPS 1000000
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_entries = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    static const char *value = "HTTP/1.1 200 OK\r\nContent-Length: 12\r\n\r\nHello world\n";
+    size_t value_len = strlen(value);
+    char key[64];
+
+    printf("%10s %14s %14s %14s %14s\n", "entries", "insert ns/op", "hit ns/op", "miss ns/op", "bytes/entry");
+    for (size_t n = 1000; n <= max_entries; n *= 10) {
+        cache_set_max_bytes((size_t)-1 / 2);  // no eviction: measure the index only
+        cache_init();
+
+        double t0 = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            int klen = snprintf(key, sizeof(key), "GET /object/%zu HTTP/1.1", i);
+            cache_insert(key, klen, NULL, 0, value, value_len, 0);
+        }
+        double t1 = now_ns();
+        cache_stats_t stats;
+        cache_get_stats(&stats);
+
+        uint64_t seed = 88172645463325252ULL;
+        size_t found = 0;
+        double t2 = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            int klen = snprintf(key, sizeof(key), "GET /object/%zu HTTP/1.1", (size_t)(xorshift(&seed) % n));
+            cache_object_t *obj = cache_lookup(key, klen);
+            if (obj) {
+                found++;
+                cache_release(obj);
+            }
+        }
+        double t3 = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            int klen = snprintf(key, sizeof(key), "GET /absent/%zu HTTP/1.1", (size_t)(xorshift(&seed) % n));
+            cache_object_t *obj = cache_lookup(key, klen);
+            if (obj) {
+                found++;
+                cache_release(obj);
+            }
+        }
+        double t4 = now_ns();
+
+        if (found != LOOKUPS)
+            fprintf(stderr, "unexpected hit count %zu\n", found);
+        printf("%10zu %14.1f %14.1f %14.1f %14.1f\n", n, (t1 - t0) / n, (t3 - t2) / LOOKUPS, (t4 - t3) / LOOKUPS,
+               (double)stats.bytes / n);
+        cache_cleanup();
+    }
+    return 0;
+}
@@ -0,0 +1,228 @@
+// Cache policy simulator: replays a trace of keys through cache.c once per
+// admission policy and memory budget, and reports the hit ratios and the
+// memory each needed. A trace is either the proxy's access log (the key is
+// the method and target, the size its bytes= field) or one "KEY [SIZE]" per
+// line. --synthetic N makes one up instead: Zipf-distributed requests for
+// popular objects mixed with a stream of keys requested only once.
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+
+typedef struct {
+    size_t key_off;
+    uint32_t key_len;
+    uint32_t size;
+} request_t;
+
+static char *keys;
+static size_t keys_len, keys_cap;
+static request_t *requests;
+static size_t request_count, request_cap;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void add_request(const char *key, size_t key_len, size_t size) {
+    if (keys_len + key_len > keys_cap) {
+        keys_cap = keys_cap ? keys_cap * 2 : 1 << 20;
+        while (keys_len + key_len > keys_cap)
+            keys_cap *= 2;
+        keys = realloc(keys, keys_cap);
+    }
+    if (request_count == request_cap) {
+        request_cap = request_cap ? request_cap * 2 : 1 << 16;
+        requests = realloc(requests, request_cap * sizeof(*requests));
+    }
+    if (!keys || !requests) {
+        perror("realloc");
+        exit(1);
+    }
+    memcpy(keys + keys_len, key, key_len);
+    requests[request_count++] = (request_t){ keys_len, (uint32_t)key_len, (uint32_t)size };
+    keys_len += key_len;
+}
+
+static int load_trace(FILE *f, size_t default_size) {
+    char line[8192];
+    while (fgets(line, sizeof(line), f)) {
+        size_t size = default_size;
+        const char *target = strstr(line, " target=\"");
+        if (target) {
+            const char *method = strstr(line, " method=");
+            const char *bytes = strstr(line, " bytes=");
+            const char *end = strchr(target + 9, '"');
+            if (!method || !end)
+                continue;
+            method += 8;
+            size_t method_len = strcspn(method, " ");
+            char key[8192];
+            size_t len = snprintf(key, sizeof(key), "%.*s %.*s", (int)method_len, method,
+                                  (int)(end - target - 9), target + 9);
+            if (bytes)
+                size = strtoul(bytes + 7, NULL, 10);
+            add_request(key, len < sizeof(key) ? len : sizeof(key) - 1, size);
+            continue;
+        }
+        char *key = line + strspn(line, " \t");
+        size_t len = strcspn(key, " \t\r\n");
+        if (len == 0)
+            continue;
+        char *rest = key + len;
+        char *end;
+        size_t n = strtoul(rest, &end, 10);
+        if (end != rest)
+            size = n;
+        add_request(key, len, size);
+    }
+    return request_count > 0 ? 0 : -1;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+// Popular objects with Zipf(0.9) popularity, one request in three for a
+// key never seen again.
+static void synthesize(size_t n, size_t size) {
+    const size_t objects = 100000;
+    const double s = 0.9;
+    double *cdf = malloc(objects * sizeof(double));
+    if (!cdf) {
+        perror("malloc");
+        exit(1);
+    }
+    double sum = 0;
+    for (size_t i = 0; i < objects; i++)
+        cdf[i] = sum += 1.0 / pow(i + 1, s);
+    uint64_t seed = 88172645463325252ULL;
+    char key[64];
+    size_t once = 0;
+    for (size_t i = 0; i < n; i++) {
+        double u = (xorshift(&seed) >> 11) * (1.0 / 9007199254740992.0);
+        int len;
+        if (u < 1.0 / 3) {
+            len = snprintf(key, sizeof(key), "GET /once/%zu", once++);
+        } else {
+            double x = (xorshift(&seed) >> 11) * (1.0 / 9007199254740992.0) * sum;
+            size_t lo = 0, hi = objects - 1;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cdf[mid] < x)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            len = snprintf(key, sizeof(key), "GET /object/%zu", lo);
+        }
+        add_request(key, len, size);
+    }
+    free(cdf);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--mb LIST] [--size BYTES] [--synthetic N] [TRACE|-]\n"
+                    "  --mb LIST        cache budgets in MiB, comma separated (default 16,64)\n"
+                    "  --size BYTES     response size where the trace has none (default 4096)\n"
+                    "  --synthetic N    replay N made-up requests instead of a trace\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        {"mb", required_argument, NULL, 'm'},
+        {"size", required_argument, NULL, 's'},
+        {"synthetic", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *budgets = "16,64";
+    size_t size = 4096, synthetic = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'm': budgets = optarg; break;
+        case 's': size = strtoul(optarg, NULL, 10); break;
+        case 'n': synthetic = strtoul(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (synthetic) {
+        synthesize(synthetic, size);
+    } else if (optind == argc - 1) {
+        FILE *f = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+        if (!f || load_trace(f, size) < 0) {
+            fprintf(stderr, "No requests in %s\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t max_size = 0;
+    for (size_t i = 0; i < request_count; i++)
+        if (requests[i].size > max_size)
+            max_size = requests[i].size;
+    if (max_size > CACHE_MAX_OBJECT_SIZE)
+        max_size = CACHE_MAX_OBJECT_SIZE;
+    char *value = calloc(1, max_size + 1);
+    if (!value) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("%zu requests\n", request_count);
+    printf("%8s %8s %8s %10s %9s %11s %11s %11s %11s %8s\n", "policy", "MiB", "hit %", "byte hit %", "entries",
+           "cache MiB", "sketch KiB", "evictions", "rejections", "ns/req");
+    for (const char *p = budgets; *p;) {
+        char *end;
+        size_t mb = strtoul(p, &end, 10);
+        if (end == p)
+            break;
+        p = *end == ',' ? end + 1 : end;
+        for (int policy = 0; policy < CACHE_POLICIES; policy++) {
+            cache_set_policy(policy);
+            cache_set_max_bytes(mb << 20);
+            cache_init();
+            uint64_t hits = 0, bytes = 0, hit_bytes = 0;
+            double t0 = now_ns();
+            for (size_t i = 0; i < request_count; i++) {
+                const request_t *r = &requests[i];
+                const char *key = keys + r->key_off;
+                size_t len = r->size < max_size ? r->size : max_size;
+                bytes += len;
+                cache_object_t *obj = cache_lookup(key, r->key_len);
+                if (obj) {
+                    hits++;
+                    hit_bytes += len;
+                    cache_release(obj);
+                } else {
+                    cache_insert(key, r->key_len, NULL, 0, value, len, 0);
+                }
+            }
+            double t1 = now_ns();
+            cache_stats_t stats;
+            cache_get_stats(&stats);
+            printf("%8s %8zu %8.2f %10.2f %9zu %11.1f %11.1f %11lu %11lu %8.0f\n", cache_policy_name(policy), mb,
+                   100.0 * hits / request_count, bytes ? 100.0 * hit_bytes / bytes : 0.0, stats.entries,
+                   stats.bytes / 1048576.0, stats.sketch_bytes / 1024.0, stats.evictions, stats.rejections,
+                   (t1 - t0) / request_count);
+            cache_cleanup();
+        }
+    }
+    free(value);
+    return 0;
+}
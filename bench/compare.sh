@@ -0,0 +1,54 @@
+#!/bin/bash
+# Compare two result files of bench/run_bench.sh metric by metric and flag
+# regressions: a metric more than THRESHOLD percent worse (default 10).
+# Metrics ending in _rps are better higher; all others are better lower.
+# A metric at 0 in the base regresses if it becomes anything else (errors).
+# Exits 1 if anything regressed.
+# Usage: bench/compare.sh BASE.json NEW.json [THRESHOLD]
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 BASE.json NEW.json [THRESHOLD]" >&2
+  exit 2
+fi
+BASE=$1
+NEW=$2
+THRESHOLD=${3:-10}
+for f in "$BASE" "$NEW"; do
+  [ -r "$f" ] || { echo "Cannot read $f" >&2; exit 2; }
+done
+
+# Only the "metrics" object: one "name": number per line.
+metrics() {
+  awk '/"metrics"/ { on = 1; next } on && /"[^"]+": *-?[0-9]/ {
+         gsub(/[",:]/, " "); print $1, $2 }' "$1"
+}
+
+awk -v threshold="$THRESHOLD" '
+  FNR == NR { base[$1] = $2; order[++n] = $1; next }
+  { new[$1] = $2; if (!($1 in base)) order[++n] = $1 }
+  END {
+    printf "%-32s %14s %14s %9s\n", "metric", "base", "new", "change"
+    regressions = 0
+    for (i = 1; i <= n; i++) {
+      m = order[i]
+      if (!(m in base) || !(m in new)) {
+        printf "%-32s %14s %14s %9s  only in %s\n", m, m in base ? base[m] : "-", m in new ? new[m] : "-", "",
+               m in base ? "base" : "new"
+        continue
+      }
+      b = base[m]; v = new[m]
+      higher = m ~ /_rps$/
+      if (b == 0) {
+        change = "";
+        worse = higher ? v < b : v > b
+      } else {
+        pct = (v - b) / b * 100
+        change = sprintf("%+.1f%%", pct)
+        worse = higher ? -pct > threshold : pct > threshold
+      }
+      better = b != 0 && (higher ? pct > threshold : -pct > threshold)
+      printf "%-32s %14s %14s %9s%s\n", m, b, v, change, worse ? "  REGRESSION" : better ? "  better" : ""
+      regressions += worse
+    }
+    printf "\n%d regression(s) beyond %s%%\n", regressions, threshold
+    exit regressions > 0
+  }' <(metrics "$BASE") <(metrics "$NEW")
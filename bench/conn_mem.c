@@ -0,0 +1,82 @@
+// Memory the proxy spends per client connection: opens connections to a
+// running proxy and reads its resident set size from /proc before and
+// after. First the connections stay silent (accepted, waiting for a
+// request), then each sends half a request head (a buffer in use).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+static long rss_kb(int pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+static void report(const char *what, long before, long after, int n) {
+    printf("%-28s %8ld KiB for %d connections, %6.0f bytes each\n",
+           what, after - before, n, (after - before) * 1024.0 / n);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s proxy-pid [connections] [port]\n", argv[0]);
+        return 1;
+    }
+    int pid = atoi(argv[1]);
+    int n = argc > 2 ? atoi(argv[2]) : 5000;
+    int port = argc > 3 ? atoi(argv[3]) : 8080;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    int *fds = malloc(n * sizeof(int));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    long base = rss_kb(pid);
+    if (base < 0) {
+        perror("reading proxy RSS");
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (fds[i] < 0 || connect(fds[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            n = i;
+            break;
+        }
+    }
+    sleep(1);  // let the proxy accept them all
+    long idle = rss_kb(pid);
+    report("waiting for a request", base, idle, n);
+
+    const char partial[] = "GET /conn-mem HTTP/1.1\r\nHost: bench\r\n";
+    for (int i = 0; i < n; i++)
+        if (write(fds[i], partial, sizeof(partial) - 1) < 0)
+            perror("write");
+    sleep(1);
+    long reading = rss_kb(pid);
+    report("with half a request head", base, reading, n);
+
+    for (int i = 0; i < n; i++)
+        close(fds[i]);
+    free(fds);
+    return 0;
+}
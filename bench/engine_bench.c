@@ -0,0 +1,370 @@
+// A/B comparison of the proxy's I/O engines (--io-engine epoll / io_uring)
+// on the same workload: requests per second, requests per CPU second of the
+// proxy, and system calls per request. System calls are counted by tracing
+// the proxy with ptrace in a separate, slower run. Needs backends on
+// 9090-9099 (start_backends.sh).
+//
+// Workloads: cache hits on a keep-alive connection, cache hits with a new
+// client connection each (accept and close dominate), and cache misses with
+// a new client connection each (mostly bound by the backends).
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 18080
+#define MAX_SYSCALL 512
+
+static const char *proxy_path = "./proxy_server";
+static int requests = 20000;
+static int clients = 8;
+
+typedef enum { HIT_KEEPALIVE, HIT_NEW_CONN, MISS_NEW_CONN, WORKLOADS } workload_t;
+static const char *workload_names[] = { "keep-alive hits", "new-conn hits", "new-conn misses" };
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int dial(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// One response: the head, then Content-Length bytes (or up to EOF).
+// Returns 1 if the proxy closes the connection after it.
+static int read_response(int fd) {
+    char buf[16384];
+    size_t len = 0;
+    char *end = NULL;
+    while (!end) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    if (strncmp(buf, "HTTP/1.1 200", 12) != 0)
+        return -1;
+    int closing = strcasestr(buf, "Connection: close") != NULL;
+    char *cl = strcasestr(buf, "Content-Length:");
+    if (!cl)
+        return closing;
+    size_t want = (end + 4 - buf) + strtoul(cl + 15, NULL, 10);
+    while (len < want) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            return -1;
+        len += n;
+    }
+    return closing;
+}
+
+typedef struct {
+    workload_t workload;
+    int id;
+    int count;
+    int errors;
+} client_t;
+
+static atomic_int run_seq;  // makes miss paths unique across runs
+
+static void *client_main(void *arg) {
+    client_t *c = arg;
+    char req[256];
+    int fd = -1;
+    int seq = atomic_fetch_add(&run_seq, 1);
+    for (int i = 0; i < c->count; i++) {
+        if (fd < 0 && (fd = dial()) < 0) {
+            c->errors++;
+            continue;
+        }
+        int len;
+        if (c->workload == HIT_KEEPALIVE)
+            len = snprintf(req, sizeof(req), "GET /engine-bench/hit HTTP/1.1\r\nHost: bench\r\n\r\n");
+        else if (c->workload == HIT_NEW_CONN)
+            len = snprintf(req, sizeof(req),
+                           "GET /engine-bench/hit HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n");
+        else
+            len = snprintf(req, sizeof(req),
+                           "GET /engine-bench/miss/%d/%d HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n",
+                           seq, i);
+        int closing = write(fd, req, len) != len ? -1 : read_response(fd);
+        if (closing < 0)
+            c->errors++;
+        if (closing || c->workload != HIT_KEEPALIVE) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static int run_load(workload_t workload, int total) {
+    pthread_t th[64];
+    client_t cl[64];
+    int errors = 0;
+    for (int t = 0; t < clients; t++) {
+        cl[t] = (client_t){ .workload = workload, .id = t, .count = total / clients };
+        pthread_create(&th[t], NULL, client_main, &cl[t]);
+    }
+    for (int t = 0; t < clients; t++) {
+        pthread_join(th[t], NULL);
+        errors += cl[t].errors;
+    }
+    return errors;
+}
+
+static pid_t start_proxy(const char *engine, int traced) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execl(proxy_path, proxy_path, "--port", "18080", "--workers", "1", "--io-engine", engine,
+              "--health-interval", "0", (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait_listening(void) {
+    for (int i = 0; i < 200; i++) {
+        int fd = dial();
+        if (fd >= 0) {
+            close(fd);
+            return 0;
+        }
+        usleep(20000);
+    }
+    return -1;
+}
+
+// CPU time of all the proxy's threads, from the scheduler's nanosecond
+// counters (utime and stime in /proc/<pid>/stat tick too coarsely).
+static double cpu_seconds(pid_t pid) {
+    char path[320];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    unsigned long long total = 0, ns;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/schedstat", pid, de->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        if (fscanf(f, "%llu", &ns) == 1)
+            total += ns;
+        fclose(f);
+    }
+    closedir(dir);
+    return total / 1e9;
+}
+
+// Traced threads are reaped one by one, and the proxy is the only child.
+// A killed io_uring proxy's listener outlives it until the kernel tears the
+// ring down; the next proxy would share the port with it (SO_REUSEPORT).
+static void stop_proxy(pid_t pid) {
+    kill(pid, SIGKILL);
+    while (waitpid(-1, NULL, __WALL) > 0 || errno == EINTR)
+        ;
+    for (int i = 0; i < 200; i++) {
+        int fd = dial();
+        if (fd < 0)
+            return;
+        close(fd);
+        usleep(10000);
+    }
+}
+
+// Syscall tracing: the tracer loop runs in the main thread (ptrace is tied
+// to the thread that attached) while the load runs in another one.
+static atomic_int counting, load_done;
+static unsigned long counts[MAX_SYSCALL];
+
+typedef struct {
+    workload_t workload;
+    int total;
+    int errors;
+} load_arg_t;
+
+static void *load_main(void *arg) {
+    load_arg_t *a = arg;
+    if (a->workload != MISS_NEW_CONN)
+        run_load(HIT_KEEPALIVE, clients);  // prime the cache
+    atomic_store(&counting, 1);
+    a->errors = run_load(a->workload, a->total);
+    atomic_store(&counting, 0);
+    atomic_store(&load_done, 1);
+    return NULL;
+}
+
+static int trace_run(const char *engine, workload_t workload, int total) {
+    memset(counts, 0, sizeof(counts));
+    atomic_store(&counting, 0);
+    atomic_store(&load_done, 0);
+    pid_t pid = start_proxy(engine, 1);
+    int status;
+    waitpid(pid, &status, 0);  // the SIGSTOP before exec
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACECLONE | PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    pthread_t loader;
+    load_arg_t arg = { .workload = workload, .total = total };
+    int started = 0;
+    double ready_at = now_s() + 0.5;
+    while (!atomic_load(&load_done)) {
+        if (!started && now_s() > ready_at) {
+            // Give the proxy time to start listening (it is traced, so slower).
+            pthread_create(&loader, NULL, load_main, &arg);
+            started = 1;
+        }
+        pid_t tid = waitpid(-1, &status, __WALL | WNOHANG);
+        if (tid == 0) {
+            usleep(100);
+            continue;
+        }
+        if (tid < 0)
+            break;
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            continue;
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            struct user_regs_struct regs;
+            ptrace(PTRACE_GETREGS, tid, NULL, &regs);
+            // On entry the kernel reports -ENOSYS in rax.
+            if ((long)regs.rax == -ENOSYS && atomic_load(&counting) && regs.orig_rax < MAX_SYSCALL)
+                counts[regs.orig_rax]++;
+            sig = 0;
+        } else if (sig == SIGTRAP || sig == SIGSTOP) {
+            sig = 0;  // clone events and new threads starting
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    if (started)
+        pthread_join(loader, NULL);
+    stop_proxy(pid);
+    return arg.errors;
+}
+
+static const struct {
+    int nr;
+    const char *name;
+} names[] = {
+    { SYS_read, "read" }, { SYS_write, "write" }, { SYS_close, "close" }, { SYS_accept4, "accept4" },
+    { SYS_socket, "socket" }, { SYS_connect, "connect" }, { SYS_epoll_wait, "epoll_wait" },
+    { SYS_epoll_ctl, "epoll_ctl" }, { SYS_io_uring_enter, "io_uring_enter" }, { SYS_getsockopt, "getsockopt" },
+    { SYS_setsockopt, "setsockopt" }, { SYS_sendto, "sendto" }, { SYS_recvfrom, "recvfrom" },
+    { SYS_splice, "splice" }, { SYS_fcntl, "fcntl" }, { SYS_futex, "futex" }, { SYS_shutdown, "shutdown" },
+    { SYS_epoll_pwait, "epoll_pwait" }, { SYS_writev, "writev" }, { SYS_mmap, "mmap" },
+    { SYS_munmap, "munmap" }, { SYS_madvise, "madvise" }, { SYS_brk, "brk" },
+};
+
+static const char *syscall_name(int nr) {
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (names[i].nr == nr)
+            return names[i].name;
+    static char other[16];
+    snprintf(other, sizeof(other), "#%d", nr);
+    return other;
+}
+
+static void bench(const char *engine, workload_t workload) {
+    pid_t pid = start_proxy(engine, 0);
+    if (wait_listening() < 0) {
+        fprintf(stderr, "proxy did not start\n");
+        stop_proxy(pid);
+        exit(1);
+    }
+    if (workload != MISS_NEW_CONN)
+        run_load(HIT_KEEPALIVE, clients);
+    double cpu0 = cpu_seconds(pid), t0 = now_s();
+    int errors = run_load(workload, requests);
+    double wall = now_s() - t0, cpu = cpu_seconds(pid) - cpu0;
+    stop_proxy(pid);
+
+    int traced = requests / 4 < 2000 ? 2000 : requests / 4;
+    errors += trace_run(engine, workload, traced);
+    unsigned long total = 0;
+    for (int i = 0; i < MAX_SYSCALL; i++)
+        total += counts[i];
+    printf("%-9s %-16s %9.0f %11.0f %9.2f  ", engine, workload_names[workload], requests / wall,
+           cpu > 0 ? requests / cpu : 0.0, (double)total / traced);
+    // The four most frequent calls per request.
+    for (int k = 0; k < 4; k++) {
+        int best = -1;
+        for (int i = 0; i < MAX_SYSCALL; i++)
+            if (counts[i] && (best < 0 || counts[i] > counts[best]))
+                best = i;
+        if (best < 0)
+            break;
+        printf(" %s %.2f", syscall_name(best), (double)counts[best] / traced);
+        counts[best] = 0;
+    }
+    printf("%s\n", errors ? "  (errors!)" : "");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        requests = atoi(argv[1]);
+    if (argc > 2)
+        clients = atoi(argv[2]);
+    if (argc > 3)
+        proxy_path = argv[3];
+    if (requests < 100 || clients < 1 || clients > 64) {
+        fprintf(stderr, "Usage: %s [requests] [clients (1-64)] [proxy binary]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("%d requests from %d clients, proxy with one worker on port %d\n\n", requests, clients, BENCH_PORT);
+    printf("%-9s %-16s %9s %11s %9s   %s\n", "engine", "workload", "req/s", "req/CPU-s", "sys/req",
+           "most frequent per request");
+    const char *engines[] = { "epoll", "io_uring" };
+    for (int w = 0; w < WORKLOADS; w++)
+        for (int e = 0; e < 2; e++)
+            bench(engines[e], (workload_t)w);
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Bytes sent and CPU per cache hit for a text response served as it is,
+// served as a gzip variant made once when it was cached (what the proxy
+// does), and compressed anew on every hit at zlib levels 1 and 6. Each hit
+// picks the encoding from the request's Accept-Encoding, gets its bytes
+// ready and writes them to a socket another thread drains, so the cost of
+// sending more bytes is counted too. CPU is the sending thread's.
+#include "../http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+static const char request[] =
+    "GET /api/items?page=3 HTTP/1.1\r\nHost: example.com\r\nAccept: application/json\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\nUser-Agent: gzip_bench\r\n\r\n";
+
+static double thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// JSON-like records with some variety, roughly as compressible as an API response.
+static char *make_body(size_t len) {
+    static const char *const words[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel"};
+    char *body = malloc(len + 128);
+    size_t off = 0;
+    unsigned seed = 12345;
+    for (int id = 0; off < len; id++) {
+        seed = seed * 1103515245 + 12345;
+        off += snprintf(body + off, 128, "{\"id\":%d,\"name\":\"%s-%u\",\"score\":%u.%02u,\"active\":%s},", id,
+                        words[(seed >> 8) % 8], (seed >> 12) % 10000, (seed >> 4) % 1000, (seed >> 16) % 100,
+                        (seed >> 20) & 1 ? "true" : "false");
+    }
+    return body;
+}
+
+static size_t deflate_body(z_stream *z, const char *body, size_t len, char *out, size_t cap) {
+    deflateReset(z);
+    z->next_in = (Bytef *)body;
+    z->avail_in = (uInt)len;
+    z->next_out = (Bytef *)out;
+    z->avail_out = (uInt)cap;
+    if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed\n");
+        exit(1);
+    }
+    return z->total_out;
+}
+
+static void *drain(void *arg) {
+    int fd = *(int *)arg;
+    static char buf[1 << 16];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static void send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+enum { MODE_IDENTITY, MODE_PRECOMPRESSED, MODE_FLY1, MODE_FLY6, MODES };
+static const char *const mode_names[MODES] = {"identity", "precompressed", "on-the-fly -1", "on-the-fly -6"};
+
+int main(int argc, char *argv[]) {
+    int hits = argc > 1 ? atoi(argv[1]) : 20000;
+    static const size_t sizes[] = {1024, 8192, 32768, 61440};
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    pthread_t reader;
+    pthread_create(&reader, NULL, drain, &fds[1]);
+
+    http_request_t req;
+    http_request_init(&req);
+    if (http_parse_request(request, sizeof(request) - 1, &req) != 1) {
+        fprintf(stderr, "bad request\n");
+        return 1;
+    }
+    z_stream fly[MODES];
+    for (int m = MODE_FLY1; m <= MODE_FLY6; m++) {
+        memset(&fly[m], 0, sizeof(fly[m]));
+        deflateInit2(&fly[m], m == MODE_FLY1 ? 1 : 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    }
+
+    printf("%-8s %-15s %12s %10s %12s\n", "body", "mode", "bytes/hit", "ratio", "cpu ns/hit");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        char *body = make_body(len);
+        size_t cap = deflateBound(&fly[MODE_FLY6], len);
+        char *out = malloc(cap);
+        // The proxy's variant: made once, at level 6, off the event loop.
+        char *variant = malloc(cap);
+        size_t variant_len = deflate_body(&fly[MODE_FLY6], body, len, variant, cap);
+        for (int m = 0; m < MODES; m++) {
+            double start = thread_cpu_ns();
+            size_t bytes = 0;
+            for (int i = 0; i < hits; i++) {
+                const char *data = body;
+                size_t n = len;
+                if (m != MODE_IDENTITY && http_accepts_gzip(request, &req)) {
+                    if (m == MODE_PRECOMPRESSED) {
+                        data = variant;
+                        n = variant_len;
+                    } else {
+                        data = out;
+                        n = deflate_body(&fly[m], body, len, out, cap);
+                    }
+                }
+                send_all(fds[0], data, n);
+                bytes += n;
+            }
+            double ns = (thread_cpu_ns() - start) / hits;
+            printf("%-8zu %-15s %12zu %9.1f%% %12.0f\n", len, mode_names[m], bytes / hits,
+                   100.0 * (double)bytes / hits / len, ns);
+        }
+        free(body);
+        free(out);
+        free(variant);
+    }
+    shutdown(fds[0], SHUT_WR);
+    pthread_join(reader, NULL);
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Content-aware routing with the Maglev table in balancer.c:
+//  - how evenly keys spread over the backends,
+//  - how many keys move when a backend leaves or joins (ideally 1/N),
+//  - the cost of a pick,
+//  - how the load bound spreads a skewed (Zipf) key popularity, and how
+//    many requests still reach their key's own backend.
+#include "../balancer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x | 1;  // 0 means "no key"
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_pool(Backend *pool, int count, int skip) {
+    int n = 0;
+    for (int i = 0; i < MAX_SERVERS && n < count; i++) {
+        if (i == skip)
+            continue;
+        snprintf(pool[n].ip, sizeof(pool[n].ip), "127.0.0.1");
+        pool[n].port = 9090 + i;
+        pool[n].weight = 1;
+        n++;
+    }
+}
+
+// Port a key maps to, ignoring load.
+static int owner(const balancer_t *b, const Backend *pool, uint64_t h) {
+    return pool[b->maglev[h % MAGLEV_SIZE]].port;
+}
+
+static double churn(const balancer_t *a, const Backend *pa, const balancer_t *b, const Backend *pb, size_t keys) {
+    size_t moved = 0;
+    for (size_t k = 0; k < keys; k++) {
+        uint64_t h = mix(k);
+        moved += owner(a, pa, h) != owner(b, pb, h);
+    }
+    return 100.0 * moved / keys;
+}
+
+int main(int argc, char *argv[]) {
+    size_t keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (keys < 1000) {
+        fprintf(stderr, "Usage: %s [keys]\n", argv[0]);
+        return 1;
+    }
+    static balancer_t full, less;
+    Backend pool[MAX_SERVERS], pool_less[MAX_SERVERS];
+
+    make_pool(pool, MAX_SERVERS, -1);
+    double t0 = now_ns();
+    balancer_init(&full, BALANCE_MAGLEV, pool, MAX_SERVERS, 10000);
+    double t1 = now_ns();
+    printf("table of %d entries for %d backends built in %.2f ms\n", MAGLEV_SIZE, MAX_SERVERS, (t1 - t0) / 1e6);
+
+    size_t share[MAX_SERVERS] = {0};
+    for (size_t k = 0; k < keys; k++)
+        share[full.maglev[mix(k) % MAGLEV_SIZE]]++;
+    size_t lo = keys, hi = 0;
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        lo = share[i] < lo ? share[i] : lo;
+        hi = share[i] > hi ? share[i] : hi;
+    }
+    printf("keys per backend: min %.2f%% max %.2f%% (mean %.2f%%)\n",
+           100.0 * lo / keys, 100.0 * hi / keys, 100.0 / MAX_SERVERS);
+
+    // Remove each backend in turn; adding it back is the same change reversed.
+    double worst = 0, sum = 0;
+    for (int gone = 0; gone < MAX_SERVERS; gone++) {
+        make_pool(pool_less, MAX_SERVERS - 1, gone);
+        balancer_init(&less, BALANCE_MAGLEV, pool_less, MAX_SERVERS - 1, 10000);
+        double c = churn(&full, pool, &less, pool_less, keys);
+        sum += c;
+        worst = c > worst ? c : worst;
+    }
+    printf("keys remapped when one of %d backends leaves: mean %.2f%% worst %.2f%% (ideal %.2f%%)\n",
+           MAX_SERVERS, sum / MAX_SERVERS, worst, 100.0 / MAX_SERVERS);
+
+    // Pick cost, with nothing in flight and with the load bound in play.
+    size_t picks = 5000000;
+    t0 = now_ns();
+    for (size_t n = 0; n < picks; n++)
+        balancer_release(&full, balancer_pick(&full, 0, mix(n), 1000000));
+    t1 = now_ns();
+    printf("pick + release: %.1f ns/op\n", (t1 - t0) / picks);
+
+    // Zipf(1.1) popularity over the keys, a fixed number of requests in flight.
+    enum { IN_FLIGHT = 256 };
+    size_t nkeys = keys < 100000 ? keys : 100000;
+    double *cdf = malloc(nkeys * sizeof(double));
+    double total = 0;
+    for (size_t k = 0; k < nkeys; k++)
+        cdf[k] = (total += 1.0 / pow(k + 1, 1.1));
+    printf("\nZipf(1.1) over %zu keys, %d requests in flight\n", nkeys, IN_FLIGHT);
+    printf("%12s %14s %14s\n", "load factor", "busiest share", "to own backend");
+    const int factors[] = { 100, 125, 150, 200, 1000000 };
+    for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        balancer_init(&full, BALANCE_MAGLEV, pool, MAX_SERVERS, 10000);
+        balancer_set_load_factor(&full, factors[f]);
+        int ring[IN_FLIGHT];
+        size_t served[MAX_SERVERS] = {0}, own = 0, requests = 1000000;
+        uint64_t seed = 88172645463325252ULL;
+        for (size_t n = 0; n < requests; n++) {
+            if (n >= IN_FLIGHT)
+                balancer_release(&full, ring[n % IN_FLIGHT]);
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            double u = (seed >> 11) * (1.0 / 9007199254740992.0) * total;
+            size_t lo_k = 0, hi_k = nkeys - 1;
+            while (lo_k < hi_k) {
+                size_t mid = (lo_k + hi_k) / 2;
+                if (cdf[mid] < u)
+                    lo_k = mid + 1;
+                else
+                    hi_k = mid;
+            }
+            uint64_t h = mix(lo_k);
+            int i = balancer_pick(&full, 0, h, 1000000);
+            ring[n % IN_FLIGHT] = i;
+            served[i]++;
+            own += i == full.maglev[h % MAGLEV_SIZE];
+        }
+        for (size_t n = 0; n < IN_FLIGHT; n++)
+            balancer_release(&full, ring[n]);
+        size_t busiest = 0;
+        for (int i = 0; i < MAX_SERVERS; i++)
+            busiest = served[i] > busiest ? served[i] : busiest;
+        char label[16];
+        if (factors[f] >= 1000000)
+            snprintf(label, sizeof(label), "unbounded");
+        else
+            snprintf(label, sizeof(label), "%d%%", factors[f]);
+        printf("%12s %13.1f%% %13.1f%%\n", label, 100.0 * busiest / requests, 100.0 * own / requests);
+    }
+    free(cdf);
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Closed-loop load for the cache-hit path: each thread repeatedly connects,
+// sends the same GET and reads the reply until the proxy closes the socket.
+// With keep-alive, each thread sends its requests over one connection and
+// finds the end of every reply from its Content-Length.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static const char *request = "GET /bench HTTP/1.0\r\nHost: localhost\r\n\r\n";
+static const char *keepalive_request = "GET /bench HTTP/1.1\r\nHost: localhost\r\n\r\n";
+static int proxy_port = 8080;
+static int keepalive;
+static volatile int running = 1;
+static atomic_long completed;
+static atomic_long failed;
+
+// Read one Content-Length framed reply; returns 0 when complete.
+static int read_reply(int fd, char *buffer, size_t size) {
+    size_t len = 0;
+    char *head_end = NULL;
+    while (!head_end) {
+        ssize_t n = read(fd, buffer + len, size - 1 - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buffer[len] = '\0';
+        head_end = strstr(buffer, "\r\n\r\n");
+        if (!head_end && len == size - 1)
+            return -1;
+    }
+    const char *cl = strcasestr(buffer, "\r\nContent-Length:");
+    if (!cl || cl > head_end)
+        return -1;
+    size_t want = (head_end + 4 - buffer) + strtoul(cl + 17, NULL, 10);
+    while (len < want) {
+        ssize_t n = read(fd, buffer, want - len < size ? want - len : size);
+        if (n <= 0)
+            return -1;
+        len += n;
+    }
+    return 0;
+}
+
+static void keepalive_loop(const struct sockaddr_in *addr) {
+    char buffer[4096];
+    size_t req_len = strlen(keepalive_request);
+    while (running) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            atomic_fetch_add(&failed, 1);
+            continue;
+        }
+        if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+            atomic_fetch_add(&failed, 1);
+            close(fd);
+            continue;
+        }
+        // Stay on this connection until the proxy ends it (max requests).
+        while (running) {
+            if (write(fd, keepalive_request, req_len) != (ssize_t)req_len ||
+                read_reply(fd, buffer, sizeof(buffer)) < 0)
+                break;
+            atomic_fetch_add(&completed, 1);
+        }
+        close(fd);
+    }
+}
+
+static void *client_thread(void *arg) {
+    (void)arg;
+    char buffer[4096];
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(proxy_port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    if (keepalive) {
+        keepalive_loop(&addr);
+        return NULL;
+    }
+    while (running) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            atomic_fetch_add(&failed, 1);
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            write(fd, request, strlen(request)) < 0) {
+            atomic_fetch_add(&failed, 1);
+            close(fd);
+            continue;
+        }
+        ssize_t total = 0, n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            total += n;
+        close(fd);
+        if (total > 0)
+            atomic_fetch_add(&completed, 1);
+        else
+            atomic_fetch_add(&failed, 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    if (argc > 3)
+        proxy_port = atoi(argv[3]);
+    if (argc > 4)
+        keepalive = strcmp(argv[4], "keepalive") == 0;
+    if (threads < 1 || seconds < 1) {
+        fprintf(stderr, "Usage: %s [threads] [seconds] [port] [keepalive]\n", argv[0]);
+        return 1;
+    }
+
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, client_thread, NULL);
+    sleep(seconds);
+    running = 0;
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    long ok = atomic_load(&completed);
+    printf("threads=%d seconds=%d keepalive=%d completed=%ld failed=%ld rps=%.1f\n",
+           threads, seconds, keepalive, ok, atomic_load(&failed), (double)ok / seconds);
+    return 0;
+}
@@ -0,0 +1,250 @@
+// Hot-path microbenchmarks for the benchmark suite (bench/run_bench.sh),
+// written as one JSON object of "name": value lines:
+//   - cache_insert/cache_lookup (hits and misses) at 1K to 1M entries, and
+//     hits with several threads looking up at once;
+//   - least-connection balancer_pick + release with 1 to 8 threads picking
+//     at once (CPU time of all threads, so contention shows on any core count;
+//     the operations are split among the threads);
+//   - request parsing and cache key building for a short and a browser-like
+//     request.
+// Every figure is the median of REPEATS runs with fixed seeds and counts.
+// Names end in their unit; all are lower-is-better.
+#include "../cache.h"
+#include "../balancer.h"
+#include "../http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define REPEATS 5
+#define LOOKUPS 500000
+#define PICKS 1000000
+#define PARSES 1000000
+#define MAX_THREADS 8
+
+static const char short_request[] = "GET /item/42 HTTP/1.1\r\nHost: example.com\r\n\r\n";
+static const char browser_request[] =
+    "GET /articles/2023/10/some-long-article-name?utm_source=feed HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.org/\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; consent=yes\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Cache-Control: max-age=0\r\n\r\n";
+
+static double wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *v) {
+    qsort(v, REPEATS, sizeof(double), compare_double);
+    return v[REPEATS / 2];
+}
+
+static int first_metric = 1;
+
+static void metric(const char *name, double value) {
+    printf("%s  \"%s\": %.2f", first_metric ? "" : ",\n", name, value);
+    first_metric = 0;
+    fflush(stdout);
+}
+
+static int object_key(char *key, size_t cap, const char *kind, size_t i) {
+    return snprintf(key, cap, "GET example.com /%s/%zu", kind, i);
+}
+
+static void fill_cache(size_t n) {
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 12\r\n\r\n";
+    char key[64];
+    for (size_t i = 0; i < n; i++) {
+        int klen = object_key(key, sizeof(key), "object", i);
+        cache_insert(key, klen, head, sizeof(head) - 1, "Hello world\n", 12, 0);
+    }
+}
+
+static size_t lookups(size_t n, const char *kind, int count, uint64_t seed) {
+    char key[64];
+    size_t found = 0;
+    for (int i = 0; i < count; i++) {
+        int klen = object_key(key, sizeof(key), kind, (size_t)(xorshift(&seed) % n));
+        cache_object_t *obj = cache_lookup(key, klen);
+        if (obj) {
+            found++;
+            cache_release(obj);
+        }
+    }
+    return found;
+}
+
+typedef struct {
+    size_t n;
+    int count;
+    uint64_t seed;
+} lookup_arg_t;
+
+static void *lookup_thread(void *arg) {
+    lookup_arg_t *a = arg;
+    lookups(a->n, "object", a->count, a->seed);
+    return NULL;
+}
+
+static void bench_cache(void) {
+    static const size_t sizes[] = {1000, 10000, 100000, 1000000};
+    static const char *const labels[] = {"1k", "10k", "100k", "1m"};
+    char name[64];
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        double insert[REPEATS], hit[REPEATS], miss[REPEATS];
+        for (int r = 0; r < REPEATS; r++) {
+            cache_set_max_bytes((size_t)-1 / 2);  // no eviction: measure the index only
+            cache_init();
+            double t0 = wall_ns();
+            fill_cache(n);
+            double t1 = wall_ns();
+            if (lookups(n, "object", LOOKUPS, 88172645463325252ULL + r) != LOOKUPS)
+                fprintf(stderr, "micro_bench: lookups missed\n");
+            double t2 = wall_ns();
+            lookups(n, "absent", LOOKUPS, 88172645463325252ULL + r);
+            double t3 = wall_ns();
+            insert[r] = (t1 - t0) / n;
+            hit[r] = (t2 - t1) / LOOKUPS;
+            miss[r] = (t3 - t2) / LOOKUPS;
+            cache_cleanup();
+        }
+        snprintf(name, sizeof(name), "cache_insert_%s_ns", labels[s]);
+        metric(name, median(insert));
+        snprintf(name, sizeof(name), "cache_hit_%s_ns", labels[s]);
+        metric(name, median(hit));
+        snprintf(name, sizeof(name), "cache_miss_%s_ns", labels[s]);
+        metric(name, median(miss));
+    }
+
+    // Hits from several threads at once on 100K entries, LOOKUPS in all.
+    cache_set_max_bytes((size_t)-1 / 2);
+    cache_init();
+    fill_cache(100000);
+    for (int threads = 2; threads <= MAX_THREADS; threads *= 2) {
+        double cpu[REPEATS];
+        for (int r = 0; r < REPEATS; r++) {
+            pthread_t tids[MAX_THREADS];
+            lookup_arg_t args[MAX_THREADS];
+            double t0 = cpu_ns();
+            for (int t = 0; t < threads; t++) {
+                args[t] = (lookup_arg_t){100000, LOOKUPS / threads, 88172645463325252ULL + t * 7919 + r};
+                pthread_create(&tids[t], NULL, lookup_thread, &args[t]);
+            }
+            for (int t = 0; t < threads; t++)
+                pthread_join(tids[t], NULL);
+            cpu[r] = (cpu_ns() - t0) / ((double)(LOOKUPS / threads) * threads);
+        }
+        snprintf(name, sizeof(name), "cache_hit_100k_%dt_cpu_ns", threads);
+        metric(name, median(cpu));
+    }
+    cache_cleanup();
+}
+
+typedef struct {
+    balancer_t *b;
+    int picks;
+} pick_arg_t;
+
+static void *pick_thread(void *arg) {
+    pick_arg_t *a = arg;
+    balancer_t *b = a->b;
+    for (int n = 0; n < a->picks; n++) {
+        int i = balancer_pick(b, 0, 0, 0);
+        balancer_release(b, i);
+    }
+    return NULL;
+}
+
+static void bench_least_conn(void) {
+    static balancer_t b;
+    Backend pool[MAX_SERVERS];
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        snprintf(pool[i].ip, sizeof(pool[i].ip), "127.0.0.1");
+        pool[i].port = 9090 + i;
+        pool[i].weight = 1;
+    }
+    char name[64];
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double cpu[REPEATS];
+        for (int r = 0; r < REPEATS; r++) {
+            balancer_init(&b, BALANCE_LEAST_CONN, pool, MAX_SERVERS, 10000);
+            pthread_t tids[MAX_THREADS];
+            pick_arg_t arg = {&b, PICKS / threads};
+            double t0 = cpu_ns();
+            for (int t = 0; t < threads; t++)
+                pthread_create(&tids[t], NULL, pick_thread, &arg);
+            for (int t = 0; t < threads; t++)
+                pthread_join(tids[t], NULL);
+            cpu[r] = (cpu_ns() - t0) / ((double)arg.picks * threads);
+        }
+        snprintf(name, sizeof(name), "least_conn_pick_%dt_cpu_ns", threads);
+        metric(name, median(cpu));
+    }
+}
+
+static void bench_http(const char *label, const char *request, size_t len) {
+    char name[64], key[1024];
+    double parse[REPEATS], build[REPEATS];
+    http_request_t req;
+    size_t checksum = 0;
+    for (int r = 0; r < REPEATS; r++) {
+        double t0 = wall_ns();
+        for (int i = 0; i < PARSES; i++) {
+            http_request_init(&req);
+            checksum += http_parse_request(request, len, &req) + req.header_count;
+        }
+        double t1 = wall_ns();
+        for (int i = 0; i < PARSES; i++)
+            checksum += http_cache_key(request, &req, "Accept-Encoding", 15, key, sizeof(key));
+        double t2 = wall_ns();
+        parse[r] = (t1 - t0) / PARSES;
+        build[r] = (t2 - t1) / PARSES;
+    }
+    if (checksum == 0)
+        fprintf(stderr, "micro_bench: nothing parsed\n");
+    snprintf(name, sizeof(name), "parse_%s_ns", label);
+    metric(name, median(parse));
+    snprintf(name, sizeof(name), "cache_key_%s_ns", label);
+    metric(name, median(build));
+}
+
+int main(void) {
+    http_parser_init();
+    printf("{\n");
+    bench_cache();
+    bench_least_conn();
+    bench_http("short", short_request, sizeof(short_request) - 1);
+    bench_http("browser", browser_request, sizeof(browser_request) - 1);
+    printf("\n}\n");
+    return 0;
+}
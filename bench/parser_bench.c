@@ -0,0 +1,232 @@
+// Request parser throughput in GB/s for each delimiter scanner this CPU
+// supports, preceded by a corpus check. Every request must parse to its
+// expected result, framing and cache key; then it is parsed whole, byte by
+// byte and at random split points, and mutated at random, and all scanners
+// must agree with the scalar one on every outcome.
+#include "../http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    const char *data;
+    size_t len;
+    int r;                      // what http_parse_request must return
+    int has_body;               // for a valid request
+    const char *key;            // for a valid request, keyed on VARY
+} corpus_case_t;
+
+#define VARY "Accept-Language, accept-encoding"
+#define NO_VARY "\naccept-language:\naccept-encoding:"  // key suffix when neither header is sent
+#define VALID(s, body, key) {s, sizeof(s) - 1, 1, body, key}
+#define INVALID(s) {s, sizeof(s) - 1, -1, 0, NULL}
+
+static const corpus_case_t corpus[] = {
+    VALID("GET / HTTP/1.1\r\nHost: example.com\r\n\r\n", 0, "GET example.com/" NO_VARY),
+    VALID("GET /index.html?lang=en&x=1 HTTP/1.0\r\nHost: Example.COM:80\r\nConnection: keep-alive\r\n\r\n", 0,
+          "GET example.com/index.html?lang=en&x=1" NO_VARY),
+    VALID("GET http://example.com/abs/path HTTP/1.1\r\nHost: ignored\r\n\r\n", 0, "GET example.com/abs/path" NO_VARY),
+    VALID("POST /upload HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhello", 1, "POST a/upload" NO_VARY),
+    VALID("POST /chunks HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: gzip, chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n", 1,
+          "POST a/chunks" NO_VARY),
+    VALID("GET /bare-lf HTTP/1.1\nHost: a\nX-Tab:\tvalue\t\n\n", 0, "GET a/bare-lf" NO_VARY),
+    VALID("HEAD /h HTTP/1.1\r\nHost: a\r\nAccept-Encoding: gzip\r\nAccept-Language: de\r\n\r\n", 0,
+          "HEAD a/h\naccept-language:de\naccept-encoding:gzip"),
+    VALID("GET /browser HTTP/1.1\r\n"
+          "Host: www.example.org\r\n"
+          "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+          "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+          "Accept-Language: en-US,en;q=0.5\r\n"
+          "Accept-Encoding: gzip, deflate, br\r\n"
+          "Referer: https://www.example.org/articles/2023/10/some-long-article-name?utm_source=feed\r\n"
+          "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; consent=yes; tracking=none\r\n"
+          "Upgrade-Insecure-Requests: 1\r\n"
+          "Sec-Fetch-Dest: document\r\n"
+          "Sec-Fetch-Mode: navigate\r\n"
+          "Sec-Fetch-Site: same-origin\r\n"
+          "Cache-Control: max-age=0\r\n\r\n", 0,
+          "GET www.example.org/browser\naccept-language:en-US,en;q=0.5\naccept-encoding:gzip, deflate, br"),
+    VALID("GET /x HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n", 1, "GET a/x" NO_VARY),
+    // Malformed, or framed more than one way (request smuggling)
+    INVALID("GET /x HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n"),
+    INVALID("POST /x HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\nContent-Length: 4\r\n\r\n"),
+    INVALID("POST /x HTTP/1.1\r\nHost: a\r\nContent-Length: 4\r\nTransfer-Encoding: chunked\r\n\r\n"),
+    INVALID("POST /x HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked, gzip\r\n\r\n"),
+    INVALID("POST /x HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: identity\r\n\r\n"),
+    INVALID("GET /x HTTP/1.1\r\nHost: a\r\nContent-Length: -1\r\n\r\n"),
+    INVALID("GET /x HTTP/1.1\r\nHost: a\r\nHost: b\r\n\r\n"),
+    INVALID("GET /x HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n"),
+    INVALID("GET /x HTTP/1.1\r\nBad Name: a\r\n\r\n"),
+    INVALID("GET /x HTTP/1.1\r\nHost: a\0b\r\n\r\n"),
+    INVALID("GET /x HTTP/1.1\r\nHost: a\rb\r\n\r\n"),
+    INVALID("GET /x HTTP/2.0\r\n\r\n"),
+    INVALID("GET  HTTP/1.1\r\n\r\n"),
+    INVALID("SSH-2.0-OpenSSH_9.2\r\n"),
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Everything the parser reports, flattened so results can be compared.
+typedef struct {
+    int r;
+    size_t head_len;
+    int header_count;
+    uint32_t target_off, target_len, host_len;
+    int keep_alive, has_body;
+    char key[512];
+    size_t key_len;
+} outcome_t;
+
+static void parse_split(const char *buf, size_t len, size_t step, unsigned *seed, outcome_t *o) {
+    http_request_t req;
+    http_request_init(&req);
+    size_t fed = 0;
+    int r = 0;
+    while (fed < len) {
+        size_t n = step ? step : 1 + (size_t)(rand_r(seed) % 64);
+        fed = fed + n > len ? len : fed + n;
+        r = http_parse_request(buf, fed, &req);
+        if (r != 0)
+            break;
+    }
+    memset(o, 0, sizeof(*o));
+    o->r = r;
+    if (r == 1) {
+        o->head_len = req.head_len;
+        o->header_count = req.header_count;
+        o->target_off = req.target_off;
+        o->target_len = req.target_len;
+        o->host_len = req.host_len;
+        o->keep_alive = req.keep_alive;
+        o->has_body = req.has_body;
+        o->key_len = http_cache_key(buf, &req, VARY, sizeof(VARY) - 1, o->key, sizeof(o->key));
+    }
+}
+
+static int same(const outcome_t *a, const outcome_t *b) {
+    return a->r == b->r && a->head_len == b->head_len && a->header_count == b->header_count &&
+           a->target_off == b->target_off && a->target_len == b->target_len && a->host_len == b->host_len &&
+           a->keep_alive == b->keep_alive && a->has_body == b->has_body && a->key_len == b->key_len &&
+           memcmp(a->key, b->key, a->key_len) == 0;
+}
+
+static const char *impls[] = {"scalar", "sse4.2", "avx2"};
+#define IMPL_COUNT 3
+
+// Parse buf whole, byte by byte and in random pieces with every scanner.
+static int check_case(const char *buf, size_t len, unsigned *seed) {
+    outcome_t ref, o;
+    http_parser_use("scalar");
+    parse_split(buf, len, len, seed, &ref);
+    for (int i = 0; i < IMPL_COUNT; i++) {
+        if (http_parser_use(impls[i]) < 0)
+            continue;
+        for (int mode = 0; mode < 3; mode++) {
+            parse_split(buf, len, mode == 0 ? len : mode == 1 ? 1 : 0, seed, &o);
+            if (!same(&ref, &o)) {
+                fprintf(stderr, "corpus mismatch (%s, mode %d, r=%d vs %d): %.*s\n",
+                        impls[i], mode, o.r, ref.r, (int)len, buf);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// The scalar parse of a corpus request against what it must give.
+static int check_expected(const corpus_case_t *c) {
+    outcome_t o;
+    unsigned seed = 0;
+    http_parser_use("scalar");
+    parse_split(c->data, c->len, c->len, &seed, &o);
+    int ok = o.r == c->r;
+    if (ok && c->r == 1)
+        ok = o.has_body == c->has_body && o.key_len == strlen(c->key) && memcmp(o.key, c->key, o.key_len) == 0;
+    if (!ok)
+        fprintf(stderr, "corpus: unexpected result (r=%d, has_body=%d, key %.*s): %.*s\n", o.r, o.has_body,
+                (int)o.key_len, o.key, (int)c->len, c->data);
+    return ok ? 0 : -1;
+}
+
+static int run_corpus(void) {
+    static const char noise[] = "\r\n\t :\0\x7f\x80GET/HTTP1.,;";
+    unsigned seed = 12345;
+    size_t cases = 0;
+    char buf[4096];
+    for (size_t c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++) {
+        const char *data = corpus[c].data;
+        size_t len = corpus[c].len;
+        if (check_expected(&corpus[c]) < 0 || check_case(data, len, &seed) < 0)
+            return -1;
+        cases++;
+        for (int m = 0; m < 2000; m++) {
+            memcpy(buf, data, len);
+            size_t mlen = len;
+            int edits = 1 + rand_r(&seed) % 4;
+            for (int e = 0; e < edits; e++) {
+                size_t at = rand_r(&seed) % mlen;
+                switch (rand_r(&seed) % 3) {
+                case 0:
+                    buf[at] = noise[rand_r(&seed) % (sizeof(noise) - 1)];
+                    break;
+                case 1:
+                    if (mlen + 1 < sizeof(buf)) {
+                        memmove(buf + at + 1, buf + at, mlen - at);
+                        buf[at] = noise[rand_r(&seed) % (sizeof(noise) - 1)];
+                        mlen++;
+                    }
+                    break;
+                default:
+                    if (mlen > 1) {
+                        memmove(buf + at, buf + at + 1, mlen - at - 1);
+                        mlen--;
+                    }
+                }
+            }
+            if (check_case(buf, mlen, &seed) < 0)
+                return -1;
+            cases++;
+        }
+    }
+    printf("corpus: %zu requests as expected; %zu cases, all scanners agree on whole, byte-wise and split parses\n",
+           sizeof(corpus) / sizeof(corpus[0]), cases);
+    return 0;
+}
+
+static void run_bench(double seconds) {
+    const char *req = corpus[7].data;  // browser-like request
+    size_t len = corpus[7].len;
+    for (int i = 0; i < IMPL_COUNT; i++) {
+        if (http_parser_use(impls[i]) < 0) {
+            printf("%-7s unsupported\n", impls[i]);
+            continue;
+        }
+        http_request_t parsed;
+        size_t iters = 0, checksum = 0;
+        double t0 = now_ns(), t1;
+        do {
+            for (int k = 0; k < 10000; k++) {
+                http_request_init(&parsed);
+                checksum += http_parse_request(req, len, &parsed) + parsed.header_count;
+            }
+            iters += 10000;
+            t1 = now_ns();
+        } while (t1 - t0 < seconds * 1e9);
+        double ns = (t1 - t0) / iters;
+        printf("%-7s %zu-byte request: %6.1f ns/parse  %.2f GB/s  (checksum %zu)\n",
+               impls[i], len, ns, len / ns, checksum % 1000);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    if (run_corpus() < 0)
+        return 1;
+    run_bench(seconds > 0 ? seconds : 1.0);
+    return 0;
+}
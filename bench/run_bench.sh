@@ -0,0 +1,131 @@
+#!/bin/bash
+# The benchmark suite: bench/micro_bench, then end-to-end runs of the proxy
+# against dummy_server on loopback, written as one JSON file for
+# bench/compare.sh. Each end-to-end workload gets a fresh backend and proxy,
+# a warm-up run and a measured simulate_client run:
+#   hit    100 URLs, all cached after the warm-up
+#   miss   100000 URLs with caching off (--cache-ttl 0 --cache-stale 0)
+#   zipf   100000 URLs with Zipf 0.99 popularity
+#   large  256 KiB bodies, relayed with splice() and not cached
+# For each it records requests/s, latency percentiles and errors from the
+# client, and the proxy's CPU time per request and peak RSS.
+# Usage: bench/run_bench.sh [OUT.json]
+# Environment: DURATION (s, default 10), CONNECTIONS (64), WORKERS (1),
+# CLIENT_THREADS (2), PORT (18080), SCENARIOS ("hit miss zipf large"),
+# SKIP_MICRO=1 to leave out the microbenchmarks.
+cd "$(dirname "$0")/.." || exit 1
+
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+WORKERS=${WORKERS:-1}
+CLIENT_THREADS=${CLIENT_THREADS:-2}
+PORT=${PORT:-18080}
+SCENARIOS=${SCENARIOS:-"hit miss zipf large"}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=${1:-bench/results/$(date +%Y%m%d-%H%M%S)-$COMMIT.json}
+
+make -s -f Makefile.proxy && make -s -f Makefile.backend && make -s -f Makefile.simclient &&
+  make -s -f Makefile.bench || exit 1
+
+# The proxy's backends are fixed (backend_servers.c); others there would skew the runs.
+if (exec 3<>/dev/tcp/127.0.0.1/9090) 2>/dev/null; then
+  echo "Something already listens on port 9090; stop the backends first." >&2
+  exit 1
+fi
+
+mkdir -p "$(dirname "$OUT")"
+TMP=$(mktemp -d)
+BACKEND_PID=
+PROXY_PID=
+stop() {
+  [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null && wait "$PROXY_PID" 2>/dev/null
+  [ -n "$BACKEND_PID" ] && kill "$BACKEND_PID" 2>/dev/null && wait "$BACKEND_PID" 2>/dev/null
+  PROXY_PID=
+  BACKEND_PID=
+}
+trap 'stop; rm -rf "$TMP"' EXIT
+
+TICKS=$(getconf CLK_TCK)
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# A number from simulate_client's JSON report.
+field() {
+  grep -o "\"$1\": [0-9.]*" "$2" | head -1 | awk '{ print $2 }'
+}
+
+wait_port() {
+  for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Nothing came up on port $1" >&2
+  return 1
+}
+
+# scenario NAME "BACKEND ARGS" "PROXY ARGS" "CLIENT ARGS"
+scenario() {
+  local name=$1
+  echo "[bench] $name" >&2
+  ./dummy_server --threads 2 $2 9090-9099 > "$TMP/backend.log" 2>&1 &
+  BACKEND_PID=$!
+  wait_port 9099 || exit 1
+  ./proxy_server --port "$PORT" --workers "$WORKERS" --log-level warn $3 > "$TMP/proxy.log" 2>&1 &
+  PROXY_PID=$!
+  wait_port "$PORT" || exit 1
+  local client="./simulate_client --port $PORT --threads $CLIENT_THREADS --connections $CONNECTIONS $4"
+  $client --duration 1 > /dev/null 2>&1
+  local cpu0
+  cpu0=$(cpu_ticks "$PROXY_PID")
+  $client --duration "$DURATION" --json "$TMP/$name.json" > /dev/null 2>&1
+  local cpu1 rss requests
+  cpu1=$(cpu_ticks "$PROXY_PID")
+  rss=$(awk '/^VmHWM:/ { print $2 }' "/proc/$PROXY_PID/status")
+  stop
+  requests=$(field requests "$TMP/$name.json")
+  {
+    printf '  "e2e_%s_rps": %s,\n' "$name" "$(field rps "$TMP/$name.json")"
+    printf '  "e2e_%s_p50_ms": %s,\n' "$name" "$(field p50 "$TMP/$name.json")"
+    printf '  "e2e_%s_p99_ms": %s,\n' "$name" "$(field p99 "$TMP/$name.json")"
+    printf '  "e2e_%s_p999_ms": %s,\n' "$name" "$(field p99.9 "$TMP/$name.json")"
+    printf '  "e2e_%s_errors": %s,\n' "$name" "$(field errors "$TMP/$name.json")"
+    awk -v t="$((cpu1 - cpu0))" -v hz="$TICKS" -v n="$requests" -v name="$name" \
+      'BEGIN { printf "  \"e2e_%s_cpu_us_per_req\": %.3f,\n", name, (n > 0 ? t / hz / n * 1e6 : 0) }'
+    printf '  "e2e_%s_rss_kb": %s,\n' "$name" "$rss"
+  } >> "$TMP/metrics"
+}
+
+: > "$TMP/metrics"
+if [ -z "$SKIP_MICRO" ]; then
+  echo "[bench] micro" >&2
+  ./bench/micro_bench | sed '1d;$d;s/[^,]$/&,/' >> "$TMP/metrics" || exit 1
+fi
+for s in $SCENARIOS; do
+  case $s in
+  hit) scenario hit "" "" "--urls 100 --zipf 0" ;;
+  miss) scenario miss "" "--cache-ttl 0 --cache-stale 0 --coalesce-timeout 0" "--urls 100000 --zipf 0" ;;
+  zipf) scenario zipf "" "" "--urls 100000 --zipf 0.99" ;;
+  large) scenario large "--size 262144" "" "--urls 1000 --zipf 0.99" ;;
+  *) echo "Unknown scenario: $s" >&2; exit 1 ;;
+  esac
+done
+
+{
+  echo "{"
+  echo "  \"meta\": {"
+  echo "    \"commit\": \"$COMMIT\","
+  echo "    \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+  echo "    \"host\": \"$(uname -n)\","
+  echo "    \"kernel\": \"$(uname -r)\","
+  echo "    \"cpus\": \"$(nproc)\","
+  echo "    \"workers\": \"$WORKERS\","
+  echo "    \"connections\": \"$CONNECTIONS\","
+  echo "    \"duration_s\": \"$DURATION\""
+  echo "  },"
+  echo "  \"metrics\": {"
+  sed '$s/,$//' "$TMP/metrics" | sed 's/^/  /'
+  echo "  }"
+  echo "}"
+} > "$OUT"
+echo "[bench] wrote $OUT" >&2
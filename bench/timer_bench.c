@@ -0,0 +1,79 @@
+// Timer wheel microbenchmark: cost of arming, re-arming and expiring
+// connection deadlines as the number of armed timers grows. Every operation
+// is O(1), so the per-operation cost should stay flat across sizes.
+#include "../timer_wheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+// Deadlines like the proxy's: mostly seconds away, some minutes.
+static uint64_t deadline(uint64_t now, uint64_t *seed) {
+    uint64_t r = xorshift(seed);
+    return now + 1 + (r % 8 == 0 ? r % 300000 : r % 30000);
+}
+
+static size_t fired;
+
+static void count_fire(wheel_timer_t *t, void *arg) {
+    (void)t;
+    (void)arg;
+    fired++;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_timers = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    printf("%10s %12s %12s %12s %14s\n", "timers", "add ns/op", "rearm ns/op", "cancel ns/op", "expire ns/timer");
+    for (size_t n = 1000; n <= max_timers; n *= 10) {
+        wheel_timer_t *timers = malloc(n * sizeof(wheel_timer_t));
+        if (!timers) {
+            perror("malloc");
+            return 1;
+        }
+        static timer_wheel_t tw;
+        uint64_t now = 1000000, seed = 88172645463325252ULL;
+        timer_wheel_init(&tw, now);
+        for (size_t i = 0; i < n; i++)
+            timer_init(&timers[i], NULL);
+
+        double t0 = now_ns();
+        for (size_t i = 0; i < n; i++)
+            timer_add(&tw, &timers[i], deadline(now, &seed));
+        double t1 = now_ns();
+        // A connection moving to its next phase re-arms its timer.
+        for (size_t i = 0; i < n; i++)
+            timer_add(&tw, &timers[xorshift(&seed) % n], deadline(now, &seed));
+        double t2 = now_ns();
+        for (size_t i = 0; i < n / 2; i++)
+            timer_cancel(&tw, &timers[i * 2]);
+        double t3 = now_ns();
+        // Let the clock run until every remaining timer fired, in 10 ms steps.
+        size_t armed = tw.count;
+        fired = 0;
+        while (tw.count > 0) {
+            now += 10;
+            timer_wheel_advance(&tw, now, count_fire, NULL);
+        }
+        double t4 = now_ns();
+        if (fired != armed)
+            fprintf(stderr, "fired %zu of %zu timers\n", fired, armed);
+
+        printf("%10zu %12.1f %12.1f %12.1f %14.1f\n", n, (t1 - t0) / n, (t2 - t1) / n,
+               (t3 - t2) / (n / 2), (t4 - t3) / armed);
+        free(timers);
+    }
+    return 0;
+}
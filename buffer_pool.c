@@ -0,0 +1,94 @@
+#include "buffer_pool.h"
+#include "config.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Buffers per allocation from the system
+#define BUFFERS_PER_PAGE 64
+
+typedef struct free_buffer {
+    struct free_buffer *next;
+} free_buffer_t;
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static free_buffer_t *shared_list;
+static size_t shared_count;
+static atomic_size_t total, in_use;
+
+// A thread's own free buffers. Past BUFFER_CACHE_MAX half of them go to the
+// shared list; an empty cache takes half that many from it.
+static __thread free_buffer_t *cache;
+static __thread int cache_count;
+
+static int refill(void) {
+    pthread_mutex_lock(&shared_lock);
+    while (shared_list && cache_count < BUFFER_CACHE_MAX / 2) {
+        free_buffer_t *b = shared_list;
+        shared_list = b->next;
+        shared_count--;
+        b->next = cache;
+        cache = b;
+        cache_count++;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    if (cache_count > 0)
+        return 0;
+    char *page = aligned_alloc(4096, (size_t)IO_BUFFER_SIZE * BUFFERS_PER_PAGE);
+    if (!page)
+        return -1;
+    for (int i = 0; i < BUFFERS_PER_PAGE; i++) {
+        free_buffer_t *b = (free_buffer_t *)(page + (size_t)i * IO_BUFFER_SIZE);
+        b->next = cache;
+        cache = b;
+    }
+    cache_count = BUFFERS_PER_PAGE;
+    atomic_fetch_add_explicit(&total, BUFFERS_PER_PAGE, memory_order_relaxed);
+    return 0;
+}
+
+char *buffer_pool_get(void) {
+    if (!cache && refill() < 0)
+        return NULL;
+    free_buffer_t *b = cache;
+    cache = b->next;
+    cache_count--;
+    atomic_fetch_add_explicit(&in_use, 1, memory_order_relaxed);
+    return (char *)b;
+}
+
+void buffer_pool_put(char *buf) {
+    if (!buf)
+        return;
+    free_buffer_t *b = (free_buffer_t *)buf;
+    b->next = cache;
+    cache = b;
+    cache_count++;
+    atomic_fetch_sub_explicit(&in_use, 1, memory_order_relaxed);
+    if (cache_count <= BUFFER_CACHE_MAX)
+        return;
+    // Keep the most recently used (cache-warm) half.
+    free_buffer_t *keep = cache;
+    for (int i = 1; i < BUFFER_CACHE_MAX / 2; i++)
+        keep = keep->next;
+    free_buffer_t *spill = keep->next;
+    keep->next = NULL;
+    int spilled = cache_count - BUFFER_CACHE_MAX / 2;
+    cache_count = BUFFER_CACHE_MAX / 2;
+    free_buffer_t *last = spill;
+    while (last->next)
+        last = last->next;
+    pthread_mutex_lock(&shared_lock);
+    last->next = shared_list;
+    shared_list = spill;
+    shared_count += spilled;
+    pthread_mutex_unlock(&shared_lock);
+}
+
+void buffer_pool_get_stats(buffer_pool_stats_t *stats) {
+    stats->total = atomic_load_explicit(&total, memory_order_relaxed);
+    stats->in_use = atomic_load_explicit(&in_use, memory_order_relaxed);
+    pthread_mutex_lock(&shared_lock);
+    stats->shared = shared_count;
+    pthread_mutex_unlock(&shared_lock);
+}
@@ -0,0 +1,24 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+// I/O buffers of IO_BUFFER_SIZE bytes, lent to connections only while they
+// have data in flight. Each thread keeps a few free buffers of its own and
+// trades them with a shared free list in batches, so the lock is rarely
+// taken. Buffers are allocated in pages and never returned to the system.
+typedef struct {
+    size_t total;       // buffers allocated
+    size_t in_use;      // lent out
+    size_t shared;      // free on the shared list (the rest sit in thread caches)
+} buffer_pool_stats_t;
+
+/* A buffer, or NULL if out of memory */
+char *buffer_pool_get(void);
+
+/* Give a buffer back (NULL is ignored) */
+void buffer_pool_put(char *buf);
+
+void buffer_pool_get_stats(buffer_pool_stats_t *stats);
+
+#endif // BUFFER_POOL_H
@@ -1,62 +1,703 @@
 #include "cache.h"
+#include "cache_file.h"
+#include "config.h"
+#include "slab.h"
+#include "log.h"
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <stdio.h>
+#include <pthread.h>
 
-static cache_entry_t *cache_head = NULL;
+#define CACHE_SHARD_MIN_SLOTS 64
+#define CACHE_SKETCH_MIN_WORDS 64
+
+// LRU lists of a shard. With CACHE_POLICY_LRU every entry is on the window.
+enum { SEG_WINDOW, SEG_PROBATION, SEG_PROTECTED, SEGMENTS };
+
+typedef struct {
+    cache_entry_t *head;              // most recently used
+    cache_entry_t *tail;              // next to leave
+    size_t bytes;
+} cache_lru_t;
+
+// Count-min sketch with 4-bit counters, 16 to a word and one word per key
+// the shard holds. A key has a counter in each of four words, at the same
+// nibble group in all of them; its frequency is the smallest of the four.
+typedef struct {
+    uint64_t *table;
+    size_t mask;                      // words - 1
+    size_t additions;                 // increments since the counters were last halved
+} cache_sketch_t;
+
+// Open-addressing slot; the full hash is kept next to the pointer so probes
+// only touch an entry when the hashes already match.
+typedef struct {
+    uint64_t hash;
+    cache_entry_t *entry;             // NULL for an empty slot
+} cache_slot_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_slot_t *slots;              // linear probing, power-of-two sized
+    size_t mask;
+    size_t count;
+    size_t bytes;
+    cache_lru_t lru[SEGMENTS];
+    cache_sketch_t sketch;
+    cache_entry_t *wheel[CACHE_WHEEL_SLOTS];  // entries by expire_time, one slot per second
+    time_t wheel_time;                // last second cache_expire() processed
+    unsigned long hits;
+    unsigned long stale_hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long rejections;
+    unsigned long expirations;
+    unsigned long file_hits;
+} __attribute__((aligned(64))) cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static size_t cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+static cache_policy_t cache_policy = CACHE_POLICY_TINYLFU;
+static const char *cache_file_path;
+static size_t cache_file_bytes;
+static size_t shard_budget, window_budget, protected_budget;
+
+static const char *const policy_names[CACHE_POLICIES] = { "tinylfu", "lru" };
+
+static inline uint64_t hash_mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+uint64_t cache_hash(const char *key, size_t len) {
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xc6a4a7935bd1e995ULL);
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ hash_mix(w)) * 0x87c37b91114253d5ULL;
+        h = (h << 31) | (h >> 33);
+        p += 8;
+        len -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    h ^= hash_mix(tail ^ len);
+    return hash_mix(h);
+}
+
+static inline cache_shard_t *shard_for(uint64_t hash) {
+    return &shards[hash >> 58];  // top 6 bits; slot index uses the low bits
+}
+
+void cache_set_max_bytes(size_t max_bytes) {
+    if (max_bytes > 0)
+        cache_max_bytes = max_bytes;
+}
+
+void cache_set_file(const char *path, size_t bytes) {
+    cache_file_path = path;
+    cache_file_bytes = bytes;
+}
+
+void cache_set_policy(cache_policy_t policy) {
+    cache_policy = policy;
+}
+
+int cache_policy_by_name(const char *name) {
+    for (int i = 0; i < CACHE_POLICIES; i++)
+        if (strcmp(name, policy_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *cache_policy_name(cache_policy_t policy) {
+    return policy < CACHE_POLICIES ? policy_names[policy] : "?";
+}
+
+// Grow the sketch to a word per entry. The counts start over, which only
+// happens a few times as the cache fills.
+static int sketch_ensure(cache_sketch_t *k, size_t entries) {
+    if (k->table && entries <= k->mask + 1)
+        return 0;
+    size_t words = k->table ? (k->mask + 1) * 2 : CACHE_SKETCH_MIN_WORDS;
+    while (words < entries)
+        words *= 2;
+    uint64_t *table = calloc(words, sizeof(uint64_t));
+    if (!table)
+        return -1;
+    free(k->table);
+    k->table = table;
+    k->mask = words - 1;
+    k->additions = 0;
+    return 0;
+}
+
+static inline size_t sketch_word(const cache_sketch_t *k, uint64_t hash, int i) {
+    static const uint64_t seeds[4] = {
+        0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+    };
+    uint64_t h = (hash + seeds[i]) * seeds[i];
+    return (size_t)(h + (h >> 32)) & k->mask;
+}
+
+static int sketch_frequency(const cache_sketch_t *k, uint64_t hash) {
+    int start = (int)(hash & 3) << 2, freq = 15;
+    for (int i = 0; i < 4; i++) {
+        int c = (int)(k->table[sketch_word(k, hash, i)] >> ((start + i) << 2)) & 0xf;
+        if (c < freq)
+            freq = c;
+    }
+    return freq;
+}
+
+static void sketch_increment(cache_sketch_t *k, uint64_t hash) {
+    int start = (int)(hash & 3) << 2, added = 0;
+    for (int i = 0; i < 4; i++) {
+        uint64_t *word = &k->table[sketch_word(k, hash, i)];
+        int shift = (start + i) << 2;
+        if (((*word >> shift) & 0xf) < 15) {
+            *word += 1ULL << shift;
+            added = 1;
+        }
+    }
+    // Aging: halve every counter once there were ten increments per word.
+    if (added && ++k->additions >= (k->mask + 1) * 10) {
+        for (size_t w = 0; w <= k->mask; w++)
+            k->table[w] = (k->table[w] >> 1) & 0x7777777777777777ULL;
+        k->additions /= 2;
+    }
+}
 
 void cache_init() {
-    cache_head = NULL;
+    slab_init();
+    shard_budget = cache_max_bytes / CACHE_SHARDS;
+    window_budget = shard_budget / 100 * CACHE_WINDOW_PERCENT;
+    protected_budget = (shard_budget - window_budget) / 100 * CACHE_PROTECTED_PERCENT;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        memset(s, 0, sizeof(*s));
+        pthread_mutex_init(&s->lock, NULL);
+        s->slots = calloc(CACHE_SHARD_MIN_SLOTS, sizeof(cache_slot_t));
+        if (!s->slots || (cache_policy == CACHE_POLICY_TINYLFU && sketch_ensure(&s->sketch, 0) < 0)) {
+            LOG_ERRNO("cache_init");
+            exit(EXIT_FAILURE);
+        }
+        s->mask = CACHE_SHARD_MIN_SLOTS - 1;
+    }
+    if (cache_file_path && cache_file_open(cache_file_path, cache_file_bytes) < 0) {
+        LOG_ERRNO(cache_file_path);
+        exit(EXIT_FAILURE);
+    }
 }
 
 void cache_cleanup() {
-    cache_entry_t *entry = cache_head;
-    while (entry) {
-        cache_entry_t *tmp = entry;
-        entry = entry->next;
-        free(tmp);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (size_t j = 0; s->slots && j <= s->mask; j++) {
+            cache_entry_t *entry = s->slots[j].entry;
+            if (entry) {
+                cache_release(entry->value);
+                slab_free(entry, entry->slab_class);
+            }
+        }
+        free(s->slots);
+        s->slots = NULL;
+        s->mask = 0;
+        s->count = 0;
+        s->bytes = 0;
+        memset(s->lru, 0, sizeof(s->lru));
+        free(s->sketch.table);
+        memset(&s->sketch, 0, sizeof(s->sketch));
+        memset(s->wheel, 0, sizeof(s->wheel));
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void lru_unlink(cache_shard_t *s, cache_entry_t *e) {
+    cache_lru_t *l = &s->lru[e->segment];
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        l->head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        l->tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+    l->bytes -= e->charge;
+}
+
+static void lru_push_front(cache_shard_t *s, cache_entry_t *e, int segment) {
+    cache_lru_t *l = &s->lru[segment];
+    e->segment = (uint8_t)segment;
+    e->lru_prev = NULL;
+    e->lru_next = l->head;
+    if (l->head)
+        l->head->lru_prev = e;
+    l->head = e;
+    if (!l->tail)
+        l->tail = e;
+    l->bytes += e->charge;
+}
+
+// A hit. Within the window and the protected segment it is LRU order; a
+// probation entry hit again is promoted, demoting protected entries past
+// their budget back to probation.
+static void shard_touch(cache_shard_t *s, cache_entry_t *e) {
+    int segment = e->segment == SEG_PROBATION ? SEG_PROTECTED : e->segment;
+    if (s->lru[segment].head == e)
+        return;
+    lru_unlink(s, e);
+    lru_push_front(s, e, segment);
+    cache_lru_t *protected = &s->lru[SEG_PROTECTED];
+    while (segment == SEG_PROTECTED && protected->bytes > protected_budget && protected->tail != e) {
+        cache_entry_t *demoted = protected->tail;
+        lru_unlink(s, demoted);
+        lru_push_front(s, demoted, SEG_PROBATION);
+    }
+}
+
+static void wheel_link(cache_shard_t *s, cache_entry_t *e) {
+    e->wheel_prev = NULL;
+    e->wheel_next = NULL;
+    if (e->expire_time == 0)
+        return;  // never expires
+    cache_entry_t **slot = &s->wheel[e->expire_time % CACHE_WHEEL_SLOTS];
+    e->wheel_next = *slot;
+    if (*slot)
+        (*slot)->wheel_prev = e;
+    *slot = e;
+}
+
+static void wheel_unlink(cache_shard_t *s, cache_entry_t *e) {
+    if (e->expire_time == 0)
+        return;
+    if (e->wheel_prev)
+        e->wheel_prev->wheel_next = e->wheel_next;
+    else
+        s->wheel[e->expire_time % CACHE_WHEEL_SLOTS] = e->wheel_next;
+    if (e->wheel_next)
+        e->wheel_next->wheel_prev = e->wheel_prev;
+}
+
+void cache_release(cache_object_t *obj) {
+    // Mapped objects belong to the cache file, which reuses their space once
+    // nobody holds them. They never get a variant.
+    if (obj && atomic_fetch_sub_explicit(&obj->refcount, 1, memory_order_acq_rel) == 1 &&
+        obj->slab_class != CACHE_OBJECT_MAPPED) {
+        cache_release(atomic_load_explicit(&obj->gzip, memory_order_relaxed));
+        slab_free(obj, obj->slab_class);
+    }
+}
+
+// Bytes an object takes, with its variant. Caller must hold the lock of the
+// shard whose entry holds it, since variants are attached under that lock.
+static size_t object_charge(const cache_object_t *obj) {
+    const cache_object_t *gzip = atomic_load_explicit(&obj->gzip, memory_order_relaxed);
+    return slab_chunk_size(sizeof(cache_object_t) + obj->len) +
+           (gzip ? slab_chunk_size(sizeof(cache_object_t) + gzip->len) : 0);
+}
+
+// Returns the slot index holding key, or -1. Caller must hold the shard lock.
+static long shard_find(cache_shard_t *s, uint64_t hash, const char *key, size_t key_len) {
+    size_t i = hash & s->mask;
+    while (s->slots[i].entry) {
+        cache_entry_t *e = s->slots[i].entry;
+        if (s->slots[i].hash == hash && e->key_len == key_len && memcmp(e->key, key, key_len) == 0)
+            return (long)i;
+        i = (i + 1) & s->mask;
+    }
+    return -1;
+}
+
+// Backward-shift deletion keeps probe sequences intact without tombstones.
+static void shard_remove_slot(cache_shard_t *s, size_t i) {
+    cache_entry_t *e = s->slots[i].entry;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & s->mask;
+        if (!s->slots[j].entry)
+            break;
+        size_t home = s->slots[j].hash & s->mask;
+        // Move slot j back into the hole unless its home lies cyclically in (i, j].
+        int in_range = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!in_range) {
+            s->slots[i] = s->slots[j];
+            i = j;
+        }
+    }
+    s->slots[i].entry = NULL;
+    s->slots[i].hash = 0;
+    s->count--;
+    s->bytes -= e->charge;
+    lru_unlink(s, e);
+    wheel_unlink(s, e);
+    // Readers still sending the value keep it alive through their own reference.
+    cache_release(e->value);
+    slab_free(e, e->slab_class);
+}
+
+static void shard_remove_entry(cache_shard_t *s, cache_entry_t *e) {
+    long i = shard_find(s, e->hash, e->key, e->key_len);
+    if (i >= 0)
+        shard_remove_slot(s, (size_t)i);
+}
+
+static int shard_grow(cache_shard_t *s) {
+    size_t new_cap = (s->mask + 1) * 2;
+    cache_slot_t *slots = calloc(new_cap, sizeof(cache_slot_t));
+    if (!slots)
+        return -1;
+    for (size_t i = 0; i <= s->mask; i++) {
+        if (!s->slots[i].entry)
+            continue;
+        size_t j = s->slots[i].hash & (new_cap - 1);
+        while (slots[j].entry)
+            j = (j + 1) & (new_cap - 1);
+        slots[j] = s->slots[i];
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->mask = new_cap - 1;
+    return 0;
+}
+
+// An entry leaving the window: it stays if the main area has room, or if
+// its key is more popular than each entry it has to evict (the probation
+// segment's least recently used first). Otherwise it is the one evicted.
+static void shard_admit(cache_shard_t *s, cache_entry_t *candidate) {
+    lru_unlink(s, candidate);
+    lru_push_front(s, candidate, SEG_PROBATION);
+    int freq = -1;
+    while (s->bytes > shard_budget) {
+        cache_entry_t *victim = s->lru[SEG_PROBATION].tail;
+        if (victim == candidate)
+            victim = s->lru[SEG_PROTECTED].tail;
+        if (victim && freq < 0)
+            freq = sketch_frequency(&s->sketch, candidate->hash);
+        if (!victim || freq <= sketch_frequency(&s->sketch, victim->hash)) {
+            shard_remove_entry(s, candidate);
+            s->rejections++;
+            return;
+        }
+        shard_remove_entry(s, victim);
+        s->evictions++;
+    }
+}
+
+// Bring the shard back within its share of the budget after inserting entry.
+static void shard_evict(cache_shard_t *s, cache_entry_t *entry) {
+    if (cache_policy == CACHE_POLICY_LRU) {
+        cache_lru_t *l = &s->lru[SEG_WINDOW];
+        while (s->bytes > shard_budget && l->tail && l->tail != entry) {
+            shard_remove_entry(s, l->tail);
+            s->evictions++;
+        }
+        return;
+    }
+    while (s->lru[SEG_WINDOW].bytes > window_budget)
+        shard_admit(s, s->lru[SEG_WINDOW].tail);
+    // A replaced value may have grown an entry of the main area.
+    for (int segment = SEG_PROBATION; segment <= SEG_PROTECTED && s->bytes > shard_budget; segment++) {
+        cache_lru_t *l = &s->lru[segment];
+        while (s->bytes > shard_budget && l->tail && l->tail != entry) {
+            shard_remove_entry(s, l->tail);
+            s->evictions++;
+        }
     }
-    cache_head = NULL;
 }
 
 void cache_expire() {
     time_t now = time(NULL);
-    cache_entry_t **ptr = &cache_head;
-    while (*ptr) {
-        if ((*ptr)->expire_time != 0 && (*ptr)->expire_time <= now) {
-            cache_entry_t *expired = *ptr;
-            *ptr = expired->next;
-            free(expired);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        // Visit the slot of every second since the last tick (each slot at
+        // most once); entries there that are due a later revolution stay.
+        time_t from = s->wheel_time ? s->wheel_time + 1 : now;
+        if (now - from >= CACHE_WHEEL_SLOTS)
+            from = now - CACHE_WHEEL_SLOTS + 1;
+        for (time_t t = from; t <= now; t++) {
+            cache_entry_t *e = s->wheel[t % CACHE_WHEEL_SLOTS];
+            while (e) {
+                cache_entry_t *next = e->wheel_next;
+                if (e->expire_time <= now) {
+                    shard_remove_entry(s, e);
+                    s->expirations++;
+                }
+                e = next;
+            }
+        }
+        s->wheel_time = now;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// Insert obj under key, taking over a reference. Returns the entry, or NULL
+// if it was not kept; a value it replaced is left in *old for the caller to
+// release once the lock is dropped. Caller must hold the shard lock.
+static cache_entry_t *shard_insert(cache_shard_t *s, uint64_t hash, const char *key, size_t key_len,
+                                   cache_object_t *obj, const cache_times_t *t, cache_object_t **old) {
+    size_t obj_charge = object_charge(obj);
+    cache_entry_t *entry;
+    int segment = SEG_WINDOW;
+    long i = shard_find(s, hash, key, key_len);
+    if (i >= 0) {
+        // Replace in place so repeated inserts never grow the cache.
+        entry = s->slots[i].entry;
+        segment = entry->segment;
+        lru_unlink(s, entry);
+        wheel_unlink(s, entry);
+        *old = entry->value;
+        s->bytes -= entry->charge;
+        entry->charge -= object_charge(entry->value);
+    } else {
+        if (((s->count + 1) * 4 > (s->mask + 1) * 3 && shard_grow(s) < 0) ||
+            (cache_policy == CACHE_POLICY_TINYLFU && sketch_ensure(&s->sketch, s->count + 1) < 0)) {
+            cache_release(obj);
+            return NULL;
+        }
+        uint8_t entry_class;
+        entry = slab_alloc(sizeof(cache_entry_t) + key_len, &entry_class);
+        if (!entry) {
+            cache_release(obj);
+            return NULL;
+        }
+        entry->slab_class = entry_class;
+        entry->key_len = (uint32_t)key_len;
+        memcpy(entry->key, key, key_len);
+        entry->hash = hash;
+        entry->charge = slab_chunk_size(sizeof(cache_entry_t) + key_len) + sizeof(cache_slot_t);
+        size_t j = hash & s->mask;
+        while (s->slots[j].entry)
+            j = (j + 1) & s->mask;
+        s->slots[j].hash = hash;
+        s->slots[j].entry = entry;
+        s->count++;
+    }
+    entry->value = obj;
+    entry->charge += obj_charge;
+    entry->fresh_until = t->fresh_until;
+    entry->stale_until = t->stale_until;
+    entry->expire_time = t->expire_time;
+    entry->refresh_at = 0;
+    s->bytes += entry->charge;
+    lru_push_front(s, entry, segment);
+    wheel_link(s, entry);
+    shard_evict(s, entry);
+    return shard_find(s, hash, key, key_len) >= 0 ? entry : NULL;
+}
+
+// How an entry with these times may be served at now. refresh_at hands
+// out one refresh per CACHE_REFRESH_RETRY seconds.
+static cache_freshness_t freshness_at(const cache_times_t *t, time_t *refresh_at, time_t now) {
+    if (t->expire_time == 0 || now < t->fresh_until)
+        return CACHE_FRESH;
+    if (now < t->stale_until) {
+        if (now < *refresh_at)
+            return CACHE_STALE;
+        *refresh_at = now + CACHE_REFRESH_RETRY;
+        return CACHE_STALE_REFRESH;
+    }
+    return CACHE_STALE_IF_ERROR;
+}
+
+cache_object_t *cache_lookup_stale(const char *key, size_t key_len, cache_freshness_t *freshness) {
+    uint64_t hash = cache_hash(key, key_len);
+    cache_shard_t *s = shard_for(hash);
+    cache_object_t *obj = NULL, *mapped = NULL, *old = NULL;
+    cache_times_t t;
+    time_t now = time(NULL), refresh_at = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (cache_policy == CACHE_POLICY_TINYLFU)
+        sketch_increment(&s->sketch, hash);
+    long i = shard_find(s, hash, key, key_len);
+    if (i < 0 && cache_file_enabled()) {
+        // Not in memory, but the cache file may have it (say, after a
+        // restart): serve the mapped copy and keep it in memory as well.
+        pthread_mutex_unlock(&s->lock);
+        mapped = cache_file_get(hash, key, key_len, now, &t);
+        pthread_mutex_lock(&s->lock);
+        if (mapped) {
+            s->file_hits++;
+            i = shard_find(s, hash, key, key_len);
+            if (i < 0) {
+                atomic_fetch_add_explicit(&mapped->refcount, 1, memory_order_relaxed);
+                shard_insert(s, hash, key, key_len, mapped, &t, &old);
+                i = shard_find(s, hash, key, key_len);
+            }
+        }
+    }
+    if (i >= 0) {
+        cache_entry_t *entry = s->slots[i].entry;
+        if (entry->expire_time != 0 && entry->expire_time <= now) {
+            // Past its lifetime but not yet reached by the timing wheel.
+            shard_remove_slot(s, (size_t)i);
+            s->expirations++;
         } else {
-            ptr = &(*ptr)->next;
+            obj = entry->value;
+            atomic_fetch_add_explicit(&obj->refcount, 1, memory_order_relaxed);
+            shard_touch(s, entry);
+            cache_times_t et = { entry->fresh_until, entry->stale_until, entry->expire_time };
+            *freshness = freshness_at(&et, &entry->refresh_at, now);
         }
+    } else if (mapped) {
+        // Turned away by admission; this request still gets it.
+        obj = mapped;
+        mapped = NULL;
+        *freshness = freshness_at(&t, &refresh_at, now);
+    }
+    if (obj && *freshness != CACHE_STALE_IF_ERROR) {
+        s->hits++;
+        if (*freshness != CACHE_FRESH)
+            s->stale_hits++;
+    } else {
+        s->misses++;
     }
+    pthread_mutex_unlock(&s->lock);
+    cache_release(mapped);
+    cache_release(old);
+    return obj;
 }
 
-char *cache_lookup(const char *key) {
-    cache_expire();  // clean up expired entries
-    cache_entry_t *entry = cache_head;
-    while (entry) {
-        if (strncmp(entry->key, key, CACHE_KEY_SIZE) == 0)
-            return entry->value;
-        entry = entry->next;
+cache_object_t *cache_lookup(const char *key, size_t key_len) {
+    cache_freshness_t freshness;
+    cache_object_t *obj = cache_lookup_stale(key, key_len, &freshness);
+    if (obj && freshness != CACHE_FRESH) {
+        cache_release(obj);
+        obj = NULL;
     }
-    return NULL;
+    return obj;
 }
 
-void cache_insert(const char *key, const char *value, int ttl_seconds) {
-    cache_expire();  // expire old entries first
-    cache_entry_t *entry = malloc(sizeof(cache_entry_t));
-    if (!entry) return;
-    strncpy(entry->key, key, CACHE_KEY_SIZE - 1);
-    entry->key[CACHE_KEY_SIZE - 1] = '\0';
-    strncpy(entry->value, value, CACHE_VALUE_SIZE - 1);
-    entry->value[CACHE_VALUE_SIZE - 1] = '\0';
-    if (ttl_seconds > 0)
-        entry->expire_time = time(NULL) + ttl_seconds;
-    else
-        entry->expire_time = 0; // never expire
-    entry->next = cache_head;
-    cache_head = entry;
-}
\ No newline at end of file
+cache_object_t *cache_object_alloc(size_t value_len, size_t head_len) {
+    if (value_len > CACHE_MAX_OBJECT_SIZE)
+        return NULL;
+    uint8_t obj_class;
+    cache_object_t *obj = slab_alloc(sizeof(cache_object_t) + value_len, &obj_class);
+    if (!obj)
+        return NULL;
+    atomic_init(&obj->refcount, 1);
+    obj->slab_class = obj_class;
+    obj->vary = 0;
+    obj->head_len = (uint32_t)head_len;
+    obj->len = value_len;
+    atomic_init(&obj->gzip, NULL);
+    return obj;
+}
+
+int cache_insert_object(const char *key, size_t key_len, cache_object_t *obj, const cache_lifetime_t *life) {
+    uint64_t hash = cache_hash(key, key_len);
+    cache_shard_t *s = shard_for(hash);
+    time_t now = time(NULL);
+    cache_times_t t;
+    t.fresh_until = now + (life->fresh > 0 ? life->fresh : 0);
+    t.stale_until = t.fresh_until + (life->stale_revalidate > 0 ? life->stale_revalidate : 0);
+    time_t error_until = t.fresh_until + (life->stale_error > 0 ? life->stale_error : 0);
+    t.expire_time = t.stale_until > error_until ? t.stale_until : error_until;
+    if (life->fresh < 0)
+        t.expire_time = 0;  // never expire
+    else if (t.expire_time <= now) {
+        cache_release(obj);  // nothing to keep it for
+        return 0;
+    }
+
+    cache_object_t *old = NULL;
+    pthread_mutex_lock(&s->lock);
+    int kept = shard_insert(s, hash, key, key_len, obj, &t, &old) != NULL;
+    int persist = kept && cache_file_enabled();
+    if (persist)
+        atomic_fetch_add_explicit(&obj->refcount, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&s->lock);
+    cache_release(old);
+    // Admitted entries are copied to the cache file in the background.
+    if (persist)
+        cache_file_put(hash, key, key_len, obj, &t);
+    return kept;
+}
+
+int cache_attach_gzip(const char *key, size_t key_len, cache_object_t *obj, cache_object_t *gzip) {
+    uint64_t hash = cache_hash(key, key_len);
+    cache_shard_t *s = shard_for(hash);
+    int attached = 0;
+    pthread_mutex_lock(&s->lock);
+    long i = shard_find(s, hash, key, key_len);
+    cache_entry_t *entry = i >= 0 ? s->slots[i].entry : NULL;
+    if (entry && entry->value == obj && obj->slab_class != CACHE_OBJECT_MAPPED &&
+        !atomic_load_explicit(&obj->gzip, memory_order_relaxed)) {
+        // Readers may find the variant as soon as it is stored.
+        atomic_store_explicit(&obj->gzip, gzip, memory_order_release);
+        size_t charge = slab_chunk_size(sizeof(cache_object_t) + gzip->len);
+        entry->charge += charge;
+        s->lru[entry->segment].bytes += charge;
+        s->bytes += charge;
+        shard_evict(s, entry);
+        attached = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!attached)
+        cache_release(gzip);
+    return attached;
+}
+
+void cache_forget(const char *key, size_t key_len, const cache_object_t *obj) {
+    uint64_t hash = cache_hash(key, key_len);
+    cache_shard_t *s = shard_for(hash);
+    pthread_mutex_lock(&s->lock);
+    long i = shard_find(s, hash, key, key_len);
+    if (i >= 0 && s->slots[i].entry->value == obj)
+        shard_remove_slot(s, (size_t)i);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void cache_insert(const char *key, size_t key_len, const char *head, size_t head_len,
+                  const char *body, size_t body_len, int ttl_seconds) {
+    // Copy the value outside the shard lock; only pointer swaps happen under it.
+    cache_object_t *obj = cache_object_alloc(head_len + body_len, head_len);
+    if (!obj)
+        return;
+    if (head_len)
+        memcpy(obj->data, head, head_len);
+    if (body_len)
+        memcpy(obj->data + head_len, body, body_len);
+    cache_lifetime_t life = {ttl_seconds > 0 ? ttl_seconds : -1, 0, 0};
+    cache_insert_object(key, key_len, obj, &life);
+}
+
+void cache_insert_vary(const char *key, size_t key_len, const char *vary, size_t vary_len,
+                       const cache_lifetime_t *life) {
+    cache_object_t *obj = cache_object_alloc(vary_len, 0);
+    if (!obj)
+        return;
+    obj->vary = 1;
+    memcpy(obj->data, vary, vary_len);
+    cache_insert_object(key, key_len, obj, life);
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->max_bytes = cache_max_bytes;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        stats->entries += s->count;
+        stats->bytes += s->bytes;
+        stats->hits += s->hits;
+        stats->stale_hits += s->stale_hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->rejections += s->rejections;
+        stats->file_hits += s->file_hits;
+        stats->expirations += s->expirations;
+        if (s->sketch.table)
+            stats->sketch_bytes += (s->sketch.mask + 1) * sizeof(uint64_t);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -2,30 +2,181 @@
 #define CACHE_H
 
 #include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
-#define CACHE_KEY_SIZE 256
-#define CACHE_VALUE_SIZE 4096
+// Independent hash tables, each behind its own lock; the top bits of a
+// key's hash pick the shard so concurrent workers rarely contend.
+#define CACHE_SHARDS 64
+
+// Largest cacheable response; anything bigger is relayed but not stored.
+#define CACHE_MAX_OBJECT_SIZE (64UL * 1024 * 1024)
+
+// Expiry runs on a hashed timing wheel per shard with one-second slots;
+// entries further out than this many seconds wait for extra revolutions.
+#define CACHE_WHEEL_SLOTS 1024
+
+// A stale entry hands out one refresh per this many seconds, so a refresh
+// that fails or hangs is retried without every hit starting one.
+#define CACHE_REFRESH_RETRY 5
+
+// W-TinyLFU: a new entry first waits in a window LRU holding this share of
+// a shard's budget. When it leaves the window it enters the main area only
+// if its key was looked up more often than the entry it would evict, by a
+// count-min sketch of lookups whose counters are halved every 10 lookups
+// per key it is sized for, so popularity fades. The main area is a segmented
+// LRU: entries hit again there move to a protected segment of this share of it.
+#define CACHE_WINDOW_PERCENT 1
+#define CACHE_PROTECTED_PERCENT 80
+
+// What happens to an insert when the cache is full (--cache-admission)
+typedef enum {
+    CACHE_POLICY_TINYLFU,             // admitted only if more popular than its victim
+    CACHE_POLICY_LRU,                 // always admitted; the least recently used entry goes
+    CACHE_POLICIES
+} cache_policy_t;
+
+// How long an entry lives, in seconds from insertion
+typedef struct {
+    int fresh;                        // served as is (< 0 for never expire)
+    int stale_revalidate;             // then served stale while it is refreshed
+    int stale_error;                  // then (or meanwhile) only served when the backend fails
+} cache_lifetime_t;
+
+// The same as absolute times
+typedef struct {
+    time_t fresh_until;
+    time_t stale_until;               // end of stale-while-revalidate
+    time_t expire_time;               // removal time (0 for never)
+} cache_times_t;
+
+typedef enum {
+    CACHE_FRESH,
+    CACHE_STALE,                      // serve it; another request is refreshing it
+    CACHE_STALE_REFRESH,              // serve it and refresh it in the background
+    CACHE_STALE_IF_ERROR              // fetch anew; serve it only if the backend fails
+} cache_freshness_t;
+
+// A cached response body: binary safe, any size, reference counted. The
+// cache holds one reference; every reader serving it holds another, so an
+// object stays valid while it is being sent even if it is evicted. A
+// response may have a gzip variant attached once it is cached (see
+// compress.h); the object holds a reference to it and drops it when freed.
+typedef struct cache_object {
+    atomic_int refcount;
+    uint8_t slab_class;
+    uint8_t vary;                     // data is a Vary value; the variants live under longer keys
+    uint32_t head_len;                // HTTP head at the start of data (0 for a raw reply)
+    size_t len;
+    _Atomic(struct cache_object *) gzip;  // the same response gzip-encoded, or NULL
+    char data[];
+} cache_object_t;
+
+// slab_class of an object that lives in the cache file (see cache_file.h)
+#define CACHE_OBJECT_MAPPED 0xfe
 
 typedef struct cache_entry {
-    char key[CACHE_KEY_SIZE];         // e.g., the GET request line/URI
-    char value[CACHE_VALUE_SIZE];     // the backend response
-    time_t expire_time;               // absolute expiration time (0 for never)
-    struct cache_entry *next;
+    uint64_t hash;                    // cache_hash() of key
+    time_t fresh_until;               // then stale
+    time_t stale_until;               // end of stale-while-revalidate
+    time_t expire_time;               // absolute removal time (0 for never)
+    time_t refresh_at;                // a stale hit may start a refresh from then on
+    struct cache_entry *wheel_prev;   // timing wheel slot of expire_time
+    struct cache_entry *wheel_next;
+    struct cache_entry *lru_prev;     // towards the most recently used entry
+    struct cache_entry *lru_next;     // towards the least recently used entry
+    cache_object_t *value;            // the backend response
+    size_t charge;                    // bytes counted against the budget
+    uint32_t key_len;
+    uint8_t slab_class;
+    uint8_t segment;                  // which LRU list it is on
+    char key[];                       // e.g., the GET request line/URI (not NUL terminated)
 } cache_entry_t;
 
+typedef struct {
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long hits;
+    unsigned long stale_hits;         // hits served stale (included in hits)
+    unsigned long misses;
+    unsigned long evictions;          // entries dropped to stay within max_bytes
+    unsigned long rejections;         // new entries the admission policy turned away
+    unsigned long expirations;
+    unsigned long file_hits;          // lookups answered from the cache file (included in hits)
+    size_t sketch_bytes;              // frequency sketch (not counted in bytes)
+} cache_stats_t;
+
+/* Set the memory budget in bytes (call before cache_init; 0 keeps the default) */
+void cache_set_max_bytes(size_t max_bytes);
+
+/* Keep a copy of the cache in a file of this size that survives restarts
+   (call before cache_init; see cache_file.h) */
+void cache_set_file(const char *path, size_t bytes);
+
+/* Choose the admission policy (call before cache_init) */
+void cache_set_policy(cache_policy_t policy);
+
+/* Policy by name ("tinylfu" or "lru"), or -1 */
+int cache_policy_by_name(const char *name);
+const char *cache_policy_name(cache_policy_t policy);
+
 /* Initialize the cache (call once at startup) */
 void cache_init();
 
-/* Free all cache entries */
+/* Free all cache entries (cache_init may be called again afterwards) */
 void cache_cleanup();
 
-/* Look up a cached value by key (returns NULL if not found or expired) */
-char *cache_lookup(const char *key);
+/* Hash a key the way the cache indexes it */
+uint64_t cache_hash(const char *key, size_t len);
+
+/* Look up a cached value by key (returns a referenced object, or NULL if not found or not fresh).
+   The caller must cache_release() the object when it is done sending it. */
+cache_object_t *cache_lookup(const char *key, size_t key_len);
+
+/* Like cache_lookup, but also return entries past their freshness lifetime
+   that may still be served stale, with *freshness saying how. Only one
+   lookup per CACHE_REFRESH_RETRY seconds gets CACHE_STALE_REFRESH. */
+cache_object_t *cache_lookup_stale(const char *key, size_t key_len, cache_freshness_t *freshness);
+
+/* Drop a reference obtained from cache_lookup() */
+void cache_release(cache_object_t *obj);
 
-/* Insert a cache entry with TTL in seconds (ttl <= 0 for never expire) */
-void cache_insert(const char *key, const char *value, int ttl_seconds);
+/* Insert a cache entry with TTL in seconds (ttl <= 0 for never expire).
+   The value is head followed by body (head_len 0 for a raw reply), copied
+   once into a slab-allocated object; reinserting an existing key replaces
+   its value in place. A new key may be turned away by the admission policy. */
+void cache_insert(const char *key, size_t key_len, const char *head, size_t head_len,
+                  const char *body, size_t body_len, int ttl_seconds);
 
-/* Remove expired entries (optional, can be called periodically) */
+/* Allocate an uninitialized object of value_len bytes (refcount 1) for the
+   caller to fill and pass to cache_insert_object; NULL if too large */
+cache_object_t *cache_object_alloc(size_t value_len, size_t head_len);
+
+/* Insert a filled object under key, taking over the caller's reference.
+   Returns 1 if it was kept, 0 if it was turned away. */
+int cache_insert_object(const char *key, size_t key_len, cache_object_t *obj, const cache_lifetime_t *life);
+
+/* Record under key the Vary value of a response whose variants are stored
+   under keys extended with the varying request headers */
+void cache_insert_vary(const char *key, size_t key_len, const char *vary, size_t vary_len,
+                       const cache_lifetime_t *life);
+
+/* Attach gzip as the gzip variant of obj if obj is still the value of key
+   and has none yet, taking over the caller's reference; the entry is then
+   charged for it too. Returns 1 if it was attached, 0 if it was released. */
+int cache_attach_gzip(const char *key, size_t key_len, cache_object_t *obj, cache_object_t *gzip);
+
+/* Drop key from memory if obj is still its value (for cache_file.c, which
+   reclaims the space of mapped objects) */
+void cache_forget(const char *key, size_t key_len, const cache_object_t *obj);
+
+/* Remove entries whose lifetime ended since the last call; call once a second.
+   Only the timing wheel slots of the elapsed seconds are visited. */
 void cache_expire();
 
-#endif // CACHE_H
\ No newline at end of file
+/* Sum the per-shard counters */
+void cache_get_stats(cache_stats_t *stats);
+
+#endif // CACHE_H
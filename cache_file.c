@@ -0,0 +1,440 @@
+#include "cache_file.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEADER_BYTES 4096
+#define RECORD_MAGIC 0x52435850u      // "PXCR"
+#define WRAP_MAGIC 0x57435850u        // the ring goes on at the start of the arena
+#define RECORD_ALIGN 64
+#define PIN_WAIT_MS 100               // for readers of a record about to be overwritten
+
+typedef struct {
+    char magic[8];                    // CACHE_FILE_MAGIC
+    uint32_t version;
+    uint32_t boot;                    // bumped on every open
+    uint64_t file_bytes;
+    uint64_t index_slots;
+    uint64_t arena_off;
+    uint64_t arena_bytes;
+    uint64_t head;                    // where the next record goes
+    uint64_t tail;                    // oldest record
+    uint64_t used;                    // bytes from tail to head, skipped ends included
+    uint64_t records;                 // indexed records
+} file_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;                  // arena offset + 1, 0 for an empty slot
+} file_slot_t;
+
+typedef struct {
+    uint32_t magic;                   // RECORD_MAGIC once the record is complete
+    uint32_t checksum;                // record_checksum()
+    uint64_t size;                    // whole record, RECORD_ALIGN aligned
+    uint64_t hash;
+    int64_t fresh_until;
+    int64_t stale_until;
+    int64_t expire_time;
+    uint32_t key_len;
+    uint32_t boot;                    // run that checked it and counts references in obj (0 = none)
+    uint64_t obj_off;                 // of the cache_object_t, from the record's start
+    char key[];
+} file_record_t;
+
+typedef struct {
+    uint64_t hash;
+    char *key;
+    size_t key_len;
+    cache_object_t *obj;
+    cache_times_t times;
+} pending_t;
+
+static struct {
+    file_header_t *header;
+    file_slot_t *slots;
+    char *arena;
+    uint32_t boot;
+    int broken;                       // the ring is corrupt; nothing more is written
+    pthread_rwlock_t lock;            // slots, and the boot and refcount of records
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    pending_t *queue, *batch;
+    size_t queue_len;
+    time_t blocked_until;             // space is pinned; drop inserts until then
+    atomic_ulong writes, dropped, discarded;
+} cf;
+
+static int enabled;
+
+static inline size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+static uint32_t record_checksum(const file_record_t *r, const cache_object_t *obj) {
+    uint64_t fields[8] = {
+        r->size, r->hash, (uint64_t)r->fresh_until, (uint64_t)r->stale_until, (uint64_t)r->expire_time,
+        ((uint64_t)r->key_len << 32) | obj->vary, obj->head_len, obj->len
+    };
+    uint64_t h = cache_hash((const char *)fields, sizeof(fields));
+    h ^= cache_hash(r->key, r->key_len) * 0x9e3779b97f4a7c15ULL;
+    h ^= cache_hash(obj->data, obj->len) * 0xc2b2ae3d27d4eb4fULL;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+// The record at an arena offset if its bounds make sense (its contents may
+// still be torn).
+static file_record_t *record_at(uint64_t off) {
+    uint64_t arena_bytes = cf.header->arena_bytes;
+    if (off > arena_bytes - sizeof(file_record_t))
+        return NULL;
+    file_record_t *r = (file_record_t *)(cf.arena + off);
+    if (r->magic != RECORD_MAGIC || r->size > arena_bytes - off || r->key_len > r->size ||
+        r->obj_off < sizeof(file_record_t) + r->key_len || r->obj_off > r->size - sizeof(cache_object_t))
+        return NULL;
+    return r;
+}
+
+static cache_object_t *record_object(file_record_t *r) {
+    cache_object_t *obj = (cache_object_t *)((char *)r + r->obj_off);
+    return obj->len <= r->size - r->obj_off - sizeof(cache_object_t) ? obj : NULL;
+}
+
+// Slot of key, or -1. Caller holds the lock.
+static long index_find(uint64_t hash, const char *key, size_t key_len) {
+    size_t mask = cf.header->index_slots - 1;
+    for (size_t i = hash & mask; cf.slots[i].offset; i = (i + 1) & mask) {
+        if (cf.slots[i].hash != hash)
+            continue;
+        file_record_t *r = record_at(cf.slots[i].offset - 1);
+        if (r && r->key_len == key_len && memcmp(r->key, key, key_len) == 0)
+            return (long)i;
+    }
+    return -1;
+}
+
+// Slot pointing at the record at off, or -1. Caller holds the lock.
+static long index_find_offset(uint64_t hash, uint64_t off) {
+    size_t mask = cf.header->index_slots - 1;
+    for (size_t i = hash & mask; cf.slots[i].offset; i = (i + 1) & mask)
+        if (cf.slots[i].offset == off + 1)
+            return (long)i;
+    return -1;
+}
+
+// Backward-shift deletion, as in cache.c. Caller holds the lock for writing.
+static void index_remove(size_t i) {
+    size_t mask = cf.header->index_slots - 1, j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!cf.slots[j].offset)
+            break;
+        size_t home = cf.slots[j].hash & mask;
+        int in_range = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!in_range) {
+            cf.slots[i] = cf.slots[j];
+            i = j;
+        }
+    }
+    cf.slots[i].offset = 0;
+    cf.slots[i].hash = 0;
+    cf.header->records--;
+}
+
+// Free the oldest record. A record handed out in this run is first dropped
+// from memory and then waited for until its readers are done; -1 if they
+// take too long.
+static int reclaim(void) {
+    file_header_t *h = cf.header;
+    if (h->arena_bytes - h->tail < sizeof(file_record_t) ||
+        ((file_record_t *)(cf.arena + h->tail))->magic == WRAP_MAGIC) {
+        h->used -= h->arena_bytes - h->tail;
+        h->tail = 0;
+        return 0;
+    }
+    file_record_t *r = record_at(h->tail);
+    if (!r) {
+        LOG_ERROR("[Cache] Cache file is corrupt at offset %llu; no longer writing to it",
+                  (unsigned long long)h->tail);
+        cf.broken = 1;
+        return -1;
+    }
+    pthread_rwlock_wrlock(&cf.lock);
+    long i = index_find_offset(r->hash, h->tail);
+    if (i >= 0)
+        index_remove((size_t)i);
+    pthread_rwlock_unlock(&cf.lock);
+    if (r->boot == cf.boot) {
+        cache_object_t *obj = record_object(r);
+        for (int waited = 0;; waited++) {
+            cache_forget(r->key, r->key_len, obj);
+            if (atomic_load(&obj->refcount) == 0)
+                break;
+            if (waited == PIN_WAIT_MS)
+                return -1;
+            usleep(1000);
+        }
+    }
+    h->tail += r->size;
+    h->used -= r->size;
+    return 0;
+}
+
+// Free need contiguous bytes at head.
+static int make_room(size_t need) {
+    file_header_t *h = cf.header;
+    while (1) {
+        if (h->used == 0)
+            h->head = h->tail = 0;
+        if (h->used == 0 || h->head > h->tail) {
+            if (h->arena_bytes - h->head >= need)
+                return 0;
+            // Skip the end of the arena and go on at its start.
+            if (h->arena_bytes - h->head >= sizeof(file_record_t))
+                ((file_record_t *)(cf.arena + h->head))->magic = WRAP_MAGIC;
+            h->used += h->arena_bytes - h->head;
+            h->head = 0;
+            continue;
+        }
+        if (h->tail - h->head >= need)
+            return 0;
+        if (reclaim() < 0)
+            return -1;
+    }
+}
+
+static void write_record(const pending_t *p, time_t now) {
+    file_header_t *h = cf.header;
+    const cache_object_t *src = p->obj;
+    size_t obj_off = align_up(sizeof(file_record_t) + p->key_len, 8);
+    size_t size = align_up(obj_off + sizeof(cache_object_t) + src->len, RECORD_ALIGN);
+    if (cf.broken || size > h->arena_bytes / 4 || now < cf.blocked_until) {
+        atomic_fetch_add(&cf.dropped, 1);
+        return;
+    }
+    if (make_room(size) < 0) {
+        cf.blocked_until = now + 1;
+        atomic_fetch_add(&cf.dropped, 1);
+        return;
+    }
+    uint64_t off = h->head;
+    file_record_t *r = (file_record_t *)(cf.arena + off);
+    r->magic = 0;
+    r->size = size;
+    r->hash = p->hash;
+    r->fresh_until = p->times.fresh_until;
+    r->stale_until = p->times.stale_until;
+    r->expire_time = p->times.expire_time;
+    r->key_len = (uint32_t)p->key_len;
+    r->boot = 0;
+    r->obj_off = obj_off;
+    memcpy(r->key, p->key, p->key_len);
+    cache_object_t *obj = (cache_object_t *)((char *)r + obj_off);
+    atomic_init(&obj->refcount, 0);
+    obj->slab_class = CACHE_OBJECT_MAPPED;
+    obj->vary = src->vary;
+    obj->head_len = src->head_len;
+    obj->len = src->len;
+    atomic_init(&obj->gzip, NULL);  // variants are not persisted
+    memcpy(obj->data, src->data, src->len);
+    r->checksum = record_checksum(r, obj);
+    __atomic_store_n(&r->magic, RECORD_MAGIC, __ATOMIC_RELEASE);
+    h->head += size;
+    h->used += size;
+
+    // Index it last, so a crash before this leaves at worst an unindexed record.
+    pthread_rwlock_wrlock(&cf.lock);
+    long i = index_find(p->hash, p->key, p->key_len);
+    if (i >= 0) {
+        cf.slots[i].offset = off + 1;
+    } else if ((h->records + 1) * 4 <= h->index_slots * 3) {
+        size_t mask = h->index_slots - 1, j = p->hash & mask;
+        while (cf.slots[j].offset)
+            j = (j + 1) & mask;
+        cf.slots[j].hash = p->hash;
+        cf.slots[j].offset = off + 1;
+        h->records++;
+    }
+    pthread_rwlock_unlock(&cf.lock);
+    atomic_fetch_add(&cf.writes, 1);
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&cf.queue_lock);
+        while (cf.queue_len == 0)
+            pthread_cond_wait(&cf.queue_cond, &cf.queue_lock);
+        pending_t *batch = cf.queue;
+        size_t n = cf.queue_len;
+        cf.queue = cf.batch;
+        cf.batch = batch;
+        cf.queue_len = 0;
+        pthread_mutex_unlock(&cf.queue_lock);
+
+        time_t now = time(NULL);
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i].times.expire_time == 0 || batch[i].times.expire_time > now)
+                write_record(&batch[i], now);
+            cache_release(batch[i].obj);
+            free(batch[i].key);
+        }
+    }
+    return NULL;
+}
+
+// Whether the header describes a file of this layout that can be reused.
+static int header_valid(const file_header_t *h, size_t bytes, size_t slots, size_t arena_off) {
+    return memcmp(h->magic, CACHE_FILE_MAGIC, sizeof(h->magic)) == 0 && h->version == CACHE_FILE_VERSION &&
+           h->file_bytes == bytes && h->index_slots == slots && h->arena_off == arena_off &&
+           h->arena_bytes == bytes - arena_off && h->head <= h->arena_bytes && h->tail <= h->arena_bytes &&
+           h->used <= h->arena_bytes && h->records <= slots;
+}
+
+int cache_file_open(const char *path, size_t bytes) {
+    size_t slots = 1024;
+    while (slots < bytes / CACHE_FILE_BYTES_PER_SLOT)
+        slots *= 2;
+    size_t arena_off = align_up(HEADER_BYTES + slots * sizeof(file_slot_t), 4096);
+    if (bytes < arena_off + 64 * RECORD_ALIGN) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    // One proxy per file.
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err == EWOULDBLOCK ? EBUSY : err;
+        return -1;
+    }
+    struct stat st;
+    file_header_t old;
+    int reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == bytes &&
+                pread(fd, &old, sizeof(old), 0) == (ssize_t)sizeof(old) && header_valid(&old, bytes, slots, arena_off);
+    // A new file, or one of another layout, starts over empty (and sparse).
+    if (!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)bytes) < 0)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    char *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);  // the mapping and the lock stay
+    if (map == MAP_FAILED) {
+        errno = err;
+        return -1;
+    }
+    cf.header = (file_header_t *)map;
+    cf.slots = (file_slot_t *)(map + HEADER_BYTES);
+    cf.arena = map + arena_off;
+    if (!reuse) {
+        file_header_t *h = cf.header;
+        memcpy(h->magic, CACHE_FILE_MAGIC, sizeof(h->magic));
+        h->version = CACHE_FILE_VERSION;
+        h->file_bytes = bytes;
+        h->index_slots = slots;
+        h->arena_off = arena_off;
+        h->arena_bytes = bytes - arena_off;
+    }
+    cf.boot = cf.header->boot + 1 ? cf.header->boot + 1 : 1;
+    cf.header->boot = cf.boot;
+    pthread_rwlock_init(&cf.lock, NULL);
+    pthread_mutex_init(&cf.queue_lock, NULL);
+    pthread_cond_init(&cf.queue_cond, NULL);
+    cf.queue = calloc(CACHE_FILE_QUEUE, sizeof(pending_t));
+    cf.batch = calloc(CACHE_FILE_QUEUE, sizeof(pending_t));
+    pthread_t thread;
+    if (!cf.queue || !cf.batch || (errno = pthread_create(&thread, NULL, writer_main, NULL)) != 0) {
+        if (!cf.queue || !cf.batch)
+            errno = ENOMEM;
+        return -1;
+    }
+    pthread_detach(thread);
+    enabled = 1;
+    LOG_INFO("[Cache] Cache file %s: %zu MiB, %s with %llu records", path, bytes >> 20, reuse ? "reopened" : "created",
+             (unsigned long long)cf.header->records);
+    return 0;
+}
+
+int cache_file_enabled(void) {
+    return enabled;
+}
+
+void cache_file_put(uint64_t hash, const char *key, size_t key_len, cache_object_t *obj, const cache_times_t *t) {
+    char *copy = malloc(key_len);
+    if (copy) {
+        memcpy(copy, key, key_len);
+        pthread_mutex_lock(&cf.queue_lock);
+        if (cf.queue_len < CACHE_FILE_QUEUE) {
+            cf.queue[cf.queue_len++] = (pending_t){ hash, copy, key_len, obj, *t };
+            if (cf.queue_len == 1)
+                pthread_cond_signal(&cf.queue_cond);
+            pthread_mutex_unlock(&cf.queue_lock);
+            return;
+        }
+        pthread_mutex_unlock(&cf.queue_lock);
+        free(copy);
+    }
+    atomic_fetch_add(&cf.dropped, 1);
+    cache_release(obj);
+}
+
+cache_object_t *cache_file_get(uint64_t hash, const char *key, size_t key_len, time_t now, cache_times_t *t) {
+    if (!enabled)
+        return NULL;
+    pthread_rwlock_rdlock(&cf.lock);
+    long i = index_find(hash, key, key_len);
+    file_record_t *r = i >= 0 ? record_at(cf.slots[i].offset - 1) : NULL;
+    if (r && __atomic_load_n(&r->boot, __ATOMIC_ACQUIRE) != cf.boot) {
+        // First use in this run: check it, and start counting its references.
+        pthread_rwlock_unlock(&cf.lock);
+        pthread_rwlock_wrlock(&cf.lock);
+        i = index_find(hash, key, key_len);
+        r = i >= 0 ? record_at(cf.slots[i].offset - 1) : NULL;
+        if (r && r->boot != cf.boot) {
+            cache_object_t *obj = record_object(r);
+            if (!obj || record_checksum(r, obj) != r->checksum) {
+                index_remove((size_t)i);
+                atomic_fetch_add(&cf.discarded, 1);
+                r = NULL;
+            } else {
+                atomic_store(&obj->refcount, 0);
+                __atomic_store_n(&r->boot, cf.boot, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    cache_object_t *obj = NULL;
+    if (r && (r->expire_time == 0 || r->expire_time > now)) {
+        obj = record_object(r);
+        atomic_fetch_add_explicit(&obj->refcount, 1, memory_order_relaxed);
+        t->fresh_until = r->fresh_until;
+        t->stale_until = r->stale_until;
+        t->expire_time = r->expire_time;
+    }
+    pthread_rwlock_unlock(&cf.lock);
+    return obj;
+}
+
+void cache_file_get_stats(cache_file_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!enabled)
+        return;
+    stats->file_bytes = cf.header->file_bytes;
+    stats->used_bytes = cf.header->used;
+    stats->records = cf.header->records;
+    stats->writes = atomic_load(&cf.writes);
+    stats->dropped = atomic_load(&cf.dropped);
+    stats->discarded = atomic_load(&cf.discarded);
+}
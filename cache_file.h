@@ -0,0 +1,57 @@
+#ifndef CACHE_FILE_H
+#define CACHE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "cache.h"
+
+// A copy of the cache in a memory-mapped file, so a restarted proxy starts
+// with a warm cache. The file has a fixed layout: a header, an index of
+// (hash, offset) slots and an arena used as a ring of records. A record
+// holds a key, its absolute lifetimes and the cached object, laid out as a
+// cache_object_t so it can be served straight from the mapping, plus a
+// checksum over all of it.
+//
+// Workers only queue what to persist; a writer thread copies records in,
+// reclaiming the oldest ones to make room. After a restart nothing is read
+// up front. A lookup that misses in memory finds the key through the
+// file's index, checks the record's checksum and expiry the first time it
+// is touched, and hands out the mapped object. Torn or expired records are
+// dropped. Only the identity form of a response is kept, so responses
+// served from the file go out uncompressed until they are fetched again.
+#define CACHE_FILE_MAGIC "PXYCACHE"
+#define CACHE_FILE_VERSION 2
+
+// Inserts waiting for the writer; more are not persisted
+#define CACHE_FILE_QUEUE 8192
+
+// File bytes per index slot; a slot takes 16 bytes
+#define CACHE_FILE_BYTES_PER_SLOT 256
+
+typedef struct {
+    size_t file_bytes;
+    size_t used_bytes;                // arena bytes holding records
+    size_t records;                   // indexed records
+    unsigned long writes;             // records written
+    unsigned long dropped;            // inserts not persisted: queue full, too large or space pinned
+    unsigned long discarded;          // torn records found on lookup
+} cache_file_stats_t;
+
+/* Map the file at path, creating or reformatting it if it is not a cache
+   file of this size, and start the writer (0, or -1 with errno) */
+int cache_file_open(const char *path, size_t bytes);
+
+/* Whether cache_file_open succeeded */
+int cache_file_enabled(void);
+
+/* Queue obj to be written under key, taking over a reference */
+void cache_file_put(uint64_t hash, const char *key, size_t key_len, cache_object_t *obj, const cache_times_t *t);
+
+/* The mapped object stored under key, referenced, with its times; NULL if
+   there is none, it expired or it is torn */
+cache_object_t *cache_file_get(uint64_t hash, const char *key, size_t key_len, time_t now, cache_times_t *t);
+
+void cache_file_get_stats(cache_file_stats_t *stats);
+
+#endif // CACHE_FILE_H
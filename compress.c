@@ -0,0 +1,260 @@
+#include "compress.h"
+#include "config.h"
+#include "http.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+
+// Content-Type prefixes worth compressing (a "/" ends a whole family); any
+// +json or +xml type is as well.
+static const char *const compressible_types[] = {
+    "text/", "application/json", "application/javascript", "application/xml", "application/x-javascript",
+    "image/svg+xml", NULL
+};
+
+typedef struct {
+    char *key;
+    size_t key_len;
+    cache_object_t *obj;
+} job_t;
+
+static struct {
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    job_t *queue, *batch;
+    size_t queue_len;
+    z_stream z;                       // reused for every job
+    char *out;                        // deflate output, grown as needed
+    size_t out_cap;
+    atomic_ulong variants, skipped, dropped;
+    atomic_ullong identity_bytes, gzip_bytes;
+} cz;
+
+static int enabled;
+
+static int line_is(const char *line, size_t len, const char *name) {
+    size_t n = strlen(name);
+    return len > n && line[n] == ':' && strncasecmp(line, name, n) == 0;
+}
+
+// The variant's head: the identity head without its Content-Length, with a
+// strong ETag made weak, then the encoding and the compressed length.
+// Returns its length, 0 if out is too small.
+static size_t variant_head(const char *head, size_t head_len, size_t body_len, char *out, size_t out_cap) {
+    const char *line = head;
+    const char *end = head + head_len;
+    size_t out_len = 0;
+    int first = 1;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            break;
+        size_t len = eol + 1 - line;
+        if (len <= 2 && !first)
+            break;  // the blank line ending the head
+        if (!first && line_is(line, len, "Content-Length")) {
+            line = eol + 1;
+            continue;
+        }
+        const char *copy = line;
+        size_t copy_len = len;
+        if (!first && line_is(line, len, "ETag")) {
+            const char *v = line + 5;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            if (v < eol && *v == '"') {
+                if (out_len + 8 > out_cap)
+                    return 0;
+                memcpy(out + out_len, "ETag: W/", 8);
+                out_len += 8;
+                copy = v;
+                copy_len = eol + 1 - v;
+            }
+        }
+        if (out_len + copy_len > out_cap)
+            return 0;
+        memcpy(out + out_len, copy, copy_len);
+        out_len += copy_len;
+        first = 0;
+        line = eol + 1;
+    }
+    int n = snprintf(out + out_len, out_cap - out_len, "Content-Encoding: gzip\r\nContent-Length: %zu\r\n\r\n",
+                     body_len);
+    if (n < 0 || (size_t)n >= out_cap - out_len)
+        return 0;
+    return out_len + n;
+}
+
+static void compress_job(const job_t *j) {
+    cache_object_t *obj = j->obj;
+    // Nobody else holds it: it left the cache before its turn came.
+    if (atomic_load_explicit(&obj->refcount, memory_order_relaxed) == 1) {
+        atomic_fetch_add(&cz.dropped, 1);
+        return;
+    }
+    const char *body = obj->data + obj->head_len;
+    size_t body_len = obj->len - obj->head_len;
+    size_t bound = deflateBound(&cz.z, body_len);
+    if (bound > cz.out_cap) {
+        char *out = realloc(cz.out, bound);
+        if (!out) {
+            atomic_fetch_add(&cz.dropped, 1);
+            return;
+        }
+        cz.out = out;
+        cz.out_cap = bound;
+    }
+    deflateReset(&cz.z);
+    cz.z.next_in = (Bytef *)body;
+    cz.z.avail_in = (uInt)body_len;
+    cz.z.next_out = (Bytef *)cz.out;
+    cz.z.avail_out = (uInt)cz.out_cap;
+    if (deflate(&cz.z, Z_FINISH) != Z_STREAM_END) {
+        atomic_fetch_add(&cz.dropped, 1);
+        return;
+    }
+    size_t gzip_len = cz.z.total_out;
+    // A second copy is only worth its memory if it is clearly smaller.
+    if (gzip_len * 100 > body_len * (100 - COMPRESS_MIN_SAVING)) {
+        atomic_fetch_add(&cz.skipped, 1);
+        return;
+    }
+    char head[IO_BUFFER_SIZE + 128];
+    size_t head_len = variant_head(obj->data, obj->head_len, gzip_len, head, sizeof(head));
+    cache_object_t *gzip = head_len ? cache_object_alloc(head_len + gzip_len, head_len) : NULL;
+    if (!gzip) {
+        atomic_fetch_add(&cz.dropped, 1);
+        return;
+    }
+    memcpy(gzip->data, head, head_len);
+    memcpy(gzip->data + head_len, cz.out, gzip_len);
+    if (!cache_attach_gzip(j->key, j->key_len, obj, gzip)) {
+        atomic_fetch_add(&cz.dropped, 1);
+        return;
+    }
+    atomic_fetch_add(&cz.variants, 1);
+    atomic_fetch_add(&cz.identity_bytes, body_len);
+    atomic_fetch_add(&cz.gzip_bytes, gzip_len);
+}
+
+static void *compress_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&cz.queue_lock);
+        while (cz.queue_len == 0)
+            pthread_cond_wait(&cz.queue_cond, &cz.queue_lock);
+        job_t *batch = cz.queue;
+        size_t n = cz.queue_len;
+        cz.queue = cz.batch;
+        cz.batch = batch;
+        cz.queue_len = 0;
+        pthread_mutex_unlock(&cz.queue_lock);
+
+        for (size_t i = 0; i < n; i++) {
+            compress_job(&batch[i]);
+            cache_release(batch[i].obj);
+            free(batch[i].key);
+        }
+    }
+    return NULL;
+}
+
+int compress_start(int level) {
+    if (level <= 0)
+        return 0;
+    if (level > 9)
+        level = 9;
+    // Window bits 15 + 16: a gzip wrapper rather than zlib's.
+    if (deflateInit2(&cz.z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&cz.queue_lock, NULL);
+    pthread_cond_init(&cz.queue_cond, NULL);
+    cz.queue = calloc(COMPRESS_QUEUE, sizeof(job_t));
+    cz.batch = calloc(COMPRESS_QUEUE, sizeof(job_t));
+    pthread_t thread;
+    if (!cz.queue || !cz.batch || (errno = pthread_create(&thread, NULL, compress_main, NULL)) != 0) {
+        if (!cz.queue || !cz.batch)
+            errno = ENOMEM;
+        return -1;
+    }
+    pthread_detach(thread);
+    enabled = 1;
+    LOG_INFO("[Cache] Keeping gzip variants of compressible responses (level %d)", level);
+    return 0;
+}
+
+int compress_enabled(void) {
+    return enabled;
+}
+
+static int type_compressible(const char *type, size_t len) {
+    size_t n = 0;
+    while (n < len && type[n] != ';' && type[n] != ' ' && type[n] != '\t')
+        n++;
+    for (int i = 0; compressible_types[i]; i++) {
+        size_t plen = strlen(compressible_types[i]);
+        if (n >= plen && strncasecmp(type, compressible_types[i], plen) == 0 &&
+            (n == plen || compressible_types[i][plen - 1] == '/'))
+            return 1;
+    }
+    return (n > 5 && strncasecmp(type + n - 5, "+json", 5) == 0) ||
+           (n > 4 && strncasecmp(type + n - 4, "+xml", 4) == 0);
+}
+
+int compress_eligible(const char *head, size_t head_len, size_t body_len) {
+    if (!enabled || head_len == 0 || body_len < COMPRESS_MIN_BODY)
+        return 0;
+    size_t len;
+    // Already encoded, kept in chunks, partial, or varying on request
+    // headers (the cached head would need a second Vary field).
+    if (http_find_header(head, head_len, "Content-Encoding", &len) ||
+        http_find_header(head, head_len, "Transfer-Encoding", &len) ||
+        http_find_header(head, head_len, "Content-Range", &len) || http_find_header(head, head_len, "Vary", &len))
+        return 0;
+    const char *end = head + head_len;
+    const char *from = head;
+    const char *v;
+    while ((v = http_find_header(from, end - from, "Cache-Control", &len))) {
+        if (http_list_has(v, len, "no-transform"))
+            return 0;
+        from = v + len;
+    }
+    v = http_find_header(head, head_len, "Content-Type", &len);
+    return v && type_compressible(v, len);
+}
+
+void compress_submit(const char *key, size_t key_len, cache_object_t *obj) {
+    char *copy = enabled ? malloc(key_len) : NULL;
+    if (copy) {
+        memcpy(copy, key, key_len);
+        pthread_mutex_lock(&cz.queue_lock);
+        if (cz.queue_len < COMPRESS_QUEUE) {
+            cz.queue[cz.queue_len++] = (job_t){ copy, key_len, obj };
+            if (cz.queue_len == 1)
+                pthread_cond_signal(&cz.queue_cond);
+            pthread_mutex_unlock(&cz.queue_lock);
+            return;
+        }
+        pthread_mutex_unlock(&cz.queue_lock);
+        free(copy);
+    }
+    if (enabled)
+        atomic_fetch_add(&cz.dropped, 1);
+    cache_release(obj);
+}
+
+void compress_get_stats(compress_stats_t *stats) {
+    stats->variants = atomic_load(&cz.variants);
+    stats->skipped = atomic_load(&cz.skipped);
+    stats->dropped = atomic_load(&cz.dropped);
+    stats->identity_bytes = atomic_load(&cz.identity_bytes);
+    stats->gzip_bytes = atomic_load(&cz.gzip_bytes);
+}
@@ -0,0 +1,42 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include "cache.h"
+
+// Gzip variants of cached responses. When a response with a text-like
+// Content-Type is cached, its cached head says it varies on Accept-Encoding
+// and a job is queued for a background thread, which deflates the body once
+// and attaches the result to the cached object (cache_attach_gzip). Hits
+// from clients that accept gzip are then sent the variant as it is, with no
+// compression work on the event loop. The variant is charged to the cache
+// budget at its compressed size and leaves the cache with its identity form.
+//
+// The variant's head is the identity head with Content-Encoding: gzip, its
+// own Content-Length and a strong ETag made weak, since the bytes differ.
+typedef struct {
+    unsigned long variants;           // gzip variants attached
+    unsigned long skipped;            // responses that did not compress well enough
+    unsigned long dropped;            // jobs lost: queue full, out of memory, or the response left the cache
+    unsigned long long identity_bytes;  // body bytes of the responses with a variant
+    unsigned long long gzip_bytes;    // and of their variants
+} compress_stats_t;
+
+/* Compress at this zlib level (1-9) from now on and start the thread;
+   level 0 leaves compression off (0, or -1 with errno) */
+int compress_start(int level);
+
+/* Whether compress_start turned compression on */
+int compress_enabled(void);
+
+/* Whether a cacheable 200 response with this head and body length should
+   get a gzip variant */
+int compress_eligible(const char *head, size_t head_len, size_t body_len);
+
+/* Queue obj, cached under key, to have a gzip variant made; takes over a
+   reference */
+void compress_submit(const char *key, size_t key_len, cache_object_t *obj);
+
+void compress_get_stats(compress_stats_t *stats);
+
+#endif // COMPRESS_H
@@ -4,4 +4,156 @@
 // default port and backend addresses
 #define DEFAULT_PORT 8080
 
+// reactor threads (--workers); 0 on the command line means one per CPU
+#define DEFAULT_WORKERS 1
+#define MAX_WORKERS 256
+
+// idle keep-alive connections per backend and worker (--pool-min/--pool-max/--pool-idle)
+#define DEFAULT_POOL_MIN_IDLE 0
+#define DEFAULT_POOL_MAX_IDLE 32
+#define DEFAULT_POOL_IDLE_TIMEOUT 30
+
+// persistent client connections (--keepalive-timeout/--keepalive-requests)
+#define DEFAULT_KEEPALIVE_TIMEOUT 15
+#define DEFAULT_KEEPALIVE_REQUESTS 1000
+
+// connection deadlines in milliseconds: backend connect, complete request head
+// from the client, first response byte from the backend, and the whole exchange
+// (--connect-timeout/--header-timeout/--first-byte-timeout/--request-timeout)
+#define DEFAULT_CONNECT_TIMEOUT_MS 3000
+#define DEFAULT_HEADER_TIMEOUT_MS 10000
+#define DEFAULT_FIRST_BYTE_TIMEOUT_MS 30000
+#define DEFAULT_REQUEST_TIMEOUT_MS 300000
+
+// backend health: active probes every interval (--health-interval, 0 = off;
+// --health-path probes with GET and expects 2xx/3xx, otherwise a TCP connect
+// is enough), taking a backend out after UNHEALTHY failed probes and back in
+// after HEALTHY passed ones
+#define DEFAULT_HEALTH_INTERVAL_MS 2000
+#define DEFAULT_HEALTH_TIMEOUT_MS 1000
+#define DEFAULT_HEALTH_UNHEALTHY 2
+#define DEFAULT_HEALTH_HEALTHY 2
+
+// outlier ejection: a backend failing this many requests in a row, or this
+// share of at least MIN_REQUESTS within 10 s, is ejected for BASE ms, doubled
+// for each ejection in a row up to MAX
+#define DEFAULT_EJECT_FAILURES 5
+#define DEFAULT_EJECT_ERROR_PERCENT 50
+#define DEFAULT_EJECT_MIN_REQUESTS 20
+#define DEFAULT_EJECT_BASE_MS 2000
+#define DEFAULT_EJECT_MAX_MS 60000
+
+// backend selection (--balance): least-conn, round-robin, p2c, peak-ewma or maglev,
+// and the time constant of peak-ewma's latency average
+#define DEFAULT_BALANCE "least-conn"
+#define DEFAULT_EWMA_DECAY_MS 10000
+
+// maglev routes each request key to one backend, but no backend takes more
+// than this percentage of the mean load per unit of weight (--hash-load-factor)
+#define DEFAULT_HASH_LOAD_FACTOR 125
+
+// times an idempotent request is sent to another backend after a connect
+// failure or a reset before any response (--retries)
+#define DEFAULT_RETRIES 2
+
+// hedging: a GET whose backend has not started answering within this
+// percentile of recent first-byte latencies (--hedge-percentile, 0 = off),
+// and at least --hedge-min-delay ms, is also sent to a second backend. The
+// extra requests stay within --hedge-budget percent, and --hedge-holdout
+// percent of such GETs are never hedged so the stats can compare.
+#define DEFAULT_HEDGE_PERCENTILE 0
+#define DEFAULT_HEDGE_BUDGET 5
+#define DEFAULT_HEDGE_MIN_DELAY_MS 5
+#define DEFAULT_HEDGE_HOLDOUT 5
+// hedges a worker may send in a burst once its budget has built up
+#define HEDGE_BURST 10
+
+// listen backlog of each worker's listener (--backlog; the kernel caps it
+// at net.core.somaxconn), and connections a worker accepts per readiness
+// event before it serves the ones it has again
+#define DEFAULT_LISTEN_BACKLOG 4096
+#define ACCEPT_BATCH 64
+
+// upstream admission control: requests in flight to each backend are capped
+// by a limit that starts at ADMISSION_INITIAL_LIMIT and adapts to latency, up
+// to --backend-max-inflight; all backends together hold at most the sum of
+// their limits and --max-inflight. Every PROBE_INTERVAL_MS a backend is held
+// at ADMISSION_MIN_LIMIT for PROBE_SAMPLES responses to measure its latency
+// without queueing. The limit grows while first-byte latency stays within
+// TOLERANCE times that plus SLACK_MS, and is cut by BACKOFF percent when it
+// does not, the backend times out or it sends 503
+#define DEFAULT_MAX_INFLIGHT 1024
+#define DEFAULT_BACKEND_MAX_INFLIGHT 256
+#define ADMISSION_INITIAL_LIMIT 20
+#define ADMISSION_MIN_LIMIT 2
+#define ADMISSION_TOLERANCE 2
+#define ADMISSION_SLACK_MS 5
+#define ADMISSION_BACKOFF 10
+#define ADMISSION_PROBE_INTERVAL_MS 10000
+#define ADMISSION_PROBE_SAMPLES 10
+
+// misses finding no room wait in their worker's queue (--queue-size, 0 =
+// refuse at once) for at most --queue-timeout ms, and are refused with 503 and
+// Retry-After: RETRY_AFTER when it is full or they would not leave it in time;
+// a worker with a queue looks for freed slots every ADMISSION_POLL_MS
+#define DEFAULT_QUEUE_SIZE 1024
+#define DEFAULT_QUEUE_TIMEOUT_MS 1000
+#define RETRY_AFTER 1
+#define ADMISSION_POLL_MS 1
+
+// seconds a request waits for an identical in-flight fetch before fetching itself (--coalesce-timeout)
+#define DEFAULT_COALESCE_TIMEOUT 3
+
+// lifetime of responses that do not set max-age (--cache-ttl), and how long
+// past it they may be served stale while refreshed or when the backend fails (--cache-stale)
+#define DEFAULT_CACHE_TTL 60
+#define DEFAULT_CACHE_STALE 10
+
+// cache memory budget (--cache-mb); entries are evicted beyond it
+#define DEFAULT_CACHE_MAX_BYTES (256UL * 1024 * 1024)
+
+// which responses a full cache takes in (--cache-admission): tinylfu keeps
+// only those requested more often than what they would evict, lru takes all
+#define DEFAULT_CACHE_ADMISSION "tinylfu"
+
+// size of the file the cache is also kept in when --cache-file is given (--cache-file-mb)
+#define DEFAULT_CACHE_FILE_BYTES (1024UL * 1024 * 1024)
+
+// gzip variants of cached responses (--gzip-level 1-9, 0 = off): bodies of
+// at least COMPRESS_MIN_BODY bytes with a text-like Content-Type are
+// compressed once on a background thread, and the result is kept only if it
+// is at least COMPRESS_MIN_SAVING percent smaller; up to COMPRESS_QUEUE
+// responses wait for the thread, more get no variant
+#define DEFAULT_GZIP_LEVEL 6
+#define COMPRESS_MIN_BODY 256
+#define COMPRESS_MIN_SAVING 10
+#define COMPRESS_QUEUE 4096
+
+// how workers wait for socket readiness (--io-engine): epoll, or io_uring
+// with batched submissions
+#define DEFAULT_IO_ENGINE "epoll"
+
+// connection I/O buffers, lent out only while a connection has data in
+// flight; each thread keeps up to BUFFER_CACHE_MAX free ones of its own
+#define IO_BUFFER_SIZE 8192
+#define BUFFER_CACHE_MAX 64
+
+// logging (--log-level error, warn, info or debug): each thread's lines
+// wait in a ring of LOG_RING_SIZE bytes until the log thread, waking every
+// LOG_DRAIN_INTERVAL_MS, writes them out; errors and warnings are limited
+// to LOG_RATELIMIT_BURST lines a second per call site
+#define DEFAULT_LOG_LEVEL "info"
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_LINE_MAX 1024
+#define LOG_DRAIN_INTERVAL_MS 10
+#define LOG_RATELIMIT_BURST 10
+
+// metrics in Prometheus text format at http://ADMIN_ADDR:port/metrics
+// (--admin-port, 0 = off); loopback only unless changed here
+#define DEFAULT_ADMIN_PORT 0
+#define ADMIN_ADDR "127.0.0.1"
+
+// bodies of at least this many bytes are moved with splice() and not cached
+#define SPLICE_MIN_BODY (64 * 1024)
+
 #endif 
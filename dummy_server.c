@@ -1,68 +1,578 @@
+// Backend emulator. Serves HTTP/1.1 with keep-alive on one port or a range
+// of ports from one process, from one or more threads that each run their
+// own epoll loop with SO_REUSEPORT listeners. How it answers is
+// configurable: a latency distribution (served from a timer wheel, so a slow
+// response holds no thread), the response size, Cache-Control header and
+// one extra header, and the share of requests that get an error status, a connection reset
+// or no answer at all. A request can override the size, latency and status
+// with ?size=N, ?delay=MS and ?status=N in its target.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "http.h"
+#include "timer_wheel.h"
+#include "log.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return 1;
+#define MAX_THREADS 64
+#define MAX_PORTS 256
+#define MAX_EVENTS 256
+#define IN_BUFFER_SIZE 8192
+#define BODY_CHUNK (64 * 1024)
+
+typedef enum {
+    LATENCY_FIXED,              // always a
+    LATENCY_EXP,                // exponential with mean a
+    LATENCY_BIMODAL,            // a, or b for pct percent of requests
+} latency_kind_t;
+
+typedef struct {
+    latency_kind_t kind;
+    double a, b, pct;           // ms, ms, percent
+} latency_t;
+
+typedef struct {
+    int first_port, last_port;
+    int threads;
+    latency_t latency;
+    size_t size;                // response body bytes
+    const char *cache_control;  // header value, NULL = none
+    const char *header;         // extra header line, NULL = none
+    double error_pct;           // answered with error_status
+    int error_status;
+    double reset_pct;           // connection reset instead of an answer
+    double stall_pct;           // never answered
+    int close;                  // close after every response
+} options_t;
+
+static options_t opt = {
+    .threads = 1,
+    .latency = { LATENCY_FIXED, 0, 0, 0 },
+    .size = 64,
+    .cache_control = NULL,
+    .error_status = 500,
+};
+
+static char body_fill[BODY_CHUNK];
+
+typedef enum {
+    CONN_READING,               // request head or body
+    CONN_WAITING,               // for its latency to pass
+    CONN_WRITING,
+    CONN_STALLED,               // never answered; read and dropped until the client leaves
+} conn_state_t;
+
+// Listeners and connections share the epoll set; kind tells them apart.
+enum { KIND_LISTENER, KIND_CONN };
+
+typedef struct {
+    int kind;
+    int fd;
+    int port;
+} listener_t;
+
+typedef struct {
+    int kind;
+    int fd;
+    int port;
+    conn_state_t state;
+    uint32_t events;            // registered interest
+    http_request_t req;
+    size_t in_len, in_msg;      // buffer[0, in_msg) is the current request
+    int head_parsed;
+    int keep_alive;
+    char head[512];             // response head
+    size_t head_len, head_off;
+    size_t body_left;
+    wheel_timer_t timer;
+    char buffer[IN_BUFFER_SIZE];
+} conn_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    timer_wheel_t timers;
+    uint64_t seed;
+    listener_t listeners[MAX_PORTS];
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+
+static double random_unit(worker_t *w) {
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    return (w->seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int chance(worker_t *w, double pct) {
+    return pct > 0 && random_unit(w) * 100 < pct;
+}
+
+static uint64_t latency_sample(worker_t *w) {
+    const latency_t *l = &opt.latency;
+    double ms = l->a;
+    if (l->kind == LATENCY_EXP)
+        ms = -l->a * log(1 - random_unit(w));
+    else if (l->kind == LATENCY_BIMODAL && chance(w, l->pct))
+        ms = l->b;
+    return (uint64_t)(ms + 0.5);
+}
+
+// "fixed:MS", "exp:MEAN_MS" or "bimodal:FAST_MS,SLOW_MS,SLOW_PCT"
+static int latency_parse(const char *spec, latency_t *l) {
+    memset(l, 0, sizeof(*l));
+    if (sscanf(spec, "fixed:%lf", &l->a) == 1) {
+        l->kind = LATENCY_FIXED;
+    } else if (sscanf(spec, "exp:%lf", &l->a) == 1) {
+        l->kind = LATENCY_EXP;
+    } else if (sscanf(spec, "bimodal:%lf,%lf,%lf", &l->a, &l->b, &l->pct) == 3) {
+        l->kind = LATENCY_BIMODAL;
+    } else {
+        return -1;
     }
+    return l->a >= 0 && l->b >= 0 ? 0 : -1;
+}
 
-    int port = atoi(argv[1]);
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
+static void set_interest(worker_t *w, conn_t *c, uint32_t events) {
+    if (events == c->events)
+        return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        LOG_ERRNO("epoll_ctl");
+    c->events = events;
+}
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Dummy: socket failed");
-        exit(EXIT_FAILURE);
+static void conn_close(worker_t *w, conn_t *c) {
+    timer_cancel(&w->timers, &c->timer);
+    close(c->fd);
+    free(c);
+}
+
+// Close with a RST instead of a FIN.
+static void conn_reset(worker_t *w, conn_t *c) {
+    struct linger lg = { 1, 0 };
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    conn_close(w, c);
+}
+
+// Value of name=N in the request's query string, or -1.
+static long query_param(const conn_t *c, const char *name) {
+    const char *target = c->buffer + c->req.target_off;
+    const char *end = target + c->req.target_len;
+    const char *q = memchr(target, '?', c->req.target_len);
+    size_t name_len = strlen(name);
+    while (q && q < end) {
+        q++;
+        if ((size_t)(end - q) > name_len && memcmp(q, name, name_len) == 0 && q[name_len] == '=')
+            return strtol(q + name_len + 1, NULL, 10);
+        q = memchr(q, '&', end - q);
     }
+    return -1;
+}
 
-    int opt = 1;
-    if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Dummy: setsockopt failed");
-        exit(EXIT_FAILURE);
+static const char *reason(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
     }
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+static void conn_drive(worker_t *w, conn_t *c);
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Dummy: bind failed");
-        exit(EXIT_FAILURE);
+// The request is in: decide how it is answered and when.
+static void conn_respond(worker_t *w, conn_t *c) {
+    if (chance(w, opt.reset_pct)) {
+        LOG_DEBUG("Port %d: resetting FD %d", c->port, c->fd);
+        conn_reset(w, c);
+        return;
+    }
+    if (chance(w, opt.stall_pct)) {
+        LOG_DEBUG("Port %d: stalling FD %d", c->port, c->fd);
+        c->state = CONN_STALLED;
+        set_interest(w, c, EPOLLIN);
+        return;
     }
+    long status = query_param(c, "status");
+    if (status < 100 || status > 599)
+        status = chance(w, opt.error_pct) ? opt.error_status : 200;
+    long size = query_param(c, "size");
+    size_t body = size >= 0 ? (size_t)size : status == 200 ? opt.size : 0;
+    c->keep_alive = c->req.keep_alive && !opt.close;
+    int len = snprintf(c->head, sizeof(c->head),
+                       "HTTP/1.1 %ld %s\r\nContent-Length: %zu\r\nContent-Type: text/plain\r\n"
+                       "X-Backend-Port: %d\r\n%s%s%s%s%sConnection: %s\r\n\r\n",
+                       status, reason((int)status), body, c->port,
+                       opt.cache_control && status == 200 ? "Cache-Control: " : "",
+                       opt.cache_control && status == 200 ? opt.cache_control : "",
+                       opt.cache_control && status == 200 ? "\r\n" : "",
+                       opt.header && status == 200 ? opt.header : "",
+                       opt.header && status == 200 ? "\r\n" : "", c->keep_alive ? "keep-alive" : "close");
+    c->head_len = len < (int)sizeof(c->head) ? (size_t)len : sizeof(c->head) - 1;
+    c->head_off = 0;
+    c->body_left = c->req.is_head ? 0 : body;
+    long delay = query_param(c, "delay");
+    uint64_t ms = delay >= 0 ? (uint64_t)delay : latency_sample(w);
+    LOG_DEBUG("Port %d: %.*s -> %ld after %llu ms", c->port, (int)c->req.target_len,
+              c->buffer + c->req.target_off, status, (unsigned long long)ms);
+    if (ms > 0) {
+        c->state = CONN_WAITING;
+        set_interest(w, c, 0);
+        timer_add(&w->timers, &c->timer, timer_now_ms() + ms);
+        return;
+    }
+    c->state = CONN_WRITING;
+    conn_drive(w, c);
+}
 
-    if (listen(server_fd, 10) < 0) {
-        perror("Dummy: listen failed");
-        exit(EXIT_FAILURE);
+// Write the response. Returns 1 when it is out, 0 if the socket is full
+// and -1 on error.
+static int conn_write(conn_t *c) {
+    while (c->head_off < c->head_len || c->body_left > 0) {
+        struct iovec iov[2];
+        int n = 0;
+        if (c->head_off < c->head_len)
+            iov[n++] = (struct iovec){ c->head + c->head_off, c->head_len - c->head_off };
+        if (c->body_left > 0)
+            iov[n++] = (struct iovec){ body_fill, c->body_left < BODY_CHUNK ? c->body_left : BODY_CHUNK };
+        ssize_t sent = writev(c->fd, iov, n);
+        if (sent < 0) {
+            if (errno == EAGAIN)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        size_t head_part = c->head_len - c->head_off;
+        if ((size_t)sent <= head_part) {
+            c->head_off += sent;
+        } else {
+            c->head_off = c->head_len;
+            c->body_left -= sent - head_part;
+        }
     }
+    return 1;
+}
 
-    printf("Dummy server listening on port %d...\n", port);
-    fflush(stdout);
+// Read from the client. Returns 0 if it may have more, 1 at EOF, -1 on error.
+static int conn_read(conn_t *c) {
+    while (c->in_len < IN_BUFFER_SIZE) {
+        ssize_t n = read(c->fd, c->buffer + c->in_len, IN_BUFFER_SIZE - c->in_len);
+        if (n > 0) {
+            c->in_len += n;
+            continue;
+        }
+        if (n == 0)
+            return 1;
+        if (errno == EAGAIN)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
 
+static void conn_drive(worker_t *w, conn_t *c) {
     while (1) {
-        new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (new_socket < 0) {
-            perror("Dummy: accept failed");
+        if (c->state == CONN_STALLED) {
+            // Drop whatever arrives; only the client's close ends it.
+            c->in_len = 0;
+            int r = conn_read(c);
+            if (r != 0)
+                conn_close(w, c);
+            return;
+        }
+        if (c->state == CONN_WRITING) {
+            int r = conn_write(c);
+            if (r < 0) {
+                conn_close(w, c);
+                return;
+            }
+            if (r == 0) {
+                set_interest(w, c, EPOLLOUT);
+                return;
+            }
+            if (!c->keep_alive) {
+                shutdown(c->fd, SHUT_WR);
+                conn_close(w, c);
+                return;
+            }
+            // Pipelined bytes become the start of the next request.
+            memmove(c->buffer, c->buffer + c->in_msg, c->in_len - c->in_msg);
+            c->in_len -= c->in_msg;
+            c->in_msg = 0;
+            c->head_parsed = 0;
+            http_request_init(&c->req);
+            c->state = CONN_READING;
+        }
+        if (c->state != CONN_READING)
+            return;
+        int eof = 0;
+        if (c->in_len < IN_BUFFER_SIZE) {
+            int r = conn_read(c);
+            if (r < 0) {
+                conn_close(w, c);
+                return;
+            }
+            eof = r;
+        }
+        if (!c->head_parsed) {
+            int r = http_parse_request(c->buffer, c->in_len, &c->req);
+            if (r < 0 || (r == 0 && (eof || c->in_len == IN_BUFFER_SIZE))) {
+                conn_close(w, c);
+                return;
+            }
+            if (r == 0) {
+                set_interest(w, c, EPOLLIN);
+                return;
+            }
+            c->head_parsed = 1;
+            c->in_msg = c->req.head_len;
+        }
+        // The body is read and dropped.
+        c->in_msg += http_framer_consume(&c->req.body, c->buffer + c->in_msg, c->in_len - c->in_msg);
+        if (c->req.body.error) {
+            conn_close(w, c);
+            return;
+        }
+        if (!c->req.body.done) {
+            if (eof) {
+                conn_close(w, c);
+                return;
+            }
+            // Keep the head, drop the body bytes seen so far.
+            c->in_len = c->in_msg = c->req.head_len;
+            set_interest(w, c, EPOLLIN);
+            return;
+        }
+        conn_respond(w, c);
+        return;
+    }
+}
+
+static void conn_timeout(wheel_timer_t *t, void *arg) {
+    worker_t *w = arg;
+    conn_t *c = t->data;
+    c->state = CONN_WRITING;
+    conn_drive(w, c);
+}
+
+static void accept_all(worker_t *w, listener_t *l) {
+    while (1) {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                LOG_ERRNO("accept");
+            if (errno != EINTR)
+                return;
             continue;
         }
-        printf("Dummy server: Connection received. Simulating processing...\n");
-        fflush(stdout);
+        conn_t *c = malloc(sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->kind = KIND_CONN;
+        c->fd = fd;
+        c->port = l->port;
+        c->state = CONN_READING;
+        c->events = EPOLLIN;
+        c->in_len = c->in_msg = 0;
+        c->head_parsed = 0;
+        http_request_init(&c->req);
+        timer_init(&c->timer, c);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOG_ERRNO("epoll_ctl");
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+static int create_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int64_t timeout = timer_wheel_timeout(&w->timers);
+        if (timeout < 0 || timeout > 1000)
+            timeout = 1000;
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, (int)timeout);
+        if (n < 0 && errno != EINTR) {
+            LOG_ERRNO("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int kind = *(int *)events[i].data.ptr;
+            if (kind == KIND_LISTENER)
+                accept_all(w, events[i].data.ptr);
+            else
+                conn_drive(w, events[i].data.ptr);
+        }
+        timer_wheel_advance(&w->timers, timer_now_ms(), conn_timeout, w);
+    }
+    return NULL;
+}
 
-        // Simulate backend processing delay
-        sleep(2);
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] PORT[-LAST_PORT]\n"
+                    "  --threads N          event loops, each listening on every port (default %d)\n"
+                    "  --latency SPEC       fixed:MS, exp:MEAN_MS or bimodal:FAST_MS,SLOW_MS,SLOW_PCT\n"
+                    "                       (default fixed:0)\n"
+                    "  --size N             response body bytes (default %zu)\n"
+                    "  --cache-control V    Cache-Control header of 200 responses (default none)\n"
+                    "  --header LINE        extra header line of 200 responses, e.g. \"Set-Cookie: a=1\"\n"
+                    "  --error-rate PCT     answer this share of requests with --error-status\n"
+                    "  --error-status N     (default %d)\n"
+                    "  --reset-rate PCT     reset the connection instead of answering\n"
+                    "  --stall-rate PCT     never answer (the connection stays open)\n"
+                    "  --close              close the connection after every response\n"
+                    "  --log-level LEVEL    error, warn, info or debug (debug logs every request)\n"
+                    "A request can override the size, latency and status with ?size=N, ?delay=MS and\n"
+                    "?status=N.\n",
+            prog, opt.threads, opt.size, opt.error_status);
+}
 
-        char *response = "Hello from dummy backend server";
-        write(new_socket, response, strlen(response));
-        close(new_socket);
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"latency", required_argument, NULL, 'L'},
+        {"size", required_argument, NULL, 's'},
+        {"cache-control", required_argument, NULL, 'c'},
+        {"header", required_argument, NULL, 'H'},
+        {"error-rate", required_argument, NULL, 'e'},
+        {"error-status", required_argument, NULL, 'E'},
+        {"reset-rate", required_argument, NULL, 'r'},
+        {"stall-rate", required_argument, NULL, 'S'},
+        {"close", no_argument, NULL, 'C'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int ch, level;
+    while ((ch = getopt_long(argc, argv, "t:h", long_opts, NULL)) != -1) {
+        switch (ch) {
+        case 't': opt.threads = atoi(optarg); break;
+        case 'L':
+            if (latency_parse(optarg, &opt.latency) < 0) {
+                fprintf(stderr, "Bad latency: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's': opt.size = strtoul(optarg, NULL, 10); break;
+        case 'c': opt.cache_control = optarg; break;
+        case 'H': opt.header = optarg; break;
+        case 'e': opt.error_pct = atof(optarg); break;
+        case 'E': opt.error_status = atoi(optarg); break;
+        case 'r': opt.reset_pct = atof(optarg); break;
+        case 'S': opt.stall_pct = atof(optarg); break;
+        case 'C': opt.close = 1; break;
+        case 'l':
+            level = log_level_by_name(optarg);
+            if (level < 0) {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                return 1;
+            }
+            log_set_level(level);
+            break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || sscanf(argv[optind], "%d-%d", &opt.first_port, &opt.last_port) < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.last_port < opt.first_port)
+        opt.last_port = opt.first_port;
+    int ports = opt.last_port - opt.first_port + 1;
+    if (ports > MAX_PORTS || opt.threads < 1 || opt.threads > MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(body_fill); i++)
+        body_fill[i] = "0123456789abcdef"[i % 16];
+    signal(SIGPIPE, SIG_IGN);
 
-        printf("Dummy server: Response sent and connection closed.\n");
-        fflush(stdout);
+    for (int t = 0; t < opt.threads; t++) {
+        worker_t *w = &workers[t];
+        w->id = t;
+        w->seed = 0x9e3779b97f4a7c15ull * (t + 1);
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd < 0) {
+            perror("Dummy: epoll_create1");
+            return 1;
+        }
+        timer_wheel_init(&w->timers, timer_now_ms());
+        for (int p = 0; p < ports; p++) {
+            listener_t *l = &w->listeners[p];
+            l->kind = KIND_LISTENER;
+            l->port = opt.first_port + p;
+            l->fd = create_listener(l->port);
+            if (l->fd < 0) {
+                fprintf(stderr, "Dummy: cannot listen on port %d: %s\n", l->port, strerror(errno));
+                return 1;
+            }
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = l };
+            epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, l->fd, &ev);
+        }
     }
 
+    // Lines go out from the log thread, not with a write per line.
+    if (log_init() < 0) {
+        perror("Dummy: log_init failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 1; t < opt.threads; t++) {
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            perror("Dummy: pthread_create");
+            return 1;
+        }
+    }
+    if (ports > 1)
+        LOG_INFO("Dummy server listening on ports %d-%d with %d thread(s)...", opt.first_port, opt.last_port,
+                 opt.threads);
+    else
+        LOG_INFO("Dummy server listening on port %d with %d thread(s)...", opt.first_port, opt.threads);
+    worker_main(&workers[0]);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,305 @@
+#include "fill.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define FILL_SHARDS 64
+#define FILL_BLOCK_SIZE (16 * 1024)
+
+typedef struct fill_block {
+    struct fill_block *next;
+    size_t cap;
+    char data[];
+} fill_block_t;
+
+struct fill {
+    atomic_int refcount;
+    uint64_t hash;
+    struct fill *next;          // shard chain while the fill can be joined
+    int in_table;
+    pthread_mutex_t lock;       // guards everything below
+    fill_state_t state;
+    int shared;                 // followers may use it
+    char *head;
+    size_t head_len;
+    int delimited;
+    size_t body_len;
+    fill_block_t *first;
+    fill_block_t *last;
+    size_t last_start;          // body offset of the last block
+    uint64_t waiters[FILL_WORKER_WORDS];
+    size_t key_len;
+    char key[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    fill_t *chain;
+} fill_shard_t;
+
+static fill_shard_t shards[FILL_SHARDS] = {
+    [0 ... FILL_SHARDS - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL}
+};
+
+static atomic_ulong stat_leaders;
+static atomic_ulong stat_followers;
+static atomic_ulong stat_served;
+static atomic_ulong stat_fallbacks;
+
+static fill_shard_t *shard_for(uint64_t hash) {
+    return &shards[hash >> 58];
+}
+
+// Join the fill for key or create it. With worker_id < 0 an existing fill
+// is left alone and NULL returned.
+static fill_t *fill_find_or_create(const char *key, size_t key_len, int worker_id, int *leader) {
+    uint64_t hash = cache_hash(key, key_len);
+    fill_shard_t *s = shard_for(hash);
+    pthread_mutex_lock(&s->lock);
+    for (fill_t *f = s->chain; f; f = f->next) {
+        if (f->hash == hash && f->key_len == key_len && memcmp(f->key, key, key_len) == 0) {
+            if (worker_id < 0) {
+                pthread_mutex_unlock(&s->lock);
+                *leader = 0;
+                return NULL;
+            }
+            atomic_fetch_add(&f->refcount, 1);
+            pthread_mutex_lock(&f->lock);
+            f->waiters[worker_id / 64] |= 1ULL << (worker_id % 64);
+            pthread_mutex_unlock(&f->lock);
+            pthread_mutex_unlock(&s->lock);
+            atomic_fetch_add_explicit(&stat_followers, 1, memory_order_relaxed);
+            *leader = 0;
+            return f;
+        }
+    }
+    fill_t *f = calloc(1, sizeof(fill_t) + key_len);
+    if (!f) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    atomic_init(&f->refcount, 2);  // the table's and the leader's
+    f->hash = hash;
+    f->in_table = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    f->state = FILL_PENDING;
+    f->shared = 1;
+    f->key_len = key_len;
+    memcpy(f->key, key, key_len);
+    f->next = s->chain;
+    s->chain = f;
+    pthread_mutex_unlock(&s->lock);
+    atomic_fetch_add_explicit(&stat_leaders, 1, memory_order_relaxed);
+    *leader = 1;
+    return f;
+}
+
+fill_t *fill_join(const char *key, size_t key_len, int worker_id, int *leader) {
+    return fill_find_or_create(key, key_len, worker_id, leader);
+}
+
+fill_t *fill_lead(const char *key, size_t key_len) {
+    int leader;
+    return fill_find_or_create(key, key_len, -1, &leader);
+}
+
+fill_t *fill_own(const char *key, size_t key_len) {
+    fill_t *f = calloc(1, sizeof(fill_t) + key_len);
+    if (!f)
+        return NULL;
+    atomic_init(&f->refcount, 1);
+    f->hash = cache_hash(key, key_len);
+    pthread_mutex_init(&f->lock, NULL);
+    f->state = FILL_PENDING;
+    f->key_len = key_len;
+    memcpy(f->key, key, key_len);
+    return f;
+}
+
+// Take the fill out of the table so new requests start their own.
+static void fill_unlink(fill_t *f) {
+    fill_shard_t *s = shard_for(f->hash);
+    int dropped = 0;
+    pthread_mutex_lock(&s->lock);
+    if (f->in_table) {
+        for (fill_t **p = &s->chain; *p; p = &(*p)->next) {
+            if (*p == f) {
+                *p = f->next;
+                break;
+            }
+        }
+        f->in_table = 0;
+        dropped = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (dropped)
+        fill_release(f);
+}
+
+static fill_block_t *block_new(size_t cap) {
+    fill_block_t *b = malloc(sizeof(fill_block_t) + cap);
+    if (b) {
+        b->next = NULL;
+        b->cap = cap;
+    }
+    return b;
+}
+
+int fill_publish_head(fill_t *f, const char *head, size_t head_len, int delimited, size_t size_hint,
+                      int shareable) {
+    char *copy = malloc(head_len > 0 ? head_len : 1);
+    // Bodies of known length get one block of exactly that size.
+    fill_block_t *b = block_new(size_hint > 0 && size_hint <= CACHE_MAX_OBJECT_SIZE ? size_hint : FILL_BLOCK_SIZE);
+    if (!copy || !b) {
+        free(copy);
+        free(b);
+        fill_finish(f, 0);
+        return -1;
+    }
+    memcpy(copy, head, head_len);
+    pthread_mutex_lock(&f->lock);
+    f->head = copy;
+    f->head_len = head_len;
+    f->delimited = delimited;
+    f->first = f->last = b;
+    f->last_start = 0;
+    f->state = FILL_STREAMING;
+    f->shared = shareable;
+    pthread_mutex_unlock(&f->lock);
+    if (!shareable)
+        fill_unlink(f);
+    return 0;
+}
+
+int fill_append(fill_t *f, const char *data, size_t len) {
+    // Only the leader appends, and only past body_len, which followers never
+    // read beyond; the lock just publishes the new length.
+    if (f->state != FILL_STREAMING)
+        return -1;
+    if (f->body_len + len > CACHE_MAX_OBJECT_SIZE) {
+        fill_finish(f, 0);
+        return -1;
+    }
+    size_t body_len = f->body_len;
+    while (len > 0) {
+        fill_block_t *b = f->last;
+        size_t used = body_len - f->last_start;
+        if (used == b->cap) {
+            fill_block_t *nb = block_new(FILL_BLOCK_SIZE);
+            if (!nb) {
+                fill_finish(f, 0);
+                return -1;
+            }
+            pthread_mutex_lock(&f->lock);
+            b->next = nb;
+            f->last = nb;
+            f->last_start = body_len;
+            pthread_mutex_unlock(&f->lock);
+            continue;
+        }
+        size_t n = b->cap - used < len ? b->cap - used : len;
+        memcpy(b->data + used, data, n);
+        data += n;
+        len -= n;
+        body_len += n;
+    }
+    pthread_mutex_lock(&f->lock);
+    f->body_len = body_len;
+    pthread_mutex_unlock(&f->lock);
+    return 0;
+}
+
+void fill_finish(fill_t *f, int ok) {
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FILL_PENDING || f->state == FILL_STREAMING)
+        f->state = ok ? FILL_DONE : FILL_FAILED;
+    pthread_mutex_unlock(&f->lock);
+    fill_unlink(f);
+}
+
+void fill_view(fill_t *f, fill_view_t *v) {
+    pthread_mutex_lock(&f->lock);
+    v->state = f->state;
+    v->shared = f->shared;
+    v->head = f->head;
+    v->head_len = f->head_len;
+    v->delimited = f->delimited;
+    v->body_len = f->body_len;
+    pthread_mutex_unlock(&f->lock);
+}
+
+int fill_body_iov(fill_t *f, fill_cursor_t *cur, size_t off, size_t end, struct iovec *iov, int max) {
+    // Blocks up to body_len are immutable once published, so no lock is needed.
+    const fill_block_t *b = cur->block ? cur->block : f->first;
+    size_t start = cur->block ? cur->block_start : 0;
+    while (b && b->next && off >= start + b->cap) {
+        start += b->cap;
+        b = b->next;
+    }
+    cur->block = b;
+    cur->block_start = start;
+    int count = 0;
+    while (b && off < end && count < max) {
+        if (off < start + b->cap) {
+            size_t block_end = start + b->cap < end ? start + b->cap : end;
+            iov[count].iov_base = (char *)b->data + (off - start);
+            iov[count].iov_len = block_end - off;
+            count++;
+            off = block_end;
+        }
+        start += b->cap;
+        b = b->next;
+    }
+    return count;
+}
+
+cache_object_t *fill_to_object(fill_t *f, const char *head, size_t head_len) {
+    cache_object_t *obj = cache_object_alloc(head_len + f->body_len, head_len);
+    if (!obj)
+        return NULL;
+    if (head_len)
+        memcpy(obj->data, head, head_len);
+    size_t off = 0;
+    for (fill_block_t *b = f->first; b && off < f->body_len; b = b->next) {
+        size_t n = f->body_len - off < b->cap ? f->body_len - off : b->cap;
+        memcpy(obj->data + head_len + off, b->data, n);
+        off += n;
+    }
+    return obj;
+}
+
+void fill_waiters(fill_t *f, uint64_t mask[FILL_WORKER_WORDS]) {
+    pthread_mutex_lock(&f->lock);
+    memcpy(mask, f->waiters, sizeof(f->waiters));
+    pthread_mutex_unlock(&f->lock);
+}
+
+void fill_unfollow(fill_t *f, fill_outcome_t how) {
+    if (how == FILL_SERVED)
+        atomic_fetch_add_explicit(&stat_served, 1, memory_order_relaxed);
+    else if (how == FILL_FALLBACK)
+        atomic_fetch_add_explicit(&stat_fallbacks, 1, memory_order_relaxed);
+    fill_release(f);
+}
+
+void fill_release(fill_t *f) {
+    if (!f || atomic_fetch_sub(&f->refcount, 1) != 1)
+        return;
+    fill_block_t *b = f->first;
+    while (b) {
+        fill_block_t *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(f->head);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+void fill_get_stats(fill_stats_t *stats) {
+    stats->leaders = atomic_load(&stat_leaders);
+    stats->followers = atomic_load(&stat_followers);
+    stats->served = atomic_load(&stat_served);
+    stats->fallbacks = atomic_load(&stat_fallbacks);
+}
@@ -0,0 +1,102 @@
+#ifndef FILL_H
+#define FILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "cache.h"
+#include "config.h"
+
+// A cache fill in progress. The first request to miss on a key (the leader)
+// fetches it from a backend and publishes the response into its fill; other
+// requests for the key arriving meanwhile (followers) are answered from that
+// same fill as it streams in instead of going to a backend themselves.
+// Body bytes are appended in blocks that never move, so followers on any
+// worker read them without copying or locking.
+typedef struct fill fill_t;
+
+typedef enum {
+    FILL_PENDING,       // no response head yet
+    FILL_STREAMING,     // head published, body arriving
+    FILL_DONE,          // the whole response is published
+    FILL_FAILED         // the fetch failed or the response cannot be shared
+} fill_state_t;
+
+// How a follower stopped following
+typedef enum {
+    FILL_SERVED,        // answered from the fill
+    FILL_FALLBACK,      // fetched from a backend itself (leader stalled or failed)
+    FILL_GONE           // its client went away
+} fill_outcome_t;
+
+// What has been published so far, as seen by a follower
+typedef struct {
+    fill_state_t state;
+    int shared;             // followers may be answered from it
+    const char *head;       // head without hop-by-hop headers, ending in the blank line
+    size_t head_len;        // 0 for a raw (non-HTTP) reply
+    int delimited;          // the body ends without the connection being closed
+    size_t body_len;        // body bytes published so far
+} fill_view_t;
+
+// A follower's position in the body blocks
+typedef struct {
+    const void *block;
+    size_t block_start;
+} fill_cursor_t;
+
+#define FILL_WORKER_WORDS ((MAX_WORKERS + 63) / 64)
+
+typedef struct {
+    uint64_t leaders;       // fills started
+    uint64_t followers;     // requests that joined a fill instead of missing
+    uint64_t served;        // followers answered from a fill: backend requests saved
+    uint64_t fallbacks;     // followers that had to fetch on their own
+} fill_stats_t;
+
+/* Join the fill for key, creating it if there is none; *leader is set when
+   the caller created it and must fetch. Followers register worker_id for
+   wakeups. Returns a referenced fill, NULL if out of memory. */
+fill_t *fill_join(const char *key, size_t key_len, int worker_id, int *leader);
+
+/* Start a fill for key unless one is already in flight (then NULL): for a
+   background refresh, which has no client to make wait */
+fill_t *fill_lead(const char *key, size_t key_len);
+
+/* Start a fill nobody can join: it only captures the response for the cache,
+   for a request whose response must not go to other clients */
+fill_t *fill_own(const char *key, size_t key_len);
+
+/* Leader: publish the response head (copied) once it is known. size_hint is
+   the expected body length, 0 if unknown. A fill that is not shareable (the
+   response varies per client) is only the leader's own copy of the response. */
+int fill_publish_head(fill_t *f, const char *head, size_t head_len, int delimited, size_t size_hint,
+                      int shareable);
+
+/* Leader: append body bytes; -1 (and the fill fails) past CACHE_MAX_OBJECT_SIZE */
+int fill_append(fill_t *f, const char *data, size_t len);
+
+/* Leader: the response is complete (ok) or the fetch failed */
+void fill_finish(fill_t *f, int ok);
+
+/* Snapshot of what is published */
+void fill_view(fill_t *f, fill_view_t *v);
+
+/* Describe body bytes [off, end) as up to max iovecs, advancing cur; returns the count */
+int fill_body_iov(fill_t *f, fill_cursor_t *cur, size_t off, size_t end, struct iovec *iov, int max);
+
+/* Copy a complete fill into a new cache object behind the given head */
+cache_object_t *fill_to_object(fill_t *f, const char *head, size_t head_len);
+
+/* Workers with followers to wake after the fill progressed (bit per worker id) */
+void fill_waiters(fill_t *f, uint64_t mask[FILL_WORKER_WORDS]);
+
+/* Follower: stop following (counts the outcome) */
+void fill_unfollow(fill_t *f, fill_outcome_t how);
+
+/* Drop a reference */
+void fill_release(fill_t *f);
+
+void fill_get_stats(fill_stats_t *stats);
+
+#endif // FILL_H
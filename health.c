@@ -0,0 +1,257 @@
+#include "health.h"
+#include "upstream_pool.h"
+#include "timer_wheel.h"
+#include "config.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+health_config_t health_config = {
+    .interval_ms = DEFAULT_HEALTH_INTERVAL_MS,
+    .timeout_ms = DEFAULT_HEALTH_TIMEOUT_MS,
+    .path = NULL,
+    .unhealthy_threshold = DEFAULT_HEALTH_UNHEALTHY,
+    .healthy_threshold = DEFAULT_HEALTH_HEALTHY,
+    .eject_failures = DEFAULT_EJECT_FAILURES,
+    .eject_error_percent = DEFAULT_EJECT_ERROR_PERCENT,
+    .eject_min_requests = DEFAULT_EJECT_MIN_REQUESTS,
+    .eject_base_ms = DEFAULT_EJECT_BASE_MS,
+    .eject_max_ms = DEFAULT_EJECT_MAX_MS,
+};
+
+// Error rates are measured over windows of this length.
+#define HEALTH_WINDOW_MS 10000
+
+// Shared by all workers. Successes only touch atomics (and skip the store
+// when there is nothing to reset); the lock is taken to eject a backend.
+typedef struct {
+    atomic_int active_down;         // set by failed probes
+    atomic_uint_fast64_t ejected_until;
+    atomic_int consecutive_failures;
+    atomic_uint window_requests;
+    atomic_uint window_failures;
+    pthread_mutex_t lock;
+    int ejections;                  // in a row; sets the next ejection's length
+} backend_health_t;
+
+static backend_health_t health[MAX_SERVERS] = {
+    [0 ... MAX_SERVERS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+int health_rank(int backend, uint64_t now_ms) {
+    backend_health_t *h = &health[backend];
+    if (atomic_load_explicit(&h->active_down, memory_order_relaxed) ||
+        now_ms < atomic_load_explicit(&h->ejected_until, memory_order_relaxed))
+        return 0;
+    return atomic_load_explicit(&h->consecutive_failures, memory_order_relaxed) ? 1 : 2;
+}
+
+static void eject(int backend, int run, unsigned requests, unsigned failures) {
+    backend_health_t *h = &health[backend];
+    uint64_t now = timer_now_ms();
+    pthread_mutex_lock(&h->lock);
+    // Requests that were in flight when it was ejected fail as well.
+    if (now >= atomic_load_explicit(&h->ejected_until, memory_order_relaxed)) {
+        int shift = h->ejections < 16 ? h->ejections : 16;
+        uint64_t ms = (uint64_t)health_config.eject_base_ms << shift;
+        if (ms > (uint64_t)health_config.eject_max_ms)
+            ms = health_config.eject_max_ms;
+        h->ejections++;
+        atomic_store_explicit(&h->ejected_until, now + ms, memory_order_relaxed);
+        atomic_store_explicit(&h->consecutive_failures, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->window_requests, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->window_failures, 0, memory_order_relaxed);
+        LOG_WARN("[Proxy] Backend %s:%d ejected for %llu ms (%d failures in a row, %u of %u requests failed)",
+                 backend_pool[backend].ip, backend_pool[backend].port, (unsigned long long)ms,
+                 run, failures, requests);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+void health_report(int backend, int ok) {
+    backend_health_t *h = &health[backend];
+    unsigned requests = atomic_fetch_add_explicit(&h->window_requests, 1, memory_order_relaxed) + 1;
+    if (ok) {
+        if (atomic_load_explicit(&h->consecutive_failures, memory_order_relaxed) != 0)
+            atomic_store_explicit(&h->consecutive_failures, 0, memory_order_relaxed);
+        return;
+    }
+    unsigned failures = atomic_fetch_add_explicit(&h->window_failures, 1, memory_order_relaxed) + 1;
+    int run = atomic_fetch_add_explicit(&h->consecutive_failures, 1, memory_order_relaxed) + 1;
+    if ((health_config.eject_failures > 0 && run >= health_config.eject_failures) ||
+        (health_config.eject_error_percent > 0 && requests >= (unsigned)health_config.eject_min_requests &&
+         failures * 100 >= requests * (unsigned)health_config.eject_error_percent))
+        eject(backend, run, requests, failures);
+}
+
+typedef enum {
+    PROBE_IDLE,
+    PROBE_CONNECTING,
+    PROBE_AWAIT_STATUS,
+} probe_state_t;
+
+// One probe per backend, run by a single worker. Registered with epoll with
+// data.ptr pointing into this array, which is how its events are told apart.
+typedef struct {
+    int fd;
+    probe_state_t state;
+    uint64_t next_at;           // when to start the next probe
+    uint64_t deadline;          // when the running probe fails
+    int passes;                 // in a row
+    int fails;
+    size_t got;
+    char status[16];            // start of the response: "HTTP/1.x NNN"
+} probe_t;
+
+static probe_t probes[MAX_SERVERS];
+static int probes_ready;
+static uint64_t window_end;
+
+static void probe_finish(int backend, int ok, uint64_t now) {
+    probe_t *p = &probes[backend];
+    backend_health_t *h = &health[backend];
+    if (p->fd >= 0)
+        close(p->fd);
+    p->fd = -1;
+    p->state = PROBE_IDLE;
+    p->next_at = now + health_config.interval_ms;
+    int down = atomic_load_explicit(&h->active_down, memory_order_relaxed);
+    if (ok) {
+        p->fails = 0;
+        atomic_store_explicit(&h->consecutive_failures, 0, memory_order_relaxed);
+        if (down && ++p->passes >= health_config.healthy_threshold) {
+            atomic_store_explicit(&h->active_down, 0, memory_order_relaxed);
+            LOG_INFO("[Proxy] Backend %s:%d passed its health checks, back in rotation",
+                     backend_pool[backend].ip, backend_pool[backend].port);
+        }
+    } else {
+        p->passes = 0;
+        if (!down && ++p->fails >= health_config.unhealthy_threshold) {
+            atomic_store_explicit(&h->active_down, 1, memory_order_relaxed);
+            LOG_WARN("[Proxy] Backend %s:%d failed %d health checks, taken out of rotation",
+             backend_pool[backend].ip, backend_pool[backend].port, p->fails);
+        }
+    }
+}
+
+static void probe_start(int epoll_fd, int backend, uint64_t now) {
+    probe_t *p = &probes[backend];
+    p->fd = upstream_connect(backend);
+    if (p->fd < 0) {
+        probe_finish(backend, 0, now);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = p };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+        LOG_ERRNO("epoll_ctl: probe");
+        probe_finish(backend, 0, now);
+        return;
+    }
+    p->state = PROBE_CONNECTING;
+    p->deadline = now + health_config.timeout_ms;
+    p->got = 0;
+}
+
+int64_t health_probe_tick(int epoll_fd, uint64_t now_ms) {
+    if (!probes_ready) {
+        for (int b = 0; b < MAX_SERVERS; b++)
+            probes[b].fd = -1;
+        window_end = now_ms + HEALTH_WINDOW_MS;
+        probes_ready = 1;
+    }
+    if (now_ms >= window_end) {
+        for (int b = 0; b < backend_count; b++) {
+            backend_health_t *h = &health[b];
+            atomic_store_explicit(&h->window_requests, 0, memory_order_relaxed);
+            atomic_store_explicit(&h->window_failures, 0, memory_order_relaxed);
+            // Failure streaks end with the window too, or a backend that
+            // failed once would rank behind the others for good.
+            atomic_store_explicit(&h->consecutive_failures, 0, memory_order_relaxed);
+            // A backend that stayed in rotation for a whole window starts
+            // over at the shortest ejection.
+            pthread_mutex_lock(&h->lock);
+            if (h->ejections > 0 &&
+                now_ms >= atomic_load_explicit(&h->ejected_until, memory_order_relaxed) + HEALTH_WINDOW_MS)
+                h->ejections = 0;
+            pthread_mutex_unlock(&h->lock);
+        }
+        window_end = now_ms + HEALTH_WINDOW_MS;
+    }
+    uint64_t next = window_end;
+    if (health_config.interval_ms > 0) {
+        for (int b = 0; b < backend_count; b++) {
+            probe_t *p = &probes[b];
+            if (p->state == PROBE_IDLE && now_ms >= p->next_at)
+                probe_start(epoll_fd, b, now_ms);
+            else if (p->state != PROBE_IDLE && now_ms >= p->deadline)
+                probe_finish(b, 0, now_ms);
+            uint64_t at = p->state == PROBE_IDLE ? p->next_at : p->deadline;
+            if (at < next)
+                next = at;
+        }
+    }
+    return next > now_ms ? (int64_t)(next - now_ms) : 0;
+}
+
+// Send the probe request once connected; returns -1 on failure.
+static int probe_send(int epoll_fd, probe_t *p) {
+    int backend = (int)(p - probes);
+    char req[512];
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: proxy-health-check\r\nConnection: close\r\n\r\n",
+                       health_config.path, backend_pool[backend].ip, backend_pool[backend].port);
+    if (len < 0 || len >= (int)sizeof(req) || send(p->fd, req, len, MSG_NOSIGNAL) != len)
+        return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = p };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p->fd, &ev) < 0)
+        return -1;
+    p->state = PROBE_AWAIT_STATUS;
+    return 0;
+}
+
+int health_probe_event(int epoll_fd, void *ptr, uint32_t events, uint64_t now_ms) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr < (uintptr_t)probes || addr >= (uintptr_t)(probes + MAX_SERVERS))
+        return 0;
+    probe_t *p = ptr;
+    int backend = (int)(p - probes);
+    if (p->state == PROBE_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            probe_finish(backend, 0, now_ms);
+            return 1;
+        }
+        if (!health_config.path)
+            probe_finish(backend, 1, now_ms);
+        else if (probe_send(epoll_fd, p) < 0)
+            probe_finish(backend, 0, now_ms);
+        return 1;
+    }
+    if (p->state != PROBE_AWAIT_STATUS)
+        return 1;
+    while (p->got < 12) {
+        ssize_t n = recv(p->fd, p->status + p->got, sizeof(p->status) - p->got, 0);
+        if (n > 0) {
+            p->got += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !(events & (EPOLLERR | EPOLLHUP)))
+            return 1;
+        break;
+    }
+    // Healthy if it answers 2xx or 3xx.
+    int ok = p->got >= 12 && memcmp(p->status, "HTTP/1.", 7) == 0 &&
+             (p->status[9] == '2' || p->status[9] == '3');
+    probe_finish(backend, ok, now_ms);
+    return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+#include "backend_servers.h"
+
+// Backend health, shared by all workers. A backend is taken out of
+// rotation when active probes fail (until they pass again) or when the
+// traffic it serves fails too often: it is then ejected for a time that
+// doubles with every ejection in a row.
+typedef struct {
+    int interval_ms;            // between active probes of a backend, 0 = no probes
+    int timeout_ms;             // for a probe to connect (and answer)
+    const char *path;           // probe with GET path and expect 2xx/3xx; NULL = TCP connect only
+    int unhealthy_threshold;    // failed probes in a row that mark a backend down
+    int healthy_threshold;      // passed probes in a row that mark it up again
+    int eject_failures;         // failed requests in a row that eject a backend
+    int eject_error_percent;    // or this share of failed requests within a window...
+    int eject_min_requests;     // ...of at least this many requests
+    int eject_base_ms;          // first ejection; doubled for each further one
+    int eject_max_ms;
+} health_config_t;
+
+extern health_config_t health_config;
+
+/* How eligible backend is for requests at now_ms (monotonic ms): 0 = out of
+   rotation, 1 = in rotation but its last request failed, 2 = healthy */
+int health_rank(int backend, uint64_t now_ms);
+
+/* Record how a request to backend went: ok = it answered below 500; a
+   refused or timed out connect, a reset before the response or a 5xx
+   is a failure */
+void health_report(int backend, int ok);
+
+/* Periodic work, driven by one worker's event loop: start the probes that
+   are due, time out overdue ones and roll the error-rate window over.
+   Returns ms until the next call is needed. */
+int64_t health_probe_tick(int epoll_fd, uint64_t now_ms);
+
+/* Handle an epoll event if ptr belongs to a probe (returns 1), otherwise 0 */
+int health_probe_event(int epoll_fd, void *ptr, uint32_t events, uint64_t now_ms);
+
+#endif // HEALTH_H
@@ -0,0 +1,141 @@
+#include "hedge.h"
+#include <stdatomic.h>
+#include <time.h>
+
+// Log-linear buckets: exact below 8 us, then 8 buckets per power of two
+// (within 12.5%), up to 2^40 us.
+#define SUB_BUCKETS 8
+#define HIST_BUCKETS (SUB_BUCKETS * 39)
+
+// Fewer samples than this give no usable high percentile.
+#define MIN_SAMPLES 50
+
+typedef struct {
+    atomic_ulong counts[HIST_BUCKETS];
+} latency_hist_t;
+
+static latency_hist_t served_hist;      // hedging on
+static latency_hist_t held_hist;        // held out
+static atomic_llong delay_us = -1;
+static atomic_ulong n_eligible, n_hedged, n_won, n_held_out, n_denied;
+static int updates;
+
+static int bucket_of(uint64_t us) {
+    if (us < SUB_BUCKETS)
+        return (int)us;
+    int e = 63 - __builtin_clzll(us);  // >= 3
+    int b = (e - 2) * SUB_BUCKETS + (int)((us >> (e - 3)) & (SUB_BUCKETS - 1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// Upper end of a bucket, so percentiles err on the slow side.
+static uint64_t bucket_top(int b) {
+    if (b < SUB_BUCKETS)
+        return (uint64_t)b;
+    int e = b / SUB_BUCKETS + 2;
+    uint64_t sub = b % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (e - 3)) - 1;
+}
+
+void hedge_record(uint64_t latency_us, int held_out) {
+    latency_hist_t *h = held_out ? &held_hist : &served_hist;
+    atomic_fetch_add_explicit(&h->counts[bucket_of(latency_us)], 1, memory_order_relaxed);
+}
+
+static uint64_t hist_total(latency_hist_t *h) {
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        total += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+    return total;
+}
+
+static uint64_t hist_percentile(latency_hist_t *h, uint64_t total, int percentile) {
+    if (total == 0)
+        return 0;
+    uint64_t rank = (total * percentile + 99) / 100, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+        if (seen >= rank)
+            return bucket_top(b);
+    }
+    return bucket_top(HIST_BUCKETS - 1);
+}
+
+static void hist_halve(latency_hist_t *h) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        unsigned long c = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+        if (c)
+            atomic_fetch_sub_explicit(&h->counts[b], (c + 1) / 2, memory_order_relaxed);
+    }
+}
+
+static inline uint64_t next_random(void) {
+    static __thread uint64_t state;
+    if (state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        state = ((uint64_t)ts.tv_nsec ^ (uintptr_t)&state) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+int hedge_admit(int holdout_percent) {
+    atomic_fetch_add_explicit(&n_eligible, 1, memory_order_relaxed);
+    if (holdout_percent > 0 && (int)(next_random() % 100) < holdout_percent) {
+        atomic_fetch_add_explicit(&n_held_out, 1, memory_order_relaxed);
+        return 1;
+    }
+    return 0;
+}
+
+void hedge_count_hedged(void) {
+    atomic_fetch_add_explicit(&n_hedged, 1, memory_order_relaxed);
+}
+
+void hedge_count_won(void) {
+    atomic_fetch_add_explicit(&n_won, 1, memory_order_relaxed);
+}
+
+void hedge_count_denied(void) {
+    atomic_fetch_add_explicit(&n_denied, 1, memory_order_relaxed);
+}
+
+int64_t hedge_delay_us(void) {
+    return atomic_load_explicit(&delay_us, memory_order_relaxed);
+}
+
+// The held-out requests show latency without hedging, which is what the
+// delay should be a percentile of; until there are enough of them (or with
+// no holdout) the hedged requests stand in.
+void hedge_update(int percentile, int min_delay_ms) {
+    uint64_t held = hist_total(&held_hist), served = hist_total(&served_hist);
+    int64_t d = -1;
+    if (held >= MIN_SAMPLES)
+        d = (int64_t)hist_percentile(&held_hist, held, percentile);
+    else if (served >= MIN_SAMPLES)
+        d = (int64_t)hist_percentile(&served_hist, served, percentile);
+    if (d >= 0 && d < (int64_t)min_delay_ms * 1000)
+        d = (int64_t)min_delay_ms * 1000;
+    atomic_store_explicit(&delay_us, d, memory_order_relaxed);
+    if (++updates % 10 == 0) {
+        hist_halve(&held_hist);
+        hist_halve(&served_hist);
+    }
+}
+
+void hedge_get_stats(hedge_stats_t *out) {
+    out->eligible = atomic_load_explicit(&n_eligible, memory_order_relaxed);
+    out->hedged = atomic_load_explicit(&n_hedged, memory_order_relaxed);
+    out->won = atomic_load_explicit(&n_won, memory_order_relaxed);
+    out->held_out = atomic_load_explicit(&n_held_out, memory_order_relaxed);
+    out->budget_denied = atomic_load_explicit(&n_denied, memory_order_relaxed);
+    out->delay_us = hedge_delay_us();
+    uint64_t served = hist_total(&served_hist), held = hist_total(&held_hist);
+    out->p50_us = hist_percentile(&served_hist, served, 50);
+    out->p99_us = hist_percentile(&served_hist, served, 99);
+    out->held_p50_us = hist_percentile(&held_hist, held, 50);
+    out->held_p99_us = hist_percentile(&held_hist, held, 99);
+}
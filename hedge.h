@@ -0,0 +1,43 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdint.h>
+
+// Latency bookkeeping for hedged requests: when a backend has not started
+// answering a GET within a high percentile of recent first-byte latencies,
+// the proxy sends the same request to a second backend and keeps whichever
+// answers first. A few eligible requests are held out of hedging, so the
+// stats compare tails with and without it on the same traffic.
+typedef struct {
+    uint64_t eligible;          // requests that could have been hedged
+    uint64_t hedged;            // ... that were
+    uint64_t won;               // ... and answered first by the second backend
+    uint64_t held_out;          // ... never hedged, for comparison
+    uint64_t budget_denied;     // hedges skipped for lack of budget
+    int64_t delay_us;           // current hedge delay, -1 if not known yet
+    uint64_t p50_us, p99_us;                 // first byte, hedging on
+    uint64_t held_p50_us, held_p99_us;       // first byte, held out
+} hedge_stats_t;
+
+/* Record how long a request waited for its first response byte, counted
+   from the first backend being picked */
+void hedge_record(uint64_t latency_us, int held_out);
+
+/* Count an eligible request and decide whether it is held out (1) */
+int hedge_admit(int holdout_percent);
+
+void hedge_count_hedged(void);
+void hedge_count_won(void);
+void hedge_count_denied(void);
+
+/* Delay after which to hedge, in us, or -1 while too few latencies are known */
+int64_t hedge_delay_us(void);
+
+/* Recompute the delay as the given percentile of recent first-byte
+   latencies (at least min_delay_ms). Called about once a second by one
+   worker; every tenth call also ages old samples out. */
+void hedge_update(int percentile, int min_delay_ms);
+
+void hedge_get_stats(hedge_stats_t *out);
+
+#endif // HEDGE_H
@@ -0,0 +1,87 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+// Log-linear latency histogram in the style of HdrHistogram: exact below
+// HIST_SUB_BUCKETS, then HIST_SUB_BUCKETS buckets per power of two, so a
+// quantile is within 1/16 of the true value. Values are nanoseconds up to
+// 2^HIST_MAX_EXP (18 minutes); larger ones land in the last bucket.
+#define HIST_SUB_BUCKETS 16
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * (HIST_MAX_EXP - 2))
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+// One thread records and another may read meanwhile, so slots go through
+// relaxed atomics (plain moves on x86, no locked instructions).
+static inline void hist_add(uint64_t *slot, uint64_t n) {
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t hist_load(const uint64_t *slot) {
+    return __atomic_load_n(slot, __ATOMIC_RELAXED);
+}
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS)
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);  // >= 4
+    int b = (e - 3) * HIST_SUB_BUCKETS + (int)((v >> (e - 4)) & (HIST_SUB_BUCKETS - 1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// Upper end of a bucket, so quantiles err on the slow side.
+static inline uint64_t hist_bucket_top(int b) {
+    if (b < HIST_SUB_BUCKETS)
+        return (uint64_t)b;
+    int e = b / HIST_SUB_BUCKETS + 3;
+    uint64_t sub = b % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (e - 4)) - 1;
+}
+
+static inline void hist_record(hist_t *h, uint64_t v) {
+    hist_add(&h->buckets[hist_bucket(v)], 1);
+    hist_add(&h->sum, v);
+    hist_add(&h->count, 1);
+    if (v > hist_load(&h->max))
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* Add h to into (into must not be recorded to meanwhile) */
+static inline void hist_merge(hist_t *into, const hist_t *h) {
+    into->count += hist_load(&h->count);
+    into->sum += hist_load(&h->sum);
+    uint64_t max = hist_load(&h->max);
+    if (max > into->max)
+        into->max = max;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        into->buckets[b] += hist_load(&h->buckets[b]);
+}
+
+/* Value at quantile q (0..1) of a histogram nobody records to, 0 if empty */
+static inline uint64_t hist_quantile(const hist_t *h, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        total += h->buckets[b];
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * total + 0.5), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t top = hist_bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif // HIST_H
@@ -0,0 +1,823 @@
+#define _GNU_SOURCE
+#include "http.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stddef.h>
+
+enum {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER_START_LF,
+    CHUNK_TRAILER_LINE
+};
+
+// Header fields that decide framing and connection reuse
+typedef struct {
+    int64_t content_length;     // -1 if absent
+    int chunked;
+    int conn_close;
+    int conn_keep_alive;
+} http_fields_t;
+
+static const char *find_head_end(const char *buf, size_t len) {
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    return end ? end + 4 : NULL;
+}
+
+static int value_has_token(const char *v, const char *eol, const char *token) {
+    size_t tlen = strlen(token);
+    while (v < eol) {
+        while (v < eol && (*v == ' ' || *v == '\t' || *v == ','))
+            v++;
+        const char *start = v;
+        while (v < eol && *v != ',' && *v != ' ' && *v != '\t' && *v != '\r')
+            v++;
+        if ((size_t)(v - start) == tlen && strncasecmp(start, token, tlen) == 0)
+            return 1;
+        while (v < eol && *v != ',')
+            v++;
+    }
+    return 0;
+}
+
+// Whether the last element of a comma-separated list is token: the final
+// transfer coding is the one that frames the body.
+static int value_ends_with(const char *v, const char *eol, const char *token) {
+    const char *start = eol;
+    while (start > v && start[-1] != ',')
+        start--;
+    while (start < eol && (*start == ' ' || *start == '\t'))
+        start++;
+    while (eol > start && (eol[-1] == ' ' || eol[-1] == '\t' || eol[-1] == '\r'))
+        eol--;
+    size_t tlen = strlen(token);
+    return (size_t)(eol - start) == tlen && strncasecmp(start, token, tlen) == 0;
+}
+
+// Scan header lines between the first line and the blank line.
+static void parse_fields(const char *line, const char *head_end, http_fields_t *f) {
+    f->content_length = -1;
+    f->chunked = 0;
+    f->conn_close = 0;
+    f->conn_keep_alive = 0;
+    while (line < head_end) {
+        const char *eol = memchr(line, '\n', head_end - line);
+        if (!eol)
+            break;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            f->content_length = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            f->chunked = value_ends_with(line + 18, eol, "chunked");
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            f->conn_close |= value_has_token(line + 11, eol, "close");
+            f->conn_keep_alive |= value_has_token(line + 11, eol, "keep-alive");
+        }
+        line = eol + 1;
+    }
+}
+
+static int keep_alive_for(int version_minor, const http_fields_t *f) {
+    if (version_minor >= 1)
+        return !f->conn_close;
+    return f->conn_keep_alive && !f->conn_close;
+}
+
+int http_looks_like_request(const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == ' ')
+            return i > 0;
+        if (buf[i] < 'A' || buf[i] > 'Z' || i >= 16)
+            return 0;
+    }
+    return 1;  // undecided yet: only method characters so far
+}
+
+// Delimiter scanning. A request head is walked line by line; each step
+// looks for the next control character other than HTAB, which is either
+// the CR/LF ending the line or a byte that makes the request malformed.
+typedef const char *(*find_ctl_fn)(const char *p, const char *end);
+
+static const char *find_ctl_scalar(const char *p, const char *end) {
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c < 0x20 && c != '\t') || c == 0x7f)
+            return p;
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_HAVE_SIMD 1
+
+// PCMPESTRI in ranges mode: 16 bytes per step against 0x00-0x08, 0x0a-0x1f, 0x7f.
+__attribute__((target("sse4.2")))
+static const char *find_ctl_sse42(const char *p, const char *end) {
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int i = _mm_cmpestri(ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+        p += 16;
+    }
+    return find_ctl_scalar(p, end);
+}
+
+// 32 bytes per step: min(v, 0x1f) == v flags v <= 0x1f, tabs are masked
+// back out and DEL added.
+__attribute__((target("avx2")))
+static const char *find_ctl_avx2(const char *p, const char *end) {
+    const __m256i ctl_max = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl_max), v);
+        ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+        ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(ctl);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_ctl_scalar(p, end);
+}
+#endif
+
+// Set once by http_parser_init() before the workers start.
+static find_ctl_fn find_ctl = find_ctl_scalar;
+static const char *find_ctl_name = "scalar";
+
+int http_parser_use(const char *impl) {
+    if (strcmp(impl, "scalar") == 0) {
+        find_ctl = find_ctl_scalar;
+        find_ctl_name = "scalar";
+        return 0;
+    }
+#ifdef HTTP_HAVE_SIMD
+    __builtin_cpu_init();
+    if (strcmp(impl, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        find_ctl = find_ctl_avx2;
+        find_ctl_name = "avx2";
+        return 0;
+    }
+    if (strcmp(impl, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+        find_ctl = find_ctl_sse42;
+        find_ctl_name = "sse4.2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void http_parser_init(void) {
+    if (http_parser_use("avx2") < 0 && http_parser_use("sse4.2") < 0)
+        http_parser_use("scalar");
+}
+
+const char *http_parser_impl(void) {
+    return find_ctl_name;
+}
+
+// Returns the LF ending the line that starts at p, NULL if the line is not
+// complete yet (*bad stays 0) or contains a stray control character (*bad = 1).
+static const char *line_end(const char *p, const char *end, int *bad) {
+    p = find_ctl(p, end);
+    if (p == end)
+        return NULL;
+    if (*p == '\n')
+        return p;
+    if (*p == '\r') {
+        if (p + 1 == end)
+            return NULL;
+        if (p[1] == '\n')
+            return p + 1;
+    }
+    *bad = 1;
+    return NULL;
+}
+
+static int parse_request_line(const char *buf, const char *line, const char *stop, http_request_t *req) {
+    const char *sp = memchr(line, ' ', stop - line);
+    if (!sp || sp == line)
+        return -1;
+    const char *target = sp + 1;
+    const char *sp2 = memchr(target, ' ', stop - target);
+    if (!sp2 || sp2 == target)
+        return -1;
+    const char *version = sp2 + 1;
+    if (stop - version != 8 || memcmp(version, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)version[7]))
+        return -1;
+    req->is_get = (sp - line == 3 && memcmp(line, "GET", 3) == 0);
+    req->is_head = (sp - line == 4 && memcmp(line, "HEAD", 4) == 0);
+    size_t method_len = sp - line;
+    req->idempotent = req->is_get || req->is_head ||
+                      (method_len == 3 && memcmp(line, "PUT", 3) == 0) ||
+                      (method_len == 6 && memcmp(line, "DELETE", 6) == 0) ||
+                      (method_len == 7 && memcmp(line, "OPTIONS", 7) == 0) ||
+                      (method_len == 5 && memcmp(line, "TRACE", 5) == 0);
+    req->version_minor = version[7] - '0';
+    req->target_off = (uint32_t)(target - buf);
+    req->target_len = (uint32_t)(sp2 - target);
+    return 0;
+}
+
+static int parse_header_line(const char *buf, const char *line, const char *stop, http_request_t *req) {
+    if (*line == ' ' || *line == '\t')
+        return -1;  // obsolete line folding
+    const char *colon = memchr(line, ':', stop - line);
+    if (!colon || colon == line || memchr(line, ' ', colon - line) || memchr(line, '\t', colon - line))
+        return -1;
+    const char *value = colon + 1;
+    while (value < stop && (*value == ' ' || *value == '\t'))
+        value++;
+    const char *value_end = stop;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        value_end--;
+    if (req->header_count == HTTP_MAX_HEADERS || colon - line > UINT16_MAX || value_end - value > UINT16_MAX)
+        return -1;
+    http_header_t *h = &req->headers[req->header_count++];
+    h->name_off = (uint32_t)(line - buf);
+    h->name_len = (uint16_t)(colon - line);
+    h->value_off = (uint32_t)(value - buf);
+    h->value_len = (uint16_t)(value_end - value);
+    return 0;
+}
+
+static int header_is(const char *buf, const http_header_t *h, const char *name, size_t name_len) {
+    return h->name_len == name_len && strncasecmp(buf + h->name_off, name, name_len) == 0;
+}
+
+static int parse_content_length(const char *v, size_t len, int64_t *out) {
+    if (len == 0 || len > 18)
+        return -1;
+    int64_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)v[i]))
+            return -1;
+        n = n * 10 + (v[i] - '0');
+    }
+    *out = n;
+    return 0;
+}
+
+// All header lines are in: derive framing, keep-alive and Host.
+static int finish_request(const char *buf, http_request_t *req) {
+    http_fields_t f = {.content_length = -1};
+    int have_te = 0;
+    for (int i = 0; i < req->header_count; i++) {
+        const http_header_t *h = &req->headers[i];
+        const char *v = buf + h->value_off;
+        const char *v_end = v + h->value_len;
+        if (header_is(buf, h, "Content-Length", 14)) {
+            int64_t n;
+            // Conflicting lengths are how requests get smuggled: refuse them.
+            if (parse_content_length(v, h->value_len, &n) < 0 || (f.content_length >= 0 && n != f.content_length))
+                return -1;
+            f.content_length = n;
+        } else if (header_is(buf, h, "Transfer-Encoding", 17)) {
+            // Only a body whose last coding is chunked can be framed.
+            have_te = 1;
+            f.chunked = value_ends_with(v, v_end, "chunked");
+        } else if (header_is(buf, h, "Connection", 10)) {
+            f.conn_close |= value_has_token(v, v_end, "close");
+            f.conn_keep_alive |= value_has_token(v, v_end, "keep-alive");
+        } else if (header_is(buf, h, "Authorization", 13)) {
+            req->has_authorization = 1;
+        } else if (header_is(buf, h, "Cookie", 6)) {
+            req->has_cookie = 1;
+        } else if (header_is(buf, h, "Range", 5) ||
+                   (h->name_len > 3 && strncasecmp(buf + h->name_off, "If-", 3) == 0)) {
+            req->selective = 1;
+        } else if (header_is(buf, h, "Cache-Control", 13) || header_is(buf, h, "Pragma", 6)) {
+            req->selective |= value_has_token(v, v_end, "no-cache");
+        } else if (header_is(buf, h, "Host", 4)) {
+            if (req->host_len > 0)
+                return -1;
+            req->host_off = h->value_off;
+            req->host_len = h->value_len;
+        }
+    }
+    if (have_te && !f.chunked)
+        return -1;  // a body we cannot frame
+    // Both Transfer-Encoding and Content-Length: a backend that goes by the
+    // length would read the rest of the body as another request (smuggling).
+    if (have_te && f.content_length >= 0)
+        return -1;
+    req->keep_alive = keep_alive_for(req->version_minor, &f);
+    if (f.chunked)
+        http_framer_init(&req->body, HTTP_BODY_CHUNKED, 0);
+    else if (f.content_length > 0)
+        http_framer_init(&req->body, HTTP_BODY_LENGTH, (uint64_t)f.content_length);
+    else
+        http_framer_init(&req->body, HTTP_BODY_NONE, 0);
+    req->has_body = !req->body.done;
+    return 1;
+}
+
+void http_request_init(http_request_t *req) {
+    memset(req, 0, offsetof(http_request_t, headers));
+    http_framer_init(&req->body, HTTP_BODY_NONE, 0);
+}
+
+int http_parse_request(const char *buf, size_t len, http_request_t *req) {
+    if (req->parsed == 0 && !http_looks_like_request(buf, len))
+        return -1;
+    const char *end = buf + len;
+    const char *line = buf + req->parsed;
+    while (line < end) {
+        int bad = 0;
+        const char *eol = line_end(line, end, &bad);
+        if (!eol)
+            return bad ? -1 : 0;
+        const char *stop = eol > line && eol[-1] == '\r' ? eol - 1 : eol;
+        int r;
+        if (req->parsed == 0)
+            r = parse_request_line(buf, line, stop, req);
+        else if (stop == line)
+            r = 1;  // blank line: end of the head
+        else
+            r = parse_header_line(buf, line, stop, req);
+        if (r < 0)
+            return -1;
+        line = eol + 1;
+        req->parsed = line - buf;
+        if (r == 1) {
+            req->head_len = req->parsed;
+            return finish_request(buf, req);
+        }
+    }
+    return 0;
+}
+
+const char *http_request_header(const char *buf, const http_request_t *req, const char *name, size_t *value_len) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < req->header_count; i++) {
+        if (header_is(buf, &req->headers[i], name, name_len)) {
+            *value_len = req->headers[i].value_len;
+            return buf + req->headers[i].value_off;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    char *out;
+    size_t len;
+    size_t cap;
+    int overflow;
+} key_writer_t;
+
+static void key_put(key_writer_t *k, const char *s, size_t n, int lower) {
+    if (k->len + n > k->cap) {
+        k->overflow = 1;
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+        k->out[k->len + i] = lower ? (char)tolower((unsigned char)s[i]) : s[i];
+    k->len += n;
+}
+
+size_t http_cache_key(const char *buf, const http_request_t *req, const char *vary, size_t vary_len,
+                      char *out, size_t out_cap) {
+    key_writer_t k = {out, 0, out_cap, 0};
+    const char *target = buf + req->target_off;
+    size_t target_len = req->target_len;
+    const char *host = buf + req->host_off;
+    size_t host_len = req->host_len;
+    if (target_len > 7 && strncasecmp(target, "http://", 7) == 0) {
+        // Absolute form: the authority in the target wins over Host.
+        const char *authority = target + 7;
+        const char *slash = memchr(authority, '/', target + target_len - authority);
+        host = authority;
+        host_len = (slash ? slash : target + target_len) - authority;
+        target_len = slash ? (size_t)(target + target_len - slash) : 1;
+        target = slash ? slash : "/";
+    }
+    if (host_len > 3 && memcmp(host + host_len - 3, ":80", 3) == 0)
+        host_len -= 3;
+
+    const char *method_end = memchr(buf, ' ', req->target_off);
+    key_put(&k, buf, method_end - buf, 0);
+    key_put(&k, " ", 1, 0);
+    key_put(&k, host, host_len, 1);
+    key_put(&k, target, target_len, 0);
+
+    const char *v = vary;
+    const char *v_end = vary ? vary + vary_len : NULL;
+    while (v && v < v_end) {
+        while (v < v_end && (*v == ' ' || *v == '\t' || *v == ','))
+            v++;
+        const char *name = v;
+        while (v < v_end && *v != ',' && *v != ' ' && *v != '\t')
+            v++;
+        size_t name_len = v - name;
+        if (name_len == 0)
+            continue;
+        if (name_len == 1 && *name == '*')
+            return 0;  // varies on something outside the request
+        size_t value_len = 0;
+        const char *value = NULL;
+        for (int i = 0; i < req->header_count && !value; i++) {
+            if (header_is(buf, &req->headers[i], name, name_len)) {
+                value = buf + req->headers[i].value_off;
+                value_len = req->headers[i].value_len;
+            }
+        }
+        key_put(&k, "\n", 1, 0);
+        key_put(&k, name, name_len, 1);
+        key_put(&k, ":", 1, 0);
+        key_put(&k, value, value_len, 0);
+    }
+    return k.overflow ? 0 : k.len;
+}
+
+const char *http_find_header(const char *head, size_t head_len, const char *name, size_t *value_len) {
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    const char *line = memchr(head, '\n', head_len);  // skip the start line
+    while (line && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            break;
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char *v = line + name_len + 1;
+            const char *v_end = eol > v && eol[-1] == '\r' ? eol - 1 : eol;
+            while (v < v_end && (*v == ' ' || *v == '\t'))
+                v++;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+                v_end--;
+            *value_len = v_end - v;
+            return v;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+// Delta-seconds value of a directive; -1 if it is not a number.
+static int delta_seconds(const char *v, size_t len) {
+    if (len >= 2 && v[0] == '"' && v[len - 1] == '"') {
+        v++;
+        len -= 2;
+    }
+    if (len == 0)
+        return -1;
+    long n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)v[i]))
+            return -1;
+        if (n < 0x7fffffff / 10)
+            n = n * 10 + (v[i] - '0');
+    }
+    return (int)n;
+}
+
+static int directive_is(const char *name, size_t len, const char *expected) {
+    return strlen(expected) == len && strncasecmp(name, expected, len) == 0;
+}
+
+void http_cache_control(const char *head, size_t head_len, http_cache_control_t *cc) {
+    int max_age = -1, s_maxage = -1;
+    cc->no_store = 0;
+    cc->shared_auth = 0;
+    cc->stale_while_revalidate = -1;
+    cc->stale_if_error = -1;
+    const char *end = head + head_len;
+    const char *from = head;
+    size_t len;
+    const char *v;
+    // The directives may be spread over several Cache-Control headers.
+    while ((v = http_find_header(from, end - from, "Cache-Control", &len))) {
+        const char *v_end = v + len;
+        from = v_end;
+        while (v < v_end) {
+            while (v < v_end && (*v == ' ' || *v == '\t' || *v == ','))
+                v++;
+            const char *name = v;
+            while (v < v_end && *v != ',' && *v != '=' && *v != ' ' && *v != '\t')
+                v++;
+            size_t name_len = v - name;
+            const char *arg = NULL;
+            size_t arg_len = 0;
+            if (v < v_end && *v == '=') {
+                arg = ++v;
+                while (v < v_end && *v != ',')
+                    v++;
+                arg_len = v - arg;
+                while (arg_len > 0 && (arg[arg_len - 1] == ' ' || arg[arg_len - 1] == '\t'))
+                    arg_len--;
+            }
+            while (v < v_end && *v != ',')
+                v++;
+            if (directive_is(name, name_len, "no-store") || directive_is(name, name_len, "no-cache") ||
+                directive_is(name, name_len, "private"))
+                cc->no_store = 1;
+            else if (directive_is(name, name_len, "public") || directive_is(name, name_len, "must-revalidate"))
+                cc->shared_auth = 1;
+            else if (arg && directive_is(name, name_len, "max-age"))
+                max_age = delta_seconds(arg, arg_len);
+            else if (arg && directive_is(name, name_len, "s-maxage")) {
+                s_maxage = delta_seconds(arg, arg_len);
+                cc->shared_auth = 1;
+            }
+            else if (arg && directive_is(name, name_len, "stale-while-revalidate"))
+                cc->stale_while_revalidate = delta_seconds(arg, arg_len);
+            else if (arg && directive_is(name, name_len, "stale-if-error"))
+                cc->stale_if_error = delta_seconds(arg, arg_len);
+        }
+    }
+    // A shared cache prefers s-maxage; time spent in caches upstream counts.
+    cc->max_age = s_maxage >= 0 ? s_maxage : max_age;
+    if (cc->max_age >= 0 && (v = http_find_header(head, head_len, "Age", &len))) {
+        int age = delta_seconds(v, len);
+        if (age > 0)
+            cc->max_age = age < cc->max_age ? cc->max_age - age : 0;
+    }
+}
+
+int http_list_has(const char *value, size_t len, const char *token) {
+    const char *v = value;
+    const char *end = value + len;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ','))
+            v++;
+        const char *item = v;
+        while (v < end && *v != ',' && *v != ';' && *v != '=' && *v != ' ' && *v != '\t')
+            v++;
+        if (directive_is(item, v - item, token))
+            return 1;
+        while (v < end && *v != ',')
+            v++;
+    }
+    return 0;
+}
+
+// Whether a qvalue says "not acceptable" (0, 0., 0.0 ...).
+static int qvalue_zero(const char *v, const char *end) {
+    if (v == end || *v != '0')
+        return 0;
+    for (v++; v < end && *v != ',' && *v != ';' && *v != ' ' && *v != '\t'; v++)
+        if (*v != '.' && *v != '0')
+            return 0;
+    return 1;
+}
+
+int http_accepts_gzip(const char *buf, const http_request_t *req) {
+    size_t len;
+    const char *v = http_request_header(buf, req, "Accept-Encoding", &len);
+    if (!v)
+        return 0;
+    const char *end = v + len;
+    int gzip = -1, any = -1;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ','))
+            v++;
+        const char *name = v;
+        while (v < end && *v != ',' && *v != ';' && *v != ' ' && *v != '\t')
+            v++;
+        size_t name_len = v - name;
+        int accepted = 1;
+        while (v < end && *v != ',') {
+            if (*v++ != ';')
+                continue;
+            while (v < end && (*v == ' ' || *v == '\t'))
+                v++;
+            if (end - v >= 2 && (*v == 'q' || *v == 'Q') && v[1] == '=')
+                accepted = !qvalue_zero(v + 2, end);
+        }
+        if (directive_is(name, name_len, "gzip") || directive_is(name, name_len, "x-gzip"))
+            gzip = accepted;
+        else if (directive_is(name, name_len, "*"))
+            any = accepted;
+    }
+    // A named coding overrides the wildcard.
+    return gzip >= 0 ? gzip : any > 0;
+}
+
+int http_parse_response(const char *buf, size_t len, int head_request, http_response_t *resp) {
+    memset(resp, 0, sizeof(*resp));
+    if (len < 5)
+        return memcmp(buf, "HTTP/", len) == 0 ? 0 : -1;
+    if (memcmp(buf, "HTTP/", 5) != 0)
+        return -1;
+    const char *head_end = find_head_end(buf, len);
+    if (!head_end)
+        return 0;
+    const char *eol = memchr(buf, '\n', head_end - buf);
+    if (eol - buf < 12 || buf[5] != '1' || buf[6] != '.' || buf[8] != ' ' ||
+        !isdigit((unsigned char)buf[9]) || !isdigit((unsigned char)buf[10]) || !isdigit((unsigned char)buf[11]))
+        return -1;
+
+    resp->head_len = head_end - buf;
+    resp->version_minor = buf[7] - '0';
+    resp->status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+
+    http_fields_t f;
+    parse_fields(eol + 1, head_end, &f);
+    resp->keep_alive = keep_alive_for(resp->version_minor, &f);
+    if (head_request || resp->status / 100 == 1 || resp->status == 204 || resp->status == 304)
+        http_framer_init(&resp->body, HTTP_BODY_NONE, 0);
+    else if (f.chunked)
+        http_framer_init(&resp->body, HTTP_BODY_CHUNKED, 0);
+    else if (f.content_length >= 0)
+        http_framer_init(&resp->body, HTTP_BODY_LENGTH, (uint64_t)f.content_length);
+    else {
+        http_framer_init(&resp->body, HTTP_BODY_UNTIL_CLOSE, 0);
+        resp->keep_alive = 0;
+    }
+    return 1;
+}
+
+static int is_hop_header(const char *line, size_t len) {
+    return (len >= 11 && strncasecmp(line, "Connection:", 11) == 0) ||
+           (len >= 11 && strncasecmp(line, "Keep-Alive:", 11) == 0) ||
+           (len >= 17 && strncasecmp(line, "Proxy-Connection:", 17) == 0);
+}
+
+size_t http_strip_hop_headers(const char *head, size_t head_len, char *out, size_t out_cap) {
+    const char *line = head;
+    const char *end = head + head_len;
+    size_t out_len = 0;
+    int first = 1;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            break;
+        size_t len = eol + 1 - line;
+        if (len <= 2 && !first)
+            break;  // the blank line ending the head
+        if (first || !is_hop_header(line, len)) {
+            if (out_len + len > out_cap)
+                return 0;
+            memcpy(out + out_len, line, len);
+            out_len += len;
+        }
+        first = 0;
+        line = eol + 1;
+    }
+    return out_len;
+}
+
+void http_framer_init(http_framer_t *f, http_body_mode_t mode, uint64_t content_length) {
+    memset(f, 0, sizeof(*f));
+    f->mode = mode;
+    f->chunk_state = CHUNK_SIZE;
+    if (mode == HTTP_BODY_LENGTH) {
+        f->remaining = content_length;
+        f->done = (content_length == 0);
+    } else if (mode == HTTP_BODY_NONE) {
+        f->done = 1;
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static size_t chunked_consume(http_framer_t *f, const char *buf, size_t len) {
+    size_t i = 0;
+    while (i < len && !f->done && !f->error) {
+        char c = buf[i];
+        switch (f->chunk_state) {
+        case CHUNK_SIZE: {
+            i++;
+            int h = hex_value(c);
+            if (h >= 0) {
+                if (f->chunk_size >> 60) {
+                    f->error = 1;
+                    break;
+                }
+                f->chunk_size = f->chunk_size * 16 + h;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                f->chunk_state = CHUNK_EXT;
+            } else if (c == '\r') {
+                f->chunk_state = CHUNK_SIZE_LF;
+            } else if (c == '\n') {
+                goto size_done;
+            } else {
+                f->error = 1;
+            }
+            break;
+        }
+        case CHUNK_EXT:
+            i++;
+            if (c == '\n')
+                goto size_done;
+            break;
+        case CHUNK_SIZE_LF:
+            i++;
+            if (c != '\n') {
+                f->error = 1;
+                break;
+            }
+        size_done:
+            if (f->chunk_size == 0) {
+                f->chunk_state = CHUNK_TRAILER_START;
+            } else {
+                f->remaining = f->chunk_size;
+                f->chunk_state = CHUNK_DATA;
+            }
+            f->chunk_size = 0;
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i;
+            if (n > f->remaining)
+                n = (size_t)f->remaining;
+            f->remaining -= n;
+            i += n;
+            if (f->remaining == 0)
+                f->chunk_state = CHUNK_DATA_CR;
+            break;
+        }
+        case CHUNK_DATA_CR:
+            i++;
+            if (c == '\r')
+                f->chunk_state = CHUNK_DATA_LF;
+            else if (c == '\n')
+                f->chunk_state = CHUNK_SIZE;
+            else
+                f->error = 1;
+            break;
+        case CHUNK_DATA_LF:
+            i++;
+            if (c == '\n')
+                f->chunk_state = CHUNK_SIZE;
+            else
+                f->error = 1;
+            break;
+        case CHUNK_TRAILER_START:
+            i++;
+            if (c == '\r')
+                f->chunk_state = CHUNK_TRAILER_START_LF;
+            else if (c == '\n')
+                f->done = 1;
+            else
+                f->chunk_state = CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_START_LF:
+            i++;
+            if (c == '\n')
+                f->done = 1;
+            else
+                f->error = 1;
+            break;
+        case CHUNK_TRAILER_LINE:
+            i++;
+            if (c == '\n')
+                f->chunk_state = CHUNK_TRAILER_START;
+            break;
+        }
+    }
+    return i;
+}
+
+size_t http_framer_consume(http_framer_t *f, const char *buf, size_t len) {
+    if (f->done)
+        return 0;
+    switch (f->mode) {
+    case HTTP_BODY_LENGTH: {
+        size_t n = len < f->remaining ? len : (size_t)f->remaining;
+        f->remaining -= n;
+        f->done = (f->remaining == 0);
+        return n;
+    }
+    case HTTP_BODY_CHUNKED:
+        return chunked_consume(f, buf, len);
+    case HTTP_BODY_UNTIL_CLOSE:
+        return len;
+    default:
+        return 0;
+    }
+}
+
+uint64_t http_framer_opaque_limit(const http_framer_t *f) {
+    if (f->done)
+        return 0;
+    if (f->mode == HTTP_BODY_LENGTH)
+        return f->remaining;
+    if (f->mode == HTTP_BODY_UNTIL_CLOSE)
+        return UINT64_MAX;
+    return 0;
+}
+
+void http_framer_skip(http_framer_t *f, uint64_t n) {
+    if (f->mode == HTTP_BODY_LENGTH) {
+        f->remaining -= n;
+        f->done = (f->remaining == 0);
+    }
+}
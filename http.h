@@ -0,0 +1,138 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// How the end of an HTTP/1.x message body is found
+typedef enum {
+    HTTP_BODY_NONE,         // no body (or Content-Length: 0)
+    HTTP_BODY_LENGTH,       // Content-Length bytes
+    HTTP_BODY_CHUNKED,      // Transfer-Encoding: chunked
+    HTTP_BODY_UNTIL_CLOSE   // response delimited by the server closing the connection
+} http_body_mode_t;
+
+// Tracks a body as it streams past so the relay knows where the message
+// ends without buffering it.
+typedef struct {
+    http_body_mode_t mode;
+    uint64_t remaining;     // LENGTH: bytes left; CHUNKED: bytes left in the current chunk
+    uint64_t chunk_size;    // CHUNKED: size line being parsed
+    int chunk_state;
+    int done;
+    int error;              // malformed chunk framing
+} http_framer_t;
+
+#define HTTP_MAX_HEADERS 64
+
+// A request header as offsets into the buffer the request was parsed from
+typedef struct {
+    uint32_t name_off;
+    uint32_t value_off;
+    uint16_t name_len;
+    uint16_t value_len;     // without surrounding whitespace
+} http_header_t;
+
+typedef struct {
+    size_t head_len;        // request line + headers + blank line
+    size_t parsed;          // bytes of complete lines already parsed (where the next call resumes)
+    int is_get;
+    int is_head;
+    int idempotent;         // GET, HEAD, PUT, DELETE, OPTIONS or TRACE: safe to send again
+    int version_minor;
+    int keep_alive;
+    int has_body;
+    int has_authorization;  // responses to it are private unless the origin says otherwise
+    int has_cookie;
+    int selective;          // Range, If-* or no-cache: the response answers this request alone
+    uint32_t target_off;    // request-target as sent
+    uint32_t target_len;
+    uint32_t host_off;      // Host header value (host_len 0 if absent)
+    uint32_t host_len;
+    int header_count;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    http_framer_t body;
+} http_request_t;
+
+typedef struct {
+    size_t head_len;        // status line + headers + blank line (0 for a non-HTTP reply)
+    int status;             // 0 for a non-HTTP reply relayed as-is
+    int version_minor;
+    int keep_alive;         // the upstream connection may carry another request
+    http_framer_t body;
+} http_response_t;
+
+/* Pick the fastest delimiter scanner this CPU supports (AVX2, SSE4.2 or scalar) */
+void http_parser_init(void);
+
+/* Force a scanner by name ("avx2", "sse4.2", "scalar"); returns -1 if unsupported */
+int http_parser_use(const char *impl);
+
+/* Name of the scanner in use */
+const char *http_parser_impl(void);
+
+/* Prepare req for a new request; required before the first http_parse_request call */
+void http_request_init(http_request_t *req);
+
+/* Parse a request head at the start of buf, resuming where the previous call
+   on the same (growing) buffer stopped. Nothing is allocated; headers are
+   recorded as offsets into buf. Returns 1 when complete, 0 if more bytes are
+   needed, -1 if malformed. */
+int http_parse_request(const char *buf, size_t len, http_request_t *req);
+
+/* Value of the first request header called name (case-insensitive), or NULL */
+const char *http_request_header(const char *buf, const http_request_t *req, const char *name, size_t *value_len);
+
+/* Build the cache key of a parsed request into out: method, lowercased host
+   and request-target, then the value of every request header named in vary
+   (a response's Vary value, NULL if none). Returns the key length, or 0 if
+   the request cannot be keyed (Vary: * or out too small). */
+size_t http_cache_key(const char *buf, const http_request_t *req, const char *vary, size_t vary_len,
+                      char *out, size_t out_cap);
+
+/* Value of the first header called name in a message head, or NULL */
+const char *http_find_header(const char *head, size_t head_len, const char *name, size_t *value_len);
+
+// What a response's Cache-Control headers allow a shared cache to do
+typedef struct {
+    int no_store;               // no-store, no-cache or private: do not cache
+    int shared_auth;            // public, s-maxage or must-revalidate: may answer requests with Authorization
+    int max_age;                // s-maxage, else max-age, less the Age header; -1 if absent
+    int stale_while_revalidate; // seconds it may be served stale while refreshed; -1 if absent
+    int stale_if_error;         // seconds it may be served stale when the backend fails; -1 if absent
+} http_cache_control_t;
+
+/* Read the Cache-Control (and Age) headers of a response head */
+void http_cache_control(const char *head, size_t head_len, http_cache_control_t *cc);
+
+/* Whether a comma-separated header value lists token (case-insensitive;
+   parameters after it are ignored) */
+int http_list_has(const char *value, size_t len, const char *token);
+
+/* Whether the request's Accept-Encoding allows a gzip-encoded response */
+int http_accepts_gzip(const char *buf, const http_request_t *req);
+
+/* Parse a response head; head_request suppresses the body (returns 1, 0 or -1 like http_parse_request) */
+int http_parse_response(const char *buf, size_t len, int head_request, http_response_t *resp);
+
+/* Copy a message head into out without its blank line and without the
+   hop-by-hop Connection, Keep-Alive and Proxy-Connection headers, so the
+   caller can append its own. Returns the copied length, 0 if out is too small. */
+size_t http_strip_hop_headers(const char *head, size_t head_len, char *out, size_t out_cap);
+
+/* Whether buf can still be the start of an HTTP request line ("METHOD ") */
+int http_looks_like_request(const char *buf, size_t len);
+
+/* Set a framer up for a body of the given mode and length */
+void http_framer_init(http_framer_t *f, http_body_mode_t mode, uint64_t content_length);
+
+/* Feed body bytes; returns how many of them belong to the message (the rest is the next message) */
+size_t http_framer_consume(http_framer_t *f, const char *buf, size_t len);
+
+/* Largest number of bytes that may be moved without being inspected (0 if every byte must be parsed) */
+uint64_t http_framer_opaque_limit(const http_framer_t *f);
+
+/* Account for n bytes moved without inspection (n <= http_framer_opaque_limit) */
+void http_framer_skip(http_framer_t *f, uint64_t n);
+
+#endif // HTTP_H
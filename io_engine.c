@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include "io_engine.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// user_data of submissions that are not polls on a slot
+#define UD_SPECIAL (1ULL << 63)
+#define UD_ACCEPT (UD_SPECIAL | 1)
+#define UD_EPOLL (UD_SPECIAL | 2)
+#define UD_IGNORE (UD_SPECIAL | 3)
+
+struct io_poll_slot {
+    void *ptr;
+    int fd;
+    uint32_t gen;               // bumped whenever a poll is cancelled; stale completions differ
+    uint32_t events;
+    uint32_t next;              // free list or re-arm list link (slot + 1)
+    uint8_t live;
+    uint8_t armed;              // a poll is in the kernel
+    uint8_t queued;             // on the re-arm list
+};
+
+static const char *engine_names[] = {
+    [IO_ENGINE_EPOLL] = "epoll",
+    [IO_ENGINE_URING] = "io_uring",
+};
+
+int io_engine_kind(const char *name) {
+    for (int k = 0; k < (int)(sizeof(engine_names) / sizeof(engine_names[0])); k++)
+        if (strcmp(name, engine_names[k]) == 0)
+            return k;
+    return -1;
+}
+
+const char *io_engine_name(io_engine_kind_t kind) {
+    return engine_names[kind];
+}
+
+static int uring_setup(io_engine_t *e) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    e->ring_fd = (int)syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &p);
+    if (e->ring_fd < 0 && errno == EINVAL) {
+        // Older kernel: no optional flags.
+        memset(&p, 0, sizeof(p));
+        e->ring_fd = (int)syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &p);
+    }
+    if (e->ring_fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(e->ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    e->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    e->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (e->cq_ring_size > e->sq_ring_size)
+        e->sq_ring_size = e->cq_ring_size;
+    e->sq_ring = mmap(NULL, e->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      e->ring_fd, IORING_OFF_SQ_RING);
+    if (e->sq_ring == MAP_FAILED) {
+        close(e->ring_fd);
+        return -1;
+    }
+    e->cq_ring = e->sq_ring;  // one mapping for both (IORING_FEAT_SINGLE_MMAP)
+    e->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    e->sqes = mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   e->ring_fd, IORING_OFF_SQES);
+    if (e->sqes == MAP_FAILED) {
+        munmap(e->sq_ring, e->sq_ring_size);
+        close(e->ring_fd);
+        return -1;
+    }
+    char *sq = e->sq_ring, *cq = e->cq_ring;
+    e->sq_head = (unsigned *)(sq + p.sq_off.head);
+    e->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    e->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    e->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    e->cq_head = (unsigned *)(cq + p.cq_off.head);
+    e->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    e->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // Submission slots map to themselves; only the tail moves.
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    return 0;
+}
+
+static int uring_enter(io_engine_t *e, unsigned to_submit, unsigned min_complete, int timeout_ms) {
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        memset(&arg, 0, sizeof(arg));
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    int ret = (int)syscall(__NR_io_uring_enter, e->ring_fd, to_submit, min_complete, flags, argp, argsz);
+    if (ret >= 0) {
+        // With SUBMIT_ALL everything queued was consumed.
+        e->sq_pending -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+    }
+    return ret;
+}
+
+// A free submission entry; hands queued ones to the kernel if the ring is full.
+static struct io_uring_sqe *get_sqe(io_engine_t *e) {
+    unsigned tail = *e->sq_tail;
+    while (tail - __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE) >= *e->sq_entries) {
+        if (uring_enter(e, e->sq_pending, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            LOG_ERRNO("io_uring_enter");
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &e->sqes[tail & *e->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    e->sq_pending++;
+    return sqe;
+}
+
+static inline uint64_t poll_token(uint32_t slot, uint32_t gen) {
+    return ((uint64_t)(gen & 0x7fffffff) << 32) | slot;
+}
+
+static void queue_poll(io_engine_t *e, uint32_t slot) {
+    io_poll_slot_t *s = &e->slots[slot];
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->fd;
+    sqe->poll32_events = s->events;
+    sqe->user_data = poll_token(slot, s->gen);
+    s->armed = 1;
+}
+
+static void queue_poll_remove(io_engine_t *e, uint32_t slot) {
+    io_poll_slot_t *s = &e->slots[slot];
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = poll_token(slot, s->gen);
+        sqe->user_data = UD_IGNORE;
+    }
+    s->armed = 0;
+    s->gen++;
+}
+
+static void queue_accept(io_engine_t *e) {
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = e->listen_fd;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD_ACCEPT;
+    e->accept_armed = 1;
+}
+
+static void queue_epoll(io_engine_t *e) {
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = e->epoll_fd;
+    sqe->poll32_events = EPOLLIN;
+    sqe->user_data = UD_EPOLL;
+    e->epoll_armed = 1;
+}
+
+static uint32_t slot_alloc(io_engine_t *e) {
+    if (!e->free_slot) {
+        uint32_t count = e->slot_count ? e->slot_count * 2 : 1024;
+        io_poll_slot_t *slots = realloc(e->slots, count * sizeof(*slots));
+        if (!slots)
+            return UINT32_MAX;
+        memset(slots + e->slot_count, 0, (count - e->slot_count) * sizeof(*slots));
+        for (uint32_t i = count; i > e->slot_count; i--) {
+            slots[i - 1].next = e->free_slot;
+            e->free_slot = i;
+        }
+        e->slots = slots;
+        e->slot_count = count;
+    }
+    uint32_t slot = e->free_slot - 1;
+    e->free_slot = e->slots[slot].next;
+    return slot;
+}
+
+// Puts the listener back into the epoll set, which the ring polls.
+static void accept_through_epoll(io_engine_t *e) {
+    e->accept_epoll = 1;
+    e->accept_armed = 1;  // never queued again
+    int flags = fcntl(e->listen_fd, F_GETFL, 0);
+    if (flags >= 0 && fcntl(e->listen_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        LOG_ERRNO("fcntl F_SETFL");
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->listen_fd, &ev) < 0)
+        LOG_ERRNO("epoll_ctl: listen_fd");
+}
+
+int io_engine_init(io_engine_t *e, io_engine_kind_t kind, int epoll_fd, int listen_fd) {
+    memset(e, 0, sizeof(*e));
+    e->kind = kind;
+    e->epoll_fd = epoll_fd;
+    e->listen_fd = listen_fd;
+    e->ring_fd = -1;
+    if (kind == IO_ENGINE_EPOLL)
+        return 0;
+    if (uring_setup(e) < 0)
+        return -1;
+    // The listener is served by a multishot accept instead of the epoll set.
+    // It must block: io_uring would fail the accept on a non-blocking
+    // socket with EAGAIN rather than wait for connections.
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL) < 0)
+        LOG_ERRNO("epoll_ctl: listen_fd");
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    if (flags >= 0 && fcntl(listen_fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+        LOG_ERRNO("fcntl F_SETFL");
+    queue_accept(e);
+    queue_epoll(e);
+    return 0;
+}
+
+void io_engine_destroy(io_engine_t *e) {
+    if (e->kind != IO_ENGINE_URING)
+        return;
+    munmap(e->sqes, e->sqes_size);
+    munmap(e->sq_ring, e->sq_ring_size);
+    close(e->ring_fd);
+    free(e->slots);
+}
+
+int io_watch(io_engine_t *e, io_watch_t *wt, int fd, void *ptr, uint32_t events) {
+    if (fd < 0 || (wt->slot && wt->events == events))
+        return 0;
+    if (e->kind == IO_ENGINE_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = ptr;
+        if (epoll_ctl(e->epoll_fd, wt->slot ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+        wt->slot = 1;
+        wt->events = events;
+        return 0;
+    }
+    uint32_t slot;
+    if (wt->slot) {
+        slot = wt->slot - 1;
+        if (e->slots[slot].armed)
+            queue_poll_remove(e, slot);
+    } else {
+        slot = slot_alloc(e);
+        if (slot == UINT32_MAX)
+            return -1;
+        io_poll_slot_t *s = &e->slots[slot];
+        s->fd = fd;
+        s->live = 1;
+        s->armed = 0;
+        s->queued = 0;
+        wt->slot = slot + 1;
+    }
+    io_poll_slot_t *s = &e->slots[slot];
+    s->ptr = ptr;
+    s->events = events;
+    if (events)
+        queue_poll(e, slot);
+    wt->events = events;
+    return 0;
+}
+
+void io_watch_move(io_engine_t *e, io_watch_t *wt, int fd, void *ptr) {
+    if (!wt->slot)
+        return;
+    if (e->kind == IO_ENGINE_URING) {
+        e->slots[wt->slot - 1].ptr = ptr;
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = wt->events;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(e->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        LOG_ERRNO("epoll_ctl");
+}
+
+void io_unwatch(io_engine_t *e, io_watch_t *wt, int fd) {
+    if (!wt->slot)
+        return;
+    if (e->kind == IO_ENGINE_EPOLL) {
+        epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    } else {
+        uint32_t slot = wt->slot - 1;
+        io_poll_slot_t *s = &e->slots[slot];
+        if (s->armed)
+            queue_poll_remove(e, slot);
+        else
+            s->gen++;
+        s->live = 0;
+        s->ptr = NULL;
+        // A slot still on the re-arm list is freed when the list is walked.
+        if (!s->queued) {
+            s->next = e->free_slot;
+            e->free_slot = slot + 1;
+        }
+    }
+    wt->slot = 0;
+    wt->events = 0;
+}
+
+void io_close(io_engine_t *e, io_watch_t *wt, int fd) {
+    if (fd < 0)
+        return;
+    if (e->kind == IO_ENGINE_EPOLL) {
+        // close() also drops the epoll registration.
+        close(fd);
+        wt->slot = 0;
+        wt->events = 0;
+        return;
+    }
+    io_unwatch(e, wt, fd);
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (!sqe) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = UD_IGNORE;
+}
+
+int io_accept(io_engine_t *e, io_event_t *ev) {
+    if (e->kind == IO_ENGINE_EPOLL || e->accept_epoll)
+        return accept4(e->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    int fd = ev->fd;
+    ev->fd = -1;
+    if (fd < 0)
+        errno = EAGAIN;
+    return fd;
+}
+
+// Polls that fired are re-armed only now, after their handlers ran: a
+// one-shot poll reports an fd that is still ready at once, like a
+// level-triggered epoll registration.
+static void rearm(io_engine_t *e) {
+    while (e->rearm_head) {
+        uint32_t slot = e->rearm_head - 1;
+        io_poll_slot_t *s = &e->slots[slot];
+        e->rearm_head = s->next;
+        s->queued = 0;
+        if (!s->live) {
+            s->next = e->free_slot;
+            e->free_slot = slot + 1;
+        } else if (!s->armed && s->events) {
+            queue_poll(e, slot);
+        }
+    }
+    if (!e->accept_armed)
+        queue_accept(e);
+    if (!e->epoll_armed)
+        queue_epoll(e);
+}
+
+static int uring_wait(io_engine_t *e, io_event_t *events, int max, int timeout_ms) {
+    rearm(e);
+    unsigned head = *e->cq_head;
+    int ready = head != __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+    if (!ready || e->sq_pending) {
+        // Hand over everything queued and wait, in one call.
+        if (uring_enter(e, e->sq_pending, ready ? 0 : 1, timeout_ms) < 0 && errno != ETIME && errno != EINTR &&
+            errno != EBUSY)
+            return -1;
+    }
+    int n = 0;
+    unsigned tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max) {
+        struct io_uring_cqe *cqe = &e->cqes[head & *e->cq_mask];
+        uint64_t ud = cqe->user_data;
+        int res = cqe->res;
+        int more = cqe->flags & IORING_CQE_F_MORE;
+        head++;
+        if (ud == UD_IGNORE)
+            continue;
+        if (ud == UD_ACCEPT) {
+            if (!more)
+                e->accept_armed = 0;
+            if (res >= 0) {
+                events[n++] = (io_event_t){ .ptr = NULL, .events = EPOLLIN, .fd = res };
+            } else if (res == -EINVAL && !e->accept_epoll) {
+                // No multishot accept before Linux 5.19
+                LOG_WARN("[Proxy] io_uring cannot accept here, accepting through epoll");
+                accept_through_epoll(e);
+            } else if (res != -ECANCELED) {
+                errno = -res;
+                LOG_ERRNO("accept");
+            }
+            continue;
+        }
+        if (ud == UD_EPOLL) {
+            e->epoll_armed = 0;
+            struct epoll_event ev[64];
+            int room = max - n < 64 ? max - n : 64;
+            int got = room > 0 ? epoll_wait(e->epoll_fd, ev, room, 0) : 0;
+            for (int i = 0; i < got; i++)
+                events[n++] = (io_event_t){ .ptr = ev[i].data.ptr, .events = ev[i].events, .fd = -1 };
+            continue;
+        }
+        uint32_t slot = (uint32_t)ud;
+        uint32_t gen = (uint32_t)(ud >> 32);
+        if (slot >= e->slot_count)
+            continue;
+        io_poll_slot_t *s = &e->slots[slot];
+        if (!s->live || (s->gen & 0x7fffffff) != gen)
+            continue;  // cancelled or re-registered since
+        s->armed = 0;
+        if (!s->queued) {
+            s->queued = 1;
+            s->next = e->rearm_head;
+            e->rearm_head = slot + 1;
+        }
+        if (res > 0)
+            events[n++] = (io_event_t){ .ptr = s->ptr, .events = (uint32_t)res, .fd = -1 };
+    }
+    __atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+int io_wait(io_engine_t *e, io_event_t *events, int max, int timeout_ms) {
+    if (e->kind == IO_ENGINE_URING)
+        return uring_wait(e, events, max, timeout_ms);
+    struct epoll_event ev[max];
+    int nfds = epoll_wait(e->epoll_fd, ev, max, timeout_ms);
+    for (int i = 0; i < nfds; i++)
+        events[i] = (io_event_t){ .ptr = ev[i].data.ptr, .events = ev[i].events, .fd = -1 };
+    return nfds;
+}
@@ -0,0 +1,92 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Readiness notification for one worker, with epoll or io_uring underneath.
+// Both drive the same connection state machine: it is told which fds are
+// readable or writable and does its own reads and writes. With io_uring,
+// interest changes, accepts and closes are queued as submissions and go to
+// the kernel in one io_uring_enter() per loop iteration together with the
+// wait, instead of an epoll_ctl(), accept4() or close() call each. Polls
+// are one-shot and re-armed only after the handlers ran, so readiness is
+// level-triggered as with epoll. Rare registrations (health probes, the
+// wakeup eventfd) stay in the worker's epoll set, which io_uring polls.
+// There are no registered buffers, fixed files or linked submissions: the
+// ring carries no reads or writes they could apply to.
+typedef enum {
+    IO_ENGINE_EPOLL,
+    IO_ENGINE_URING,
+} io_engine_kind_t;
+
+// Submission/completion ring size per worker
+#define IO_URING_ENTRIES 1024
+
+// Interest registered for one fd
+typedef struct {
+    uint32_t events;            // interest currently registered
+    uint32_t slot;              // registered: epoll 1, io_uring poll slot + 1; 0 if not
+} io_watch_t;
+
+typedef struct {
+    void *ptr;                  // as given to io_watch (NULL: the listener)
+    uint32_t events;            // EPOLLIN, EPOLLOUT, EPOLLHUP, EPOLLERR
+    int fd;                     // io_uring: a connection the listener accepted, else -1
+} io_event_t;
+
+typedef struct io_poll_slot io_poll_slot_t;
+
+typedef struct {
+    io_engine_kind_t kind;
+    int epoll_fd;
+    int listen_fd;
+
+    // io_uring only
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_pending;        // queued submissions not yet handed to the kernel
+    io_poll_slot_t *slots;      // poll registrations, indexed by slot
+    uint32_t slot_count;
+    uint32_t free_slot;         // free list head (slot + 1, 0 if empty)
+    uint32_t rearm_head;        // fired polls to re-arm before waiting (slot + 1)
+    int accept_armed;
+    int accept_epoll;           // no multishot accept: the listener is in the epoll set
+    int epoll_armed;
+} io_engine_t;
+
+/* Engine by name ("epoll", "io_uring"), -1 if unknown */
+int io_engine_kind(const char *name);
+const char *io_engine_name(io_engine_kind_t kind);
+
+/* Set up e on the worker's epoll set and listener (returns 0, -1 if the
+   kind is not available here; e is then unusable) */
+int io_engine_init(io_engine_t *e, io_engine_kind_t kind, int epoll_fd, int listen_fd);
+void io_engine_destroy(io_engine_t *e);
+
+/* Register fd, or change its interest, with ptr reported on its events */
+int io_watch(io_engine_t *e, io_watch_t *wt, int fd, void *ptr, uint32_t events);
+
+/* Report fd's events with a different ptr from now on */
+void io_watch_move(io_engine_t *e, io_watch_t *wt, int fd, void *ptr);
+
+/* Drop fd's registration (it stays open) */
+void io_unwatch(io_engine_t *e, io_watch_t *wt, int fd);
+
+/* Drop fd's registration and close it */
+void io_close(io_engine_t *e, io_watch_t *wt, int fd);
+
+/* Wait up to timeout_ms for events (returns their number, -1 with errno) */
+int io_wait(io_engine_t *e, io_event_t *events, int max, int timeout_ms);
+
+/* For a listener event: the next accepted connection (non-blocking), or
+   -1 with errno EAGAIN once there is none */
+int io_accept(io_engine_t *e, io_event_t *ev);
+
+#endif // IO_ENGINE_H
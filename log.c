@@ -0,0 +1,326 @@
+#include "log.h"
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+// Where a line goes
+enum { STREAM_OUT, STREAM_ERR, STREAM_ACCESS, STREAMS, STREAM_SKIP = 0xff };
+
+// A record in a ring: this header, then len bytes of text, padded to 4.
+// A SKIP record fills the end of the ring when the next line does not fit
+// there.
+typedef struct {
+    uint16_t len;
+    uint8_t stream;
+    uint8_t pad;
+} record_t;
+
+#define RECORD_SIZE(len) ((sizeof(record_t) + (len) + 3) & ~(size_t)3)
+
+typedef struct log_ring {
+    char *buf;
+    atomic_size_t head;         // read up to here by the drain thread
+    atomic_size_t tail;         // written up to here by the owning thread
+    atomic_ulong dropped;
+    struct log_ring *next;
+} log_ring_t;
+
+static _Atomic(log_ring_t *) rings;
+static __thread log_ring_t *my_ring;
+static atomic_ulong unringed_drops;  // threads whose ring could not be allocated
+
+static atomic_int level = LOG_LEVEL_INFO;
+static atomic_int running;
+static int fds[STREAMS] = { STDOUT_FILENO, STDERR_FILENO, -1 };
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+static const char *level_tags[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+int log_level_by_name(const char *name) {
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++)
+        if (strcmp(name, level_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *log_level_name(int l) {
+    return l >= 0 && l <= LOG_LEVEL_DEBUG ? level_names[l] : "?";
+}
+
+int log_level(void) {
+    return atomic_load_explicit(&level, memory_order_relaxed);
+}
+
+void log_set_level(int l) {
+    atomic_store_explicit(&level, l, memory_order_relaxed);
+}
+
+void log_adjust_level(int step) {
+    int l = log_level() + step;
+    if (l >= LOG_LEVEL_ERROR && l <= LOG_LEVEL_DEBUG)
+        log_set_level(l);
+}
+
+int log_access_enabled(void) {
+    return fds[STREAM_ACCESS] >= 0;
+}
+
+int log_open_access(const char *path) {
+    int fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    fds[STREAM_ACCESS] = fd;
+    return 0;
+}
+
+int log_ratelimit(log_ratelimit_t *rl) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+    int suppressed = 0;
+    if (window != ts.tv_sec &&
+        __atomic_compare_exchange_n(&rl->window, &window, ts.tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&rl->count, 1, __ATOMIC_RELAXED) > LOG_RATELIMIT_BURST) {
+        __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return suppressed;
+}
+
+// Wall clock time as text; the part down to the second is formatted once
+// per second and thread.
+static int format_time(char *out, size_t size) {
+    static __thread time_t stamp_sec = -1;
+    static __thread char stamp[32];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != stamp_sec) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        stamp_sec = ts.tv_sec;
+    }
+    return snprintf(out, size, "%s.%03ld ", stamp, ts.tv_nsec / 1000000);
+}
+
+static log_ring_t *ring_register(void) {
+    log_ring_t *r = calloc(1, sizeof(*r));
+    if (r && !(r->buf = malloc(LOG_RING_SIZE))) {
+        free(r);
+        r = NULL;
+    }
+    if (!r)
+        return NULL;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Put a line into the calling thread's ring, or drop it if there is no room.
+static void ring_push(int stream, const char *line, size_t len) {
+    log_ring_t *r = my_ring;
+    if (!r && !(r = my_ring = ring_register())) {
+        atomic_fetch_add_explicit(&unringed_drops, 1, memory_order_relaxed);
+        return;
+    }
+    size_t need = RECORD_SIZE(len);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t at = tail & (LOG_RING_SIZE - 1);
+    size_t skip = at + need > LOG_RING_SIZE ? LOG_RING_SIZE - at : 0;
+    if (LOG_RING_SIZE - (tail - head) < skip + need) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (skip) {
+        record_t pad = { .len = (uint16_t)(skip - sizeof(record_t)), .stream = STREAM_SKIP };
+        memcpy(r->buf + at, &pad, sizeof(pad));
+        tail += skip;
+        at = 0;
+    }
+    record_t rec = { .len = (uint16_t)len, .stream = (uint8_t)stream };
+    memcpy(r->buf + at, &rec, sizeof(rec));
+    memcpy(r->buf + at + sizeof(rec), line, len);
+    atomic_store_explicit(&r->tail, tail + need, memory_order_release);
+}
+
+static void emit(int stream, const char *line, size_t len) {
+    if (atomic_load_explicit(&running, memory_order_acquire))
+        ring_push(stream, line, len);
+    else if (fds[stream] >= 0)
+        write_all(fds[stream], line, len);
+}
+
+// Line length after snprintf() returned n at len, truncated so that the
+// newline still fits.
+static size_t appended(size_t len, int n) {
+    if (n < 0)
+        return len;
+    return len + n < LOG_LINE_MAX - 1 ? len + n : LOG_LINE_MAX - 1;
+}
+
+void log_write(int l, int suppressed, const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    size_t len = format_time(line, sizeof(line));
+    len += snprintf(line + len, sizeof(line) - len, "%s ", level_tags[l]);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+    va_end(ap);
+    len = appended(len, n);
+    if (suppressed > 0) {
+        n = snprintf(line + len, sizeof(line) - len, " (%d like it suppressed)", suppressed);
+        len = appended(len, n);
+    }
+    line[len++] = '\n';
+    emit(l <= LOG_LEVEL_WARN ? STREAM_ERR : STREAM_OUT, line, len);
+}
+
+void log_access(const char *fmt, ...) {
+    if (!log_access_enabled())
+        return;
+    char line[LOG_LINE_MAX];
+    size_t len = format_time(line, sizeof(line));
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+    va_end(ap);
+    len = appended(len, n);
+    line[len++] = '\n';
+    emit(STREAM_ACCESS, line, len);
+}
+
+unsigned long log_dropped(void) {
+    unsigned long total = atomic_load_explicit(&unringed_drops, memory_order_relaxed);
+    for (log_ring_t *r = atomic_load(&rings); r; r = r->next)
+        total += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    return total;
+}
+
+// Batches per output, written out when full and at the end of a pass
+static char out[STREAMS][64 * 1024];
+static size_t out_len[STREAMS];
+
+static void out_flush(int stream) {
+    if (out_len[stream] > 0 && fds[stream] >= 0)
+        write_all(fds[stream], out[stream], out_len[stream]);
+    out_len[stream] = 0;
+}
+
+static void out_append(int stream, const char *line, size_t len) {
+    if (out_len[stream] + len > sizeof(out[stream]))
+        out_flush(stream);
+    memcpy(out[stream] + out_len[stream], line, len);
+    out_len[stream] += len;
+}
+
+// Move every ring's lines to the outputs (drain_lock held). Returns the
+// number of bytes moved.
+static size_t drain(void) {
+    size_t moved = 0;
+    for (log_ring_t *r = atomic_load(&rings); r; r = r->next) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        moved += tail - head;
+        while (head != tail) {
+            record_t rec;
+            size_t at = head & (LOG_RING_SIZE - 1);
+            memcpy(&rec, r->buf + at, sizeof(rec));
+            if (rec.stream != STREAM_SKIP)
+                out_append(rec.stream, r->buf + at + sizeof(rec), rec.len);
+            head += RECORD_SIZE(rec.len);
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    for (int s = 0; s < STREAMS; s++)
+        out_flush(s);
+    return moved;
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+// Says once a second if lines were dropped, and when the level changed.
+static void report(unsigned long *dropped_seen, int *level_seen) {
+    unsigned long dropped = log_dropped();
+    if (dropped != *dropped_seen) {
+        log_write(LOG_LEVEL_WARN, 0, "[Log] %lu lines dropped, the log could not keep up",
+                  dropped - *dropped_seen);
+        *dropped_seen = dropped;
+    }
+    int l = log_level();
+    if (l != *level_seen) {
+        log_write(LOG_LEVEL_WARN, 0, "[Log] Level is now %s", log_level_name(l));
+        *level_seen = l;
+    }
+}
+
+static void *drain_main(void *arg) {
+    (void)arg;
+    unsigned long dropped_seen = 0;
+    int level_seen = log_level();
+    time_t reported = 0;
+    struct timespec idle = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+    struct timespec busy = { 0, 1000000L };
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (now.tv_sec != reported) {
+            report(&dropped_seen, &level_seen);
+            reported = now.tv_sec;
+        }
+        pthread_mutex_lock(&drain_lock);
+        size_t moved = drain();
+        pthread_mutex_unlock(&drain_lock);
+        // The threads that log never wake us (that would cost them a
+        // system call), so poll: often while lines keep coming, at
+        // LOG_DRAIN_INTERVAL_MS when quiet.
+        if (moved == 0)
+            nanosleep(&idle, NULL);
+        else if (moved < LOG_RING_SIZE / 4)
+            nanosleep(&busy, NULL);
+    }
+    return NULL;
+}
+
+int log_init(void) {
+    pthread_t thread;
+    atomic_store_explicit(&running, 1, memory_order_release);
+    int err = pthread_create(&thread, NULL, drain_main, NULL);
+    if (err != 0) {
+        atomic_store(&running, 0);
+        errno = err;
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(log_flush);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <string.h>
+
+// Logging off the hot path: each thread formats its lines into a ring of
+// its own (LOG_RING_SIZE bytes, one producer, no lock), and a background
+// thread drains all rings in batches with one write() per output. A full
+// ring drops the line and counts it instead of blocking. Errors and
+// warnings are rate-limited per call site. Before log_init() (or in
+// programs that never call it) lines are written directly.
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} log_level_t;
+
+// Per call site: at most LOG_RATELIMIT_BURST lines a second, then the
+// number suppressed is added to the next line that gets through.
+typedef struct {
+    long window;
+    int count;
+    int suppressed;
+} log_ratelimit_t;
+
+/* Level by name ("error", "warn", "info", "debug"), -1 if unknown */
+int log_level_by_name(const char *name);
+const char *log_level_name(int level);
+
+/* Current level; lines above it are not formatted at all */
+int log_level(void);
+void log_set_level(int level);
+
+/* One step more (+1) or less (-1) verbose; safe in a signal handler */
+void log_adjust_level(int step);
+
+/* Start the drain thread (returns 0, -1 with errno) */
+int log_init(void);
+
+/* Send access log lines to path ("-" for stdout); returns 0, -1 with errno */
+int log_open_access(const char *path);
+int log_access_enabled(void);
+
+/* Write out everything logged so far (also done at exit) */
+void log_flush(void);
+
+/* Lines dropped because a ring was full */
+unsigned long log_dropped(void);
+
+/* Returns -1 if the line is suppressed, else the number suppressed before it */
+int log_ratelimit(log_ratelimit_t *rl);
+
+void log_write(int level, int suppressed, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_access(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define LOG_AT(level, ...)                           \
+    do {                                             \
+        if ((level) <= log_level())                  \
+            log_write((level), 0, __VA_ARGS__);      \
+    } while (0)
+
+#define LOG_LIMITED(level, ...)                              \
+    do {                                                     \
+        if ((level) <= log_level()) {                        \
+            static log_ratelimit_t log_rl_;                  \
+            int log_sup_ = log_ratelimit(&log_rl_);          \
+            if (log_sup_ >= 0)                               \
+                log_write((level), log_sup_, __VA_ARGS__);   \
+        }                                                    \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_LIMITED(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_LIMITED(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// perror() through the log
+#define LOG_ERRNO(what)                                    \
+    do {                                                   \
+        int log_err_ = errno;                              \
+        LOG_ERROR("%s: %s", (what), strerror(log_err_));   \
+    } while (0)
+
+#endif // LOG_H
@@ -0,0 +1,240 @@
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+const char *const cache_result_names[CACHE_RESULTS] = {
+    "-", "hit", "stale", "stale-error", "coalesced", "miss", "pass", "tunnel"
+};
+
+__thread metrics_thread_t *metrics_self;
+static _Atomic(metrics_thread_t *) threads;
+
+metrics_thread_t *metrics_thread(void) {
+    metrics_thread_t *t = aligned_alloc(64, sizeof(*t));
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &t->next, t))
+        ;
+    return metrics_self = t;
+}
+
+void metrics_printf(metrics_buf_t *out, const char *fmt, ...) {
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (out->len + n < out->cap) {
+            out->len += n;
+            return;
+        }
+        size_t cap = out->cap ? out->cap * 2 : 16384;
+        while (cap <= out->len + n)
+            cap *= 2;
+        char *data = realloc(out->data, cap);
+        if (!data)
+            return;
+        out->data = data;
+        out->cap = cap;
+    }
+}
+
+// A histogram as a Prometheus summary in seconds. labels is "" or
+// "name=\"value\"".
+static void render_summary(metrics_buf_t *out, const char *name, const char *labels, const hist_t *h) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    const char *sep = labels[0] ? "," : "";
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        metrics_printf(out, "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, sep, quantiles[i],
+                       hist_quantile(h, quantiles[i]) / 1e9);
+    const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+    metrics_printf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close, h->sum / 1e9);
+    metrics_printf(out, "%s_count%s%s%s %llu\n", name, open, labels, close, (unsigned long long)h->count);
+}
+
+static const struct {
+    const char *name, *help;
+} counter_info[METRIC_COUNTERS] = {
+    [METRIC_ACCEPTED] = { "proxy_accepted_connections_total", "Client connections accepted." },
+    [METRIC_ACCEPT_ERRORS] = { "proxy_accept_errors_total", "Failed accept calls." },
+    [METRIC_CONNECTS] = { "proxy_backend_connects_total", "Backend connects started." },
+    [METRIC_CONNECT_FAILURES] = { "proxy_backend_connect_failures_total",
+                                  "Backend connects refused, failed or timed out." },
+    [METRIC_FIRST_BYTE_TIMEOUTS] = { "proxy_backend_first_byte_timeouts_total",
+                                     "Requests whose backend did not start answering in time." },
+    [METRIC_RETRIES] = { "proxy_retries_total", "Requests sent again to another backend." },
+    [METRIC_QUEUED] = { "proxy_admission_queued_total", "Requests that waited for an upstream slot." },
+    [METRIC_SHED] = { "proxy_admission_shed_total",
+                      "Requests answered 503 or stale because no upstream slot was free in time." },
+    [METRIC_GZIP_HITS] = { "proxy_cache_gzip_hits_total", "Cache hits sent as their gzip variant." },
+    [METRIC_BYTES_TO_CLIENT] = { "proxy_client_sent_bytes_total", "Bytes written to clients." },
+    [METRIC_BYTES_TO_BACKEND] = { "proxy_backend_sent_bytes_total", "Request bytes written to backends." },
+};
+
+static const struct {
+    const char *name, *help;
+} hist_info[HISTS] = {
+    [HIST_REQUEST] = { "proxy_request_duration_seconds",
+                       "From a request's first byte to the end of its response." },
+    [HIST_CONNECT] = { "proxy_backend_connect_seconds", "Backend connect time." },
+    [HIST_FIRST_BYTE] = { "proxy_first_byte_seconds",
+                          "From picking the first backend to the first response byte." },
+    [HIST_CACHE_LOOKUP] = { "proxy_cache_lookup_seconds", "Cache lookup time." },
+};
+
+void metrics_render(metrics_buf_t *out, metrics_gauges_fn gauges) {
+    uint64_t counters[METRIC_COUNTERS] = {0}, requests[CACHE_RESULTS] = {0}, responses[6] = {0};
+    hist_t *hists = calloc(HISTS + MAX_SERVERS, sizeof(*hists));
+    if (!hists)
+        return;
+    hist_t *backend_hists = hists + HISTS;
+    for (metrics_thread_t *t = atomic_load(&threads); t; t = t->next) {
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+            counters[i] += hist_load(&t->counters[i]);
+        for (int i = 0; i < CACHE_RESULTS; i++)
+            requests[i] += hist_load(&t->requests[i]);
+        for (int i = 0; i < 6; i++)
+            responses[i] += hist_load(&t->responses[i]);
+        for (int i = 0; i < HISTS; i++)
+            hist_merge(&hists[i], &t->hists[i]);
+        for (int i = 0; i < MAX_SERVERS; i++)
+            hist_merge(&backend_hists[i], &t->backend_first_byte[i]);
+    }
+
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+        metrics_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name,
+                       counter_info[i].help, counter_info[i].name, counter_info[i].name,
+                       (unsigned long long)counters[i]);
+    metrics_printf(out, "# HELP proxy_requests_total Requests by how they were answered.\n"
+                        "# TYPE proxy_requests_total counter\n");
+    for (int i = 0; i < CACHE_RESULTS; i++)
+        metrics_printf(out, "proxy_requests_total{cache=\"%s\"} %llu\n",
+                       i == CACHE_RESULT_NONE ? "none" : cache_result_names[i], (unsigned long long)requests[i]);
+    metrics_printf(out, "# HELP proxy_responses_total Responses by status class.\n"
+                        "# TYPE proxy_responses_total counter\n");
+    for (int i = 0; i < 6; i++) {
+        char code[8] = "none";
+        if (i > 0)
+            snprintf(code, sizeof(code), "%dxx", i);
+        metrics_printf(out, "proxy_responses_total{code=\"%s\"} %llu\n", code, (unsigned long long)responses[i]);
+    }
+    for (int i = 0; i < HISTS; i++) {
+        metrics_printf(out, "# HELP %s %s\n# TYPE %s summary\n", hist_info[i].name, hist_info[i].help,
+                       hist_info[i].name);
+        render_summary(out, hist_info[i].name, "", &hists[i]);
+    }
+    metrics_printf(out, "# HELP proxy_backend_first_byte_seconds From picking a backend to its first response byte.\n"
+                        "# TYPE proxy_backend_first_byte_seconds summary\n");
+    for (int i = 0; i < backend_count && i < MAX_SERVERS; i++) {
+        char labels[sizeof(backend_pool[0].ip) + 32];  // backend="ip:port"
+        snprintf(labels, sizeof(labels), "backend=\"%.*s:%d\"", (int)sizeof(backend_pool[i].ip), backend_pool[i].ip,
+                 backend_pool[i].port);
+        render_summary(out, "proxy_backend_first_byte_seconds", labels, &backend_hists[i]);
+    }
+    free(hists);
+    if (gauges)
+        gauges(out);
+}
+
+// Reads a request head, answers it and closes. Scrapes are rare, so one
+// connection at a time is enough.
+static void serve_one(int fd, metrics_gauges_fn gauges) {
+    struct timeval tv = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char req[4096];
+    size_t len = 0;
+    while (len < sizeof(req) - 1) {
+        ssize_t n = read(fd, req + len, sizeof(req) - 1 - len);
+        if (n <= 0)
+            return;
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    metrics_buf_t body = {0};
+    const char *status = "404 Not Found";
+    if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET /metrics?", 13) == 0) {
+        status = "200 OK";
+        metrics_render(&body, gauges);
+    }
+    char head[160];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                            status, body.len);
+    if (write(fd, head, head_len) == head_len) {
+        size_t off = 0;
+        while (off < body.len) {
+            ssize_t n = write(fd, body.data + off, body.len - off);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+    }
+    free(body.data);
+}
+
+typedef struct {
+    int fd;
+    metrics_gauges_fn gauges;
+} admin_t;
+
+static void *admin_main(void *arg) {
+    admin_t *a = arg;
+    while (1) {
+        int fd = accept(a->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                LOG_ERRNO("[Metrics] accept");
+            continue;
+        }
+        serve_one(fd, a->gauges);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *addr, int port, metrics_gauges_fn gauges) {
+    static admin_t admin;
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    admin.fd = fd;
+    admin.gauges = gauges;
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, admin_main, &admin);
+    if (err != 0) {
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
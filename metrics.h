@@ -0,0 +1,120 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "backend_servers.h"
+#include "hist.h"
+
+// Counters and latency histograms, recorded by each thread into a block of
+// its own (one writer, no atomic read-modify-write, no shared cache lines)
+// and summed only when the admin port is scraped. Recording is a load, an
+// add and a store; latencies go into hist.h histograms of nanoseconds.
+typedef enum {
+    METRIC_ACCEPTED,            // client connections
+    METRIC_ACCEPT_ERRORS,
+    METRIC_CONNECTS,            // backend connects started
+    METRIC_CONNECT_FAILURES,    // refused, failed or timed out
+    METRIC_FIRST_BYTE_TIMEOUTS,
+    METRIC_RETRIES,             // requests sent to another backend
+    METRIC_QUEUED,              // requests that waited for upstream admission
+    METRIC_SHED,                // requests refused for lack of an upstream slot
+    METRIC_GZIP_HITS,           // cache hits sent as the gzip variant
+    METRIC_BYTES_TO_CLIENT,
+    METRIC_BYTES_TO_BACKEND,
+    METRIC_COUNTERS
+} metric_counter_t;
+
+// How a request was answered (the access log's cache= field)
+typedef enum {
+    CACHE_RESULT_NONE,          // not parsed far enough to tell
+    CACHE_RESULT_HIT,
+    CACHE_RESULT_STALE,         // served while refreshed
+    CACHE_RESULT_STALE_ERROR,   // served because the backend failed
+    CACHE_RESULT_COALESCED,     // answered from another request's fetch
+    CACHE_RESULT_MISS,
+    CACHE_RESULT_PASS,          // not cacheable
+    CACHE_RESULT_TUNNEL,
+    CACHE_RESULTS
+} cache_result_t;
+
+extern const char *const cache_result_names[CACHE_RESULTS];
+
+typedef enum {
+    HIST_REQUEST,               // request's first byte to the end of its response
+    HIST_CONNECT,               // backend connect
+    HIST_FIRST_BYTE,            // first backend picked to first response byte
+    HIST_CACHE_LOOKUP,
+    HISTS
+} metric_hist_t;
+
+typedef struct metrics_thread {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t requests[CACHE_RESULTS];
+    uint64_t responses[6];      // by status class; [0] for none or a raw reply
+    hist_t hists[HISTS];
+    hist_t backend_first_byte[MAX_SERVERS];  // per backend, from when it was picked
+    struct metrics_thread *next;
+} __attribute__((aligned(64))) metrics_thread_t;
+
+extern __thread metrics_thread_t *metrics_self;
+
+/* The calling thread's block, allocated on first use (NULL if out of memory) */
+metrics_thread_t *metrics_thread(void);
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void metrics_count(metric_counter_t c, uint64_t n) {
+    metrics_thread_t *t = metrics_self ? metrics_self : metrics_thread();
+    if (t)
+        hist_add(&t->counters[c], n);
+}
+
+static inline void metrics_observe(metric_hist_t h, uint64_t ns) {
+    metrics_thread_t *t = metrics_self ? metrics_self : metrics_thread();
+    if (t)
+        hist_record(&t->hists[h], ns);
+}
+
+/* A finished request: how it was answered, its status (0 if none) and how
+   long it took */
+static inline void metrics_request(cache_result_t result, int status, uint64_t ns) {
+    metrics_thread_t *t = metrics_self ? metrics_self : metrics_thread();
+    if (!t)
+        return;
+    hist_add(&t->requests[result], 1);
+    hist_add(&t->responses[status >= 100 && status < 600 ? status / 100 : 0], 1);
+    hist_record(&t->hists[HIST_REQUEST], ns);
+}
+
+static inline void metrics_backend_first_byte(int backend, uint64_t ns) {
+    metrics_thread_t *t = metrics_self ? metrics_self : metrics_thread();
+    if (t && backend >= 0 && backend < MAX_SERVERS)
+        hist_record(&t->backend_first_byte[backend], ns);
+}
+
+// Text output of a scrape
+typedef struct {
+    char *data;
+    size_t len, cap;
+} metrics_buf_t;
+
+void metrics_printf(metrics_buf_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Adds the values that are read rather than recorded (gauges, other
+   modules' counters) to a scrape */
+typedef void (*metrics_gauges_fn)(metrics_buf_t *out);
+
+/* The whole scrape in Prometheus text format */
+void metrics_render(metrics_buf_t *out, metrics_gauges_fn gauges);
+
+/* Serve GET /metrics on addr:port from a thread of its own (returns 0,
+   -1 with errno) */
+int metrics_serve(const char *addr, int port, metrics_gauges_fn gauges);
+
+#endif // METRICS_H
@@ -1,325 +1,2729 @@
+#define _GNU_SOURCE
 #include "proxy.h"
 #include "backend_servers.h"
 #include "config.h"
 #include "cache.h"
+#include "cache_file.h"
+#include "compress.h"
+#include "thread_pool.h"
+#include "upstream_pool.h"
+#include "http.h"
+#include "relay.h"
+#include "fill.h"
+#include "health.h"
+#include "balancer.h"
+#include "hedge.h"
+#include "admission.h"
+#include "buffer_pool.h"
+#include "log.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <stdatomic.h>
 
-#define MAX_SERVERS 10
-#define BUFFER_SIZE 4096
+#define BUFFER_SIZE IO_BUFFER_SIZE
 #define MAX_EVENTS 1000
-#define LISTEN_PORT 8080
+// Room kept free behind a response head so our Connection header fits
+#define HEAD_SLACK 32
+
+proxy_config_t proxy_config = {
+    .keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT,
+    .keepalive_requests = DEFAULT_KEEPALIVE_REQUESTS,
+    .connect_timeout = DEFAULT_CONNECT_TIMEOUT_MS,
+    .header_timeout = DEFAULT_HEADER_TIMEOUT_MS,
+    .first_byte_timeout = DEFAULT_FIRST_BYTE_TIMEOUT_MS,
+    .request_timeout = DEFAULT_REQUEST_TIMEOUT_MS,
+    .retries = DEFAULT_RETRIES,
+    .hedge_percentile = DEFAULT_HEDGE_PERCENTILE,
+    .hedge_budget = DEFAULT_HEDGE_BUDGET,
+    .hedge_min_delay = DEFAULT_HEDGE_MIN_DELAY_MS,
+    .hedge_holdout = DEFAULT_HEDGE_HOLDOUT,
+    .coalesce_timeout = DEFAULT_COALESCE_TIMEOUT,
+    .cache_ttl = DEFAULT_CACHE_TTL,
+    .cache_stale = DEFAULT_CACHE_STALE,
+    .listen_backlog = DEFAULT_LISTEN_BACKLOG,
+    .queue_size = DEFAULT_QUEUE_SIZE,
+    .queue_timeout = DEFAULT_QUEUE_TIMEOUT_MS,
+};
+
+// All workers, so a fill's leader can wake followers on other threads.
+static worker_t *all_workers;
+static int worker_count;
 
 // Note: Backend type, backend_pool and backend_count are defined in backend_servers.h / backend_servers.c
 
-// Global state for backend active counts
-static int backend_active[MAX_SERVERS] = {0};
-pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Backend selection (--balance), shared by all workers.
+static balancer_t balancer;
 
-int get_least_connection_index() {
-    pthread_mutex_lock(&backend_mutex);
-    int minIndex = 0;
-    for (int i = 1; i < backend_count; i++) {
-        if (backend_active[i] < backend_active[minIndex])
-            minIndex = i;
-    }
-    backend_active[minIndex]++; // Increment active count for chosen backend
-    pthread_mutex_unlock(&backend_mutex);
-    return minIndex;
+// Pick a backend for a request and take an upstream slot for it: one
+// under the global limit, and the backend below its own. Returns the
+// backend, -1 once every backend has been tried, or BALANCE_FULL while
+// admission control has no room.
+static int acquire_backend(uint32_t tried, uint64_t route_hash, uint64_t now_us) {
+    if (!admission_acquire())
+        return BALANCE_FULL;
+    int index = balancer_pick(&balancer, tried, route_hash, now_us);
+    if (index < 0)
+        admission_release();
+    return index;
+}
+
+static void release_backend(int index) {
+    balancer_release(&balancer, index);
+    admission_release();
+}
+
+// Tell admission control how a request to a backend went; the balancer
+// enforces the backend's new limit.
+static void admission_sample(int index, uint64_t latency_us, int overload, uint64_t now_us) {
+    int active = atomic_load_explicit(&balancer.state[index].active, memory_order_relaxed);
+    balancer_set_limit(&balancer, index, admission_observe(index, latency_us, overload, active, now_us));
 }
 
 typedef enum {
-    STATE_BACKEND_CONNECT,
-    STATE_WAIT_CLIENT,
-    STATE_WAIT_BACKEND,
+    STATE_READ_REQUEST,     // reading the client's request head
+    STATE_BACKEND_CONNECT,  // request missed the cache; fresh upstream connect in progress
+    STATE_RELAY,            // streaming the request body up and the response down
+    STATE_SEND_CACHED,      // writing a cache hit straight from cache memory
+    STATE_FOLLOW,           // answered from another request's fill of the same key
+    STATE_QUEUED,           // request missed the cache; waiting for upstream admission
     STATE_DONE
 } conn_state_t;
 
-typedef struct {
-    int client_fd;
-    int backend_fd;
-    int backend_index;
+// What the connection's phase deadline is waiting for
+typedef enum {
+    PHASE_NONE,
+    PHASE_IDLE,             // the client's next request (closed quietly on expiry)
+    PHASE_HEADER,           // the rest of a request head (408)
+    PHASE_CONNECT,          // a backend connect (504)
+    PHASE_FIRST_BYTE,       // the backend's first response byte (504)
+    PHASE_FOLLOW,           // the leader's response head (fetch on our own)
+    PHASE_QUEUED            // an upstream slot (503)
+} conn_phase_t;
+
+// Whether and how a request takes part in hedging
+typedef enum {
+    HEDGE_UNDECIDED,        // not sent upstream yet
+    HEDGE_INELIGIBLE,       // not a GET that can be repeated
+    HEDGE_ACTIVE,           // hedged if its backend is slow
+    HEDGE_HELD_OUT          // never hedged; its latency is the baseline
+} hedge_cohort_t;
+
+// One socket of a connection as registered with epoll. The readiness flags
+// remember what epoll reported, so the relay only issues syscalls that can
+// make progress and level-triggered events never spin.
+typedef struct endpoint {
+    int fd;
+    io_watch_t watch;           // interest registered with the worker's I/O engine
+    int readable;               // EPOLLIN seen and not yet drained to EAGAIN
+    int writable;               // last write did not hit EAGAIN
+    int eof;                    // peer finished sending
+    int shut_wr;                // our FIN was sent (half-close)
+    struct connection *conn;
+} endpoint_t;
+
+typedef struct connection {
+    endpoint_t client;
+    endpoint_t backend;         // fd -1 until the request is known to be a cache miss
+    int backend_index;          // -1 while no backend slot is held
+    int backend_reused;         // backend fd came from the idle pool
+    uint32_t tried;             // backends this request was sent to, as bits
+    uint64_t dispatched_us;     // when the current backend was picked (latency samples)
+    uint64_t route_hash;        // hash of the request's cache key for --balance maglev, 0 if none
+    uint64_t request_us;        // when the first backend was picked (first-byte latency)
+    uint64_t connect_ns;        // when the current backend connect started
+
+    // A hedge: the same request sent to a second backend when the first is
+    // slow to answer. Whichever sends the first response byte keeps going.
+    endpoint_t hedge;           // fd -1 unless a hedge is in flight
+    int hedge_index;            // backend slot the hedge holds, -1 if none
+    int hedge_reused;
+    int hedge_connecting;
+    size_t hedge_sent;          // bytes of buffer[0, in_msg) written to it
+    uint64_t hedge_dispatched_us;
+    hedge_cohort_t hedge_cohort;
+    wheel_timer_t hedge_timer;  // when to send the hedge
+    int retries;                // times it was sent to another backend
+    int tunnel;                 // not HTTP: raw full-duplex relay until both sides close
+    int refresh;                // background refresh of a stale entry: there is no client
     conn_state_t state;
-    char buffer[BUFFER_SIZE];
-    ssize_t buflen;
-    char req_key[BUFFER_SIZE];  // copy of the GET request (if applicable) to use as cache key
+    int requests;               // requests completed on this client connection
+    int keep_client;            // the current response tells the client to keep the connection
+    conn_phase_t phase;
+    wheel_timer_t phase_timer;  // deadline of the current phase
+    wheel_timer_t request_timer; // deadline of the whole exchange
+
+    // Client -> backend. buffer[0, in_len) holds bytes read from the client:
+    // [0, in_sent) already went upstream, [in_sent, in_msg) is the rest of the
+    // current request and [in_msg, in_len) whatever the client sent after it.
+    // Both buffers come from the buffer pool and are NULL while not needed.
+    char *buffer;
+    size_t in_len;
+    size_t in_sent;
+    size_t in_msg;
+    int replayable;             // buffer still holds the whole request (retry on a stale pooled socket)
+    int upload_aborted;         // backend stopped reading the request
+    http_request_t req;
+    relay_pipe_t up_pipe;       // large request bodies, spliced
+
+    // Backend -> client. resp_buf[out_start, out_end) waits to be written.
+    char *resp_buf;             // borrowed when a backend is picked
+    size_t out_start;
+    size_t out_end;
+    size_t interim_end;         // resp_buf[out_start, interim_end): a 1xx head still to send
+    int resp_head_done;
+    int resp_done;
+    http_response_t resp;
+    relay_pipe_t down_pipe;     // large response bodies, spliced
+    fill_t *fill;               // cache fill this request leads or follows (holds a reference)
+    int fill_leader;            // we fetch and publish it; otherwise we are answered from it
+    fill_cursor_t fill_cur;     // follower: position in the fill's body
+    int following;              // on the worker's follower list
+    struct connection *follow_prev;
+    struct connection *follow_next;
+    int queued;                 // on the worker's admission queue
+    struct connection *queue_prev;
+    struct connection *queue_next;
+    uint64_t sent_to_client;
+
+    // Access log (--access-log) and metrics, per request
+    uint64_t start_ns;          // first byte of the request head, 0 once accounted for
+    uint64_t upstream_us;       // first backend picked to first response byte, 0 if none
+    int status;                 // status answered other than by relaying a backend (cache, error)
+    int served_by;              // backend whose response head was relayed, -1 if none
+    cache_result_t cache_result;
+    struct sockaddr_in peer;    // client address, looked up for the first line
+
+    cache_object_t *tx_obj;     // cached response being sent (holds a reference)
+    cache_object_t *stale_obj;  // stale copy to send if the backend fails (stale-if-error)
+    size_t tx_off;              // bytes of tx_obj already written
+    struct connection *next_closed;
 } connection_t;
 
 void set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1) {
-        perror("fcntl F_GETFL");
+        LOG_ERRNO("fcntl F_GETFL");
         exit(EXIT_FAILURE);
     }
     if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl F_SETFL");
+        LOG_ERRNO("fcntl F_SETFL");
         exit(EXIT_FAILURE);
     }
 }
 
-void cleanup_connection(int epoll_fd, connection_t *conn) {
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL);
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->backend_fd, NULL);
-    close(conn->client_fd);
-    close(conn->backend_fd);
-    pthread_mutex_lock(&backend_mutex);
-    backend_active[conn->backend_index]--;
-    pthread_mutex_unlock(&backend_mutex);
-    free(conn);
-    printf("[Proxy] Cleaned up connection.\n");
+static void endpoint_init(endpoint_t *ep, int fd, connection_t *conn) {
+    ep->fd = fd;
+    ep->watch = (io_watch_t){ 0 };
+    ep->readable = 0;
+    ep->writable = 1;
+    ep->eof = 0;
+    ep->shut_wr = 0;
+    ep->conn = conn;
 }
 
-void add_fd(int epoll_fd, int fd, connection_t *conn, uint32_t events) {
-    struct epoll_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.events = events;
-    ev.data.ptr = conn;  // store only the connection pointer
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-        perror("epoll_ctl ADD");
-        exit(EXIT_FAILURE);
+// Register or change interest only when it actually differs.
+static void set_interest(worker_t *w, endpoint_t *ep, uint32_t events) {
+    // Endpoints carry their connection pointer.
+    if (io_watch(&w->io, &ep->watch, ep->fd, ep, events) < 0)
+        LOG_ERRNO("io_watch");
+}
+
+static void close_endpoint(worker_t *w, endpoint_t *ep) {
+    io_close(&w->io, &ep->watch, ep->fd);
+    ep->fd = -1;
+}
+
+// Enter a phase whose deadline is timeout_ms from now (0 for none).
+static void phase_set(worker_t *w, connection_t *conn, conn_phase_t phase, int timeout_ms) {
+    conn->phase = phase;
+    if (timeout_ms > 0)
+        timer_add(&w->timers, &conn->phase_timer, w->now_ms + timeout_ms);
+    else
+        timer_cancel(&w->timers, &conn->phase_timer);
+}
+
+static void phase_clear(worker_t *w, connection_t *conn) {
+    phase_set(w, conn, PHASE_NONE, 0);
+}
+
+// A request head is complete: the whole exchange must finish in time.
+static void request_started(worker_t *w, connection_t *conn) {
+    phase_clear(w, conn);
+    if (proxy_config.request_timeout > 0 && !conn->tunnel)
+        timer_add(&w->timers, &conn->request_timer, w->now_ms + proxy_config.request_timeout);
+}
+
+// Wake every worker with followers of f; they re-check all their followers.
+static void notify_fill(fill_t *f) {
+    uint64_t mask[FILL_WORKER_WORDS];
+    fill_waiters(f, mask);
+    for (int word = 0; word < FILL_WORKER_WORDS; word++) {
+        while (mask[word]) {
+            int id = word * 64 + __builtin_ctzll(mask[word]);
+            mask[word] &= mask[word] - 1;
+            uint64_t one = 1;
+            if (write(all_workers[id].notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                LOG_ERRNO("eventfd write");
+        }
     }
 }
 
-int main() {
-    int listen_fd, epoll_fd;
-    struct sockaddr_in listen_addr;
+static void follow_add(worker_t *w, connection_t *conn) {
+    conn->following = 1;
+    phase_set(w, conn, PHASE_FOLLOW, proxy_config.coalesce_timeout * 1000);
+    conn->follow_next = NULL;
+    conn->follow_prev = w->follow_tail;
+    if (w->follow_tail)
+        w->follow_tail->follow_next = conn;
+    else
+        w->follow_head = conn;
+    w->follow_tail = conn;
+}
 
-    // Initialize cache before starting (cache_init defined in cache.c)
-    cache_init();
+static void follow_remove(worker_t *w, connection_t *conn) {
+    if (!conn->following)
+        return;
+    if (conn->follow_prev)
+        conn->follow_prev->follow_next = conn->follow_next;
+    else
+        w->follow_head = conn->follow_next;
+    if (conn->follow_next)
+        conn->follow_next->follow_prev = conn->follow_prev;
+    else
+        w->follow_tail = conn->follow_prev;
+    conn->following = 0;
+    if (conn->phase == PHASE_FOLLOW)
+        phase_clear(w, conn);
+}
+
+// Requests that found no upstream slot wait here in arrival order, each
+// for at most --queue-timeout ms. Only their request buffer is kept.
+static void queue_add(worker_t *w, connection_t *conn) {
+    buffer_pool_put(conn->resp_buf);
+    conn->resp_buf = NULL;
+    conn->queued = 1;
+    conn->state = STATE_QUEUED;
+    phase_set(w, conn, PHASE_QUEUED, proxy_config.queue_timeout);
+    conn->queue_next = NULL;
+    conn->queue_prev = w->queue_tail;
+    if (w->queue_tail)
+        w->queue_tail->queue_next = conn;
+    else
+        w->queue_head = conn;
+    w->queue_tail = conn;
+    w->queue_len++;
+}
+
+static void queue_remove(worker_t *w, connection_t *conn) {
+    if (!conn->queued)
+        return;
+    if (conn->queue_prev)
+        conn->queue_prev->queue_next = conn->queue_next;
+    else
+        w->queue_head = conn->queue_next;
+    if (conn->queue_next)
+        conn->queue_next->queue_prev = conn->queue_prev;
+    else
+        w->queue_tail = conn->queue_prev;
+    w->queue_len--;
+    conn->queued = 0;
+    if (conn->phase == PHASE_QUEUED)
+        phase_clear(w, conn);
+}
+
+// Let go of the connection's fill. A leader that leaves before finishing
+// fails the fill, so its followers fetch on their own.
+static void fill_drop(worker_t *w, connection_t *conn) {
+    if (!conn->fill)
+        return;
+    if (conn->fill_leader) {
+        fill_finish(conn->fill, 0);
+        notify_fill(conn->fill);
+        fill_release(conn->fill);
+    } else {
+        follow_remove(w, conn);
+        fill_unfollow(conn->fill, FILL_GONE);
+    }
+    conn->fill = NULL;
+    conn->fill_leader = 0;
+}
+
+// Abandon the hedge, if any: its backend has nothing the client needs.
+static void hedge_cancel(worker_t *w, connection_t *conn) {
+    timer_cancel(&w->timers, &conn->hedge_timer);
+    close_endpoint(w, &conn->hedge);
+    if (conn->hedge_index >= 0)
+        release_backend(conn->hedge_index);
+    conn->hedge_index = -1;
+}
+
+// Status code of a stored response head, 0 for a raw reply.
+static int head_status(const char *head, size_t head_len) {
+    if (head_len < 12 || memcmp(head, "HTTP/", 5) != 0)
+        return 0;
+    return atoi(head + 9);
+}
+
+// The request's first bytes arrived: start timing it.
+static void request_begin(connection_t *conn) {
+    if (conn->start_ns)
+        return;
+    conn->start_ns = metrics_now_ns();
+    conn->upstream_us = 0;
+    conn->status = 0;
+    conn->resp.status = 0;      // the previous response's until a new head is parsed
+    conn->served_by = -1;
+    conn->cache_result = CACHE_RESULT_NONE;
+}
+
+// A request was answered or given up on: count it, and write the access log
+// line saying who asked for what, how it was answered and how long that took.
+static void request_done(worker_t *w, connection_t *conn) {
+    if (!conn->start_ns || conn->refresh)
+        return;
+    uint64_t total_ns = metrics_now_ns() - conn->start_ns;
+    int status = conn->status ? conn->status : conn->resp.status;
+    conn->start_ns = 0;
+    metrics_request(conn->cache_result, status, total_ns);
+    metrics_count(METRIC_BYTES_TO_CLIENT, conn->sent_to_client);
+    if (conn->retries)
+        metrics_count(METRIC_RETRIES, conn->retries);
+    if (!log_access_enabled())
+        return;
+    char client[INET_ADDRSTRLEN + 8] = "-";
+    socklen_t addr_len = sizeof(conn->peer);
+    if (conn->peer.sin_family == AF_INET ||
+        (conn->client.fd >= 0 && getpeername(conn->client.fd, (struct sockaddr *)&conn->peer, &addr_len) == 0 &&
+         conn->peer.sin_family == AF_INET)) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &conn->peer.sin_addr, ip, sizeof(ip));
+        snprintf(client, sizeof(client), "%s:%d", ip, ntohs(conn->peer.sin_port));
+    }
+    // The request line as sent, with anything that would break the line
+    // format replaced.
+    char method[16] = "-", target[256] = "-";
+    if (!conn->tunnel && conn->req.head_len > 0 && conn->req.target_len > 0) {
+        size_t m = conn->req.target_off - 1 < sizeof(method) - 1 ? conn->req.target_off - 1 : sizeof(method) - 1;
+        memcpy(method, conn->buffer, m);
+        method[m] = '\0';
+        size_t t = conn->req.target_len < sizeof(target) - 1 ? conn->req.target_len : sizeof(target) - 1;
+        for (size_t i = 0; i < t; i++) {
+            char ch = conn->buffer[conn->req.target_off + i];
+            target[i] = ch > ' ' && ch < 0x7f && ch != '"' && ch != '\\' ? ch : '?';
+        }
+        target[t] = '\0';
+    }
+    char backend[64] = "-", upstream[32] = "-";
+    if (conn->served_by >= 0)
+        snprintf(backend, sizeof(backend), "%s:%d", backend_pool[conn->served_by].ip,
+                 backend_pool[conn->served_by].port);
+    if (conn->upstream_us)
+        snprintf(upstream, sizeof(upstream), "%.3f", conn->upstream_us / 1000.0);
+    log_access("worker=%d client=%s method=%s target=\"%s\" status=%d bytes=%llu cache=%s backend=%s "
+               "retries=%d upstream_ms=%s total_ms=%.3f",
+               w->id, client, method, target, status, (unsigned long long)conn->sent_to_client,
+               cache_result_names[conn->cache_result], backend, conn->retries, upstream, total_ns / 1e6);
+}
+
+// Release everything the connection holds. The memory itself is freed after
+// the current epoll batch, since later events in it may still point here.
+void cleanup_connection(worker_t *w, connection_t *conn) {
+    request_done(w, conn);
+    timer_cancel(&w->timers, &conn->phase_timer);
+    timer_cancel(&w->timers, &conn->request_timer);
+    queue_remove(w, conn);
+    hedge_cancel(w, conn);
+    close_endpoint(w, &conn->client);
+    close_endpoint(w, &conn->backend);
+    if (conn->backend_index >= 0)
+        release_backend(conn->backend_index);
+    conn->backend_index = -1;
+    relay_pipe_close(&conn->up_pipe);
+    relay_pipe_close(&conn->down_pipe);
+    cache_release(conn->tx_obj);
+    conn->tx_obj = NULL;
+    cache_release(conn->stale_obj);
+    conn->stale_obj = NULL;
+    fill_drop(w, conn);
+    buffer_pool_put(conn->buffer);
+    conn->buffer = NULL;
+    buffer_pool_put(conn->resp_buf);
+    conn->resp_buf = NULL;
+    conn->state = STATE_DONE;
+    conn->next_closed = w->closed_conns;
+    w->closed_conns = conn;
+    LOG_DEBUG("[Proxy] Cleaned up connection.");
+}
+
+static connection_t *conn_create(worker_t *w, int client_fd) {
+    connection_t *conn = object_slab_alloc(&w->conn_slab);
+    if (!conn)
+        return NULL;
+    endpoint_init(&conn->client, client_fd, conn);
+    endpoint_init(&conn->backend, -1, conn);
+    conn->backend_index = -1;
+    conn->backend_reused = 0;
+    conn->tried = 0;
+    conn->dispatched_us = 0;
+    conn->route_hash = 0;
+    conn->request_us = 0;
+    conn->connect_ns = 0;
+    endpoint_init(&conn->hedge, -1, conn);
+    conn->hedge_index = -1;
+    conn->hedge_cohort = HEDGE_UNDECIDED;
+    timer_init(&conn->hedge_timer, conn);
+    conn->retries = 0;
+    conn->tunnel = 0;
+    conn->refresh = 0;
+    conn->state = STATE_READ_REQUEST;
+    conn->requests = 0;
+    conn->keep_client = 0;
+    conn->phase = PHASE_NONE;
+    timer_init(&conn->phase_timer, conn);
+    timer_init(&conn->request_timer, conn);
+    conn->buffer = NULL;
+    conn->resp_buf = NULL;
+    conn->in_len = conn->in_sent = conn->in_msg = 0;
+    conn->replayable = 1;
+    conn->upload_aborted = 0;
+    relay_pipe_reset(&conn->up_pipe);
+    conn->out_start = conn->out_end = conn->interim_end = 0;
+    conn->resp_head_done = 0;
+    conn->resp_done = 0;
+    relay_pipe_reset(&conn->down_pipe);
+    conn->fill = NULL;
+    conn->fill_leader = 0;
+    conn->following = 0;
+    conn->queued = 0;
+    conn->sent_to_client = 0;
+    conn->start_ns = 0;
+    conn->peer.sin_family = AF_UNSPEC;
+    http_request_init(&conn->req);
+    conn->tx_obj = NULL;
+    conn->stale_obj = NULL;
+    conn->tx_off = 0;
+    conn->next_closed = NULL;
+    return conn;
+}
+
+// Best-effort error reply, only if the client has not received anything yet.
+// A 503 says when to come back.
+static void send_error_response(connection_t *conn, int status) {
+    if (conn->sent_to_client > 0 || conn->client.fd < 0)
+        return;
+    conn->status = status;
+    char msg[160], retry[32] = "";
+    const char *reason = status == 400 ? "Bad Request" :
+                         status == 408 ? "Request Timeout" :
+                         status == 431 ? "Request Header Fields Too Large" :
+                         status == 503 ? "Service Unavailable" :
+                         status == 504 ? "Gateway Timeout" : "Bad Gateway";
+    if (status == 503)
+        snprintf(retry, sizeof(retry), "Retry-After: %d\r\n", RETRY_AFTER);
+    int len = snprintf(msg, sizeof(msg), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%sConnection: close\r\n\r\n",
+                       status, reason, retry);
+    if (send(conn->client.fd, msg, len, MSG_NOSIGNAL) > 0)
+        conn->sent_to_client += len;
+}
+
+// Whether a request whose backend failed before answering may be sent to
+// another one: it must be safe to repeat, still buffered in full, and the
+// client must not have received anything.
+static int retry_allowed(const connection_t *conn) {
+    return !conn->tunnel && conn->req.idempotent && conn->replayable && conn->sent_to_client == 0 &&
+           conn->retries < proxy_config.retries;
+}
+
+// Attach a backend to a request that missed the cache: reuse an idle pooled
+// connection when one is available, otherwise start a non-blocking connect.
+// A connect that fails right away counts against the backend's health and
+// moves on to another one if the request may be retried.
+// With fresh_only set the pool is bypassed (retry after a stale reuse).
+// Returns 0, -1 on failure or BALANCE_FULL if there is no upstream slot.
+static int start_backend(worker_t *w, connection_t *conn, int fresh_only) {
+    if (!conn->resp_buf && !(conn->resp_buf = buffer_pool_get()))
+        return -1;
+    while (1) {
+        if (conn->backend_index < 0) {
+            conn->dispatched_us = balancer_now_us();
+            if (!conn->tried)
+                conn->request_us = conn->dispatched_us;
+            int index = acquire_backend(conn->tried, conn->route_hash, conn->dispatched_us);
+            if (index < 0)
+                return index;
+            conn->backend_index = index;
+            conn->tried |= 1u << conn->backend_index;
+            Backend target = backend_pool[conn->backend_index];
+            LOG_DEBUG("[Proxy] Selected backend %s:%d for client FD %d",
+                      target.ip, target.port, conn->client.fd);
+        }
+        upstream_pool_t *pool = &w->pools[conn->backend_index];
+        int fd = fresh_only ? -1 : upstream_checkout(pool);
+        if (fd >= 0) {
+            endpoint_init(&conn->backend, fd, conn);
+            conn->backend_reused = 1;
+            conn->state = STATE_RELAY;
+            LOG_DEBUG("[Proxy] Reusing pooled backend FD %d for client FD %d", fd, conn->client.fd);
+            return 0;
+        }
+        fd = upstream_connect(conn->backend_index);
+        metrics_count(METRIC_CONNECTS, 1);
+        if (fd >= 0) {
+            pool->opened++;
+            conn->connect_ns = metrics_now_ns();
+            endpoint_init(&conn->backend, fd, conn);
+            conn->backend.writable = 0;  // becomes writable when the connect completes
+            conn->backend_reused = 0;
+            conn->state = STATE_BACKEND_CONNECT;
+            phase_set(w, conn, PHASE_CONNECT, proxy_config.connect_timeout);
+            return 0;
+        }
+        metrics_count(METRIC_CONNECT_FAILURES, 1);
+        health_report(conn->backend_index, 0);
+        if (!retry_allowed(conn))
+            return -1;
+        release_backend(conn->backend_index);
+        conn->backend_index = -1;
+        conn->retries++;
+        fresh_only = 0;
+    }
+}
+
+// Forget a backend attempt that failed before any response, keeping the
+// buffered request so it can be sent again.
+static void backend_reset(worker_t *w, connection_t *conn) {
+    hedge_cancel(w, conn);
+    close_endpoint(w, &conn->backend);
+    conn->in_sent = 0;
+    conn->upload_aborted = 0;
+    conn->out_start = conn->out_end = conn->interim_end = 0;
+    conn->resp_head_done = conn->tunnel;
+    conn->resp_done = 0;
+    phase_clear(w, conn);
+}
+
+// A pooled connection turned out to be dead before it answered: replay the
+// buffered request on a fresh connection to the same backend.
+static int retry_fresh_backend(worker_t *w, connection_t *conn) {
+    backend_reset(w, conn);
+    return start_backend(w, conn, 1);
+}
+
+// The backend failed to connect or dropped the connection before answering:
+// send the request to another backend if that is allowed. Returns 1 if a
+// retry started, 0 if it may not be retried and -1 if no backend took it.
+static int retry_elsewhere(worker_t *w, connection_t *conn) {
+    if (!retry_allowed(conn))
+        return 0;
+    conn->retries++;
+    LOG_WARN("[Proxy] Retrying the request of client FD %d on another backend (retry %d)",
+             conn->client.fd, conn->retries);
+    backend_reset(w, conn);
+    release_backend(conn->backend_index);
+    conn->backend_index = -1;
+    return start_backend(w, conn, 0) < 0 ? -1 : 1;
+}
+
+static inline int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// The request is out and its backend has to answer: every upstream request
+// adds to the worker's hedging budget, and a GET that may be hedged gets
+// its hedge timer.
+static void hedge_arm(worker_t *w, connection_t *conn) {
+    if (proxy_config.hedge_percentile <= 0 || conn->hedge_cohort != HEDGE_UNDECIDED)
+        return;
+    w->hedge_tokens += proxy_config.hedge_budget * 10;
+    if (w->hedge_tokens > HEDGE_BURST * 1000)
+        w->hedge_tokens = HEDGE_BURST * 1000;
+    if (!(conn->req.is_get || conn->req.is_head) || conn->req.has_body || !conn->replayable ||
+        conn->tunnel || conn->refresh || conn->sent_to_client > 0) {
+        conn->hedge_cohort = HEDGE_INELIGIBLE;
+        return;
+    }
+    conn->hedge_cohort = hedge_admit(proxy_config.hedge_holdout) ? HEDGE_HELD_OUT : HEDGE_ACTIVE;
+    int64_t delay = hedge_delay_us();
+    if (conn->hedge_cohort == HEDGE_ACTIVE && delay >= 0) {
+        uint64_t waited = (balancer_now_us() - conn->request_us) / 1000;
+        uint64_t due = (uint64_t)(delay + 999) / 1000;
+        timer_add(&w->timers, &conn->hedge_timer, w->now_ms + (due > waited ? due - waited : 0));
+    }
+}
+
+// The hedge timer fired: send the same request to another backend, if the
+// first one still has not answered and the budget allows.
+static void hedge_start(worker_t *w, connection_t *conn) {
+    if (conn->state != STATE_RELAY || conn->resp_head_done || conn->out_end > 0 || conn->hedge.fd >= 0)
+        return;
+    if (w->hedge_tokens < 1000) {
+        hedge_count_denied();
+        return;
+    }
+    uint64_t now_us = balancer_now_us();
+    int index = acquire_backend(conn->tried, conn->route_hash, now_us);
+    if (index < 0)
+        return;
+    conn->tried |= 1u << index;
+    int fd = upstream_checkout(&w->pools[index]);
+    int reused = fd >= 0;
+    if (!reused) {
+        fd = upstream_connect(index);
+        metrics_count(METRIC_CONNECTS, 1);
+        if (fd < 0) {
+            metrics_count(METRIC_CONNECT_FAILURES, 1);
+            health_report(index, 0);
+            release_backend(index);
+            return;
+        }
+        w->pools[index].opened++;
+    }
+    w->hedge_tokens -= 1000;
+    hedge_count_hedged();
+    endpoint_init(&conn->hedge, fd, conn);
+    conn->hedge.writable = reused;
+    conn->hedge_index = index;
+    conn->hedge_reused = reused;
+    conn->hedge_connecting = !reused;
+    conn->hedge_sent = 0;
+    conn->hedge_dispatched_us = now_us;
+    LOG_DEBUG("[Proxy] Hedging the request of client FD %d on backend %s:%d after %llu ms",
+              conn->client.fd, backend_pool[index].ip, backend_pool[index].port,
+              (unsigned long long)((now_us - conn->request_us) / 1000));
+}
+
+// Move the hedge along: finish its connect, write the request and wait for
+// the first response byte. Returns 1 once that byte is there, 0 while
+// waiting and -1 if the hedge failed (it is gone then).
+static int hedge_drive(worker_t *w, connection_t *conn) {
+    endpoint_t *h = &conn->hedge;
+    if (h->fd < 0)
+        return 0;
+    if (conn->hedge_connecting) {
+        if (!h->writable) {
+            set_interest(w, h, EPOLLOUT);
+            return 0;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            metrics_count(METRIC_CONNECT_FAILURES, 1);
+            health_report(conn->hedge_index, 0);
+            hedge_cancel(w, conn);
+            return -1;
+        }
+        metrics_observe(HIST_CONNECT, (balancer_now_us() - conn->hedge_dispatched_us) * 1000);
+        conn->hedge_connecting = 0;
+    }
+    while (conn->hedge_sent < conn->in_msg) {
+        if (!h->writable) {
+            set_interest(w, h, EPOLLOUT);
+            return 0;
+        }
+        ssize_t n = send(h->fd, conn->buffer + conn->hedge_sent, conn->in_msg - conn->hedge_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (would_block()) {
+                h->writable = 0;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            hedge_cancel(w, conn);
+            return -1;
+        }
+        conn->hedge_sent += n;
+    }
+    if (h->readable) {
+        char c;
+        ssize_t n = recv(h->fd, &c, 1, MSG_PEEK);
+        if (n > 0)
+            return 1;
+        if (n == 0 || (!would_block() && errno != EINTR)) {
+            // Closed before answering; a pooled connection may just have been stale.
+            if (!conn->hedge_reused)
+                health_report(conn->hedge_index, 0);
+            hedge_cancel(w, conn);
+            return -1;
+        }
+        h->readable = 0;
+    }
+    set_interest(w, h, EPOLLIN);
+    return 0;
+}
+
+// The hedge answered first, or the first backend failed while a hedge was
+// in flight: the hedge becomes the connection's backend and carries on
+// from wherever it is.
+static void hedge_take_over(worker_t *w, connection_t *conn) {
+    close_endpoint(w, &conn->backend);
+    release_backend(conn->backend_index);
+    conn->backend = conn->hedge;
+    // Its events still name the hedge endpoint.
+    io_watch_move(&w->io, &conn->backend.watch, conn->backend.fd, &conn->backend);
+    endpoint_init(&conn->hedge, -1, conn);
+    conn->backend_index = conn->hedge_index;
+    conn->hedge_index = -1;
+    conn->backend_reused = conn->hedge_reused;
+    conn->dispatched_us = conn->hedge_dispatched_us;
+    conn->in_sent = conn->hedge_sent;
+    conn->upload_aborted = 0;
+    conn->resp_done = 0;
+    timer_cancel(&w->timers, &conn->hedge_timer);
+    if (conn->hedge_connecting) {
+        conn->state = STATE_BACKEND_CONNECT;
+        phase_set(w, conn, PHASE_CONNECT, proxy_config.connect_timeout);
+    } else {
+        conn->state = STATE_RELAY;
+        phase_clear(w, conn);
+    }
+}
+
+static void capture_append(connection_t *conn, const char *data, size_t len) {
+    if (!conn->fill || len == 0)
+        return;
+    if (fill_append(conn->fill, data, len) < 0) {
+        // Too large to cache: keep relaying, stop copying.
+        notify_fill(conn->fill);
+        fill_release(conn->fill);
+        conn->fill = NULL;
+        return;
+    }
+    notify_fill(conn->fill);
+}
+
+// How long a response may be cached and served stale, from its
+// Cache-Control header; responses without max-age get --cache-ttl and
+// --cache-stale. Returns -1 if it must not be cached: it sets a cookie, or
+// it answers a request with credentials (authorized) and the origin did
+// not mark it as shared.
+static int response_lifetime(const char *head, size_t head_len, int authorized, cache_lifetime_t *life) {
+    http_cache_control_t cc = {.max_age = -1, .stale_while_revalidate = -1, .stale_if_error = -1};
+    size_t len;
+    if (head_len > 0)
+        http_cache_control(head, head_len, &cc);
+    if (cc.no_store || (authorized && !cc.shared_auth) ||
+        (head_len > 0 && http_find_header(head, head_len, "Set-Cookie", &len)))
+        return -1;
+    life->fresh = proxy_config.cache_ttl;
+    life->stale_revalidate = proxy_config.cache_stale;
+    life->stale_error = proxy_config.cache_stale;
+    if (cc.max_age >= 0) {
+        // The origin set the lifetime; only its own directives extend it.
+        life->fresh = cc.max_age;
+        life->stale_revalidate = 0;
+        life->stale_error = 0;
+    }
+    if (cc.stale_while_revalidate >= 0)
+        life->stale_revalidate = cc.stale_while_revalidate;
+    if (cc.stale_if_error >= 0)
+        life->stale_error = cc.stale_if_error;
+    return 0;
+}
+
+// Publish the response head to the fill once it is known. Bodies of
+// SPLICE_MIN_BODY or more are spliced instead, so they are neither cached
+// nor shared; responses that vary per client, including encoded ones, are
+// cached but not shared, and only a 200 that may be cached is shared.
+static void capture_start(connection_t *conn) {
+    if (!conn->fill)
+        return;
+    size_t hint = 0;
+    int ok = conn->resp.status != 101;
+    if (conn->resp.body.mode == HTTP_BODY_LENGTH) {
+        ok = ok && conn->resp.body.remaining < SPLICE_MIN_BODY;
+        hint = (size_t)conn->resp.body.remaining;
+    }
+    char head[BUFFER_SIZE];
+    size_t len = 0;
+    if (ok && conn->resp.head_len > 0) {
+        len = http_strip_hop_headers(conn->resp_buf, conn->resp.head_len, head, sizeof(head) - 2);
+        ok = len > 0;
+        memcpy(head + len, "\r\n", 2);
+        len += 2;
+    }
+    // Without Vary, followers can't be told apart by Accept-Encoding, so an
+    // encoded body might reach a client that can't decode it.
+    int shareable = 0;
+    if (ok && len > 0 && conn->resp.status == 200) {
+        size_t field_len;
+        cache_lifetime_t life;
+        shareable = !http_find_header(head, len, "Vary", &field_len) &&
+                    !http_find_header(head, len, "Content-Encoding", &field_len) &&
+                    response_lifetime(head, len, conn->req.has_authorization, &life) == 0;
+    }
+    if (!ok || fill_publish_head(conn->fill, head, len, conn->resp.body.mode != HTTP_BODY_UNTIL_CLOSE,
+                                 hint, shareable) < 0) {
+        fill_finish(conn->fill, 0);
+        notify_fill(conn->fill);
+        fill_release(conn->fill);
+        conn->fill = NULL;
+        return;
+    }
+    notify_fill(conn->fill);
+}
+
+// Whether the client connection can carry another request once the current
+// response is out. The response must end without us closing the socket.
+static int client_keep_alive(const connection_t *conn, int delimited) {
+    return delimited && !conn->tunnel && !conn->refresh && conn->req.keep_alive &&
+           conn->requests + 1 < proxy_config.keepalive_requests;
+}
+
+static const char *connection_header(int keep_alive) {
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+// Swap the backend's hop-by-hop headers for our own Connection header. The
+// head is read with HEAD_SLACK bytes of resp_buf kept free, so the rewritten
+// head still fits in front of the body bytes that came with it.
+static int rewrite_response_head(connection_t *conn) {
+    char head[BUFFER_SIZE];
+    const char *hdr = connection_header(conn->keep_client);
+    size_t hdr_len = strlen(hdr);
+    size_t len = http_strip_hop_headers(conn->resp_buf, conn->resp.head_len, head, sizeof(head) - hdr_len);
+    size_t body_len = conn->out_end - conn->resp.head_len;
+    if (len == 0 || len + hdr_len + body_len > BUFFER_SIZE)
+        return -1;
+    memcpy(head + len, hdr, hdr_len);
+    len += hdr_len;
+    memmove(conn->resp_buf + len, conn->resp_buf + conn->resp.head_len, body_len);
+    memcpy(conn->resp_buf, head, len);
+    conn->out_end = len + body_len;
+    conn->resp.head_len = len;
+    return 0;
+}
+
+// The backend stopped reading (EPIPE/RST). It may still have answered, e.g.
+// with an early error or a raw reply, so drop the rest of the upload and let
+// the response side decide. The connection can no longer be pooled.
+static int upload_failed(connection_t *conn) {
+    if (errno != EPIPE && errno != ECONNRESET)
+        return -1;
+    conn->upload_aborted = 1;
+    relay_pipe_close(&conn->up_pipe);
+    return 0;
+}
+
+// Client -> backend: forward the rest of the current request. Reads from
+// the client only once everything read before has been written upstream,
+// so a slow backend stops the client instead of growing buffers.
+// Returns -1 on error.
+static int pump_request(connection_t *conn) {
+    endpoint_t *c = &conn->client;
+    endpoint_t *b = &conn->backend;
+    ssize_t n;
+    if (conn->upload_aborted)
+        return 0;
+    while (1) {
+        if (conn->in_sent < conn->in_msg) {
+            if (!b->writable)
+                return 0;
+            n = send(b->fd, conn->buffer + conn->in_sent, conn->in_msg - conn->in_sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (would_block()) {
+                    b->writable = 0;
+                    return 0;
+                }
+                if (errno == EINTR)
+                    continue;
+                return upload_failed(conn);
+            }
+            conn->in_sent += n;
+            metrics_count(METRIC_BYTES_TO_BACKEND, n);
+            continue;
+        }
+        if (conn->up_pipe.len > 0) {
+            if (!b->writable)
+                return 0;
+            n = relay_splice_out(&conn->up_pipe, b->fd);
+            if (n < 0) {
+                if (would_block()) {
+                    b->writable = 0;
+                    return 0;
+                }
+                if (errno == EINTR)
+                    continue;
+                return upload_failed(conn);
+            }
+            metrics_count(METRIC_BYTES_TO_BACKEND, n);
+            continue;
+        }
+        if (conn->req.body.done) {
+            // Half-close: pass the client's FIN on once everything is flushed.
+            if (conn->tunnel && c->eof && !b->shut_wr) {
+                shutdown(b->fd, SHUT_WR);
+                b->shut_wr = 1;
+            }
+            return 0;
+        }
+        if (c->eof) {
+            if (!conn->tunnel)
+                return -1;  // client closed in the middle of a request body
+            conn->req.body.done = 1;
+            continue;
+        }
+        if (!c->readable)
+            return 0;
+        if (conn->in_sent == conn->in_len && conn->in_len > 0) {
+            // Everything read so far went upstream; reuse the buffer.
+            conn->in_len = conn->in_sent = conn->in_msg = 0;
+            conn->replayable = 0;
+        }
+        uint64_t opaque = http_framer_opaque_limit(&conn->req.body);
+        if (conn->in_len == 0 && opaque >= SPLICE_MIN_BODY) {
+            n = relay_splice_in(&conn->up_pipe, c->fd, opaque);
+            if (n == 0) {
+                c->eof = 1;
+                continue;
+            }
+            if (n < 0) {
+                if (would_block()) {
+                    c->readable = 0;
+                    return 0;
+                }
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            http_framer_skip(&conn->req.body, n);
+            conn->replayable = 0;
+            continue;
+        }
+        size_t space = BUFFER_SIZE - conn->in_len;
+        if (space == 0)
+            return 0;
+        n = read(c->fd, conn->buffer + conn->in_len, space);
+        if (n == 0) {
+            c->eof = 1;
+            continue;
+        }
+        if (n < 0) {
+            if (would_block()) {
+                c->readable = 0;
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        conn->in_len += n;
+        conn->in_msg += http_framer_consume(&conn->req.body, conn->buffer + conn->in_msg,
+                                            conn->in_len - conn->in_msg);
+        if (conn->req.body.error)
+            return -1;
+    }
+}
+
+// Treat whatever the backend sent as a raw reply delimited by its close.
+static void response_set_raw(connection_t *conn) {
+    memset(&conn->resp, 0, sizeof(conn->resp));
+    http_framer_init(&conn->resp.body, HTTP_BODY_UNTIL_CLOSE, 0);
+    conn->resp_head_done = 1;
+}
+
+// Take in response bytes resp_buf[body_start, out_end): parse heads until
+// the final one, then pass body bytes through the framer and into the fill.
+// Returns 0 to go on, or what pump_response returns.
+static int response_received(connection_t *conn, size_t body_start) {
+    while (!conn->resp_head_done) {
+        int r = http_parse_response(conn->resp_buf, conn->out_end, conn->req.is_head, &conn->resp);
+        if (r == 0)
+            break;
+        if (r < 0)
+            response_set_raw(conn);  // e.g. dummy_server: plain text until close
+        if (conn->resp.status / 100 == 1 && conn->resp.status != 101) {
+            // Interim response (100 Continue, 103 Early Hints): queue it
+            // for the client; the next head is parsed once it is out.
+            conn->interim_end = conn->resp.head_len;
+            return 0;
+        }
+        if (conn->resp.status == 101) {
+            // Protocol upgrade: from here on both directions are raw bytes.
+            conn->tunnel = 1;
+            http_framer_init(&conn->resp.body, HTTP_BODY_UNTIL_CLOSE, 0);
+            http_framer_init(&conn->req.body, HTTP_BODY_UNTIL_CLOSE, 0);
+            conn->in_msg = conn->in_len;
+        }
+        conn->resp_head_done = 1;
+        health_report(conn->backend_index, conn->resp.status < 500);
+        uint64_t now_us = balancer_now_us();
+        conn->upstream_us = now_us - conn->request_us;
+        conn->served_by = conn->backend_index;
+        metrics_observe(HIST_FIRST_BYTE, conn->upstream_us * 1000);
+        metrics_backend_first_byte(conn->backend_index, (now_us - conn->dispatched_us) * 1000);
+        admission_sample(conn->backend_index, now_us - conn->dispatched_us, conn->resp.status == 503, now_us);
+        if (conn->resp.status < 500) {
+            balancer_observe(&balancer, conn->backend_index, now_us - conn->dispatched_us, now_us);
+            if (conn->hedge_cohort == HEDGE_ACTIVE || conn->hedge_cohort == HEDGE_HELD_OUT)
+                hedge_record(now_us - conn->request_us, conn->hedge_cohort == HEDGE_HELD_OUT);
+        }
+        if (conn->stale_obj && conn->resp.status >= 500)
+            return 2;
+        capture_start(conn);
+        if (conn->resp.status != 0 && !conn->tunnel) {
+            conn->keep_client = client_keep_alive(conn, conn->resp.body.mode != HTTP_BODY_UNTIL_CLOSE);
+            if (rewrite_response_head(conn) < 0)
+                return -1;
+        }
+        body_start = conn->resp.head_len;
+    }
+    if (!conn->resp_head_done)
+        return 0;
+    size_t avail = conn->out_end - body_start;
+    size_t used = http_framer_consume(&conn->resp.body, conn->resp_buf + body_start, avail);
+    if (conn->resp.body.error)
+        return -1;
+    if (used < avail) {
+        // Bytes past the end of the response: the backend is out of sync.
+        conn->out_end = body_start + used;
+        conn->resp.keep_alive = 0;
+    }
+    capture_append(conn, conn->resp_buf + body_start, used);
+    if (conn->resp.body.done)
+        conn->resp_done = 1;
+    return 0;
+}
+
+// Backend -> client: stream the response until its framing says it ended
+// (or the backend closes, for close-delimited bodies). Large bodies of known
+// length go through a pipe with splice(). The backend is only read while
+// nothing is waiting for the client, which is what applies backpressure.
+// Returns 1 if the request must be retried on a fresh connection, 2 if the
+// backend answered with a server error and a stale copy may be sent instead,
+// -1 on error.
+static int pump_response(connection_t *conn) {
+    endpoint_t *c = &conn->client;
+    endpoint_t *b = &conn->backend;
+    ssize_t n;
+    while (1) {
+        if (conn->refresh && conn->resp_head_done && !conn->fill)
+            return -1;  // a refresh whose response cannot be cached has nothing left to do
+        if (conn->interim_end > 0) {
+            if (!conn->refresh) {
+                if (!c->writable)
+                    return 0;
+                n = send(c->fd, conn->resp_buf + conn->out_start, conn->interim_end - conn->out_start, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (would_block()) {
+                        c->writable = 0;
+                        return 0;
+                    }
+                    if (errno == EINTR)
+                        continue;
+                    return -1;
+                }
+                conn->out_start += n;
+                conn->sent_to_client += n;
+                if (conn->out_start < conn->interim_end)
+                    continue;
+            }
+            // The interim head is out: parse what came after it.
+            size_t rest = conn->out_end - conn->interim_end;
+            memmove(conn->resp_buf, conn->resp_buf + conn->interim_end, rest);
+            conn->out_start = conn->interim_end = 0;
+            conn->out_end = rest;
+            int r = response_received(conn, 0);
+            if (r != 0)
+                return r;
+            continue;
+        }
+        if (conn->resp_head_done && conn->out_start < conn->out_end) {
+            if (conn->refresh) {
+                conn->out_start = conn->out_end = 0;  // captured; nobody to send it to
+                continue;
+            }
+            if (!c->writable)
+                return 0;
+            n = send(c->fd, conn->resp_buf + conn->out_start, conn->out_end - conn->out_start, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (would_block()) {
+                    c->writable = 0;
+                    return 0;
+                }
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            conn->out_start += n;
+            conn->sent_to_client += n;
+            if (conn->out_start == conn->out_end)
+                conn->out_start = conn->out_end = 0;
+            continue;
+        }
+        if (conn->down_pipe.len > 0) {
+            if (!c->writable)
+                return 0;
+            n = relay_splice_out(&conn->down_pipe, c->fd);
+            if (n < 0) {
+                if (would_block()) {
+                    c->writable = 0;
+                    return 0;
+                }
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            conn->sent_to_client += n;
+            continue;
+        }
+        if (conn->resp_done) {
+            if (conn->tunnel && !c->shut_wr) {
+                shutdown(c->fd, SHUT_WR);
+                c->shut_wr = 1;
+            }
+            return 0;
+        }
+        if (b->fd < 0 || !b->readable)
+            return 0;
+
+        uint64_t opaque = conn->resp_head_done && !conn->fill ? http_framer_opaque_limit(&conn->resp.body) : 0;
+        size_t limit = conn->resp_head_done ? BUFFER_SIZE : BUFFER_SIZE - HEAD_SLACK;
+        if (conn->out_end == 0 && opaque >= SPLICE_MIN_BODY)
+            n = relay_splice_in(&conn->down_pipe, b->fd, opaque);
+        else if (conn->out_end < limit)
+            n = read(b->fd, conn->resp_buf + conn->out_end, limit - conn->out_end);
+        else
+            return -1;  // response head larger than the buffer
+        if (n < 0) {
+            if (would_block()) {
+                b->readable = 0;
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            // A backend that closes without reading the whole request sends
+            // a RST instead of a FIN; what it sent before still counts.
+            if (errno != ECONNRESET)
+                return -1;
+            n = 0;
+        }
+        if (n == 0) {
+            b->eof = 1;
+            if (!conn->resp_head_done) {
+                if (conn->out_end == 0)
+                    return conn->backend_reused && conn->replayable ? 1 : -1;
+                response_set_raw(conn);  // partial, non-HTTP reply: relay as-is
+            }
+            if (conn->resp.body.mode != HTTP_BODY_UNTIL_CLOSE)
+                return -1;  // truncated response
+            conn->resp.body.done = 1;
+            conn->resp_done = 1;
+            continue;
+        }
+        if (conn->out_end == 0 && opaque >= SPLICE_MIN_BODY) {
+            // Spliced bytes are counted, not inspected.
+            http_framer_skip(&conn->resp.body, n);
+            conn->resp_done = conn->resp.body.done;
+            continue;
+        }
+
+        size_t body_start = conn->out_end;
+        conn->out_end += n;
+        int r = response_received(conn, body_start);
+        if (r != 0)
+            return r;
+    }
+}
+
+// Write the remainder of a cached object straight from cache memory: the
+// stored head without its blank line, our Connection header, then the body.
+// Returns 1 when everything was sent, 0 if the socket is full (wait for
+// EPOLLOUT) and -1 on error.
+static int send_cached(connection_t *conn) {
+    cache_object_t *obj = conn->tx_obj;
+    struct iovec parts[3];
+    int count = 0;
+    if (obj->head_len > 0) {
+        const char *hdr = connection_header(conn->keep_client);
+        parts[count++] = (struct iovec){obj->data, obj->head_len - 2};
+        parts[count++] = (struct iovec){(char *)hdr, strlen(hdr)};
+        parts[count++] = (struct iovec){obj->data + obj->head_len, obj->len - obj->head_len};
+    } else {
+        parts[count++] = (struct iovec){obj->data, obj->len};  // raw reply
+    }
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += parts[i].iov_len;
+
+    while (conn->tx_off < total) {
+        if (!conn->client.writable)
+            return 0;
+        struct iovec iov[3];
+        int iovcnt = 0;
+        size_t skip = conn->tx_off;
+        for (int i = 0; i < count; i++) {
+            if (skip >= parts[i].iov_len) {
+                skip -= parts[i].iov_len;
+                continue;
+            }
+            iov[iovcnt].iov_base = (char *)parts[i].iov_base + skip;
+            iov[iovcnt].iov_len = parts[i].iov_len - skip;
+            iovcnt++;
+            skip = 0;
+        }
+        ssize_t wn = writev(conn->client.fd, iov, iovcnt);
+        if (wn < 0) {
+            if (would_block()) {
+                conn->client.writable = 0;
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            LOG_ERRNO("write to client");
+            return -1;
+        }
+        conn->tx_off += wn;
+        conn->sent_to_client += wn;
+    }
+    return 1;
+}
+
+// Answer a follower from its leader's fill: the shared head without its
+// blank line, our Connection header, then body bytes as they are published.
+// Returns 1 when the whole response was sent, 0 to wait (for the leader or
+// EPOLLOUT), 2 if the fill failed before anything was sent and -1 on error.
+static int send_follow(connection_t *conn) {
+    fill_view_t v;
+    fill_view(conn->fill, &v);
+    if (v.state == FILL_PENDING)
+        return 0;
+    if (v.state == FILL_FAILED || !v.shared)
+        return conn->tx_off == 0 ? 2 : -1;
+    if (conn->tx_off == 0) {
+        conn->keep_client = client_keep_alive(conn, v.head_len > 0 && v.delimited);
+        conn->status = head_status(v.head, v.head_len);
+    }
+    const char *hdr = connection_header(conn->keep_client);
+    size_t hdr_len = strlen(hdr);
+    size_t prefix = v.head_len > 0 ? v.head_len - 2 + hdr_len : 0;
+    while (conn->tx_off < prefix + v.body_len) {
+        if (!conn->client.writable)
+            return 0;
+        struct iovec iov[16];
+        int iovcnt = 0;
+        if (v.head_len > 0 && conn->tx_off < v.head_len - 2) {
+            iov[iovcnt].iov_base = (char *)v.head + conn->tx_off;
+            iov[iovcnt++].iov_len = v.head_len - 2 - conn->tx_off;
+        }
+        if (conn->tx_off < prefix) {
+            size_t skip = conn->tx_off > v.head_len - 2 ? conn->tx_off - (v.head_len - 2) : 0;
+            iov[iovcnt].iov_base = (char *)hdr + skip;
+            iov[iovcnt++].iov_len = hdr_len - skip;
+        }
+        size_t body_off = conn->tx_off > prefix ? conn->tx_off - prefix : 0;
+        iovcnt += fill_body_iov(conn->fill, &conn->fill_cur, body_off, v.body_len, iov + iovcnt, 16 - iovcnt);
+        ssize_t wn = writev(conn->client.fd, iov, iovcnt);
+        if (wn < 0) {
+            if (would_block()) {
+                conn->client.writable = 0;
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            LOG_ERRNO("write to client");
+            return -1;
+        }
+        conn->tx_off += wn;
+        conn->sent_to_client += wn;
+    }
+    return v.state == FILL_DONE ? 1 : 0;
+}
+
+// The backend failed before the client got anything: send the stale copy
+// instead if stale-if-error allows it. Returns 1 if so.
+static int serve_stale(worker_t *w, connection_t *conn) {
+    if (!conn->stale_obj || conn->sent_to_client > 0)
+        return 0;
+    LOG_WARN("[Proxy] Backend failed, serving a stale response to client FD %d", conn->client.fd);
+    queue_remove(w, conn);
+    hedge_cancel(w, conn);
+    close_endpoint(w, &conn->backend);
+    if (conn->backend_index >= 0)
+        release_backend(conn->backend_index);
+    conn->backend_index = -1;
+    fill_drop(w, conn);
+    phase_clear(w, conn);
+    conn->tx_obj = conn->stale_obj;
+    conn->stale_obj = NULL;
+    conn->tx_off = 0;
+    conn->keep_client = client_keep_alive(conn, conn->tx_obj->head_len > 0);
+    conn->status = head_status(conn->tx_obj->data, conn->tx_obj->head_len);
+    conn->cache_result = CACHE_RESULT_STALE_ERROR;
+    conn->served_by = -1;
+    conn->state = STATE_SEND_CACHED;
+    return 1;
+}
+
+// No upstream slot in time: answer with the stale copy if there is one,
+// otherwise with a quick 503 telling the client when to retry.
+static void shed_request(worker_t *w, connection_t *conn) {
+    queue_remove(w, conn);
+    metrics_count(METRIC_SHED, 1);
+    if (serve_stale(w, conn))
+        return;
+    LOG_DEBUG("[Proxy] No upstream slot for client FD %d, answering 503", conn->client.fd);
+    send_error_response(conn, 503);
+    cleanup_connection(w, conn);
+}
+
+// Whether a request queued now would get out before its deadline: the
+// queue must have room, and at the rate it has been draining the requests
+// ahead of it must leave within --queue-timeout.
+static int queue_has_room(const worker_t *w) {
+    if (w->queue_len >= proxy_config.queue_size || proxy_config.queue_timeout <= 0)
+        return 0;
+    return w->queue_len == 0 || w->queue_rate < 0 ||
+           (uint64_t)(w->queue_len + 1) * 1000 <= (uint64_t)w->queue_rate * proxy_config.queue_timeout;
+}
+
+// Send a request that missed the cache upstream. When admission control has
+// no slot for it, or others are already waiting for one, it queues behind
+// them, or is shed if it would not get out in time.
+static void dispatch_request(worker_t *w, connection_t *conn) {
+    // Pooled connections are kept for HTTP; tunnels always get their own.
+    int r = w->queue_head ? BALANCE_FULL : start_backend(w, conn, conn->tunnel);
+    if (r == BALANCE_FULL) {
+        if (!queue_has_room(w)) {
+            shed_request(w, conn);
+            return;
+        }
+        LOG_DEBUG("[Proxy] Client FD %d waits for an upstream slot", conn->client.fd);
+        metrics_count(METRIC_QUEUED, 1);
+        queue_add(w, conn);
+        return;
+    }
+    if (r < 0 && !serve_stale(w, conn)) {
+        send_error_response(conn, 502);
+        cleanup_connection(w, conn);
+    }
+}
+
+// Stop following: the leader failed or stalled, so fetch from a backend.
+static void follow_fallback(worker_t *w, connection_t *conn) {
+    follow_remove(w, conn);
+    fill_unfollow(conn->fill, FILL_FALLBACK);
+    conn->fill = NULL;
+    LOG_WARN("[Proxy] Client FD %d stops waiting and fetches on its own", conn->client.fd);
+    conn->cache_result = CACHE_RESULT_MISS;
+    dispatch_request(w, conn);
+}
+
+// Keep the client connection for its next request. Whatever it pipelined
+// behind the finished request moves to the front of the buffer and is
+// parsed right away, so responses go out in request order.
+static void conn_next_request(worker_t *w, connection_t *conn) {
+    hedge_cancel(w, conn);
+    close_endpoint(w, &conn->backend);
+    if (conn->backend_index >= 0)
+        release_backend(conn->backend_index);
+    conn->backend_index = -1;
+    conn->backend_reused = 0;
+    conn->tried = 0;
+    conn->retries = 0;
+    conn->hedge_cohort = HEDGE_UNDECIDED;
+    if (conn->up_pipe.len > 0)
+        relay_pipe_close(&conn->up_pipe);  // unread by a backend that answered early
+    cache_release(conn->tx_obj);
+    conn->tx_obj = NULL;
+    conn->tx_off = 0;
+    cache_release(conn->stale_obj);
+    conn->stale_obj = NULL;
+    fill_drop(w, conn);
+
+    buffer_pool_put(conn->resp_buf);
+    conn->resp_buf = NULL;
+    size_t rest = conn->in_len - conn->in_msg;
+    if (rest > 0) {
+        memmove(conn->buffer, conn->buffer + conn->in_msg, rest);
+    } else {
+        buffer_pool_put(conn->buffer);
+        conn->buffer = NULL;
+    }
+    conn->in_len = rest;
+    conn->in_sent = conn->in_msg = 0;
+    conn->replayable = 1;
+    conn->upload_aborted = 0;
+    conn->out_start = conn->out_end = conn->interim_end = 0;
+    conn->resp_head_done = 0;
+    conn->resp_done = 0;
+    conn->sent_to_client = 0;
+    http_request_init(&conn->req);
+    conn->keep_client = 0;
+    conn->requests++;
+    conn->state = STATE_READ_REQUEST;
+    timer_cancel(&w->timers, &conn->request_timer);
+    if (rest > 0)
+        phase_set(w, conn, PHASE_HEADER, proxy_config.header_timeout);
+    else
+        phase_set(w, conn, PHASE_IDLE, proxy_config.keepalive_timeout * 1000);
+}
+
+// The response is out: wait for the client's next request or close.
+static void end_exchange(worker_t *w, connection_t *conn) {
+    request_done(w, conn);
+    if (conn->keep_client && conn->req.body.done)
+        conn_next_request(w, conn);
+    else
+        cleanup_connection(w, conn);
+}
+
+// Look the request up in the cache under its plain key. A Vary marker there
+// means the response depends on request headers, whose values extend the key.
+// A request with Authorization only gets responses the origin marked as
+// shared (public, s-maxage or must-revalidate).
+static cache_object_t *cache_lookup_request(connection_t *conn, const char *key, size_t key_len,
+                                            cache_freshness_t *freshness) {
+    cache_object_t *obj = cache_lookup_stale(key, key_len, freshness);
+    if (obj && obj->vary) {
+        char vary_key[BUFFER_SIZE];
+        size_t vary_key_len = http_cache_key(conn->buffer, &conn->req, obj->data, obj->len,
+                                             vary_key, sizeof(vary_key));
+        cache_release(obj);
+        obj = vary_key_len ? cache_lookup_stale(vary_key, vary_key_len, freshness) : NULL;
+    }
+    if (obj && conn->req.has_authorization) {
+        http_cache_control_t cc = {0};
+        if (obj->head_len > 0)
+            http_cache_control(obj->data, obj->head_len, &cc);
+        if (!cc.shared_auth) {
+            cache_release(obj);
+            obj = NULL;
+        }
+    }
+    return obj;
+}
+
+// A client that accepts gzip gets the gzip variant of a cached response if
+// it has one; the variant lives as long as the object holding it.
+static cache_object_t *cache_pick_encoding(const connection_t *conn, cache_object_t *obj, int *gzipped) {
+    cache_object_t *gzip = atomic_load_explicit(&obj->gzip, memory_order_acquire);
+    *gzipped = 0;
+    if (!gzip || !http_accepts_gzip(conn->buffer, &conn->req))
+        return obj;
+    atomic_fetch_add_explicit(&gzip->refcount, 1, memory_order_relaxed);
+    cache_release(obj);
+    *gzipped = 1;
+    return gzip;
+}
+
+// Refresh a stale entry without making anyone wait: a copy of the request
+// goes upstream on a connection that has no client, and the response
+// replaces the entry. It leads a fill, so misses meanwhile join it.
+static void start_refresh(worker_t *w, const connection_t *conn, const char *key, size_t key_len) {
+    fill_t *f = fill_lead(key, key_len);
+    if (!f)
+        return;  // already being fetched
+    connection_t *r = conn_create(w, -1);
+    if (r && !(r->buffer = buffer_pool_get())) {
+        cleanup_connection(w, r);
+        r = NULL;
+    }
+    if (!r) {
+        fill_finish(f, 0);
+        fill_release(f);
+        return;
+    }
+    memcpy(r->buffer, conn->buffer, conn->req.head_len);
+    r->in_len = r->in_msg = conn->req.head_len;
+    http_parse_request(r->buffer, r->in_len, &r->req);
+    r->refresh = 1;
+    r->route_hash = cache_hash(key, key_len);
+    r->fill = f;
+    r->fill_leader = 1;
+    request_started(w, r);
+    LOG_DEBUG("[Proxy] Refreshing a stale entry in the background for client FD %d", conn->client.fd);
+    if (start_backend(w, r, 0) < 0) {
+        cleanup_connection(w, r);
+        return;
+    }
+    set_interest(w, &r->backend, EPOLLOUT);
+}
+
+// Cached heads carry no hop-by-hop headers, since every hit gets its own
+// Connection header, and always say where the body ends.
+static void cache_store(connection_t *conn) {
+    fill_view_t v;
+    fill_view(conn->fill, &v);
+    cache_lifetime_t life;
+    if (v.state != FILL_STREAMING || (conn->resp.status != 200 && conn->resp.status != 0) ||
+        response_lifetime(v.head, v.head_len, conn->req.has_authorization, &life) < 0)
+        return;
+    char key[BUFFER_SIZE];
+    size_t key_len = http_cache_key(conn->buffer, &conn->req, NULL, 0, key, sizeof(key));
+    if (key_len == 0)
+        return;
+    const char *head = v.head;
+    size_t len = v.head_len;
+    char framed[BUFFER_SIZE + 128];
+    int compress = 0;
+    if (len > 0) {
+        size_t vary_len, coding_len;
+        const char *vary = http_find_header(v.head, v.head_len, "Vary", &vary_len);
+        char vary_buf[BUFFER_SIZE];
+        if (http_find_header(v.head, v.head_len, "Content-Encoding", &coding_len) &&
+            !(vary && http_list_has(vary, vary_len, "Accept-Encoding"))) {
+            // An encoded body is only for clients that sent the same
+            // Accept-Encoding, whether or not the backend said so.
+            int n = snprintf(vary_buf, sizeof(vary_buf), "%.*s%sAccept-Encoding", vary ? (int)vary_len : 0,
+                             vary ? vary : "", vary ? ", " : "");
+            if (n < 0 || (size_t)n >= sizeof(vary_buf))
+                return;
+            vary = vary_buf;
+            vary_len = (size_t)n;
+        }
+        if (vary) {
+            cache_insert_vary(key, key_len, vary, vary_len, &life);
+            key_len = http_cache_key(conn->buffer, &conn->req, vary, vary_len, key, sizeof(key));
+            if (key_len == 0)
+                return;
+        }
+        compress = compress_eligible(v.head, v.head_len, v.body_len);
+        if (!v.delimited || compress) {
+            len -= 2;
+            memcpy(framed, v.head, len);
+            // The backend ended the body by closing; say how long it was.
+            if (!v.delimited)
+                len += snprintf(framed + len, 64, "Content-Length: %zu\r\n", v.body_len);
+            // Hits may get the gzip variant instead.
+            if (compress)
+                len += snprintf(framed + len, 64, "Vary: Accept-Encoding\r\n");
+            memcpy(framed + len, "\r\n", 2);
+            len += 2;
+            head = framed;
+        }
+    }
+    cache_object_t *obj = fill_to_object(conn->fill, head, len);
+    if (!obj)
+        return;
+    if (!compress) {
+        cache_insert_object(key, key_len, obj, &life);
+        return;
+    }
+    // Keep a reference for the compression job, in case the cache keeps it.
+    atomic_fetch_add_explicit(&obj->refcount, 1, memory_order_relaxed);
+    if (cache_insert_object(key, key_len, obj, &life))
+        compress_submit(key, key_len, obj);
+    else
+        cache_release(obj);
+}
+
+// The response has been fully delivered: park the backend connection if it
+// can carry another request, then move on to the client's next request.
+static void finish_exchange(worker_t *w, connection_t *conn) {
+    if (conn->fill) {
+        // If the original request was GET, cache the backend response for as long as it allows.
+        cache_store(conn);
+        fill_finish(conn->fill, 1);
+        notify_fill(conn->fill);
+        fill_release(conn->fill);
+        conn->fill = NULL;
+    }
+    endpoint_t *b = &conn->backend;
+    if (b->fd >= 0 && !conn->tunnel && conn->resp.keep_alive && !b->eof && !conn->upload_aborted &&
+        conn->req.body.done && conn->in_sent == conn->in_msg && conn->up_pipe.len == 0) {
+        io_unwatch(&w->io, &b->watch, b->fd);
+        upstream_checkin(&w->pools[conn->backend_index], b->fd);
+        b->fd = -1;
+    }
+    LOG_DEBUG("[Proxy] Relayed %llu bytes to client FD %d",
+              (unsigned long long)conn->sent_to_client, conn->client.fd);
+    end_exchange(w, conn);
+}
+
+// Look at what the client sent: serve a cache hit, forward a miss, or fall
+// back to a raw tunnel for anything that is not HTTP.
+static void read_request(worker_t *w, connection_t *conn) {
+    endpoint_t *c = &conn->client;
+    if (!conn->buffer && c->readable && !(conn->buffer = buffer_pool_get())) {
+        LOG_ERRNO("buffer_pool_get");
+        cleanup_connection(w, conn);
+        return;
+    }
+    while (c->readable && conn->in_len < BUFFER_SIZE) {
+        ssize_t n = read(c->fd, conn->buffer + conn->in_len, BUFFER_SIZE - conn->in_len);
+        if (n == 0) {
+            c->eof = 1;
+            break;
+        }
+        if (n < 0) {
+            if (would_block()) {
+                c->readable = 0;
+                break;
+            }
+            if (errno == EINTR)
+                continue;
+            LOG_ERRNO("read from client");
+            cleanup_connection(w, conn);
+            return;
+        }
+        conn->in_len += n;
+    }
+    if (conn->in_len == 0) {
+        // Nothing in flight: an idle connection holds no buffer.
+        buffer_pool_put(conn->buffer);
+        conn->buffer = NULL;
+        if (c->eof)
+            cleanup_connection(w, conn);
+        return;
+    }
+    if (conn->phase == PHASE_IDLE)
+        phase_set(w, conn, PHASE_HEADER, proxy_config.header_timeout);
+    request_begin(conn);
+
+    int r = http_parse_request(conn->buffer, conn->in_len, &conn->req);
+    if (r == 0) {
+        if (conn->in_len == BUFFER_SIZE)
+            send_error_response(conn, 431);
+        if (conn->in_len == BUFFER_SIZE || c->eof)
+            cleanup_connection(w, conn);
+        return;
+    }
+    if (r < 0) {
+        if (http_looks_like_request(conn->buffer, conn->in_len)) {
+            send_error_response(conn, 400);
+            cleanup_connection(w, conn);
+            return;
+        }
+        // Not HTTP at all: relay raw bytes both ways until both sides close.
+        conn->tunnel = 1;
+        memset(&conn->req, 0, sizeof(conn->req));
+        http_framer_init(&conn->req.body, HTTP_BODY_UNTIL_CLOSE, 0);
+        conn->in_msg = conn->in_len;
+        response_set_raw(conn);
+        conn->cache_result = CACHE_RESULT_TUNNEL;
+        request_started(w, conn);
+    } else {
+        request_started(w, conn);
+        conn->in_msg = conn->req.head_len +
+                       http_framer_consume(&conn->req.body, conn->buffer + conn->req.head_len,
+                                           conn->in_len - conn->req.head_len);
+        // If the request is a GET, check the cache. Content-aware routing
+        // sends every request for a key to the same backend.
+        char key[BUFFER_SIZE];
+        size_t key_len = 0;
+        int cacheable = conn->req.is_get && !conn->req.has_body;
+        if (cacheable || balancer.strategy == BALANCE_MAGLEV)
+            key_len = http_cache_key(conn->buffer, &conn->req, NULL, 0, key, sizeof(key));
+        conn->route_hash = key_len > 0 ? cache_hash(key, key_len) : 0;
+        conn->cache_result = CACHE_RESULT_PASS;
+        if (cacheable && key_len > 0) {
+            conn->cache_result = CACHE_RESULT_MISS;
+            cache_freshness_t freshness;
+            uint64_t lookup_ns = metrics_now_ns();
+            conn->tx_obj = cache_lookup_request(conn, key, key_len, &freshness);
+            int gzipped = 0;
+            if (conn->tx_obj)
+                conn->tx_obj = cache_pick_encoding(conn, conn->tx_obj, &gzipped);
+            metrics_observe(HIST_CACHE_LOOKUP, metrics_now_ns() - lookup_ns);
+            if (conn->tx_obj && freshness == CACHE_STALE_IF_ERROR) {
+                conn->stale_obj = conn->tx_obj;  // only if the backend fails
+                conn->tx_obj = NULL;
+            }
+            if (conn->tx_obj) {
+                if (freshness == CACHE_STALE_REFRESH)
+                    start_refresh(w, conn, key, key_len);
+                if (gzipped)
+                    metrics_count(METRIC_GZIP_HITS, 1);
+                LOG_DEBUG("[Proxy] Found %s cached response for client FD %d",
+                          freshness == CACHE_FRESH ? "fresh" : "stale", c->fd);
+                conn->keep_client = client_keep_alive(conn, conn->tx_obj->head_len > 0);
+                conn->status = head_status(conn->tx_obj->data, conn->tx_obj->head_len);
+                conn->cache_result = freshness == CACHE_FRESH ? CACHE_RESULT_HIT : CACHE_RESULT_STALE;
+                conn->state = STATE_SEND_CACHED;
+                return;
+            }
+            // Misses on a key already being fetched wait for that fetch.
+            // Requests with credentials, ranges, preconditions or no-cache
+            // neither wait for nor lead one that others could join: their
+            // response may not be the one others asked for. Their fill only
+            // captures the response.
+            int leader = 1;
+            int own = conn->req.has_authorization || conn->req.has_cookie || conn->req.selective;
+            if (proxy_config.coalesce_timeout > 0)
+                conn->fill = own ? fill_own(key, key_len) : fill_join(key, key_len, w->id, &leader);
+            conn->fill_leader = leader;
+            if (conn->fill && !leader) {
+                LOG_DEBUG("[Proxy] Client FD %d waits for the in-flight fetch of the same key", c->fd);
+                conn->fill_cur.block = NULL;
+                conn->fill_cur.block_start = 0;
+                conn->cache_result = CACHE_RESULT_COALESCED;
+                conn->state = STATE_FOLLOW;
+                follow_add(w, conn);
+                return;
+            }
+        }
+    }
+
+    LOG_DEBUG("[Proxy] Read %zu bytes from client FD %d, forwarding to backend", conn->in_len, c->fd);
+    dispatch_request(w, conn);
+}
+
+// Recompute what each socket should be polled for from the relay state.
+static void update_interest(worker_t *w, connection_t *conn) {
+    endpoint_t *c = &conn->client;
+    endpoint_t *b = &conn->backend;
+    uint32_t cev = 0, bev = 0;
+    switch (conn->state) {
+    case STATE_READ_REQUEST:
+        cev = EPOLLIN;
+        break;
+    case STATE_SEND_CACHED:
+    case STATE_FOLLOW:
+        cev = c->writable ? 0 : EPOLLOUT;
+        break;
+    case STATE_BACKEND_CONNECT:
+        bev = EPOLLOUT;
+        break;
+    case STATE_QUEUED:
+        break;
+    case STATE_RELAY: {
+        int up_pending = !conn->upload_aborted && (conn->in_sent < conn->in_msg || conn->up_pipe.len > 0);
+        int down_pending = ((conn->resp_head_done || conn->interim_end > 0) && conn->out_start < conn->out_end) ||
+                           conn->down_pipe.len > 0;
+        if (!conn->req.body.done && !conn->upload_aborted && !c->eof && !up_pending)
+            cev |= EPOLLIN;
+        if (down_pending && !c->writable)
+            cev |= EPOLLOUT;
+        if (!conn->resp_done && !b->eof && !down_pending)
+            bev |= EPOLLIN;
+        if (up_pending && !b->writable)
+            bev |= EPOLLOUT;
+        break;
+    }
+    default:
+        return;
+    }
+    set_interest(w, c, cev);
+    set_interest(w, b, bev);
+}
+
+static void conn_drive(worker_t *w, connection_t *conn) {
+    // Loops while finished exchanges leave pipelined requests to answer.
+    while (1) {
+        if (conn->state == STATE_READ_REQUEST) {
+            read_request(w, conn);
+            if (conn->state == STATE_DONE)
+                return;
+        }
+        if (conn->state == STATE_SEND_CACHED) {
+            int sent = send_cached(conn);
+            if (sent < 0) {
+                cleanup_connection(w, conn);
+                return;
+            }
+            if (sent > 0) {
+                end_exchange(w, conn);
+                if (conn->state == STATE_DONE)
+                    return;
+                continue;
+            }
+        }
+        if (conn->state == STATE_FOLLOW) {
+            int sent = send_follow(conn);
+            if (sent == 2) {
+                follow_fallback(w, conn);
+                if (conn->state == STATE_DONE)
+                    return;
+            } else if (sent < 0) {
+                cleanup_connection(w, conn);
+                return;
+            } else if (sent == 1) {
+                LOG_DEBUG("[Proxy] Served client FD %d from an in-flight fetch", conn->client.fd);
+                follow_remove(w, conn);
+                fill_unfollow(conn->fill, FILL_SERVED);
+                conn->fill = NULL;
+                end_exchange(w, conn);
+                if (conn->state == STATE_DONE)
+                    return;
+                continue;
+            }
+        }
+        if (conn->state == STATE_BACKEND_CONNECT) {
+            if (!conn->backend.writable)
+                break;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(conn->backend.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                metrics_count(METRIC_CONNECT_FAILURES, 1);
+                LOG_WARN("[Proxy] Backend connect failed: %s", strerror(err));
+                health_report(conn->backend_index, 0);
+                if (retry_elsewhere(w, conn) > 0 || serve_stale(w, conn))
+                    continue;
+                send_error_response(conn, 502);
+                cleanup_connection(w, conn);
+                return;
+            }
+            metrics_observe(HIST_CONNECT, metrics_now_ns() - conn->connect_ns);
+            LOG_DEBUG("[Proxy] Connected to backend FD %d for client FD %d", conn->backend.fd, conn->client.fd);
+            conn->state = STATE_RELAY;
+            phase_clear(w, conn);
+        }
+        if (conn->state == STATE_RELAY) {
+            if (conn->hedge.fd >= 0 && hedge_drive(w, conn) > 0) {
+                LOG_DEBUG("[Proxy] Hedge on backend %s:%d answered first for client FD %d",
+                          backend_pool[conn->hedge_index].ip, backend_pool[conn->hedge_index].port,
+                          conn->client.fd);
+                hedge_count_won();
+                hedge_take_over(w, conn);
+                continue;
+            }
+            int up = pump_request(conn);
+            int down = up < 0 ? 0 : pump_response(conn);
+            if (down == 2 && serve_stale(w, conn))
+                continue;
+            if ((up < 0 || down == 1 || down == -1) && conn->hedge.fd >= 0 &&
+                !conn->resp_head_done && conn->out_end == 0) {
+                // The first backend failed, but the hedge may still answer.
+                if (!conn->backend_reused)
+                    health_report(conn->backend_index, 0);
+                hedge_take_over(w, conn);
+                continue;
+            }
+            if ((up < 0 || down == 1) && conn->backend_reused && conn->replayable && conn->sent_to_client == 0) {
+                // The pooled connection was closed by the backend before it
+                // answered; retry once on a fresh one.
+                if (retry_fresh_backend(w, conn) < 0) {
+                    if (serve_stale(w, conn))
+                        continue;
+                    send_error_response(conn, 502);
+                    cleanup_connection(w, conn);
+                    return;
+                }
+                break;
+            }
+            if (up < 0 || down != 0) {
+                LOG_WARN("[Proxy] Relay failed for client FD %d", conn->client.fd);
+                if (!conn->resp_head_done && conn->out_end == 0 && down != 2) {
+                    // Closed or reset before a single response byte.
+                    health_report(conn->backend_index, 0);
+                    if (retry_elsewhere(w, conn) > 0)
+                        continue;
+                }
+                if (serve_stale(w, conn))
+                    continue;
+                send_error_response(conn, 502);
+                cleanup_connection(w, conn);
+                return;
+            }
+            int flushed = conn->out_start == conn->out_end && conn->down_pipe.len == 0;
+            if (conn->resp_done && flushed &&
+                (!conn->tunnel || conn->upload_aborted ||
+                 (conn->req.body.done && conn->in_sent == conn->in_msg && conn->up_pipe.len == 0))) {
+                finish_exchange(w, conn);
+                if (conn->state == STATE_DONE)
+                    return;
+                continue;
+            }
+            // Once the request is out, the backend has to start answering in time.
+            int awaiting = !conn->resp_head_done && conn->out_end == 0;
+            int sent = conn->upload_aborted ||
+                       (conn->req.body.done && conn->in_sent == conn->in_msg && conn->up_pipe.len == 0);
+            if (!awaiting && conn->hedge_index >= 0)
+                hedge_cancel(w, conn);
+            if (awaiting && sent && conn->phase != PHASE_FIRST_BYTE) {
+                phase_set(w, conn, PHASE_FIRST_BYTE, proxy_config.first_byte_timeout);
+                hedge_arm(w, conn);
+            } else if (!awaiting && conn->phase == PHASE_FIRST_BYTE) {
+                phase_clear(w, conn);
+            }
+        }
+        break;
+    }
+    update_interest(w, conn);
+}
+
+// A connection deadline passed. Whatever the connection waited for is given
+// up on: the backend slot is released and the client told why, if it has
+// not received anything yet.
+static void conn_timeout(wheel_timer_t *t, void *arg) {
+    worker_t *w = arg;
+    connection_t *conn = t->data;
+    int fd = conn->client.fd;
+    if (t == &conn->request_timer) {
+        LOG_WARN("[Proxy] Request on client FD %d exceeded %d ms", fd, proxy_config.request_timeout);
+        if (!serve_stale(w, conn)) {
+            send_error_response(conn, conn->req.body.done ? 504 : 408);
+            cleanup_connection(w, conn);
+            return;
+        }
+    } else if (t == &conn->hedge_timer) {
+        hedge_start(w, conn);
+    } else {
+        switch (conn->phase) {
+        case PHASE_IDLE:
+            LOG_DEBUG("[Proxy] Closing idle client FD %d", fd);
+            cleanup_connection(w, conn);
+            return;
+        case PHASE_HEADER:
+            LOG_WARN("[Proxy] Client FD %d did not send a complete request in time", fd);
+            send_error_response(conn, 408);
+            cleanup_connection(w, conn);
+            return;
+        case PHASE_CONNECT:
+        case PHASE_FIRST_BYTE:
+            LOG_WARN("[Proxy] Backend %s timed out for client FD %d",
+             conn->phase == PHASE_CONNECT ? "connect" : "response", fd);
+            metrics_count(conn->phase == PHASE_CONNECT ? METRIC_CONNECT_FAILURES : METRIC_FIRST_BYTE_TIMEOUTS, 1);
+            health_report(conn->backend_index, 0);
+            admission_sample(conn->backend_index, balancer_now_us() - conn->dispatched_us, 1, balancer_now_us());
+            // A request the backend may already be processing is not repeated,
+            // but a hedge already sent may still answer in time.
+            if (conn->phase == PHASE_FIRST_BYTE && conn->hedge.fd >= 0) {
+                hedge_take_over(w, conn);
+                break;
+            }
+            if (conn->phase == PHASE_CONNECT && retry_elsewhere(w, conn) > 0)
+                break;
+            if (!serve_stale(w, conn)) {
+                send_error_response(conn, 504);
+                cleanup_connection(w, conn);
+                return;
+            }
+            break;
+        case PHASE_QUEUED:
+            LOG_WARN("[Proxy] No upstream slot for client FD %d within %d ms", fd, proxy_config.queue_timeout);
+            shed_request(w, conn);
+            if (conn->state == STATE_DONE)
+                return;
+            break;
+        case PHASE_FOLLOW: {
+            // Only a leader that has not even answered yet is given up on.
+            fill_view_t v;
+            fill_view(conn->fill, &v);
+            if (v.state != FILL_PENDING)
+                return;
+            follow_fallback(w, conn);
+            if (conn->state == STATE_DONE)
+                return;
+            break;
+        }
+        default:
+            return;
+        }
+    }
+    conn_drive(w, conn);
+}
+
+// Hand upstream slots that freed up, here or on other workers, to queued
+// requests, oldest first.
+static void queue_dispatch(worker_t *w) {
+    while (w->queue_head) {
+        connection_t *conn = w->queue_head;
+        int r = start_backend(w, conn, conn->tunnel);
+        if (r == BALANCE_FULL)
+            return;
+        queue_remove(w, conn);
+        w->queue_drained++;
+        if (r < 0 && !serve_stale(w, conn)) {
+            send_error_response(conn, 502);
+            cleanup_connection(w, conn);
+            continue;
+        }
+        conn_drive(w, conn);
+    }
+}
+
+int create_listener(int port, int reuseport) {
+    int listen_fd;
+    struct sockaddr_in listen_addr;
 
     // Create listening socket
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        exit(EXIT_FAILURE);
+        LOG_ERRNO("socket");
+        return -1;
     }
     int opt = 1;
     if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+        LOG_ERRNO("setsockopt");
+        close(listen_fd);
+        return -1;
+    }
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        LOG_ERRNO("setsockopt SO_REUSEPORT");
+        close(listen_fd);
+        return -1;
     }
     memset(&listen_addr, 0, sizeof(listen_addr));
     listen_addr.sin_family = AF_INET;
     listen_addr.sin_addr.s_addr = INADDR_ANY;
-    listen_addr.sin_port = htons(LISTEN_PORT);
+    listen_addr.sin_port = htons(port);
     if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
-        perror("bind");
-        exit(EXIT_FAILURE);
+        LOG_ERRNO("bind");
+        close(listen_fd);
+        return -1;
     }
-    if (listen(listen_fd, 10) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
+    if (listen(listen_fd, proxy_config.listen_backlog) < 0) {
+        LOG_ERRNO("listen");
+        close(listen_fd);
+        return -1;
     }
     set_nonblocking(listen_fd);
-    printf("[Proxy] Listening on port %d...\n", LISTEN_PORT);
+    return listen_fd;
+}
 
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        perror("epoll_create1");
-        exit(EXIT_FAILURE);
+void *worker_loop(void *arg) {
+    worker_t *w = arg;
+    int listen_fd = w->listen_fd;
+    int epoll_fd = w->epoll_fd;
+
+    for (int b = 0; b < backend_count; b++) {
+        if (upstream_pool_init(&w->pools[b], b) < 0) {
+            LOG_ERRNO("upstream_pool_init");
+            exit(EXIT_FAILURE);
+        }
     }
-    struct epoll_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.fd = listen_fd;  // listening fd stored in 'fd' field
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
-        perror("epoll_ctl: listen_fd");
-        exit(EXIT_FAILURE);
+    time_t last_maintenance = 0;
+    fill_stats_t last_fill_stats = {0};
+    uint64_t last_hedge_eligible = 0;
+    size_t last_conns = 0, last_buffers = 0;
+    w->queue_rate = -1;
+    w->now_ms = timer_now_ms();
+    timer_wheel_init(&w->timers, w->now_ms);
+    object_slab_init(&w->conn_slab, sizeof(connection_t));
+    if (io_engine_init(&w->io, proxy_config.io_engine, epoll_fd, listen_fd) < 0) {
+        LOG_WARN("[Proxy] Worker %d cannot use %s (%s), falling back to epoll",
+         w->id, io_engine_name(proxy_config.io_engine), strerror(errno));
+        io_engine_init(&w->io, IO_ENGINE_EPOLL, epoll_fd, listen_fd);
     }
 
-    struct epoll_event events[MAX_EVENTS];
+    io_event_t events[MAX_EVENTS];
     while (1) {
-        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        // Sleep until the next connection deadline, but wake up at least once
+        // a second to evict idle backend connections, and every
+        // ADMISSION_POLL_MS while requests wait for slots other workers may
+        // free. Worker 0 also runs the backend health checks.
+        int64_t timeout = timer_wheel_timeout(&w->timers);
+        if (timeout < 0 || timeout > 1000)
+            timeout = 1000;
+        if (w->queue_head && timeout > ADMISSION_POLL_MS)
+            timeout = ADMISSION_POLL_MS;
+        if (w->id == 0) {
+            int64_t due = health_probe_tick(epoll_fd, timer_now_ms());
+            if (due < timeout)
+                timeout = due;
+        }
+        int nfds = io_wait(&w->io, events, MAX_EVENTS, (int)timeout);
         if (nfds == -1) {
             if (errno == EINTR)
                 continue;
-            perror("epoll_wait");
+            LOG_ERRNO("io_wait");
             break;
         }
+        w->now_ms = timer_now_ms();
+        timer_wheel_advance(&w->timers, w->now_ms, conn_timeout, w);
+        time_t now = time(NULL);
+        if (now != last_maintenance) {
+            for (int b = 0; b < backend_count; b++)
+                upstream_pool_maintain(&w->pools[b], now);
+            if (w->queue_len > 0 || w->queue_drained > 0) {
+                w->queue_rate = w->queue_rate < 0 ? w->queue_drained : (w->queue_rate + w->queue_drained) / 2;
+                w->queue_drained = 0;
+            }
+            if (w->id == 0) {
+                cache_expire();
+                fill_stats_t fs;
+                fill_get_stats(&fs);
+                if (now % 10 == 0 && fs.followers != last_fill_stats.followers) {
+                    LOG_INFO("[Proxy] Coalescing: %lu fetches led, %lu requests joined them, %lu served, %lu fell back",
+                             (unsigned long)fs.leaders, (unsigned long)fs.followers,
+                             (unsigned long)fs.served, (unsigned long)fs.fallbacks);
+                    last_fill_stats = fs;
+                }
+                if (proxy_config.hedge_percentile > 0) {
+                    hedge_update(proxy_config.hedge_percentile, proxy_config.hedge_min_delay);
+                    hedge_stats_t hs;
+                    hedge_get_stats(&hs);
+                    if (now % 10 == 0 && hs.eligible != last_hedge_eligible) {
+                        uint64_t hedgeable = hs.eligible - hs.held_out;
+                        LOG_INFO("[Proxy] Hedging: %lu of %lu requests hedged (%.1f%%), %lu won by the hedge, "
+                                 "%lu over budget; first byte p50/p99 %.1f/%.1f ms, held out (%lu) %.1f/%.1f ms; "
+                                 "delay %.1f ms",
+                                 (unsigned long)hs.hedged, (unsigned long)hedgeable,
+                                 hedgeable ? 100.0 * hs.hedged / hedgeable : 0.0, (unsigned long)hs.won,
+                                 (unsigned long)hs.budget_denied, hs.p50_us / 1000.0, hs.p99_us / 1000.0,
+                                 (unsigned long)hs.held_out, hs.held_p50_us / 1000.0, hs.held_p99_us / 1000.0,
+                                 hs.delay_us / 1000.0);
+                        last_hedge_eligible = hs.eligible;
+                    }
+                }
+                // Other workers' counters are read without a lock; close enough for a log line.
+                size_t conns = 0, conn_pages = 0;
+                for (int i = 0; i < worker_count; i++) {
+                    conns += all_workers[i].conn_slab.in_use;
+                    conn_pages += all_workers[i].conn_slab.pages;
+                }
+                buffer_pool_stats_t bs;
+                buffer_pool_get_stats(&bs);
+                if (now % 10 == 0 && (conns != last_conns || bs.in_use != last_buffers)) {
+                    LOG_INFO("[Proxy] Memory: %zu connections of %zu bytes in %zu KiB of slabs, "
+                             "%zu of %zu I/O buffers lent out (%zu KiB allocated)",
+                             conns, w->conn_slab.size, conn_pages * (SLAB_PAGE_SIZE >> 10),
+                             bs.in_use, bs.total, bs.total * (IO_BUFFER_SIZE >> 10));
+                    last_conns = conns;
+                    last_buffers = bs.in_use;
+                }
+            }
+            last_maintenance = now;
+        }
         for (int i = 0; i < nfds; i++) {
-            // Check if the event is for the listening socket
-            if (events[i].data.fd == listen_fd) {
-                // Accept all pending connections
-                while (1) {
-                    int client_fd = accept(listen_fd, NULL, NULL);
+            endpoint_t *ep = events[i].ptr;
+            // The listening socket is registered with a NULL pointer.
+            if (!ep) {
+                // Accept what is pending, up to a batch: the rest waits in
+                // the backlog until the connections we have got a turn.
+                for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+                    int client_fd = io_accept(&w->io, &events[i]);
                     if (client_fd < 0) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK)
                             break;
-                        perror("accept");
+                        metrics_count(METRIC_ACCEPT_ERRORS, 1);
+                        LOG_ERRNO("accept");
                         break;
                     }
-                    set_nonblocking(client_fd);
-                    printf("[Proxy] Accepted client FD %d\n", client_fd);
-                    
-                    // Choose backend using least connections load balancing
-                    int index = get_least_connection_index();
-                    Backend target = backend_pool[index];
-                    printf("[Proxy] Selected backend %s:%d for client FD %d\n", 
-                           target.ip, target.port, client_fd);
-                    
-                    connection_t *conn = malloc(sizeof(connection_t));
+                    metrics_count(METRIC_ACCEPTED, 1);
+                    LOG_DEBUG("[Proxy] Worker %d accepted client FD %d", w->id, client_fd);
+
+                    // No backend is chosen yet: that waits until the request
+                    // has been read and turned out to be a cache miss.
+                    connection_t *conn = conn_create(w, client_fd);
                     if (!conn) {
-                        perror("malloc");
-                        close(client_fd);
-                        continue;
-                    }
-                    conn->client_fd = client_fd;
-                    conn->backend_index = index;
-                    conn->state = STATE_BACKEND_CONNECT;
-                    conn->buflen = 0;
-                    memset(conn->req_key, 0, sizeof(conn->req_key));
-                    
-                    // Create backend socket
-                    if ((conn->backend_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-                        perror("backend socket");
-                        close(client_fd);
-                        free(conn);
-                        pthread_mutex_lock(&backend_mutex);
-                        backend_active[index]--;
-                        pthread_mutex_unlock(&backend_mutex);
-                        continue;
-                    }
-                    set_nonblocking(conn->backend_fd);
-                    struct sockaddr_in backend_addr;
-                    memset(&backend_addr, 0, sizeof(backend_addr));
-                    backend_addr.sin_family = AF_INET;
-                    backend_addr.sin_port = htons(target.port);
-                    if (inet_pton(AF_INET, target.ip, &backend_addr.sin_addr) <= 0) {
-                        perror("inet_pton");
+                        LOG_ERRNO("malloc");
                         close(client_fd);
-                        close(conn->backend_fd);
-                        free(conn);
-                        pthread_mutex_lock(&backend_mutex);
-                        backend_active[index]--;
-                        pthread_mutex_unlock(&backend_mutex);
                         continue;
                     }
-                    int ret = connect(conn->backend_fd, (struct sockaddr *)&backend_addr, sizeof(backend_addr));
-                    if (ret < 0 && errno != EINPROGRESS) {
-                        perror("connect to backend");
-                        close(client_fd);
-                        close(conn->backend_fd);
-                        free(conn);
-                        pthread_mutex_lock(&backend_mutex);
-                        backend_active[index]--;
-                        pthread_mutex_unlock(&backend_mutex);
-                        continue;
-                    }
-                    // Register the backend FD for writability to detect connect completion.
-                    add_fd(epoll_fd, conn->backend_fd, conn, EPOLLOUT);
                     // Register the client FD for reading the client request.
-                    add_fd(epoll_fd, conn->client_fd, conn, EPOLLIN);
+                    set_interest(w, &conn->client, EPOLLIN);
+                    phase_set(w, conn, PHASE_HEADER, proxy_config.header_timeout);
                 }
-            } else {
-                // The event is for one of our connection fds.
-                connection_t *conn = events[i].data.ptr;
-                if (conn->state == STATE_BACKEND_CONNECT) {
-                    if (events[i].events & EPOLLOUT) {
-                        int err = 0;
-                        socklen_t len = sizeof(err);
-                        if (getsockopt(conn->backend_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
-                            fprintf(stderr, "[Proxy] Backend connect failed: %s\n", strerror(err));
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                        conn->state = STATE_WAIT_CLIENT;
-                        // Modify the backend registration to monitor EPOLLIN for the response.
-                        struct epoll_event ev_mod;
-                        memset(&ev_mod, 0, sizeof(ev_mod));
-                        ev_mod.events = EPOLLIN;
-                        ev_mod.data.ptr = conn;
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->backend_fd, &ev_mod) < 0) {
-                            perror("epoll_ctl MOD backend_fd");
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                        printf("[Proxy] Connected to backend FD %d for client FD %d\n", conn->backend_fd, conn->client_fd);
-                    }
-                } else if (conn->state == STATE_WAIT_CLIENT) {
-                    if (events[i].events & EPOLLIN) {
-                        ssize_t n = read(conn->client_fd, conn->buffer, sizeof(conn->buffer) - 1);
-                        if (n <= 0) {
-                            if (n < 0)
-                                perror("read from client");
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                        conn->buffer[n] = '\0';  // ensure null-termination
-                        conn->buflen = n;
-                        
-                        // If the request is a GET, check the cache.
-                        if (strncmp(conn->buffer, "GET", 3) == 0) {
-                            char *cached_response = cache_lookup(conn->buffer);
-                            if (cached_response) {
-                                printf("[Proxy] Found cached response for client FD %d\n", conn->client_fd);
-                                write(conn->client_fd, cached_response, strlen(cached_response));
-                                cleanup_connection(epoll_fd, conn);
-                                continue;
-                            }
-                            // Save GET request as cache key for later caching.
-                            strncpy(conn->req_key, conn->buffer, BUFFER_SIZE);
-                            conn->req_key[BUFFER_SIZE - 1] = '\0';
-                        } else {
-                            conn->req_key[0] = '\0';
-                        }
-                        
-                        printf("[Proxy] Read %zd bytes from client FD %d, sending to backend FD %d\n", 
-                               n, conn->client_fd, conn->backend_fd);
-                        ssize_t wn = write(conn->backend_fd, conn->buffer, conn->buflen);
-                        if (wn < 0) {
-                            perror("write to backend");
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                        conn->state = STATE_WAIT_BACKEND;
-                        struct epoll_event ev_mod;
-                        memset(&ev_mod, 0, sizeof(ev_mod));
-                        ev_mod.events = EPOLLIN;
-                        ev_mod.data.ptr = conn;
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->backend_fd, &ev_mod) < 0) {
-                            perror("epoll_ctl MOD for backend response");
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                    }
-                } else if (conn->state == STATE_WAIT_BACKEND) {
-                    if (events[i].events & EPOLLIN) {
-                        ssize_t n = read(conn->backend_fd, conn->buffer, sizeof(conn->buffer) - 1);
-                        if (n <= 0) {
-                            if (n < 0)
-                                perror("read from backend");
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                        conn->buffer[n] = '\0';
-                        printf("[Proxy] Read %zd bytes from backend FD %d, sending to client FD %d\n",
-                               n, conn->backend_fd, conn->client_fd);
-                        ssize_t wn = write(conn->client_fd, conn->buffer, n);
-                        if (wn < 0) {
-                            perror("write to client");
-                            cleanup_connection(epoll_fd, conn);
-                            continue;
-                        }
-                        // If the original request was GET, cache the backend response with a TTL of 60 seconds.
-                        if (conn->req_key[0] != '\0') {
-                            cache_insert(conn->req_key, conn->buffer, 60);
-                        }
-                        conn->state = STATE_DONE;
-                        cleanup_connection(epoll_fd, conn);
-                    }
+                continue;
+            }
+            if (w->id == 0 && health_probe_event(epoll_fd, ep, events[i].events, w->now_ms))
+                continue;
+            // A fill our followers wait on progressed.
+            if ((void *)ep == (void *)w) {
+                uint64_t count;
+                if (read(w->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    LOG_ERRNO("read notify_fd");
+                connection_t *f = w->follow_head;
+                while (f) {
+                    connection_t *next = f->follow_next;
+                    conn_drive(w, f);
+                    f = next;
                 }
+                continue;
             }
+            // The event is for one of our connection fds.
+            connection_t *conn = ep->conn;
+            if (conn->state == STATE_DONE)
+                continue;  // closed earlier in this batch
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                ep->readable = 1;
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                ep->writable = 1;
+            conn_drive(w, conn);
+        }
+        if (w->queue_head)
+            queue_dispatch(w);
+        while (w->closed_conns) {
+            connection_t *conn = w->closed_conns;
+            w->closed_conns = conn->next_closed;
+            object_slab_free(&w->conn_slab, conn);
         }
     }
-    close(listen_fd);
-    close(epoll_fd);
+    for (int b = 0; b < backend_count; b++)
+        upstream_pool_destroy(&w->pools[b]);
+    io_engine_destroy(&w->io);
+    return NULL;
+}
+
+static void log_more_verbose(int sig) {
+    (void)sig;
+    log_adjust_level(1);
+}
+
+static void log_less_verbose(int sig) {
+    (void)sig;
+    log_adjust_level(-1);
+}
+
+// What a scrape reads from the other modules rather than from the
+// recorded metrics. Other threads' values are read without a lock.
+static void export_gauges(metrics_buf_t *out) {
+    uint64_t now_ms = timer_now_ms();
+    metrics_printf(out, "# HELP proxy_backend_in_flight Requests holding a backend.\n"
+                        "# TYPE proxy_backend_in_flight gauge\n");
+    for (int i = 0; i < backend_count; i++)
+        metrics_printf(out, "proxy_backend_in_flight{backend=\"%s:%d\"} %d\n", backend_pool[i].ip,
+                       backend_pool[i].port, atomic_load_explicit(&balancer.state[i].active, memory_order_relaxed));
+    admission_stats_t as;
+    admission_get_stats(&as);
+    metrics_printf(out, "# HELP proxy_backend_limit Requests a backend may hold, adapted to its latency.\n"
+                        "# TYPE proxy_backend_limit gauge\n");
+    for (int i = 0; i < backend_count; i++)
+        metrics_printf(out, "proxy_backend_limit{backend=\"%s:%d\"} %d\n", backend_pool[i].ip,
+                       backend_pool[i].port, as.backend_limit[i]);
+    metrics_printf(out, "# HELP proxy_backend_latency_baseline_seconds Lowest recent first-byte latency.\n"
+                        "# TYPE proxy_backend_latency_baseline_seconds gauge\n");
+    for (int i = 0; i < backend_count; i++)
+        metrics_printf(out, "proxy_backend_latency_baseline_seconds{backend=\"%s:%d\"} %.6f\n", backend_pool[i].ip,
+                       backend_pool[i].port, as.base_us[i] / 1e6);
+    metrics_printf(out, "# HELP proxy_upstream_limit Requests all backends together may hold.\n"
+                        "# TYPE proxy_upstream_limit gauge\nproxy_upstream_limit %d\n"
+                        "# HELP proxy_upstream_in_flight Requests holding an upstream slot.\n"
+                        "# TYPE proxy_upstream_in_flight gauge\nproxy_upstream_in_flight %d\n"
+                        "# HELP proxy_admission_queue Requests waiting for an upstream slot.\n"
+                        "# TYPE proxy_admission_queue gauge\n",
+                   as.limit, as.in_flight);
+    for (int i = 0; i < worker_count; i++)
+        metrics_printf(out, "proxy_admission_queue{worker=\"%d\"} %d\n", i, all_workers[i].queue_len);
+    metrics_printf(out, "# HELP proxy_backend_up Whether a backend is in rotation.\n"
+                        "# TYPE proxy_backend_up gauge\n");
+    for (int i = 0; i < backend_count; i++)
+        metrics_printf(out, "proxy_backend_up{backend=\"%s:%d\"} %d\n", backend_pool[i].ip,
+                       backend_pool[i].port, health_rank(i, now_ms) > 0);
+
+    cache_stats_t cs;
+    cache_get_stats(&cs);
+    metrics_printf(out, "# HELP proxy_cache_entries Cached responses.\n# TYPE proxy_cache_entries gauge\n"
+                        "proxy_cache_entries %zu\n"
+                        "# HELP proxy_cache_bytes Memory held by the cache.\n# TYPE proxy_cache_bytes gauge\n"
+                        "proxy_cache_bytes %zu\n"
+                        "# HELP proxy_cache_max_bytes Cache memory budget.\n# TYPE proxy_cache_max_bytes gauge\n"
+                        "proxy_cache_max_bytes %zu\n"
+                        "# HELP proxy_cache_evictions_total Entries evicted to stay within the budget.\n"
+                        "# TYPE proxy_cache_evictions_total counter\nproxy_cache_evictions_total %lu\n"
+                        "# HELP proxy_cache_rejections_total New responses the admission policy did not keep.\n"
+                        "# TYPE proxy_cache_rejections_total counter\nproxy_cache_rejections_total %lu\n"
+                        "# HELP proxy_cache_expirations_total Entries that expired.\n"
+                        "# TYPE proxy_cache_expirations_total counter\nproxy_cache_expirations_total %lu\n"
+                        "# HELP proxy_cache_sketch_bytes Memory of the admission frequency sketch.\n"
+                        "# TYPE proxy_cache_sketch_bytes gauge\nproxy_cache_sketch_bytes %zu\n",
+                   cs.entries, cs.bytes, cs.max_bytes, cs.evictions, cs.rejections, cs.expirations,
+                   cs.sketch_bytes);
+    if (cache_file_enabled()) {
+        cache_file_stats_t cf;
+        cache_file_get_stats(&cf);
+        metrics_printf(out, "# HELP proxy_cache_file_hits_total Lookups answered from the cache file.\n"
+                            "# TYPE proxy_cache_file_hits_total counter\nproxy_cache_file_hits_total %lu\n"
+                            "# HELP proxy_cache_file_records Responses in the cache file.\n"
+                            "# TYPE proxy_cache_file_records gauge\nproxy_cache_file_records %zu\n"
+                            "# HELP proxy_cache_file_used_bytes Bytes of the cache file holding responses.\n"
+                            "# TYPE proxy_cache_file_used_bytes gauge\nproxy_cache_file_used_bytes %zu\n"
+                            "# HELP proxy_cache_file_writes_total Responses written to the cache file.\n"
+                            "# TYPE proxy_cache_file_writes_total counter\nproxy_cache_file_writes_total %lu\n"
+                            "# HELP proxy_cache_file_dropped_total Responses not written to the cache file.\n"
+                            "# TYPE proxy_cache_file_dropped_total counter\nproxy_cache_file_dropped_total %lu\n"
+                            "# HELP proxy_cache_file_discarded_total Torn records found in the cache file.\n"
+                            "# TYPE proxy_cache_file_discarded_total counter\nproxy_cache_file_discarded_total %lu\n",
+                       cs.file_hits, cf.records, cf.used_bytes, cf.writes, cf.dropped, cf.discarded);
+    }
+
+    if (compress_enabled()) {
+        compress_stats_t zs;
+        compress_get_stats(&zs);
+        metrics_printf(out, "# HELP proxy_cache_gzip_variants_total Gzip variants made of cached responses.\n"
+                            "# TYPE proxy_cache_gzip_variants_total counter\nproxy_cache_gzip_variants_total %lu\n"
+                            "# HELP proxy_cache_gzip_skipped_total Cached responses gzip did not shrink enough.\n"
+                            "# TYPE proxy_cache_gzip_skipped_total counter\nproxy_cache_gzip_skipped_total %lu\n"
+                            "# HELP proxy_cache_gzip_dropped_total Cached responses left without a gzip variant.\n"
+                            "# TYPE proxy_cache_gzip_dropped_total counter\nproxy_cache_gzip_dropped_total %lu\n"
+                            "# HELP proxy_cache_gzip_identity_bytes_total Body bytes of responses given a variant.\n"
+                            "# TYPE proxy_cache_gzip_identity_bytes_total counter\n"
+                            "proxy_cache_gzip_identity_bytes_total %llu\n"
+                            "# HELP proxy_cache_gzip_bytes_total Body bytes of the gzip variants.\n"
+                            "# TYPE proxy_cache_gzip_bytes_total counter\nproxy_cache_gzip_bytes_total %llu\n",
+                       zs.variants, zs.skipped, zs.dropped, zs.identity_bytes, zs.gzip_bytes);
+    }
+
+    fill_stats_t fs;
+    fill_get_stats(&fs);
+    hedge_stats_t hs;
+    hedge_get_stats(&hs);
+    metrics_printf(out, "# HELP proxy_coalesced_requests_total Misses that joined an identical in-flight fetch.\n"
+                        "# TYPE proxy_coalesced_requests_total counter\nproxy_coalesced_requests_total %llu\n"
+                        "# HELP proxy_coalesce_fallbacks_total Joined misses that had to fetch on their own.\n"
+                        "# TYPE proxy_coalesce_fallbacks_total counter\nproxy_coalesce_fallbacks_total %llu\n"
+                        "# HELP proxy_hedges_total Requests also sent to a second backend.\n"
+                        "# TYPE proxy_hedges_total counter\nproxy_hedges_total %llu\n"
+                        "# HELP proxy_hedges_won_total Hedges that answered first.\n"
+                        "# TYPE proxy_hedges_won_total counter\nproxy_hedges_won_total %llu\n",
+                   (unsigned long long)fs.followers, (unsigned long long)fs.fallbacks,
+                   (unsigned long long)hs.hedged, (unsigned long long)hs.won);
+
+    size_t conns = 0;
+    for (int i = 0; i < worker_count; i++)
+        conns += all_workers[i].conn_slab.in_use;
+    buffer_pool_stats_t bs;
+    buffer_pool_get_stats(&bs);
+    metrics_printf(out, "# HELP proxy_connections Connection objects in use.\n# TYPE proxy_connections gauge\n"
+                        "proxy_connections %zu\n"
+                        "# HELP proxy_io_buffers_in_use I/O buffers lent to connections.\n"
+                        "# TYPE proxy_io_buffers_in_use gauge\nproxy_io_buffers_in_use %zu\n"
+                        "# HELP proxy_io_buffers I/O buffers allocated.\n# TYPE proxy_io_buffers gauge\n"
+                        "proxy_io_buffers %zu\n"
+                        "# HELP proxy_log_dropped_lines_total Log lines dropped because a ring was full.\n"
+                        "# TYPE proxy_log_dropped_lines_total counter\nproxy_log_dropped_lines_total %lu\n",
+                   conns, bs.in_use, bs.total, log_dropped());
+
+    // For a listening socket, tcpi_unacked is the accept queue length.
+    metrics_printf(out, "# HELP proxy_listen_queue Connections waiting to be accepted.\n"
+                        "# TYPE proxy_listen_queue gauge\n");
+    for (int i = 0; i < worker_count; i++) {
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        if (getsockopt(all_workers[i].listen_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+            metrics_printf(out, "proxy_listen_queue{worker=\"%d\"} %u\n", i, ti.tcpi_unacked);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--workers N] [--port P] [--pool-min N] [--pool-max N] [--pool-idle S] [--cache-mb N]\n"
+                    "          [--keepalive-timeout S] [--keepalive-requests N] [--coalesce-timeout S]\n"
+                    "          [--cache-admission POLICY] [--cache-file PATH] [--cache-file-mb N]\n"
+                    "          [--cache-ttl S] [--cache-stale S] [--gzip-level N]\n"
+                    "          [--connect-timeout MS] [--header-timeout MS]\n"
+                    "          [--first-byte-timeout MS] [--request-timeout MS] [--retries N]\n"
+                    "          [--health-interval MS] [--health-path PATH] [--balance STRATEGY]\n"
+                    "          [--hash-load-factor PCT] [--hedge-percentile N] [--hedge-budget PCT]\n"
+                    "          [--hedge-min-delay MS] [--hedge-holdout PCT] [--io-engine NAME]\n"
+                    "          [--backlog N] [--max-inflight N] [--backend-max-inflight N]\n"
+                    "          [--queue-size N] [--queue-timeout MS]\n"
+                    "          [--log-level LEVEL] [--access-log PATH] [--admin-port P]\n"
+                    "  --workers N   reactor threads, each with its own listener (0 = one per CPU, default %d)\n"
+                    "  --port P      listening port (default %d)\n"
+                    "  --pool-min N  idle backend connections kept warm per backend and worker (default %d)\n"
+                    "  --pool-max N  idle backend connections kept per backend and worker (default %d)\n"
+                    "  --pool-idle S seconds before an idle backend connection is closed (default %d)\n"
+                    "  --cache-mb N  cache memory budget in MiB (default %lu)\n"
+                    "  --cache-admission POLICY  tinylfu (admit new responses only if requested more\n"
+                    "                            often than what they evict) or lru (default %s)\n"
+                    "  --cache-file PATH  also keep the cache in this memory-mapped file, so a restart\n"
+                    "                     starts with a warm cache (default: none)\n"
+                    "  --cache-file-mb N  size of the cache file in MiB (default %lu)\n"
+                    "  --gzip-level N  keep a gzip variant of text-like cached responses, made at this\n"
+                    "                  zlib level (1-9), for clients that accept it; 0 = off (default %d)\n"
+                    "  --keepalive-timeout S   seconds a client connection may wait for its next request (default %d)\n"
+                    "  --keepalive-requests N  requests served per client connection (default %d)\n"
+                    "  --coalesce-timeout S    seconds a cache miss waits for an identical in-flight fetch\n"
+                    "                          before fetching itself, 0 = no coalescing (default %d)\n"
+                    "  --cache-ttl S    seconds a response without max-age stays fresh (default %d)\n"
+                    "  --cache-stale S  seconds past that it may be served stale while it is refreshed,\n"
+                    "                   or when the backend fails (default %d)\n"
+                    "  --connect-timeout MS     backend connect deadline, then 504 (default %d)\n"
+                    "  --header-timeout MS      deadline for a complete request head, then 408 (default %d)\n"
+                    "  --first-byte-timeout MS  deadline for the backend to start answering, then 504 (default %d)\n"
+                    "  --request-timeout MS     deadline for a whole exchange, 0 = none (default %d)\n"
+                    "  --retries N           other backends an idempotent request is sent to when its\n"
+                    "                        backend fails before answering (default %d)\n"
+                    "  --health-interval MS  between health checks of each backend, 0 = off (default %d)\n"
+                    "  --health-path PATH    check with GET PATH and expect 2xx/3xx (default: TCP connect)\n"
+                    "  --balance STRATEGY    least-conn, round-robin, p2c, peak-ewma or maglev (default %s)\n"
+                    "  --hash-load-factor PCT  maglev: most a backend takes, in percent of the mean\n"
+                    "                          load per unit of weight (default %d)\n"
+                    "  --hedge-percentile N  send a GET to a second backend once it waits longer than\n"
+                    "                        this percentile of first-byte latencies, 0 = off (default %d)\n"
+                    "  --hedge-budget PCT    extra upstream requests hedging may add (default %d)\n"
+                    "  --hedge-min-delay MS  shortest wait before hedging (default %d)\n"
+                    "  --hedge-holdout PCT   hedgeable requests never hedged, for comparison (default %d)\n"
+                    "  --io-engine NAME      epoll or io_uring; io_uring falls back to epoll where the\n"
+                    "                        kernel lacks it (default %s)\n"
+                    "  --backlog N           connections the kernel queues for accept (default %d)\n"
+                    "  --max-inflight N      most requests in flight to all backends; the limit adapts\n"
+                    "                        to latency below this (default %d)\n"
+                    "  --backend-max-inflight N  the same for each backend (default %d)\n"
+                    "  --queue-size N        misses a worker holds while every backend is at its limit;\n"
+                    "                        beyond that they get 503, 0 = at once (default %d)\n"
+                    "  --queue-timeout MS    longest wait for an upstream slot, then 503 (default %d)\n"
+                    "  --log-level LEVEL     error, warn, info or debug (default %s); SIGUSR1 makes\n"
+                    "                        the log more verbose, SIGUSR2 less\n"
+                    "  --access-log PATH     one line per request with its timings (- for stdout)\n"
+                    "  --admin-port P        serve metrics at http://%s:P/metrics, 0 = off (default %d)\n",
+            prog, DEFAULT_WORKERS, DEFAULT_PORT,
+            DEFAULT_POOL_MIN_IDLE, DEFAULT_POOL_MAX_IDLE, DEFAULT_POOL_IDLE_TIMEOUT,
+            DEFAULT_CACHE_MAX_BYTES >> 20, DEFAULT_CACHE_ADMISSION, DEFAULT_CACHE_FILE_BYTES >> 20, DEFAULT_GZIP_LEVEL,
+            DEFAULT_KEEPALIVE_TIMEOUT, DEFAULT_KEEPALIVE_REQUESTS,
+            DEFAULT_COALESCE_TIMEOUT, DEFAULT_CACHE_TTL, DEFAULT_CACHE_STALE,
+            DEFAULT_CONNECT_TIMEOUT_MS, DEFAULT_HEADER_TIMEOUT_MS, DEFAULT_FIRST_BYTE_TIMEOUT_MS,
+            DEFAULT_REQUEST_TIMEOUT_MS, DEFAULT_RETRIES, DEFAULT_HEALTH_INTERVAL_MS,
+            DEFAULT_BALANCE, DEFAULT_HASH_LOAD_FACTOR, DEFAULT_HEDGE_PERCENTILE, DEFAULT_HEDGE_BUDGET,
+            DEFAULT_HEDGE_MIN_DELAY_MS, DEFAULT_HEDGE_HOLDOUT, DEFAULT_IO_ENGINE, DEFAULT_LISTEN_BACKLOG,
+            DEFAULT_MAX_INFLIGHT, DEFAULT_BACKEND_MAX_INFLIGHT, DEFAULT_QUEUE_SIZE, DEFAULT_QUEUE_TIMEOUT_MS,
+            DEFAULT_LOG_LEVEL,
+            ADMIN_ADDR, DEFAULT_ADMIN_PORT);
+}
+
+int main(int argc, char *argv[]) {
+    int workers = DEFAULT_WORKERS;
+    int port = DEFAULT_PORT;
+    int strategy = balancer_strategy(DEFAULT_BALANCE);
+    int load_factor = DEFAULT_HASH_LOAD_FACTOR;
+    int engine = io_engine_kind(DEFAULT_IO_ENGINE);
+    int policy = cache_policy_by_name(DEFAULT_CACHE_ADMISSION);
+    const char *cache_path = NULL;
+    size_t cache_file_bytes = DEFAULT_CACHE_FILE_BYTES;
+    int gzip_level = DEFAULT_GZIP_LEVEL;
+    int level = log_level_by_name(DEFAULT_LOG_LEVEL);
+    const char *access_path = NULL;
+    int admin_port = DEFAULT_ADMIN_PORT;
+    int max_inflight = DEFAULT_MAX_INFLIGHT;
+    int backend_max_inflight = DEFAULT_BACKEND_MAX_INFLIGHT;
+    static const struct option long_opts[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"port", required_argument, NULL, 'p'},
+        {"pool-min", required_argument, NULL, 'm'},
+        {"pool-max", required_argument, NULL, 'M'},
+        {"pool-idle", required_argument, NULL, 'i'},
+        {"cache-mb", required_argument, NULL, 'c'},
+        {"cache-admission", required_argument, NULL, 'q'},
+        {"cache-file", required_argument, NULL, 'f'},
+        {"cache-file-mb", required_argument, NULL, 'z'},
+        {"gzip-level", required_argument, NULL, 'Z'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"keepalive-requests", required_argument, NULL, 'r'},
+        {"coalesce-timeout", required_argument, NULL, 'C'},
+        {"cache-ttl", required_argument, NULL, 't'},
+        {"cache-stale", required_argument, NULL, 's'},
+        {"connect-timeout", required_argument, NULL, 'x'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"first-byte-timeout", required_argument, NULL, 'F'},
+        {"request-timeout", required_argument, NULL, 'R'},
+        {"retries", required_argument, NULL, 'y'},
+        {"health-interval", required_argument, NULL, 'I'},
+        {"health-path", required_argument, NULL, 'P'},
+        {"balance", required_argument, NULL, 'b'},
+        {"hash-load-factor", required_argument, NULL, 'L'},
+        {"hedge-percentile", required_argument, NULL, 'e'},
+        {"hedge-budget", required_argument, NULL, 'B'},
+        {"hedge-min-delay", required_argument, NULL, 'D'},
+        {"hedge-holdout", required_argument, NULL, 'O'},
+        {"io-engine", required_argument, NULL, 'E'},
+        {"backlog", required_argument, NULL, 'g'},
+        {"max-inflight", required_argument, NULL, 'j'},
+        {"backend-max-inflight", required_argument, NULL, 'J'},
+        {"queue-size", required_argument, NULL, 'Q'},
+        {"queue-timeout", required_argument, NULL, 'T'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"access-log", required_argument, NULL, 'a'},
+        {"admin-port", required_argument, NULL, 'A'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:p:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'm':
+            upstream_pool_config.min_idle = atoi(optarg);
+            break;
+        case 'M':
+            upstream_pool_config.max_idle = atoi(optarg);
+            break;
+        case 'i':
+            upstream_pool_config.idle_timeout = atoi(optarg);
+            break;
+        case 'c':
+            cache_set_max_bytes((size_t)atol(optarg) << 20);
+            break;
+        case 'f':
+            cache_path = optarg;
+            break;
+        case 'z':
+            cache_file_bytes = (size_t)atol(optarg) << 20;
+            break;
+        case 'Z':
+            gzip_level = atoi(optarg);
+            break;
+        case 'q':
+            policy = cache_policy_by_name(optarg);
+            if (policy < 0) {
+                fprintf(stderr, "Unknown cache admission policy: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'k':
+            proxy_config.keepalive_timeout = atoi(optarg);
+            break;
+        case 'r':
+            proxy_config.keepalive_requests = atoi(optarg);
+            break;
+        case 'C':
+            proxy_config.coalesce_timeout = atoi(optarg);
+            break;
+        case 't':
+            proxy_config.cache_ttl = atoi(optarg);
+            break;
+        case 's':
+            proxy_config.cache_stale = atoi(optarg);
+            break;
+        case 'x':
+            proxy_config.connect_timeout = atoi(optarg);
+            break;
+        case 'H':
+            proxy_config.header_timeout = atoi(optarg);
+            break;
+        case 'F':
+            proxy_config.first_byte_timeout = atoi(optarg);
+            break;
+        case 'R':
+            proxy_config.request_timeout = atoi(optarg);
+            break;
+        case 'y':
+            proxy_config.retries = atoi(optarg);
+            break;
+        case 'I':
+            health_config.interval_ms = atoi(optarg);
+            break;
+        case 'P':
+            health_config.path = optarg;
+            break;
+        case 'b':
+            strategy = balancer_strategy(optarg);
+            if (strategy < 0) {
+                fprintf(stderr, "Unknown balancing strategy: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'L':
+            load_factor = atoi(optarg);
+            break;
+        case 'e':
+            proxy_config.hedge_percentile = atoi(optarg);
+            if (proxy_config.hedge_percentile > 99)
+                proxy_config.hedge_percentile = 99;
+            break;
+        case 'B':
+            proxy_config.hedge_budget = atoi(optarg);
+            break;
+        case 'D':
+            proxy_config.hedge_min_delay = atoi(optarg);
+            break;
+        case 'O':
+            proxy_config.hedge_holdout = atoi(optarg);
+            break;
+        case 'E':
+            engine = io_engine_kind(optarg);
+            if (engine < 0) {
+                fprintf(stderr, "Unknown I/O engine: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'g':
+            proxy_config.listen_backlog = atoi(optarg);
+            break;
+        case 'j':
+            max_inflight = atoi(optarg);
+            break;
+        case 'J':
+            backend_max_inflight = atoi(optarg);
+            break;
+        case 'Q':
+            proxy_config.queue_size = atoi(optarg);
+            break;
+        case 'T':
+            proxy_config.queue_timeout = atoi(optarg);
+            break;
+        case 'l':
+            level = log_level_by_name(optarg);
+            if (level < 0) {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'a':
+            access_path = optarg;
+            break;
+        case 'A':
+            admin_port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
+    // A backend or client closing mid-write must not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, log_more_verbose);
+    signal(SIGUSR2, log_less_verbose);
+
+    log_set_level(level);
+    if (access_path && log_open_access(access_path) < 0) {
+        perror(access_path);
+        exit(EXIT_FAILURE);
+    }
+    if (log_init() < 0) {
+        perror("log_init");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize cache before starting (cache_init defined in cache.c)
+    cache_set_policy(policy);
+    if (cache_path)
+        cache_set_file(cache_path, cache_file_bytes);
+    cache_init();
+    if (compress_start(gzip_level) < 0) {
+        LOG_ERRNO("compress_start");
+        exit(EXIT_FAILURE);
+    }
+    http_parser_init();
+    LOG_INFO("[Proxy] HTTP parser uses %s scanning", http_parser_impl());
+    balancer_init(&balancer, strategy, backend_pool, backend_count, DEFAULT_EWMA_DECAY_MS);
+    balancer_set_load_factor(&balancer, load_factor);
+    LOG_INFO("[Proxy] Balancing with %s", balancer_strategy_name(strategy));
+    admission_init(backend_count, max_inflight, backend_max_inflight);
+    admission_stats_t as;
+    admission_get_stats(&as);
+    for (int i = 0; i < backend_count; i++)
+        balancer_set_limit(&balancer, i, as.backend_limit[i]);
+    proxy_config.io_engine = engine;
+    LOG_INFO("[Proxy] Waiting for I/O with %s", io_engine_name(engine));
+
+    static worker_t pool[MAX_WORKERS];
+    all_workers = pool;
+    worker_count = workers;
+    if (thread_pool_start(pool, workers, port) < 0)
+        exit(EXIT_FAILURE);
+    LOG_INFO("[Proxy] Listening on port %d with %d worker(s)...", port, workers);
+    if (admin_port > 0) {
+        if (metrics_serve(ADMIN_ADDR, admin_port, export_gauges) < 0) {
+            LOG_ERRNO("[Proxy] Admin port");
+            exit(EXIT_FAILURE);
+        }
+        LOG_INFO("[Proxy] Metrics at http://%s:%d/metrics", ADMIN_ADDR, admin_port);
+    }
+
+    thread_pool_join(pool, workers);
     return 0;
 }
\ No newline at end of file
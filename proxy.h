@@ -1,4 +1,70 @@
 #ifndef PROXY_H
 #define PROXY_H
 
+#include <pthread.h>
+#include "backend_servers.h"
+#include "upstream_pool.h"
+#include "timer_wheel.h"
+#include "slab.h"
+#include "io_engine.h"
+
+struct connection;
+
+// One reactor per thread: its own SO_REUSEPORT listener and epoll set,
+// nothing shared with other workers on the hot path.
+typedef struct worker {
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    pthread_t thread;
+    upstream_pool_t pools[MAX_SERVERS];  // idle backend connections, one pool per backend
+    struct connection *closed_conns;     // freed once the current epoll batch is processed
+    timer_wheel_t timers;                // connection deadlines
+    uint64_t now_ms;                     // monotonic time of the current loop iteration
+    int notify_fd;                       // eventfd: a fill our followers wait on progressed
+    struct connection *follow_head;      // client connections answered from another request's fill
+    struct connection *follow_tail;
+    int hedge_tokens;                    // hedging budget in thousandths of a request
+    struct connection *queue_head;       // requests waiting for upstream admission, oldest first
+    struct connection *queue_tail;
+    int queue_len;
+    int queue_drained;                   // requests that left the queue for a backend this second
+    int queue_rate;                      // ... per second recently, -1 until known
+    object_slab_t conn_slab;             // this worker's connection objects
+    io_engine_t io;                      // readiness notification over epoll_fd (--io-engine)
+} worker_t;
+
+// Client connection limits (--keepalive-timeout/--keepalive-requests),
+// deadlines, retries on another backend (--retries), hedging (--hedge-*), request coalescing
+// (--coalesce-timeout), heuristic cache lifetimes (--cache-ttl/--cache-stale) and
+// overload protection (--backlog/--queue-size/--queue-timeout)
+typedef struct {
+    int keepalive_timeout;      // seconds a client may take to send its next request
+    int keepalive_requests;     // requests served on one client connection before it is closed
+    int connect_timeout;        // ms for a backend connect to complete
+    int header_timeout;         // ms for a client to send a complete request head
+    int first_byte_timeout;     // ms from the request being sent to the first response byte
+    int request_timeout;        // ms for a whole exchange, 0 = no limit
+    int retries;                // other backends an idempotent request may be sent to
+    int hedge_percentile;       // hedge GETs slower than this percentile, 0 = off
+    int hedge_budget;           // at most this many extra upstream requests per 100
+    int hedge_min_delay;        // ms a request waits at least before it is hedged
+    int hedge_holdout;          // percent of hedgeable requests never hedged (for comparison)
+    int coalesce_timeout;       // seconds a follower waits for the leader's response head, 0 = off
+    int cache_ttl;              // seconds a response without max-age stays fresh
+    int cache_stale;            // then seconds it may be served stale (revalidate or error)
+    io_engine_kind_t io_engine; // how workers wait for I/O (--io-engine)
+    int listen_backlog;         // connections the kernel queues for accept
+    int queue_size;             // requests a worker may hold waiting for upstream admission
+    int queue_timeout;          // ms one may wait there before it is refused with 503
+} proxy_config_t;
+
+extern proxy_config_t proxy_config;
+
+/* Create a non-blocking listening socket bound to port (returns fd or -1) */
+int create_listener(int port, int reuseport);
+
+/* Event loop of a single worker (pthread entry point, arg is worker_t *) */
+void *worker_loop(void *arg);
+
 #endif // PROXY_H
@@ -0,0 +1,47 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+void relay_pipe_close(relay_pipe_t *p) {
+    if (p->fds[0] >= 0) {
+        close(p->fds[0]);
+        close(p->fds[1]);
+    }
+    relay_pipe_reset(p);
+}
+
+static int relay_pipe_open(relay_pipe_t *p) {
+    if (p->fds[0] >= 0)
+        return 0;
+    if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        p->fds[0] = p->fds[1] = -1;
+        return -1;
+    }
+    p->len = 0;
+    return 0;
+}
+
+ssize_t relay_splice_in(relay_pipe_t *p, int src_fd, uint64_t max) {
+    if (relay_pipe_open(p) < 0)
+        return -1;
+    size_t room = RELAY_PIPE_CAPACITY - p->len;
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (max < room)
+        room = (size_t)max;
+    ssize_t n = splice(src_fd, NULL, p->fds[1], NULL, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+        p->len += n;
+    return n;
+}
+
+ssize_t relay_splice_out(relay_pipe_t *p, int dst_fd) {
+    ssize_t n = splice(p->fds[0], NULL, dst_fd, NULL, p->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+        p->len -= n;
+    return n;
+}
@@ -0,0 +1,31 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Kernel pipe used to move body bytes socket -> socket with splice(),
+// without copying them through user space. Opened on first use.
+typedef struct {
+    int fds[2];             // [0] read end, [1] write end; -1 when closed
+    size_t len;             // bytes currently sitting in the pipe
+} relay_pipe_t;
+
+#define RELAY_PIPE_CAPACITY (64 * 1024)
+
+static inline void relay_pipe_reset(relay_pipe_t *p) {
+    p->fds[0] = p->fds[1] = -1;
+    p->len = 0;
+}
+
+/* Close both ends of the pipe (bytes still in it are lost) */
+void relay_pipe_close(relay_pipe_t *p);
+
+/* Move up to max bytes from src into the pipe (returns bytes moved, 0 on EOF, -1 with errno set) */
+ssize_t relay_splice_in(relay_pipe_t *p, int src_fd, uint64_t max);
+
+/* Move buffered pipe bytes to dst (returns bytes moved, -1 with errno set) */
+ssize_t relay_splice_out(relay_pipe_t *p, int dst_fd);
+
+#endif // RELAY_H
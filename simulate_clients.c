@@ -1,72 +1,733 @@
+// Load generator for the proxy. A few threads, each with its own epoll set,
+// drive many non-blocking client connections that send GETs for URLs drawn
+// from a Zipf distribution, so popular URLs hit the cache and the long tail
+// misses.
+//
+// Closed loop (default): every connection sends its next request as soon as
+// the previous response is in. Open loop (--rate): requests are due at a
+// constant rate whether or not earlier ones were answered; a due request
+// waits for a free connection, and its latency counts from when it was due,
+// not from when it was sent, so a stalled server cannot hide its stalls by
+// slowing the load down (coordinated omission).
+//
+// With --close every request gets a new connection and its latency includes
+// the connect; otherwise connections are kept alive and reopened only when
+// the server closes them.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "http.h"
+#include "hist.h"
 
-#define PROXY_PORT 8080
-#define NUM_CLIENTS 10
-
-void *simulate_client(void *arg) {
-    int client_no = *((int *)arg);
-    free(arg);
-    
-    int sockfd;
-    struct sockaddr_in proxy_addr;
-    char buffer[4096];
-    
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Client socket error");
-        pthread_exit(NULL);
-    }
-    
-    memset(&proxy_addr, 0, sizeof(proxy_addr));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_port = htons(PROXY_PORT);
-    if (inet_pton(AF_INET, "127.0.0.1", &proxy_addr.sin_addr) <= 0) {
-        perror("Client inet_pton error");
-        close(sockfd);
-        pthread_exit(NULL);
-    }
-    
-    if (connect(sockfd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) {
-        perror("Client connect error");
-        close(sockfd);
-        pthread_exit(NULL);
-    }
-    
-    // Send a simple message to the proxy
-    char message[100];
-    sprintf(message, "Hello from client %d", client_no);
-    write(sockfd, message, strlen(message));
-    printf("[Client %d] Sent: %s\n", client_no, message);
-    
-    // Read response from proxy
-    ssize_t n = read(sockfd, buffer, sizeof(buffer)-1);
-    if (n > 0) {
-        buffer[n] = '\0';
-        printf("[Client %d] Received: %s\n", client_no, buffer);
+#define MAX_THREADS 64
+#define MAX_EVENTS 1024
+#define HEAD_MAX 8192
+// Connects a thread has in progress at once while it opens its connections
+#define MAX_CONNECTING 512
+
+typedef struct {
+    const char *host;
+    int port;
+    int threads;
+    int connections;            // total, spread over the threads
+    int duration;               // seconds
+    double rate;                // requests per second in total, 0 = closed loop
+    int close;                  // a new connection per request
+    int urls;
+    double zipf;                // exponent, 0 = uniform
+    const char *prefix;         // URL path prefix
+    int sources;                // local addresses 127.0.0.1 .. 127.0.0.N to connect from
+    const char *json;           // report path, NULL = none
+} options_t;
+
+static options_t opt = {
+    .host = "127.0.0.1",
+    .port = 8080,
+    .threads = 2,
+    .connections = 64,
+    .duration = 10,
+    .rate = 0,
+    .close = 0,
+    .urls = 1000,
+    .zipf = 0.99,
+    .prefix = "/item/",
+    .sources = 1,
+    .json = NULL,
+};
+
+static struct sockaddr_in server;
+static double *zipf_cdf;        // cumulative popularity of URL ranks 0..urls-1
+static atomic_int stopping;
+
+typedef enum {
+    CONN_CLOSED,                // no socket (not opened yet, or between requests with --close)
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_READING,
+    CONN_IDLE                   // open, waiting for a due request (open loop)
+} conn_state_t;
+
+typedef struct conn {
+    int fd;
+    conn_state_t state;
+    int busy;                   // a request is assigned (sending or waiting for its response)
+    uint32_t url;
+    uint32_t sent;              // bytes of the request written
+    uint64_t start_ns;          // when the request was due (open loop) or started
+    char *head;                 // partial response head carried between reads, NULL if none
+    size_t head_len;
+    int head_done;
+    http_response_t resp;
+    struct conn *next_idle;
+} conn_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int timer_fd;               // open loop: fires once per arrival interval
+    conn_t *conns;
+    int count;
+    int sources_next;
+    uint64_t seed;
+    int connecting;             // connects in progress
+    // Connections without a request: free for the next due one (open loop),
+    // or waiting to be restarted after their connect failed (closed loop)
+    conn_t *idle;
+    // Open loop: requests that came due while every connection was busy,
+    // as their due times, oldest first
+    uint64_t *backlog;
+    size_t backlog_cap, backlog_head, backlog_len;
+    uint64_t interval_ns;
+    uint64_t next_due_ns;
+    hist_t latency;
+    // Read by the main thread for progress lines
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t status[6];         // by class, [0] for anything else
+    uint64_t bytes;
+    uint64_t connects;
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(worker_t *w) {
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    return w->seed;
+}
+
+// Rank of the next URL: binary search of a uniform draw in the CDF.
+static uint32_t pick_url(worker_t *w) {
+    double u = (next_random(w) >> 11) * (1.0 / 9007199254740992.0);
+    uint32_t lo = 0, hi = (uint32_t)opt.urls - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int zipf_init(void) {
+    zipf_cdf = malloc(sizeof(double) * opt.urls);
+    if (!zipf_cdf)
+        return -1;
+    double total = 0;
+    for (int i = 0; i < opt.urls; i++) {
+        total += 1.0 / pow(i + 1, opt.zipf);
+        zipf_cdf[i] = total;
+    }
+    for (int i = 0; i < opt.urls; i++)
+        zipf_cdf[i] /= total;
+    zipf_cdf[opt.urls - 1] = 1.0;
+    return 0;
+}
+
+static void count(uint64_t *slot, uint64_t n) {
+    hist_add(slot, n);
+}
+
+static void conn_reset_response(conn_t *c) {
+    free(c->head);
+    c->head = NULL;
+    c->head_len = 0;
+    c->head_done = 0;
+}
+
+static void conn_close(worker_t *w, conn_t *c) {
+    if (c->fd >= 0)
+        close(c->fd);  // also leaves the epoll set
+    if (c->state == CONN_CONNECTING)
+        w->connecting--;
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+    conn_reset_response(c);
+}
+
+// Start a non-blocking connect; the socket is watched edge-triggered for
+// both directions for as long as it is open.
+static int conn_open(worker_t *w, conn_t *c) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (opt.sources > 1) {
+        // Each local address has its own ephemeral ports, so more
+        // connections to one server port fit.
+        struct sockaddr_in local = { .sin_family = AF_INET };
+        local.sin_addr.s_addr = htonl(0x7f000001 + (uint32_t)(w->sources_next++ % opt.sources));
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->state = CONN_CONNECTING;
+    w->connecting++;
+    count(&w->connects, 1);
+    return 0;
+}
+
+static size_t format_request(const conn_t *c, char *buf, size_t size) {
+    return (size_t)snprintf(buf, size, "GET %s%u HTTP/1.1\r\nHost: %s\r\n%s\r\n", opt.prefix, c->url, opt.host,
+                            opt.close ? "Connection: close\r\n" : "");
+}
+
+// Write what is left of the request. Returns 0 when it is out or the socket
+// is full, -1 on error.
+static int conn_send(conn_t *c) {
+    char req[512];
+    size_t len = format_request(c, req, sizeof(req));
+    while (c->sent < len) {
+        ssize_t n = send(c->fd, req + c->sent, len - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->sent += (uint32_t)n;
+    }
+    c->state = CONN_READING;
+    return 0;
+}
+
+static void conn_drive(worker_t *w, conn_t *c, uint32_t events);
+
+static void conn_park(worker_t *w, conn_t *c) {
+    if (c->state != CONN_CLOSED)
+        c->state = CONN_IDLE;
+    c->next_idle = w->idle;
+    w->idle = c;
+}
+
+// Give a request to a connection: due at start_ns. Returns -1 if the
+// connection could not be opened (the request counts as an error and the
+// connection stays closed, without a request).
+static int conn_start(worker_t *w, conn_t *c, uint64_t start_ns) {
+    c->busy = 1;
+    c->url = pick_url(w);
+    c->sent = 0;
+    c->start_ns = start_ns;
+    conn_reset_response(c);
+    memset(&c->resp, 0, sizeof(c->resp));
+    if (c->state == CONN_CLOSED) {
+        if (conn_open(w, c) < 0) {
+            count(&w->errors, 1);
+            c->busy = 0;
+            return -1;
+        }
+        return 0;  // sends once connected
+    }
+    c->state = CONN_SENDING;
+    conn_drive(w, c, EPOLLOUT);
+    return 0;
+}
+
+// A connection has nothing to do: give it the oldest due request (open
+// loop) or its next one (closed loop), or park it.
+static void conn_free(worker_t *w, conn_t *c) {
+    c->busy = 0;
+    if (atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        conn_close(w, c);
+        return;
+    }
+    if (opt.rate <= 0) {
+        if (conn_start(w, c, now_ns()) < 0)
+            conn_park(w, c);  // restarted after the next wait
+        return;
+    }
+    while (w->backlog_len > 0) {
+        uint64_t due = w->backlog[w->backlog_head];
+        w->backlog_head = (w->backlog_head + 1) % w->backlog_cap;
+        w->backlog_len--;
+        if (conn_start(w, c, due) == 0)
+            return;
+    }
+    conn_park(w, c);
+}
+
+static void request_done(worker_t *w, conn_t *c, int ok) {
+    if (ok) {
+        hist_record(&w->latency, now_ns() - c->start_ns);
+        count(&w->completed, 1);
+        int status = c->resp.status;
+        count(&w->status[status >= 100 && status < 600 ? status / 100 : 0], 1);
     } else {
-        printf("[Client %d] No response received.\n", client_no);
+        count(&w->errors, 1);
+    }
+    if (!ok || opt.close || !c->resp.keep_alive)
+        conn_close(w, c);
+    conn_free(w, c);
+}
+
+// Feed response bytes: the head is parsed (buffered across reads if it is
+// split), then the body is only counted. Returns 1 once the response is
+// complete, 0 if more is needed, -1 if it is malformed.
+static int conn_consume(conn_t *c, const char *data, size_t len) {
+    if (!c->head_done) {
+        const char *buf = data;
+        size_t buf_len = len;
+        if (c->head || len < HEAD_MAX) {
+            if (!c->head && !(c->head = malloc(HEAD_MAX)))
+                return -1;
+            size_t take = len < HEAD_MAX - c->head_len ? len : HEAD_MAX - c->head_len;
+            memcpy(c->head + c->head_len, data, take);
+            buf = c->head;
+            buf_len = c->head_len + take;
+        }
+        int r = http_parse_response(buf, buf_len, 0, &c->resp);
+        if (r < 0)
+            return -1;
+        if (r == 0) {
+            if (buf_len >= HEAD_MAX)
+                return -1;
+            c->head_len = buf_len;
+            return 0;
+        }
+        c->head_done = 1;
+        // What came after the head in this read is body.
+        size_t used = c->resp.head_len - c->head_len;
+        free(c->head);
+        c->head = NULL;
+        c->head_len = 0;
+        data += used;
+        len -= used;
+    }
+    size_t used = http_framer_consume(&c->resp.body, data, len);
+    if (c->resp.body.error || used < len)
+        return -1;
+    return c->resp.body.done ? 1 : 0;
+}
+
+static void conn_drive(worker_t *w, conn_t *c, uint32_t events) {
+    if (c->state == CONN_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            if (c->busy) {
+                request_done(w, c, 0);
+            } else {
+                conn_close(w, c);
+                conn_park(w, c);
+            }
+            return;
+        }
+        w->connecting--;
+        if (!c->busy) {
+            conn_free(w, c);  // opened ahead of its first request
+            return;
+        }
+        c->state = CONN_SENDING;
+    }
+    if (c->state == CONN_SENDING && conn_send(c) < 0) {
+        request_done(w, c, 0);
+        return;
+    }
+    if (c->state == CONN_IDLE && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        // The server closed a connection we were not using: drop it from
+        // the idle list lazily by marking it closed.
+        conn_close(w, c);
+        return;
+    }
+    if (c->state != CONN_READING || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+    char buf[65536];
+    while (1) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return;
+            if (errno == EINTR)
+                continue;
+            request_done(w, c, 0);
+            return;
+        }
+        if (n == 0) {
+            // A close-delimited body ends here; anything else was cut short.
+            int ok = c->head_done && c->resp.body.mode == HTTP_BODY_UNTIL_CLOSE;
+            c->resp.keep_alive = 0;
+            request_done(w, c, ok);
+            return;
+        }
+        count(&w->bytes, (uint64_t)n);
+        int r = conn_consume(c, buf, (size_t)n);
+        if (r != 0) {
+            request_done(w, c, r > 0);
+            return;
+        }
+    }
+}
+
+// Open loop: every request due by now goes to an idle connection, or
+// waits in the backlog for one.
+static void arrivals(worker_t *w, uint64_t now) {
+    while (w->next_due_ns <= now) {
+        uint64_t due = w->next_due_ns;
+        w->next_due_ns += w->interval_ns;
+        conn_t *c = w->idle;
+        if (c) {
+            w->idle = c->next_idle;
+            if (conn_start(w, c, due) < 0)
+                conn_park(w, c);
+            continue;
+        }
+        if (w->backlog_len == w->backlog_cap) {
+            size_t cap = w->backlog_cap ? w->backlog_cap * 2 : 4096;
+            uint64_t *b = malloc(cap * sizeof(*b));
+            if (!b) {
+                count(&w->errors, 1);
+                continue;
+            }
+            for (size_t i = 0; i < w->backlog_len; i++)
+                b[i] = w->backlog[(w->backlog_head + i) % w->backlog_cap];
+            free(w->backlog);
+            w->backlog = b;
+            w->backlog_cap = cap;
+            w->backlog_head = 0;
+        }
+        w->backlog[(w->backlog_head + w->backlog_len) % w->backlog_cap] = due;
+        w->backlog_len++;
     }
-    
-    close(sockfd);
-    pthread_exit(NULL);
 }
 
-int main() {
-    pthread_t threads[NUM_CLIENTS];
-    for (int i = 0; i < NUM_CLIENTS; i++) {
-        int *client_no = malloc(sizeof(int));
-        *client_no = i;
-        pthread_create(&threads[i], NULL, simulate_client, client_no);
-        // delay between requests
-        usleep(100000); // 0.1 seconds
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int opened = 0;
+    uint64_t start = now_ns();
+    if (opt.rate > 0) {
+        w->next_due_ns = start + w->interval_ns * (uint64_t)w->id / (uint64_t)opt.threads;
+        struct itimerspec its = {
+            .it_interval = { (time_t)(w->interval_ns / 1000000000ull), (long)(w->interval_ns % 1000000000ull) },
+            .it_value = { 0, 1 },
+        };
+        if (w->interval_ns < 50000)
+            its.it_interval = (struct timespec){ 0, 50000 };  // batch very high rates
+        timerfd_settime(w->timer_fd, 0, &its, NULL);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev);
+    }
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        // Open connections gradually, so the listener's backlog does not
+        // overflow into SYN retransmits.
+        while (opened < w->count && w->connecting < MAX_CONNECTING) {
+            conn_t *c = &w->conns[opened++];
+            if (opt.rate > 0 && opt.close)
+                conn_park(w, c);  // a slot for one request at a time
+            else if (opt.rate > 0 ? conn_open(w, c) : conn_start(w, c, now_ns()))
+                conn_park(w, c);
+        }
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 100);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            conn_t *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t expirations;
+                if (read(w->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    perror("read timerfd");
+                continue;
+            }
+            if (c->fd >= 0)
+                conn_drive(w, c, events[i].events);
+        }
+        if (opt.rate > 0) {
+            arrivals(w, now_ns());
+        } else {
+            // Closed loop: connections whose connect failed start over.
+            conn_t *retry = w->idle;
+            w->idle = NULL;
+            while (retry) {
+                conn_t *c = retry;
+                retry = c->next_idle;
+                if (conn_start(w, c, now_ns()) < 0)
+                    conn_park(w, c);
+            }
+        }
+    }
+    for (int i = 0; i < w->count; i++)
+        conn_close(w, &w->conns[i]);
+    return NULL;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    atomic_store(&stopping, 1);
+}
+
+static void totals(uint64_t *completed, uint64_t *errors) {
+    *completed = *errors = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        *completed += hist_load(&workers[i].completed);
+        *errors += hist_load(&workers[i].errors);
+    }
+}
+
+static void report(double seconds) {
+    hist_t *h = calloc(1, sizeof(*h));
+    if (!h)
+        return;
+    uint64_t completed = 0, errors = 0, bytes = 0, connects = 0, status[6] = {0}, backlog = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        worker_t *w = &workers[i];
+        hist_merge(h, &w->latency);
+        completed += w->completed;
+        errors += w->errors;
+        bytes += w->bytes;
+        connects += w->connects;
+        backlog += w->backlog_len;
+        for (int s = 0; s < 6; s++)
+            status[s] += w->status[s];
+    }
+    static const double quantiles[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999 };
+    static const char *labels[] = { "p50", "p75", "p90", "p99", "p99.9", "p99.99" };
+    int nq = sizeof(quantiles) / sizeof(quantiles[0]);
+
+    printf("\n%s loop, %s, %d connections, %d threads, %d URLs (zipf %.2f), %.1f s\n",
+           opt.rate > 0 ? "open" : "closed", opt.close ? "new connection per request" : "keep-alive",
+           opt.connections, opt.threads, opt.urls, opt.zipf, seconds);
+    if (opt.rate > 0)
+        printf("target rate %.0f req/s, %llu requests still due at the end\n", opt.rate, (unsigned long long)backlog);
+    printf("requests %llu, errors %llu, %.1f req/s, %.2f MB/s, %llu connects\n", (unsigned long long)completed,
+           (unsigned long long)errors, completed / seconds, bytes / seconds / 1e6, (unsigned long long)connects);
+    printf("status 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           (unsigned long long)status[1], (unsigned long long)status[2], (unsigned long long)status[3],
+           (unsigned long long)status[4], (unsigned long long)status[5], (unsigned long long)status[0]);
+    printf("latency ms:");
+    for (int q = 0; q < nq; q++)
+        printf(" %s %.3f", labels[q], hist_quantile(h, quantiles[q]) / 1e6);
+    printf(" max %.3f mean %.3f\n", h->max / 1e6, h->count ? (double)h->sum / h->count / 1e6 : 0.0);
+
+    // The distribution, one line per doubling of the latency.
+    printf("%12s %10s %8s\n", "<= ms", "count", "cum %");
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS && seen < h->count; b += HIST_SUB_BUCKETS) {
+        uint64_t in = 0;
+        for (int s = b; s < b + HIST_SUB_BUCKETS; s++)
+            in += h->buckets[s];
+        if (in == 0)
+            continue;
+        seen += in;
+        printf("%12.3f %10llu %7.3f%%\n", hist_bucket_top(b + HIST_SUB_BUCKETS - 1) / 1e6, (unsigned long long)in,
+               100.0 * seen / h->count);
+    }
+
+    if (opt.json) {
+        FILE *f = strcmp(opt.json, "-") == 0 ? stdout : fopen(opt.json, "w");
+        if (!f) {
+            perror(opt.json);
+        } else {
+            fprintf(f, "{\"mode\": \"%s\", \"rate\": %.1f, \"keepalive\": %s, \"connections\": %d, "
+                       "\"threads\": %d, \"urls\": %d, \"zipf\": %.3f, \"seconds\": %.3f,\n"
+                       " \"requests\": %llu, \"errors\": %llu, \"rps\": %.1f, \"bytes\": %llu, \"connects\": %llu,\n"
+                       " \"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, "
+                       "\"other\": %llu},\n \"latency_ms\": {",
+                    opt.rate > 0 ? "open" : "closed", opt.rate, opt.close ? "false" : "true", opt.connections,
+                    opt.threads, opt.urls, opt.zipf, seconds, (unsigned long long)completed,
+                    (unsigned long long)errors, completed / seconds, (unsigned long long)bytes,
+                    (unsigned long long)connects, (unsigned long long)status[1], (unsigned long long)status[2],
+                    (unsigned long long)status[3], (unsigned long long)status[4], (unsigned long long)status[5],
+                    (unsigned long long)status[0]);
+            for (int q = 0; q < nq; q++)
+                fprintf(f, "\"%s\": %.3f, ", labels[q], hist_quantile(h, quantiles[q]) / 1e6);
+            fprintf(f, "\"max\": %.3f, \"mean\": %.3f}}\n", h->max / 1e6,
+                    h->count ? (double)h->sum / h->count / 1e6 : 0.0);
+            if (f != stdout)
+                fclose(f);
+        }
+    }
+    free(h);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--host ADDR] [--port P] [--threads N] [--connections N] [--duration S]\n"
+                    "          [--rate R] [--close] [--urls N] [--zipf S] [--prefix PATH] [--sources N]\n"
+                    "          [--json PATH]\n"
+                    "  --host ADDR        server address (default %s)\n"
+                    "  --port P           server port (default %d)\n"
+                    "  --threads N        event loops (default %d, at most %d)\n"
+                    "  --connections N    client connections in total (default %d)\n"
+                    "  --duration S       seconds to run (default %d)\n"
+                    "  --rate R           open loop at R requests/s in total, latency counted from when\n"
+                    "                     each request was due; 0 = closed loop (default)\n"
+                    "  --close            a new connection per request (default: keep-alive)\n"
+                    "  --urls N           distinct URLs (default %d)\n"
+                    "  --zipf S           popularity skew of the URLs, 0 = uniform (default %.2f)\n"
+                    "  --prefix PATH      URL path before the URL number (default %s)\n"
+                    "  --sources N        connect from 127.0.0.1 .. 127.0.0.N, for more than ~28000\n"
+                    "                     connections to one port (default 1)\n"
+                    "  --json PATH        also write the results as JSON (- for stdout)\n",
+            prog, opt.host, opt.port, opt.threads, MAX_THREADS, opt.connections, opt.duration, opt.urls, opt.zipf,
+            opt.prefix);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 't'},
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"close", no_argument, NULL, 'C'},
+        {"urls", required_argument, NULL, 'u'},
+        {"zipf", required_argument, NULL, 'z'},
+        {"prefix", required_argument, NULL, 'P'},
+        {"sources", required_argument, NULL, 's'},
+        {"json", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "p:t:c:d:r:h", long_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'H': opt.host = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'C': opt.close = 1; break;
+        case 'u': opt.urls = atoi(optarg); break;
+        case 'z': opt.zipf = atof(optarg); break;
+        case 'P': opt.prefix = optarg; break;
+        case 's': opt.sources = atoi(optarg); break;
+        case 'j': opt.json = optarg; break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+    if (opt.threads < 1 || opt.threads > MAX_THREADS || opt.connections < opt.threads || opt.urls < 1 ||
+        opt.duration < 1 || opt.sources < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    server.sin_family = AF_INET;
+    server.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Not an IPv4 address: %s\n", opt.host);
+        return 1;
+    }
+    if (zipf_init() < 0) {
+        perror("malloc");
+        return 1;
+    }
+    // One descriptor per connection, plus a few per thread.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (int i = 0; i < opt.threads; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->count = opt.connections / opt.threads + (i < opt.connections % opt.threads);
+        w->conns = calloc(w->count, sizeof(conn_t));
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        w->seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        w->sources_next = i;
+        if (opt.rate > 0)
+            w->interval_ns = (uint64_t)(1e9 * opt.threads / opt.rate);
+        if (!w->conns || w->epoll_fd < 0 || w->timer_fd < 0) {
+            perror("worker setup");
+            return 1;
+        }
+        for (int c = 0; c < w->count; c++)
+            w->conns[c].fd = -1;
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < opt.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
     }
-    for (int i = 0; i < NUM_CLIENTS; i++) {
-        pthread_join(threads[i], NULL);
+    // A progress line a second until the time is up (or Ctrl-C).
+    uint64_t last_completed = 0, last_errors = 0;
+    for (int s = 0; s < opt.duration && !atomic_load(&stopping); s++) {
+        sleep(1);
+        uint64_t completed, errors;
+        totals(&completed, &errors);
+        fprintf(stderr, "%3ds %10llu req/s %6llu errors\n", s + 1, (unsigned long long)(completed - last_completed),
+                (unsigned long long)(errors - last_errors));
+        last_completed = completed;
+        last_errors = errors;
     }
+    atomic_store(&stopping, 1);
+    double seconds = (now_ns() - start) / 1e9;
+    for (int i = 0; i < opt.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    report(seconds);
     return 0;
 }
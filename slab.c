@@ -0,0 +1,171 @@
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SLAB_MAX_CLASSES 64
+
+typedef struct slab_chunk {
+    struct slab_chunk *next;
+} slab_chunk_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t chunk_size;
+    slab_chunk_t *free_list;
+    char *page_cursor;        // unused tail of the newest page
+    size_t page_left;
+    size_t chunks_used;
+    size_t chunks_free;
+    size_t pages;
+} __attribute__((aligned(64))) slab_class_t;
+
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int class_count = 0;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static void slab_build_classes(void) {
+    size_t size = SLAB_MIN_CHUNK;
+    while (class_count < SLAB_MAX_CLASSES - 1 && size < SLAB_MAX_CHUNK) {
+        pthread_mutex_init(&classes[class_count].lock, NULL);
+        classes[class_count++].chunk_size = size;
+        size = ((size_t)(size * SLAB_GROWTH_FACTOR) + 7) & ~(size_t)7;
+    }
+    pthread_mutex_init(&classes[class_count].lock, NULL);
+    classes[class_count++].chunk_size = SLAB_MAX_CHUNK;
+}
+
+void slab_init(void) {
+    pthread_once(&slab_once, slab_build_classes);
+}
+
+static int slab_class_for(size_t size) {
+    if (size > SLAB_MAX_CHUNK)
+        return -1;
+    int lo = 0, hi = class_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].chunk_size >= size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+void *slab_alloc(size_t size, uint8_t *cls) {
+    slab_init();
+    int id = slab_class_for(size);
+    if (id < 0) {
+        *cls = SLAB_LARGE;
+        return malloc(size);
+    }
+    slab_class_t *c = &classes[id];
+    void *ptr = NULL;
+    pthread_mutex_lock(&c->lock);
+    if (c->free_list) {
+        ptr = c->free_list;
+        c->free_list = c->free_list->next;
+        c->chunks_free--;
+    } else {
+        if (c->page_left < c->chunk_size) {
+            // The remainder of the old page (less than one chunk) is abandoned.
+            size_t page = c->chunk_size > SLAB_PAGE_SIZE ? c->chunk_size : SLAB_PAGE_SIZE;
+            char *mem = malloc(page);
+            if (!mem) {
+                pthread_mutex_unlock(&c->lock);
+                return NULL;
+            }
+            c->page_cursor = mem;
+            c->page_left = page - page % c->chunk_size;
+            c->pages++;
+        }
+        ptr = c->page_cursor;
+        c->page_cursor += c->chunk_size;
+        c->page_left -= c->chunk_size;
+    }
+    c->chunks_used++;
+    pthread_mutex_unlock(&c->lock);
+    *cls = (uint8_t)id;
+    return ptr;
+}
+
+void slab_free(void *ptr, uint8_t cls) {
+    if (!ptr)
+        return;
+    if (cls == SLAB_LARGE) {
+        free(ptr);
+        return;
+    }
+    slab_class_t *c = &classes[cls];
+    slab_chunk_t *chunk = ptr;
+    pthread_mutex_lock(&c->lock);
+    chunk->next = c->free_list;
+    c->free_list = chunk;
+    c->chunks_used--;
+    c->chunks_free++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+size_t slab_chunk_size(size_t size) {
+    slab_init();
+    int id = slab_class_for(size);
+    return id < 0 ? size : classes[id].chunk_size;
+}
+
+int slab_class_count(void) {
+    slab_init();
+    return class_count;
+}
+
+void slab_get_stats(int cls, slab_class_stats_t *stats) {
+    slab_class_t *c = &classes[cls];
+    pthread_mutex_lock(&c->lock);
+    stats->chunk_size = c->chunk_size;
+    stats->chunks_used = c->chunks_used;
+    stats->chunks_free = c->chunks_free;
+    stats->pages = c->pages;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void object_slab_init(object_slab_t *s, size_t size) {
+    memset(s, 0, sizeof(*s));
+    // Keep objects aligned for whatever they embed.
+    if (size < sizeof(slab_chunk_t))
+        size = sizeof(slab_chunk_t);
+    s->size = (size + 15) & ~(size_t)15;
+}
+
+void *object_slab_alloc(object_slab_t *s) {
+    void *ptr;
+    if (s->free_list) {
+        slab_chunk_t *chunk = s->free_list;
+        s->free_list = chunk->next;
+        s->free--;
+        ptr = chunk;
+    } else {
+        if (s->page_left < s->size) {
+            char *mem = aligned_alloc(64, SLAB_PAGE_SIZE);
+            if (!mem)
+                return NULL;
+            s->page_cursor = mem;
+            s->page_left = SLAB_PAGE_SIZE;
+            s->pages++;
+        }
+        ptr = s->page_cursor;
+        s->page_cursor += s->size;
+        s->page_left -= s->size;
+    }
+    s->in_use++;
+    return ptr;
+}
+
+void object_slab_free(object_slab_t *s, void *ptr) {
+    if (!ptr)
+        return;
+    slab_chunk_t *chunk = ptr;
+    chunk->next = s->free_list;
+    s->free_list = chunk;
+    s->in_use--;
+    s->free++;
+}
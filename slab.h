@@ -0,0 +1,61 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-classed slab allocator for cache objects. Chunk sizes grow by
+// SLAB_GROWTH_FACTOR from SLAB_MIN_CHUNK; each class carves its chunks out of
+// SLAB_PAGE_SIZE pages. Requests above SLAB_MAX_CHUNK fall back to malloc.
+#define SLAB_MIN_CHUNK 48
+#define SLAB_MAX_CHUNK (512 * 1024)
+#define SLAB_PAGE_SIZE (1024 * 1024)
+#define SLAB_GROWTH_FACTOR 1.25
+#define SLAB_LARGE 0xff   // class id of malloc'd (oversized) chunks
+
+typedef struct {
+    size_t chunk_size;
+    size_t chunks_used;
+    size_t chunks_free;
+    size_t pages;
+} slab_class_stats_t;
+
+/* Build the size-class table (called once; safe to call again) */
+void slab_init(void);
+
+/* Allocate at least size bytes; the class id needed by slab_free is stored in *cls */
+void *slab_alloc(size_t size, uint8_t *cls);
+
+/* Return a chunk to its class free list */
+void slab_free(void *ptr, uint8_t cls);
+
+/* Bytes actually reserved for an allocation of size bytes */
+size_t slab_chunk_size(size_t size);
+
+/* Number of size classes and per-class statistics */
+int slab_class_count(void);
+void slab_get_stats(int cls, slab_class_stats_t *stats);
+
+// Fixed-size objects for a single thread, e.g. a worker's connections: a
+// free list without locks, refilled from SLAB_PAGE_SIZE pages that are kept
+// for reuse once allocated.
+typedef struct {
+    size_t size;
+    void *free_list;
+    char *page_cursor;
+    size_t page_left;
+    size_t in_use;
+    size_t free;
+    size_t pages;
+} object_slab_t;
+
+/* Prepare s for objects of size bytes */
+void object_slab_init(object_slab_t *s, size_t size);
+
+/* An object from s, or NULL if out of memory */
+void *object_slab_alloc(object_slab_t *s);
+
+/* Give ptr back to s */
+void object_slab_free(object_slab_t *s, void *ptr);
+
+#endif // SLAB_H
@@ -0,0 +1,148 @@
+#!/bin/bash
+# Checks that the cache and the coalescing of concurrent misses keep one
+# client's responses from another: each case starts dummy_server and the
+# proxy afresh, sends requests with curl and reads the proxy's cache results
+# from its metrics.
+# Usage: tests/cache_privacy.sh (after building the proxy and dummy_server)
+# Environment: PORT (18080), ADMIN_PORT (18081).
+cd "$(dirname "$0")/.." || exit 1
+
+PORT=${PORT:-18080}
+ADMIN_PORT=${ADMIN_PORT:-18081}
+BACKEND_PID=
+PROXY_PID=
+FAILED=0
+
+if (exec 3<>/dev/tcp/127.0.0.1/9090) 2>/dev/null; then
+  echo "Something already listens on port 9090; stop the backends first." >&2
+  exit 1
+fi
+
+stop() {
+  [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null && wait "$PROXY_PID" 2>/dev/null
+  [ -n "$BACKEND_PID" ] && kill "$BACKEND_PID" 2>/dev/null && wait "$BACKEND_PID" 2>/dev/null
+  PROXY_PID=
+  BACKEND_PID=
+}
+trap stop EXIT
+
+wait_port() {
+  for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Nothing came up on port $1" >&2
+  return 1
+}
+
+# start DUMMY_SERVER_ARG...
+start() {
+  ./dummy_server "$@" 9090-9099 > /dev/null 2>&1 &
+  BACKEND_PID=$!
+  wait_port 9099 || exit 1
+  ./proxy_server --port "$PORT" --admin-port "$ADMIN_PORT" --log-level error > /dev/null 2>&1 &
+  PROXY_PID=$!
+  wait_port "$PORT" || exit 1
+}
+
+get() {
+  curl -s -o /dev/null "$@" "http://127.0.0.1:$PORT/me"
+}
+
+# Three requests at once, with the given headers; the backend takes 300 ms,
+# so the later two find the first one's fetch in flight.
+get_concurrently() {
+  local pids=()
+  for h in "$@"; do
+    if [ -n "$h" ]; then get -H "$h" & else get & fi
+    pids+=($!)
+    sleep 0.05
+  done
+  wait "${pids[@]}"
+}
+
+# Requests the proxy answered with the given cache result.
+answered() {
+  curl -s "http://127.0.0.1:$ADMIN_PORT/metrics" | awk -v r="proxy_requests_total{cache=\"$1\"}" '$1 == r { print $2 }'
+}
+
+# expect CASE RESULT COUNT
+expect() {
+  local n
+  n=$(answered "$2")
+  if [ "$n" = "$3" ]; then
+    echo "ok    $1: $2=$n"
+  else
+    echo "FAIL  $1: $2=$n, expected $3"
+    FAILED=1
+  fi
+}
+
+start
+get
+get
+expect "anonymous requests share a response" hit 1
+stop
+
+start
+get -H "Authorization: Bearer alice"
+get -H "Cookie: session=bob"
+expect "a response to Authorization is not stored" hit 0
+get -H "Cookie: session=bob"
+get -H "Authorization: Bearer alice"
+expect "Authorization does not get a stored response" hit 1
+stop
+
+start --cache-control "public, max-age=60"
+get -H "Authorization: Bearer alice"
+get -H "Authorization: Bearer bob"
+expect "a public response to Authorization is shared" hit 1
+stop
+
+start --header "Set-Cookie: session=alice"
+get
+get
+expect "a response that sets a cookie is not stored" hit 0
+stop
+
+start --latency fixed:300
+get_concurrently "" "" ""
+expect "anonymous misses wait for one fetch" coalesced 2
+stop
+
+start --latency fixed:300 --cache-control "private, no-store"
+get_concurrently "" "" ""
+expect "a private response is not shared with waiting requests" coalesced 0
+stop
+
+start --latency fixed:300 --cache-control "private, no-store"
+get_concurrently "Authorization: Bearer alice" "Authorization: Bearer bob" "Authorization: Bearer carol"
+expect "requests with Authorization do not wait for each other" coalesced 0
+stop
+
+start --latency fixed:300
+get_concurrently "" "Cookie: session=bob" "Cookie: session=carol"
+expect "requests with Cookie do not wait for another fetch" coalesced 0
+stop
+
+start --latency fixed:300 --header "Set-Cookie: session=alice"
+get_concurrently "" "" ""
+expect "a response that sets a cookie is not shared with waiting requests" coalesced 0
+stop
+
+start --latency fixed:300
+get_concurrently "Range: bytes=0-4" "" ""
+expect "a Range request's fetch is not shared, others still wait for one" coalesced 1
+stop
+
+start --latency fixed:300
+get_concurrently "If-None-Match: \"v1\"" "" ""
+expect "a conditional request's fetch is not shared, others still wait for one" coalesced 1
+stop
+
+start --latency fixed:300 --header "Content-Encoding: gzip"
+get_concurrently "Accept-Encoding: gzip" "" ""
+expect "an encoded response without Vary is not shared with waiting requests" coalesced 0
+stop
+
+exit $FAILED
@@ -1 +1,61 @@
+#include "thread_pool.h"
+#include "log.h"
+#include <string.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+int thread_pool_start(worker_t *workers, int count, int port) {
+    for (int i = 0; i < count; i++) {
+        worker_t *w = &workers[i];
+        memset(w, 0, sizeof(*w));
+        w->id = i;
+        // Every worker binds its own socket; the kernel spreads new
+        // connections across them (SO_REUSEPORT), so accepts never contend.
+        w->listen_fd = create_listener(port, 1);
+        if (w->listen_fd < 0)
+            return -1;
+        w->epoll_fd = epoll_create1(0);
+        if (w->epoll_fd < 0) {
+            LOG_ERRNO("epoll_create1");
+            return -1;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;  // connection fds carry an endpoint pointer, the listener NULL
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) == -1) {
+            LOG_ERRNO("epoll_ctl: listen_fd");
+            return -1;
+        }
+        // Other workers finishing a fill wake our followers through this.
+        w->notify_fd = eventfd(0, EFD_NONBLOCK);
+        if (w->notify_fd < 0) {
+            LOG_ERRNO("eventfd");
+            return -1;
+        }
+        ev.data.ptr = w;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->notify_fd, &ev) == -1) {
+            LOG_ERRNO("epoll_ctl: notify_fd");
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+        if (err != 0) {
+            LOG_ERROR("[Proxy] pthread_create: %s", strerror(err));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void thread_pool_join(worker_t *workers, int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].listen_fd);
+        close(workers[i].notify_fd);
+        close(workers[i].epoll_fd);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "proxy.h"
+
+/* Create listener + epoll set for each worker and start its thread (returns 0 on success) */
+int thread_pool_start(worker_t *workers, int count, int port);
+
+/* Wait for all worker threads to exit and release their fds */
+void thread_pool_join(worker_t *workers, int count);
+
+#endif // THREAD_POOL_H
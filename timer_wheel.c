@@ -0,0 +1,162 @@
+#include "timer_wheel.h"
+#include <time.h>
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define LEVEL_SHIFT(l) ((l) * TIMER_SLOT_BITS)
+#define WHEEL_SPAN (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Slot lists are circular with the slot itself as the sentinel, so a timer
+// unlinks without knowing which list it is on.
+static void list_init(wheel_timer_t *head) {
+    head->prev = head->next = head;
+}
+
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now) {
+    for (int i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++)
+        list_init(&tw->slots[i]);
+    for (int l = 0; l < TIMER_LEVELS; l++)
+        tw->occupied[l] = 0;
+    tw->now = now;
+    tw->count = 0;
+}
+
+void timer_init(wheel_timer_t *t, void *data) {
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->slot = 0;
+    t->data = data;
+}
+
+// Put t in the slot of the lowest level whose span covers its delay.
+static void place(timer_wheel_t *tw, wheel_timer_t *t) {
+    uint64_t delta = t->expires - tw->now;
+    uint64_t when = t->expires;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        when = tw->now + delta;  // parked; re-placed when its slot comes round
+    }
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && (delta >> LEVEL_SHIFT(level + 1)) != 0)
+        level++;
+    int index = (int)((when >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    wheel_timer_t *head = &tw->slots[level * TIMER_SLOTS + index];
+    t->slot = (uint16_t)(level * TIMER_SLOTS + index);
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    tw->occupied[level] |= 1ULL << index;
+}
+
+static void unlink_timer(timer_wheel_t *tw, wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    wheel_timer_t *head = &tw->slots[t->slot];
+    if (head->next == head)
+        tw->occupied[t->slot / TIMER_SLOTS] &= ~(1ULL << (t->slot % TIMER_SLOTS));
+    t->prev = t->next = NULL;
+}
+
+void timer_add(timer_wheel_t *tw, wheel_timer_t *t, uint64_t expires) {
+    if (timer_pending(t))
+        unlink_timer(tw, t);
+    else
+        tw->count++;
+    t->expires = expires > tw->now ? expires : tw->now + 1;
+    place(tw, t);
+}
+
+void timer_cancel(timer_wheel_t *tw, wheel_timer_t *t) {
+    if (!timer_pending(t))
+        return;
+    unlink_timer(tw, t);
+    tw->count--;
+}
+
+// Move a slot's timers onto a private list headed by out.
+static void take_slot(timer_wheel_t *tw, int level, int index, wheel_timer_t *out) {
+    wheel_timer_t *head = &tw->slots[level * TIMER_SLOTS + index];
+    list_init(out);
+    if (head->next == head)
+        return;
+    out->next = head->next;
+    out->prev = head->prev;
+    out->next->prev = out;
+    out->prev->next = out;
+    list_init(head);
+    tw->occupied[level] &= ~(1ULL << index);
+}
+
+// The next tick at which level 0 has a timer or a higher level turns.
+static uint64_t next_tick(const timer_wheel_t *tw) {
+    uint64_t t = tw->now + 1;
+    if ((t & SLOT_MASK) == 0)
+        return t;
+    uint64_t bits = tw->occupied[0] >> (t & SLOT_MASK);
+    if (bits)
+        return t + __builtin_ctzll(bits);
+    return (t | SLOT_MASK) + 1;
+}
+
+void timer_wheel_advance(timer_wheel_t *tw, uint64_t now, timer_fire_fn fire, void *arg) {
+    while (tw->now < now) {
+        if (tw->count == 0) {
+            tw->now = now;
+            break;
+        }
+        uint64_t tick = next_tick(tw);
+        if (tick > now) {
+            tw->now = now;
+            break;
+        }
+        tw->now = tick;
+        // Where a level turns, its next slot moves down to finer levels.
+        for (int l = 1; l < TIMER_LEVELS; l++) {
+            if (tick & ((1ULL << LEVEL_SHIFT(l)) - 1))
+                break;
+            wheel_timer_t moving;
+            take_slot(tw, l, (int)((tick >> LEVEL_SHIFT(l)) & SLOT_MASK), &moving);
+            while (moving.next != &moving) {
+                wheel_timer_t *t = moving.next;
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                place(tw, t);
+            }
+        }
+        wheel_timer_t due;
+        take_slot(tw, 0, (int)(tick & SLOT_MASK), &due);
+        while (due.next != &due) {
+            wheel_timer_t *t = due.next;
+            t->prev->next = t->next;
+            t->next->prev = t->prev;
+            t->prev = t->next = NULL;
+            tw->count--;
+            fire(t, arg);
+        }
+    }
+}
+
+int64_t timer_wheel_timeout(const timer_wheel_t *tw) {
+    if (tw->count == 0)
+        return -1;
+    uint64_t best = UINT64_MAX;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        if (!tw->occupied[l])
+            continue;
+        // First occupied slot this level reaches after the current tick.
+        uint64_t cur = tw->now >> LEVEL_SHIFT(l);
+        int from = (int)((cur + 1) & SLOT_MASK);
+        uint64_t bits = tw->occupied[l];
+        uint64_t rotated = from ? (bits >> from) | (bits << (TIMER_SLOTS - from)) : bits;
+        uint64_t when = (cur + 1 + __builtin_ctzll(rotated)) << LEVEL_SHIFT(l);
+        if (when < best)
+            best = when;
+    }
+    return best > tw->now ? (int64_t)(best - tw->now) : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel with millisecond ticks: level l has 64 slots of
+// 64^l ms each, so four levels reach 4.6 hours (later deadlines are parked
+// in the last level and re-placed as it turns). Adding and cancelling a
+// timer is O(1); a timer moves down at most once per level before it fires.
+// Each worker owns one wheel, so nothing here is locked.
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+// Embedded in whatever it times; data points back at the owner.
+typedef struct wheel_timer {
+    struct wheel_timer *prev;
+    struct wheel_timer *next;   // NULL while not armed
+    uint64_t expires;           // absolute time in ms
+    uint16_t slot;              // level * TIMER_SLOTS + index
+    void *data;
+} wheel_timer_t;
+
+typedef struct {
+    wheel_timer_t slots[TIMER_LEVELS * TIMER_SLOTS];  // list heads
+    uint64_t occupied[TIMER_LEVELS];                  // bit per non-empty slot
+    uint64_t now;                                     // last tick processed
+    size_t count;
+} timer_wheel_t;
+
+typedef void (*timer_fire_fn)(wheel_timer_t *t, void *arg);
+
+/* Monotonic clock in milliseconds */
+uint64_t timer_now_ms(void);
+
+/* Start an empty wheel at time now */
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now);
+
+/* Prepare a timer for use (not armed) */
+void timer_init(wheel_timer_t *t, void *data);
+
+/* Arm (or re-arm) t to fire at expires; times already past fire on the next advance */
+void timer_add(timer_wheel_t *tw, wheel_timer_t *t, uint64_t expires);
+
+/* Disarm t (no-op if it is not armed) */
+void timer_cancel(timer_wheel_t *tw, wheel_timer_t *t);
+
+static inline int timer_pending(const wheel_timer_t *t) {
+    return t->next != NULL;
+}
+
+/* Process every tick up to now, calling fire for each timer that expires.
+   fire may add and cancel timers, including other expiring ones. */
+void timer_wheel_advance(timer_wheel_t *tw, uint64_t now, timer_fire_fn fire, void *arg);
+
+/* Milliseconds until the wheel next has work (a timer due or a slot to move
+   down), for use as a poll timeout; -1 if no timer is armed */
+int64_t timer_wheel_timeout(const timer_wheel_t *tw);
+
+#endif // TIMER_WHEEL_H
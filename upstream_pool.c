@@ -0,0 +1,126 @@
+#include "upstream_pool.h"
+#include "backend_servers.h"
+#include "config.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+upstream_pool_config_t upstream_pool_config = {
+    DEFAULT_POOL_MIN_IDLE,
+    DEFAULT_POOL_MAX_IDLE,
+    DEFAULT_POOL_IDLE_TIMEOUT
+};
+
+int upstream_pool_init(upstream_pool_t *pool, int backend_index) {
+    memset(pool, 0, sizeof(*pool));
+    pool->backend_index = backend_index;
+    if (upstream_pool_config.max_idle > 0) {
+        pool->idle = calloc(upstream_pool_config.max_idle, sizeof(upstream_conn_t));
+        if (!pool->idle)
+            return -1;
+    }
+    return 0;
+}
+
+void upstream_pool_destroy(upstream_pool_t *pool) {
+    for (int i = 0; i < pool->idle_count; i++)
+        close(pool->idle[i].fd);
+    free(pool->idle);
+    pool->idle = NULL;
+    pool->idle_count = 0;
+}
+
+int upstream_connect(int backend_index) {
+    Backend *target = &backend_pool[backend_index];
+    struct sockaddr_in backend_addr;
+    memset(&backend_addr, 0, sizeof(backend_addr));
+    backend_addr.sin_family = AF_INET;
+    backend_addr.sin_port = htons(target->port);
+    if (inet_pton(AF_INET, target->ip, &backend_addr.sin_addr) <= 0) {
+        LOG_ERRNO("inet_pton");
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        LOG_ERRNO("backend socket");
+        return -1;
+    }
+    int ret = connect(fd, (struct sockaddr *)&backend_addr, sizeof(backend_addr));
+    if (ret < 0 && errno != EINPROGRESS) {
+        LOG_ERRNO("connect to backend");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// An idle connection is usable if it is still ESTABLISHED (the peer has not
+// sent a FIN) and has no unsolicited bytes waiting to be read.
+static int upstream_is_healthy(int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_state != TCP_ESTABLISHED)
+        return 0;
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_checkout(upstream_pool_t *pool) {
+    while (pool->idle_count > 0) {
+        int fd = pool->idle[--pool->idle_count].fd;
+        if (upstream_is_healthy(fd)) {
+            pool->reused++;
+            return fd;
+        }
+        close(fd);
+        pool->discarded++;
+    }
+    return -1;
+}
+
+void upstream_checkin(upstream_pool_t *pool, int fd) {
+    if (pool->idle_count >= upstream_pool_config.max_idle) {
+        close(fd);
+        return;
+    }
+    pool->idle[pool->idle_count].fd = fd;
+    pool->idle[pool->idle_count].idle_since = time(NULL);
+    pool->idle_count++;
+}
+
+void upstream_pool_maintain(upstream_pool_t *pool, time_t now) {
+    // The stack is ordered by idle_since, oldest at the bottom.
+    int expired = 0;
+    while (expired < pool->idle_count &&
+           now - pool->idle[expired].idle_since >= upstream_pool_config.idle_timeout) {
+        close(pool->idle[expired].fd);
+        expired++;
+    }
+    if (expired > 0) {
+        memmove(pool->idle, pool->idle + expired, (pool->idle_count - expired) * sizeof(upstream_conn_t));
+        pool->idle_count -= expired;
+        pool->discarded += expired;
+    }
+    // Pre-open connections up to min_idle. The handshake completes in the
+    // background; a socket that is not yet established when it is checked
+    // out simply fails validation and the next one is tried.
+    int want = upstream_pool_config.min_idle;
+    if (want > upstream_pool_config.max_idle)
+        want = upstream_pool_config.max_idle;
+    while (pool->idle_count < want) {
+        int fd = upstream_connect(pool->backend_index);
+        if (fd < 0)
+            break;
+        pool->opened++;
+        pool->idle[pool->idle_count].fd = fd;
+        pool->idle[pool->idle_count].idle_since = now;
+        pool->idle_count++;
+    }
+}
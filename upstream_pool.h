@@ -0,0 +1,49 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <time.h>
+
+// Idle keep-alive connection parked in a pool
+typedef struct {
+    int fd;
+    time_t idle_since;
+} upstream_conn_t;
+
+// Pool of idle upstream connections to one backend. Each worker owns one
+// pool per backend, so check-out and check-in never take a lock.
+typedef struct {
+    int backend_index;
+    upstream_conn_t *idle;      // LIFO stack, most recently used on top
+    int idle_count;
+    unsigned long reused;       // check-outs served from the pool
+    unsigned long opened;       // fresh connects
+    unsigned long discarded;    // idle connections found dead or evicted
+} upstream_pool_t;
+
+typedef struct {
+    int min_idle;       // connections kept warm per backend and worker
+    int max_idle;       // idle connections beyond this are closed on check-in
+    int idle_timeout;   // seconds an idle connection may stay parked
+} upstream_pool_config_t;
+
+extern upstream_pool_config_t upstream_pool_config;
+
+/* Allocate the idle stack for a backend's pool (returns 0 on success) */
+int upstream_pool_init(upstream_pool_t *pool, int backend_index);
+
+/* Close every idle connection and free the pool */
+void upstream_pool_destroy(upstream_pool_t *pool);
+
+/* Start a non-blocking connect to a backend (returns fd, or -1 on immediate failure) */
+int upstream_connect(int backend_index);
+
+/* Take a validated idle connection (returns fd, or -1 if the pool has none) */
+int upstream_checkout(upstream_pool_t *pool);
+
+/* Park a connection whose response was fully read (closes it if the pool is full) */
+void upstream_checkin(upstream_pool_t *pool, int fd);
+
+/* Evict connections idle longer than idle_timeout and top the pool up to min_idle */
+void upstream_pool_maintain(upstream_pool_t *pool, time_t now);
+
+#endif // UPSTREAM_POOL_H